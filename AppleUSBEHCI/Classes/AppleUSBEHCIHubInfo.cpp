@@ -29,6 +29,9 @@
 //
 #include <IOKit/IOTypes.h>
 
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSDictionary.h>
+
 #include <IOKit/usb/IOUSBLog.h>
 
 #include "AppleUSBEHCI.h"
@@ -60,15 +63,32 @@ extern KernelDebugLevel	    gKernelDebugLevel;
 	#define USBError( LEVEL, FORMAT, ARGS... )  { kprintf( FORMAT "\n", ## ARGS ) ; }
 #endif
 
+// the split placement bitmaps have one bit per frame in the schedule (the two constants are in different enums)
+typedef char EHCISplitPlacementFramesCheck[((int)kEHCISplitPlacementFrames == (int)kEHCIMaxPollingInterval) ? 1 : -1];
+
 
 OSDefineMetaClassAndStructors(AppleUSBEHCIHubInfo, OSObject)
 
 AppleUSBEHCIHubInfo*
-AppleUSBEHCIHubInfo::AddHubInfo	(AppleUSBEHCIHubInfo **hubListPtr, USBDeviceAddress hubAddr, UInt32 flags)
+AppleUSBEHCIHubInfo::AddHubInfo	(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddr, UInt32 flags)
 {
-    AppleUSBEHCIHubInfo 	*hiList = *hubListPtr;
-    AppleUSBEHCIHubInfo 	*hiPtr = new AppleUSBEHCIHubInfo;
+    AppleUSBEHCIHubInfo 	*hiPtr;
+	int						i;
+	
+	if (!hubTable || (hubAddr >= kEHCIHubInfoMaxHubAddresses))
+	{
+		USBLog(1, "AppleUSBEHCIHubInfo::AddHubInfo - invalid hubTable[%p] or hubAddr[%d]", hubTable, hubAddr);
+		return NULL;
+	}
 	
+	if (hubTable->hubs[hubAddr])
+	{
+		// the old hub at this address must have gone away without telling us
+		USBLog(1, "AppleUSBEHCIHubInfo::AddHubInfo - replacing stale hiPtr[%p] for hubAddr[%d]", hubTable->hubs[hubAddr], hubAddr);
+		DeleteHubInfo(hubTable, hubAddr);
+	}
+	
+	hiPtr = new AppleUSBEHCIHubInfo;
 	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCIHubInfo::NewHubInfo -  new hiPtr[%p] for hubAddr[%d]", hiPtr, hubAddr);
 	if (hiPtr)
 	{
@@ -78,10 +98,13 @@ AppleUSBEHCIHubInfo::AddHubInfo	(AppleUSBEHCIHubInfo **hubListPtr, USBDeviceAddr
 			hiPtr->multiTT = false;
 
 		hiPtr->hubAddr = hubAddr;
-		hiPtr->next = hiList;
-		hiPtr->ttList = NULL;
-		hiList = hiPtr;
-		*hubListPtr = hiList;
+		hiPtr->placementPolicy = hubTable->placementPolicy;
+		hiPtr->hubTable = hubTable;
+		for (i=0; i < kEHCIHubInfoTTBuckets; i++)
+			hiPtr->ttTable[i] = NULL;
+		hubTable->hubs[hubAddr] = hiPtr;
+		hubTable->numHubs++;
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCIHubInfo::NewHubInfo - now tracking %d hubs and %d TTs", (int)hubTable->numHubs, (int)hubTable->numTTs);
 	}
 	return hiPtr;
 }	
@@ -89,14 +112,12 @@ AppleUSBEHCIHubInfo::AddHubInfo	(AppleUSBEHCIHubInfo **hubListPtr, USBDeviceAddr
 
 
 AppleUSBEHCIHubInfo*
-AppleUSBEHCIHubInfo::FindHubInfo(AppleUSBEHCIHubInfo *hiPtr, USBDeviceAddress hubAddr)
+AppleUSBEHCIHubInfo::FindHubInfo(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddr)
 {    
-    while (hiPtr)
-    {
-		if (hiPtr->hubAddr == hubAddr)
-			break;
-		hiPtr = hiPtr->next;
-    }
+	AppleUSBEHCIHubInfo		*hiPtr = NULL;
+	
+	if (hubTable && (hubAddr < kEHCIHubInfoMaxHubAddresses))
+		hiPtr = hubTable->hubs[hubAddr];
     
     USBLog(6, "AppleUSBEHCIHubInfo::FindHubInfo for hubAddr[%d], returning hiPtr[%p]", hubAddr, hiPtr);
     
@@ -106,57 +127,46 @@ AppleUSBEHCIHubInfo::FindHubInfo(AppleUSBEHCIHubInfo *hiPtr, USBDeviceAddress hu
 
 
 IOReturn
-AppleUSBEHCIHubInfo::DeleteHubInfo(AppleUSBEHCIHubInfo **hubListPtr, USBDeviceAddress hubAddress)
+AppleUSBEHCIHubInfo::DeleteHubInfo(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddress)
 {
-    AppleUSBEHCIHubInfo 	*hiList = *hubListPtr;
-    AppleUSBEHCIHubInfo 	*hiPtr, *tempPtr;
-	AppleUSBEHCITTInfo		*ttiPtr, *tempTTPtr;
+    AppleUSBEHCIHubInfo 	*hiPtr;
 
-	if (!hiList)
+	if (!hubTable || !hubTable->numHubs || (hubAddress >= kEHCIHubInfoMaxHubAddresses))
 		return kIOReturnInternalError;
 
-	// first remove any at the beginning
-	if (hiList->hubAddr == hubAddress)
+	hiPtr = hubTable->hubs[hubAddress];
+	if (hiPtr)
 	{
-		ttiPtr = hiList->ttList;
+		hubTable->hubs[hubAddress] = NULL;
+		hubTable->numHubs--;
+		hiPtr->ReleaseTTs();
+		USBLog(5, "AppleUSBEHCIHubInfo::DeleteHubInfo - releasing hiPtr[%p] for hubAddr[%d], now tracking %d hubs and %d TTs", hiPtr, hubAddress, (int)hubTable->numHubs, (int)hubTable->numTTs);
+		hiPtr->release();
+	}
+	return kIOReturnSuccess;
+}
+
+
+
+void
+AppleUSBEHCIHubInfo::ReleaseTTs(void)
+{
+	AppleUSBEHCITTInfo		*ttiPtr, *tempTTPtr;
+	int						i;
+	
+	for (i=0; i < kEHCIHubInfoTTBuckets; i++)
+	{
+		ttiPtr = ttTable[i];
+		ttTable[i] = NULL;
 		while (ttiPtr)
 		{
 			tempTTPtr = ttiPtr->next;
-			USBLog(5, "AppleUSBEHCIHubInfo::DeleteHubInfo - hiList[%p] releasing ttiPtr[%p]", hiList, ttiPtr);
+			USBLog(5, "AppleUSBEHCIHubInfo[%p]::ReleaseTTs - releasing ttiPtr[%p]", this, ttiPtr);
 			ttiPtr->release();
+			hubTable->numTTs--;
 			ttiPtr = tempTTPtr;
 		}
-		hiPtr = hiList;
-		hiList = hiList->next;
-		USBLog(5, "AppleUSBEHCIHubInfo::DeleteHubInfo- hiList[%p] releasing hiPtr[%p] from head of list", hiList, hiPtr);
-		hiPtr->release();
 	}
-	else
-	{
-		hiPtr = hiList;
-		while (hiPtr && (hiPtr->next))
-		{
-			if (hiPtr->next->hubAddr == hubAddress)
-			{
-				tempPtr = hiPtr->next;
-				hiPtr->next = tempPtr->next;
-				ttiPtr = tempPtr->ttList;
-				while (ttiPtr)
-				{
-					tempTTPtr = ttiPtr->next;
-					USBLog(5, "AppleUSBEHCIHubInfo::DeleteHubInfo - hiPtr[%p] releasing ttiPtr[%p]", tempPtr, ttiPtr);
-					ttiPtr->release();
-					ttiPtr = tempTTPtr;
-				}
-				USBLog(5, "AppleUSBEHCIHubInfo::DeleteHubInfo- hiPtr[%p] releasing hiPtr[%p] from middle of list", tempPtr, tempPtr);
-				tempPtr->release();
-			}
-			else
-				hiPtr = hiPtr->next;
-		}
-	}
-	*hubListPtr = hiList;								// fix the master pointer
-	return kIOReturnSuccess;
 }
 
 
@@ -164,24 +174,29 @@ AppleUSBEHCIHubInfo::DeleteHubInfo(AppleUSBEHCIHubInfo **hubListPtr, USBDeviceAd
 AppleUSBEHCITTInfo	*
 AppleUSBEHCIHubInfo::GetTTInfo(int portAddress)
 {
-	AppleUSBEHCITTInfo	*ttiPtr = ttList;
+	AppleUSBEHCITTInfo	**bucket;
+	AppleUSBEHCITTInfo	*ttiPtr;
 	
 	// if this is a multiTT hub, then we have to find a ttiPtr with the correct address
-	// otherwise, we just go with the ttList (if it already exists)
-	if (multiTT)
-	{
-		while (ttiPtr && (ttiPtr->hubPort != portAddress))
-			ttiPtr = ttiPtr->next;
-	}
+	// otherwise, there is just the one on port 0 (if it already exists)
+	if (!multiTT)
+		portAddress = 0;
+	
+	bucket = &ttTable[portAddress & (kEHCIHubInfoTTBuckets - 1)];
+	ttiPtr = *bucket;
+	while (ttiPtr && (ttiPtr->hubPort != portAddress))
+		ttiPtr = ttiPtr->next;
 	
 	if (!ttiPtr)
 	{
-		ttiPtr = AppleUSBEHCITTInfo::NewTTInfo(multiTT ? portAddress : 0);
+		ttiPtr = AppleUSBEHCITTInfo::NewTTInfo(portAddress);
 		if (ttiPtr)
 		{
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCIHubInfo[%p]::GetTTInfo - Adding ttiPtr[%p] to ttList", this, ttiPtr);
-			ttiPtr->next = ttList;
-			ttList = ttiPtr;
+			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCIHubInfo[%p]::GetTTInfo - Adding ttiPtr[%p] for port %d", this, ttiPtr, portAddress);
+			ttiPtr->SetPlacementPolicy(placementPolicy);
+			ttiPtr->next = *bucket;
+			*bucket = ttiPtr;
+			hubTable->numTTs++;
 		}
 	}
 	
@@ -189,11 +204,98 @@ AppleUSBEHCIHubInfo::GetTTInfo(int portAddress)
 }
 
 
+
+//
+// SetPlacementPolicyFromProperty
+// Takes the value of kAppleEHCITTPlacementPolicyKey (an OSNumber, or NULL when the property is not set) and gives it to
+// every hub in the table now, and to the hubs added later. A missing or invalid value selects the default policy.
+//
+IOReturn
+AppleUSBEHCIHubInfo::SetPlacementPolicyFromProperty(AppleUSBEHCIHubInfoTable *hubTable, OSObject *policyProperty)
+{
+	OSNumber		*policyNumber = OSDynamicCast(OSNumber, policyProperty);
+	UInt8			policy = kEHCISplitPlacementPolicyEarliest;
+	IOReturn		ret = kIOReturnSuccess;
+	int				i;
+	
+	if (!hubTable)
+		return kIOReturnBadArgument;
+	
+	if (policyNumber && (policyNumber->unsigned32BitValue() < kEHCISplitPlacementPolicyCount))
+		policy = (UInt8)policyNumber->unsigned32BitValue();
+	else if (policyProperty)
+	{
+		USBLog(1, "AppleUSBEHCIHubInfo::SetPlacementPolicyFromProperty - invalid %s, using the default", kAppleEHCITTPlacementPolicyKey);
+		ret = kIOReturnBadArgument;
+	}
+	
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCIHubInfo::SetPlacementPolicyFromProperty - TT placement policy(%d)", (int)policy);
+	hubTable->placementPolicy = policy;
+	for (i=0; i < kEHCIHubInfoMaxHubAddresses; i++)
+		if (hubTable->hubs[i])
+			hubTable->hubs[i]->SetPlacementPolicy(policy);
+	
+	return ret;
+}
+
+
+
+// CopyDiagnostics
+// A new dictionary with the counts which the table keeps for diagnostics, and its placement policy, for the controller to
+// publish under kAppleEHCIHubInfoDiagnosticsKey. The caller releases it.
+//
+OSDictionary *
+AppleUSBEHCIHubInfo::CopyDiagnostics(AppleUSBEHCIHubInfoTable *hubTable)
+{
+	const char		*names[3] = { "Hubs", "TTs", "Placement Policy" };
+	UInt32			values[3];
+	OSDictionary	*dictionary;
+	OSNumber		*number;
+	int				i;
+	
+	if (!hubTable)
+		return NULL;
+	
+	dictionary = OSDictionary::withCapacity(3);
+	if (!dictionary)
+		return NULL;
+	
+	values[0] = hubTable->numHubs;
+	values[1] = hubTable->numTTs;
+	values[2] = hubTable->placementPolicy;
+	for (i=0; i < 3; i++)
+	{
+		number = OSNumber::withNumber(values[i], 32);
+		if (number)
+		{
+			dictionary->setObject(names[i], number);
+			number->release();
+		}
+	}
+	
+	return dictionary;
+}
+
+
+
+void
+AppleUSBEHCIHubInfo::SetPlacementPolicy(UInt8 policy)
+{
+	AppleUSBEHCITTInfo	*ttiPtr;
+	int					i;
+	
+	placementPolicy = policy;
+	for (i=0; i < kEHCIHubInfoTTBuckets; i++)
+		for (ttiPtr = ttTable[i]; ttiPtr; ttiPtr = ttiPtr->next)
+			ttiPtr->SetPlacementPolicy(policy);
+}
+
+
 #pragma mark AppleUSBEHCITTInfo
 OSDefineMetaClassAndStructors(AppleUSBEHCITTInfo, OSObject)
 
 
-// CompareSPEs - used when creating an ordered set of SPEs to move when adding or subtracting
+// CompareSPEs - used when sorting the list of SPEs to move when adding or subtracting
 // A comparison result of the object:
 //		a positive value if obj2 should precede obj1,</li>
 //		a negative value if obj1 should precede obj2,</li>
@@ -201,17 +303,13 @@ OSDefineMetaClassAndStructors(AppleUSBEHCITTInfo, OSObject)
 static SInt32
 CompareSPEs(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISplitPeriodicEndpoint *pSPE2, const AppleUSBEHCITTInfo *forTT)
 {
-	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CompareSPEs - pSPE1[%p] pSPE2[%p]", forTT, pSPE1, pSPE2);
-	
+	// no print() of the SPEs in here, since this gets called O(n log n) times per sort
 	if (!pSPE1 || !pSPE2)
 	{
 		USBLog(1, "AppleUSBEHCITTInfo[%p]::CompareSPEs - one or more objects NULL - returning 0", forTT);
 		return 0;
 	}
 	
-	((AppleUSBEHCISplitPeriodicEndpoint *)pSPE1)->print(gEHCIBandwidthLogLevel);
-	((AppleUSBEHCISplitPeriodicEndpoint *)pSPE2)->print(gEHCIBandwidthLogLevel);
-	
 	// first get the two obvious cases out of the way
 	if ((pSPE1->_epType == kUSBIsoc) && (pSPE2->_epType == kUSBInterrupt))
 	{
@@ -233,7 +331,6 @@ CompareSPEs(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISp
 		return -1;
 	}
 	
-	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CompareSPEs - EQUAL", forTT);
 	return 0;
 }
 
@@ -284,7 +381,11 @@ AppleUSBEHCITTInfo::NewTTInfo(int portAddress)
 			ttiPtr->_isochQueue[i] = pSPE;
 			ttiPtr->_FStimeUsed[i] = kEHCIFSSOFBytesUsed + kEHCIFSHubAdjustBytes;
 		}
-		ttiPtr->_pSPEsToAdjust = OSOrderedSet::withCapacity(kAppleEHCITTInfoInitialOrderedSetSize, (OSOrderedSet::OSOrderFunction)CompareSPEs, ttiPtr);
+		ttiPtr->_SPEsToAdjust = NULL;
+		ttiPtr->_numSPEsToAdjust = 0;
+		ttiPtr->_pSPEsToAdjust = NULL;
+		ttiPtr->_placementPolicy = kEHCISplitPlacementPolicyEarliest;
+		ttiPtr->_repackPending = false;
 	}
 	
 	if (err != kIOReturnSuccess)
@@ -298,8 +399,6 @@ AppleUSBEHCITTInfo::NewTTInfo(int portAddress)
 			if (pSPE)
 				pSPE->release();
 		}
-		if (ttiPtr->_pSPEsToAdjust)
-			ttiPtr->_pSPEsToAdjust->release();
 		ttiPtr->release();
 		ttiPtr = NULL;
 	}
@@ -471,10 +570,6 @@ IOReturn
 AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pSPE)
 {
 	IOReturn								err;
-	int										frameIndex;
-	AppleUSBEHCISplitPeriodicEndpoint		*curSPE;
-	AppleUSBEHCISplitPeriodicEndpoint		*prevSPE;
-	AppleUSBEHCISplitPeriodicEndpoint		*tempSPE;
 	
 	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth: pSPE[%p]", this, pSPE);
 	ShowPeriodicBandwidthUsed(gEHCIBandwidthLogLevel, "+AllocatePeriodicBandwidth"); 
@@ -482,12 +577,44 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 		return kIOReturnInternalError;
 	
 	err = pSPE->FindStartFrameAndStartTime();
+	if ((err == kIOReturnNoBandwidth) && (_placementPolicy == kEHCISplitPlacementPolicyRepack))
+	{
+		// the SPE only goes in if everything already on the TT can be placed again around it
+		err = RepackPeriodicBandwidth(pSPE);
+		if (err == kIOReturnSuccess)
+		{
+			ShowPeriodicBandwidthUsed(gEHCIBandwidthLogLevel, "-AllocatePeriodicBandwidth (repacked)");
+			return kIOReturnSuccess;
+		}
+	}
 	if (err)
 	{
 		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth - pSPE->FindStartFrameAndStartTime returned err[%p]", this, (void*)err);
 		return err;
 	}
 	
+	err = LinkPeriodicBandwidth(pSPE);
+	
+	// TODO - Adjust all of the starting times as needed..
+	
+	ShowPeriodicBandwidthUsed(gEHCIBandwidthLogLevel, "-AllocatePeriodicBandwidth");
+	return err;
+}
+
+
+
+//
+// LinkPeriodicBandwidth
+// puts an SPE whose _startFrame and _startTime are already set into the lists for each of its frames, and reserves the FS bus time
+//
+IOReturn
+AppleUSBEHCITTInfo::LinkPeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	int										frameIndex;
+	AppleUSBEHCISplitPeriodicEndpoint		*curSPE;
+	AppleUSBEHCISplitPeriodicEndpoint		*prevSPE;
+	AppleUSBEHCISplitPeriodicEndpoint		*tempSPE;
+	
 	for (frameIndex=pSPE->_startFrame; frameIndex < kEHCIMaxPollingInterval; frameIndex += pSPE->_period)
 	{
 		if (pSPE->_epType == kUSBIsoc)
@@ -495,7 +622,7 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 			prevSPE = _isochQueue[frameIndex];				// there is always at least a dummy
 			if (!prevSPE)
 			{
-				USBLog(1, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth - invalid isoch queue head at frame (%d)", this, (int)frameIndex);
+				USBLog(1, "AppleUSBEHCITTInfo[%p]::LinkPeriodicBandwidth - invalid isoch queue head at frame (%d)", this, (int)frameIndex);
 				return kIOReturnInternalError;
 			}
 			curSPE = prevSPE->_nextSPE;
@@ -514,7 +641,7 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 					_largeIsoch[frameIndex] = pSPE;
 				else
 				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth - inserting pSPE(%p) into frame (%d) between (%p) and (%p)", this, pSPE, frameIndex, prevSPE, curSPE);
+					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::LinkPeriodicBandwidth - inserting pSPE(%p) into frame (%d) between (%p) and (%p)", this, pSPE, frameIndex, prevSPE, curSPE);
 					if (frameIndex == pSPE->_startFrame)
 						pSPE->_nextSPE = curSPE;								// only do this for the primary harmonic
 					
@@ -537,7 +664,7 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 			prevSPE = _interruptQueue[frameIndex];				// there is always at least a dummy
 			if (!prevSPE)
 			{
-				USBLog(1, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth - invalid interrupt queue head at frame (%d)", this, (int)frameIndex);
+				USBLog(1, "AppleUSBEHCITTInfo[%p]::LinkPeriodicBandwidth - invalid interrupt queue head at frame (%d)", this, (int)frameIndex);
 				return kIOReturnInternalError;
 			}
 			curSPE = prevSPE->_nextSPE;
@@ -550,7 +677,7 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 			}
 			if (curSPE != pSPE)
 			{
-				USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::AllocatePeriodicBandwidth - inserting pSPE(%p) into frame (%d) between (%p) and (%p)", this, pSPE, frameIndex, prevSPE, curSPE);
+				USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::LinkPeriodicBandwidth - inserting pSPE(%p) into frame (%d) between (%p) and (%p)", this, pSPE, frameIndex, prevSPE, curSPE);
 				if (frameIndex == pSPE->_startFrame)
 					pSPE->_nextSPE = curSPE;								// only do this for the primary harmonic
 				prevSPE->_nextSPE = pSPE;
@@ -559,9 +686,6 @@ AppleUSBEHCITTInfo::AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint
 		ReserveFSBusBytes(frameIndex, pSPE->_FSBytesUsed);
 	}
 	
-	// TODO - Adjust all of the starting times as needed..
-	
-	ShowPeriodicBandwidthUsed(gEHCIBandwidthLogLevel, "-AllocatePeriodicBandwidth");
 	return kIOReturnSuccess;
 }
 
@@ -631,82 +755,75 @@ AppleUSBEHCITTInfo::DeallocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoin
 
 
 
+//
+// CalculateSPEsToAdjustAfterChange
+// When an SPE is added or removed, the SPEs which come after it in the frames where it lives may need a new start time.
+// Only those frames are walked. The per frame lists are a tree which shares its tail with the other frames (the same as the
+// hardware periodic list), so walking them also finds every SPE downstream of the change in the other frames.
+// The exception is a large isoch change, which moves every isoch SPE in its frames. The ones with a shorter period take
+// the interrupt SPEs of other frames along with them, so a large change still walks all of the frames.
+// The SPEs found are kept in an intrusive list on the TT, rather than in an OSOrderedSet, so that there is no allocation and
+// no linear containsObject or sorted insert for each one. The list is sorted once at the end.
+//
 IOReturn
 AppleUSBEHCITTInfo::CalculateSPEsToAdjustAfterChange(AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added)
 {
 	int										index;
+	int										firstFrame, frameStep;
 	AppleUSBEHCISplitPeriodicEndpoint		*pSPE;
+	bool									largeChange;
 	
 	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - pSPEChanged(%p) %s", this, pSPEChanged, added ? "ADDED" : "REMOVED");
-	if (_pSPEsToAdjust->getCount())
+	if (_repackPending)
 	{
-		USBLog(1, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - ordered set already exists. error", this);
+		// RepackPeriodicBandwidth already left every SPE which moved on the list
+		_repackPending = false;
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - using the %d SPEs moved by the re-pack", this, (int)_numSPEsToAdjust);
+		return kIOReturnSuccess;
+	}
+	if (_numSPEsToAdjust)
+	{
+		USBLog(1, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - adjust list already exists. error", this);
 		return kIOReturnInternalError;
 	}
-	if (pSPEChanged->_FSBytesUsed >= kEHCIFSLargeIsochPacket)
+	if (!pSPEChanged->_period)
+	{
+		USBLog(1, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - pSPEChanged(%p) has no period", this, pSPEChanged);
+		return kIOReturnBadArgument;
+	}
+	
+	largeChange = (pSPEChanged->_FSBytesUsed >= kEHCIFSLargeIsochPacket);
+	if (largeChange)
 	{
 		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %s packet is a large one. everyone needs to move", this, added ? "new" : "old");
-		for (index = 0; index < kEHCIMaxPollingInterval; index++)
-		{
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - looking at Isoch queue index(%d)[%p]", this, index, _isochQueue[index]);
-			pSPE = _isochQueue[index]->_nextSPE;						// skip past the dummy
-			while (pSPE)
-			{
-				if (!_pSPEsToAdjust->containsObject(pSPE))
-				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-					_pSPEsToAdjust->setObject(pSPE);
-				}
-				else
-				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) already in adjust set", this, index, pSPE);
-				}
-				pSPE = pSPE->_nextSPE;
-			}
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - looking at interrupt queue index(%d)[%p]", this, index, _interruptQueue[index]);
-			pSPE = _interruptQueue[index]->_nextSPE;					// skip past the dummy
-			while (pSPE)
-			{
-				if (!_pSPEsToAdjust->containsObject(pSPE))
-				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-					_pSPEsToAdjust->setObject(pSPE);
-				}
-				else
-				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) already in adjust set", this, index, pSPE);
-				}
-				pSPE = pSPE->_nextSPE;
-			}
-		}
 	}
 	else if (pSPEChanged->_epType == kUSBIsoc)
 	{
-		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %s packet is a ISOCH. some Isoch and all Int will move", this, added ? "new" : "old");
-		for (index = 0; index < kEHCIMaxPollingInterval; index++)
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %s packet is a ISOCH. some Isoch and all Int in its frames will move", this, added ? "new" : "old");
+	}
+	else
+	{
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %s packet is INTERRUPT - some Int in its frames will move", this, added ? "new" : "old");
+	}
+	
+	firstFrame = largeChange ? 0 : pSPEChanged->_startFrame;
+	frameStep = largeChange ? 1 : pSPEChanged->_period;
+	for (index = firstFrame; index < kEHCIMaxPollingInterval; index += frameStep)
+	{
+		if (largeChange || (pSPEChanged->_epType == kUSBIsoc))
 		{
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - looking at Isoch queue index(%d)[%p]", this, index, _isochQueue[index]);
 			pSPE = _isochQueue[index]->_nextSPE;						// skip past the dummy
-			if (!added)
+			if (largeChange)
+			{
+				AddSPEChainToAdjust(pSPE, NULL);
+			}
+			else if (!added)
 			{
-				// do this when an endpoint has been removed
+				// do this when an endpoint has been removed. the isoch list is in decreasing _startTime order, so this one can't stop early
 				while (pSPE)
 				{
-					if (pSPE != pSPEChanged)
-					{
-						if (pSPE->_startTime >= pSPEChanged->_startTime)
-						{
-							if (!_pSPEsToAdjust->containsObject(pSPE))
-							{
-								USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-								_pSPEsToAdjust->setObject(pSPE);
-							}
-						}
-						else
-						{
-							USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) not a candidate because of a lower start time", this, index, pSPE);
-						}
-					}
+					if ((pSPE != pSPEChanged) && (pSPE->_startTime >= pSPEChanged->_startTime))
+						AddSPEToAdjust(pSPE);
 					pSPE = pSPE->_nextSPE;
 				}
 			}
@@ -717,58 +834,24 @@ AppleUSBEHCITTInfo::CalculateSPEsToAdjustAfterChange(AppleUSBEHCISplitPeriodicEn
 				{
 					pSPE = pSPE->_nextSPE;
 				}
-				while (pSPE)
-				{
-					if (!_pSPEsToAdjust->containsObject(pSPE))
-					{
-						USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-						_pSPEsToAdjust->setObject(pSPE);
-					}
-					pSPE = pSPE->_nextSPE;
-				}
-			}
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - looking at interrupt queue index(%d)[%p]", this, index, _interruptQueue[index]);
-			pSPE = _interruptQueue[index]->_nextSPE;					// skip past the dummy
-			while (pSPE)
-			{
-				if (!_pSPEsToAdjust->containsObject(pSPE))
-				{
-					USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-					_pSPEsToAdjust->setObject(pSPE);
-				}
-				USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - looking at interrupt queue _nextSPE[%p]", this, pSPE->_nextSPE);
-				pSPE = pSPE->_nextSPE;
+				AddSPEChainToAdjust(pSPE, NULL);
 			}
+			
+			// all of the interrupt SPEs in the frame come after the isoch ones
+			AddSPEChainToAdjust(_interruptQueue[index]->_nextSPE, NULL);
 		}
-	}
-	else
-	{
-		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %s packet is INTERRUPT - some  Int will move", this, added ? "new" : "old");
-		for (index = 0; index < kEHCIMaxPollingInterval; index++)
+		else
 		{
 			pSPE = _interruptQueue[index]->_nextSPE;					// skip past the dummy
 			if (!added)
 			{
-				// do this when an endpoint has been removed
-				while (pSPE)
+				// do this when an endpoint has been removed. the interrupt list is in increasing _startTime order, so
+				// once one is a candidate the rest of the chain is as well
+				while (pSPE && ((pSPE == pSPEChanged) || (pSPE->_startTime < pSPEChanged->_startTime)))
 				{
-					if (pSPE != pSPEChanged)
-					{
-						if (pSPE->_startTime >= pSPEChanged->_startTime)
-						{
-							if (!_pSPEsToAdjust->containsObject(pSPE))
-							{
-								USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-								_pSPEsToAdjust->setObject(pSPE);
-							}
-						}
-						else
-						{
-							USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) not a candidate because of a lower start time", this, index, pSPE);
-						}
-					}
 					pSPE = pSPE->_nextSPE;
 				}
+				AddSPEChainToAdjust(pSPE, pSPEChanged);
 			}
 			else 
 			{
@@ -777,22 +860,321 @@ AppleUSBEHCITTInfo::CalculateSPEsToAdjustAfterChange(AppleUSBEHCISplitPeriodicEn
 				{
 					pSPE = pSPE->_nextSPE;
 				}
-				while (pSPE)
+				AddSPEChainToAdjust(pSPE, pSPEChanged);
+			}
+		}
+	}
+	
+	SortSPEsToAdjust();
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %d candidates to consider", this, (int)_numSPEsToAdjust);
+	return kIOReturnSuccess;
+}
+
+
+
+void
+AppleUSBEHCITTInfo::AddSPEToAdjust(AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	if (pSPE->_onAdjustList)
+		return;
+	
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::AddSPEToAdjust - pSPE(%p) being added to adjustment list", this, pSPE);
+	pSPE->retain();
+	pSPE->_onAdjustList = true;
+	pSPE->_nextSPEToAdjust = _SPEsToAdjust;
+	_SPEsToAdjust = pSPE;
+	_numSPEsToAdjust++;
+}
+
+
+
+//
+// AddSPEChainToAdjust
+// Adds pSPE and everything after it in its list, except for pSPEToSkip. Because the lists share their tails, once we get to an
+// SPE which is already on the adjust list, the rest of the chain is already there too.
+//
+void
+AppleUSBEHCITTInfo::AddSPEChainToAdjust(AppleUSBEHCISplitPeriodicEndpoint *pSPE, AppleUSBEHCISplitPeriodicEndpoint *pSPEToSkip)
+{
+	while (pSPE && !pSPE->_onAdjustList)
+	{
+		if (pSPE != pSPEToSkip)
+			AddSPEToAdjust(pSPE);
+		pSPE = pSPE->_nextSPE;
+	}
+}
+
+
+
+//
+// SortSPEList
+// A stable merge sort of a list linked through _nextSPEToAdjust, which puts pSPE1 first when compare returns a negative
+// value. It is used for the adjust list (see CompareSPEsForAdjust) and by the re-pack, which sorts the same list into the
+// order to place the SPEs in and then the order to restore them in
+//
+typedef SInt32 (*SPECompareFunction)(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISplitPeriodicEndpoint *pSPE2, const AppleUSBEHCITTInfo *forTT);
+
+static AppleUSBEHCISplitPeriodicEndpoint *
+SortSPEList(AppleUSBEHCISplitPeriodicEndpoint *list, UInt32 count, SPECompareFunction compare, const AppleUSBEHCITTInfo *forTT)
+{
+	UInt32									runLength;
+	
+	for (runLength = 1; runLength < count; runLength *= 2)
+	{
+		AppleUSBEHCISplitPeriodicEndpoint	*head = NULL;
+		AppleUSBEHCISplitPeriodicEndpoint	**tail = &head;
+		
+		while (list)
+		{
+			AppleUSBEHCISplitPeriodicEndpoint	*left = list;
+			AppleUSBEHCISplitPeriodicEndpoint	*right = list;
+			UInt32								leftCount = 0, rightCount = runLength;
+			
+			while (right && (leftCount < runLength))
+			{
+				right = right->_nextSPEToAdjust;
+				leftCount++;
+			}
+			
+			// take from the left run on a tie, so that the sort is stable
+			while (leftCount || (rightCount && right))
+			{
+				AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+				
+				if (leftCount && (!rightCount || !right || (compare(left, right, forTT) <= 0)))
 				{
-					if (pSPE != pSPEChanged)
-					{
-						if (!_pSPEsToAdjust->containsObject(pSPE))
-						{
-							USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - index[%d] pSPE(%p) being added to adjustment set", this, index, pSPE);
-							_pSPEsToAdjust->setObject(pSPE);
-						}
-					}
-					pSPE = pSPE->_nextSPE;
+					pSPE = left;
+					left = left->_nextSPEToAdjust;
+					leftCount--;
+				}
+				else
+				{
+					pSPE = right;
+					right = right->_nextSPEToAdjust;
+					rightCount--;
 				}
+				*tail = pSPE;
+				tail = &pSPE->_nextSPEToAdjust;
 			}
+			list = right;
 		}
+		*tail = NULL;
+		list = head;
+	}
+	return list;
+}
+
+
+
+// CompareSPEsForRepack - the order in which a re-pack places the SPEs (see EHCISplitPlacementRepackCompare)
+static SInt32
+CompareSPEsForRepack(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISplitPeriodicEndpoint *pSPE2, const AppleUSBEHCITTInfo *)
+{
+	return EHCISplitPlacementRepackCompare(pSPE1->_period, pSPE1->_FSBytesUsed, pSPE2->_period, pSPE2->_FSBytesUsed);
+}
+
+
+
+// CompareSPEsForRestore - the order in which a failed re-pack puts the SPEs back. LinkPeriodicBandwidth puts a new SPE
+// at the end of the SPEs with the same period in the frame, so linking them in increasing _startTime order rebuilds the lists
+static SInt32
+CompareSPEsForRestore(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISplitPeriodicEndpoint *pSPE2, const AppleUSBEHCITTInfo *)
+{
+	if (pSPE1->_previousStartTime != pSPE2->_previousStartTime)
+		return (pSPE1->_previousStartTime < pSPE2->_previousStartTime) ? -1 : 1;
+	return 0;
+}
+
+
+
+// CompareSPEsForAdjust - the order which the OSOrderedSet built with CompareSPEs had. OSOrderedSet keeps obj1 ahead of
+// obj2 when the order function returns a positive value (the opposite of what its header says), so that is isoch before
+// interrupt, and increasing _startTime within each
+static SInt32
+CompareSPEsForAdjust(const AppleUSBEHCISplitPeriodicEndpoint *pSPE1, const AppleUSBEHCISplitPeriodicEndpoint *pSPE2, const AppleUSBEHCITTInfo *forTT)
+{
+	return -CompareSPEs(pSPE1, pSPE2, forTT);
+}
+
+
+
+//
+// SortSPEsToAdjust
+// Sorts the adjust list into the order the SPEs should be moved in, which is the order _pSPEsToAdjust kept them in
+//
+void
+AppleUSBEHCITTInfo::SortSPEsToAdjust(void)
+{
+	if (_numSPEsToAdjust < 2)
+		return;
+	
+	_SPEsToAdjust = SortSPEList(_SPEsToAdjust, _numSPEsToAdjust, CompareSPEsForAdjust, this);
+}
+
+
+
+//
+// GetNextSPEToAdjust
+// Takes the first SPE off of the adjust list. The caller gets the retain which the list was holding.
+//
+AppleUSBEHCISplitPeriodicEndpoint *
+AppleUSBEHCITTInfo::GetNextSPEToAdjust(void)
+{
+	AppleUSBEHCISplitPeriodicEndpoint		*pSPE = _SPEsToAdjust;
+	
+	if (pSPE)
+	{
+		_SPEsToAdjust = pSPE->_nextSPEToAdjust;
+		_numSPEsToAdjust--;
+		pSPE->_nextSPEToAdjust = NULL;
+		pSPE->_onAdjustList = false;
 	}
-	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::CalculateSPEsToAdjustAfterChange - %d candidates to consider", this, _pSPEsToAdjust->getCount());
+	return pSPE;
+}
+
+
+
+void
+AppleUSBEHCITTInfo::SetPlacementPolicy(UInt8 policy)
+{
+	if (policy >= kEHCISplitPlacementPolicyCount)
+	{
+		USBLog(1, "AppleUSBEHCITTInfo[%p]::SetPlacementPolicy - invalid policy(%d), using the default", this, (int)policy);
+		policy = kEHCISplitPlacementPolicyEarliest;
+	}
+	_placementPolicy = policy;
+}
+
+
+
+//
+// RepackPeriodicBandwidth
+// Called when pNewSPE does not fit on the TT as it is. Every SPE on the TT is taken out and placed again, biggest load
+// first, with pNewSPE among them. If everything fits, the SPEs which ended up in a different place are left on the
+// adjust list (with _previousStartFrame and _previousStartTime saying where they were) for the caller to move, the same as
+// it does after CalculateSPEsToAdjustAfterChange. If not, the TT is put back the way that it was and pNewSPE is rejected.
+// Only the TT's own bookkeeping is moved here. For each SPE it gets back, the caller has to move the endpoint in the
+// hardware periodic list from _previousStartFrame to _startFrame, release its _HSSplitINBytesUsed in the old frames and
+// reserve them in the new ones, and then set _previousStartFrame back to kEHCIMaxPollingInterval.
+//
+IOReturn
+AppleUSBEHCITTInfo::RepackPeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pNewSPE)
+{
+	AppleUSBEHCISplitPeriodicEndpoint		*pSPE;
+	AppleUSBEHCISplitPeriodicEndpoint		*failedSPE = NULL;
+	AppleUSBEHCISplitPeriodicEndpoint		*movedList = NULL;
+	UInt32									numMoved = 0;
+	int										frameIndex;
+	bool									linkFailed = false;
+	IOReturn								err = kIOReturnSuccess;
+	IOReturn								restoreErr = kIOReturnSuccess;
+	
+	if (_numSPEsToAdjust)
+	{
+		USBLog(1, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - adjust list already exists. error", this);
+		return kIOReturnNoBandwidth;
+	}
+	
+	// the lists for each frame share their tails, so this finds every SPE on the TT without finding any of them twice
+	for (frameIndex=0; frameIndex < kEHCIMaxPollingInterval; frameIndex++)
+	{
+		if (!_isochQueue[frameIndex] || !_interruptQueue[frameIndex])
+		{
+			USBLog(1, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - invalid queue head at frame (%d)", this, (int)frameIndex);
+			while ((pSPE = GetNextSPEToAdjust()))
+				pSPE->release();
+			return kIOReturnInternalError;
+		}
+		if (_largeIsoch[frameIndex])
+			AddSPEToAdjust(_largeIsoch[frameIndex]);
+		AddSPEChainToAdjust(_isochQueue[frameIndex]->_nextSPE, NULL);
+		AddSPEChainToAdjust(_interruptQueue[frameIndex]->_nextSPE, NULL);
+	}
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - re-packing %d SPEs to make room for pSPE(%p)", this, (int)_numSPEsToAdjust, pNewSPE);
+	
+	for (pSPE = _SPEsToAdjust; pSPE; pSPE = pSPE->_nextSPEToAdjust)
+	{
+		pSPE->_previousStartFrame = pSPE->_startFrame;
+		pSPE->_previousStartTime = pSPE->_startTime;
+		DeallocatePeriodicBandwidth(pSPE);
+	}
+	pNewSPE->_previousStartFrame = kEHCIMaxPollingInterval;
+	pNewSPE->_previousStartTime = 0;
+	AddSPEToAdjust(pNewSPE);
+	
+	_SPEsToAdjust = SortSPEList(_SPEsToAdjust, _numSPEsToAdjust, CompareSPEsForRepack, this);
+	for (pSPE = _SPEsToAdjust; pSPE; pSPE = pSPE->_nextSPEToAdjust)
+	{
+		err = pSPE->FindStartFrameAndStartTime();
+		if (err)
+		{
+			failedSPE = pSPE;
+			break;
+		}
+		err = LinkPeriodicBandwidth(pSPE);
+		if (err)
+		{
+			USBLog(1, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - LinkPeriodicBandwidth failed for pSPE(%p) err(0x%x)", this, pSPE, (uint32_t)err);
+			failedSPE = pSPE;
+			linkFailed = true;
+			break;
+		}
+	}
+	
+	if (failedSPE)
+	{
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - pSPE(%p) did not fit. putting the TT back", this, failedSPE);
+		for (pSPE = _SPEsToAdjust; pSPE != failedSPE; pSPE = pSPE->_nextSPEToAdjust)
+			DeallocatePeriodicBandwidth(pSPE);
+		
+		// LinkPeriodicBandwidth stops at the same frame that DeallocatePeriodicBandwidth does, so this takes off whatever it did link
+		if (linkFailed)
+			DeallocatePeriodicBandwidth(failedSPE);
+		
+		_SPEsToAdjust = SortSPEList(_SPEsToAdjust, _numSPEsToAdjust, CompareSPEsForRestore, this);
+		while ((pSPE = GetNextSPEToAdjust()))
+		{
+			if (pSPE != pNewSPE)
+			{
+				pSPE->SetStartFrameAndStartTime(pSPE->_previousStartFrame, pSPE->_previousStartTime);
+				if (LinkPeriodicBandwidth(pSPE) != kIOReturnSuccess)
+				{
+					USBLog(1, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - could not put pSPE(%p) back at frame(%d)", this, pSPE, (int)pSPE->_startFrame);
+					restoreErr = kIOReturnInternalError;
+				}
+			}
+			pSPE->_previousStartFrame = kEHCIMaxPollingInterval;
+			pSPE->release();
+		}
+		pNewSPE->SetStartFrameAndStartTime(kEHCIMaxPollingInterval, 0);			// this is invalid
+		if (restoreErr)
+			return restoreErr;
+		return linkFailed ? err : kIOReturnNoBandwidth;
+	}
+	
+	// only keep the SPEs which moved
+	while ((pSPE = GetNextSPEToAdjust()))
+	{
+		if ((pSPE != pNewSPE) && ((pSPE->_startFrame != pSPE->_previousStartFrame) || (pSPE->_startTime != pSPE->_previousStartTime)))
+		{
+			pSPE->_nextSPEToAdjust = movedList;
+			movedList = pSPE;
+			numMoved++;
+		}
+		else
+		{
+			pSPE->_previousStartFrame = kEHCIMaxPollingInterval;
+			pSPE->release();
+		}
+	}
+	for (pSPE = movedList; pSPE; pSPE = pSPE->_nextSPEToAdjust)
+		pSPE->_onAdjustList = true;
+	_SPEsToAdjust = movedList;
+	_numSPEsToAdjust = numMoved;
+	SortSPEsToAdjust();
+	_repackPending = (numMoved != 0);
+	
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::RepackPeriodicBandwidth - pSPE(%p) placed at frame(%d) time(%d), %d SPEs moved", this, pNewSPE, (int)pNewSPE->_startFrame, (int)pNewSPE->_startTime, (int)numMoved);
 	return kIOReturnSuccess;
 }
 
@@ -821,12 +1203,13 @@ AppleUSBEHCITTInfo::release() const
 	if ((oldCount-1) == (2 * kEHCIMaxPollingInterval))
 	{
 		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCITTInfo[%p]::release - retainCount is now %d", this, getRetainCount());
-		if (_pSPEsToAdjust->getCount() > 0)
+		if (_numSPEsToAdjust > 0)
 		{
-			USBLog(1, "AppleUSBEHCITTInfo[%p]::release - _pSPEsToAdjust has a count of %d", this, _pSPEsToAdjust->getCount());
+			USBLog(1, "AppleUSBEHCITTInfo[%p]::release - _SPEsToAdjust has a count of %d", this, (int)_numSPEsToAdjust);
+			while (_SPEsToAdjust)
+				((AppleUSBEHCITTInfo*)this)->GetNextSPEToAdjust()->release();
 		}
 		
-		_pSPEsToAdjust->release();
 		for (i=0; i < kEHCIMaxPollingInterval; i++)
 		{
 			if (_interruptQueue[i])
@@ -974,6 +1357,10 @@ AppleUSBEHCISplitPeriodicEndpoint::NewSplitPeriodicEndpoint(	AppleUSBEHCITTInfo
 		pSPE->_SSflags = 0;
 		pSPE->_CSflags = 0;
 		pSPE->_wraparound = false;
+		pSPE->_nextSPEToAdjust = NULL;
+		pSPE->_onAdjustList = false;
+		pSPE->_previousStartFrame = kEHCIMaxPollingInterval;
+		pSPE->_previousStartTime = 0;
 	}
 	
 	return pSPE;
@@ -1054,120 +1441,52 @@ AppleUSBEHCISplitPeriodicEndpoint::SetStartFrameAndStartTime(UInt8 startFrame, U
 // FindStartFrameAndStartTime
 // This method is common to both Interrupt and Isoch endpoints
 // It determines the start_frame (in our 32 frame overall scedule) and start_time (measured in FS bytes) this transaction EP will live
+// The search itself is in AppleUSBEHCISplitPlacement.h, which checks all of the frames at once as a bitmap instead of
+// walking every harmonic of every candidate frame
 //
 IOReturn
 AppleUSBEHCISplitPeriodicEndpoint::FindStartFrameAndStartTime(void)
 {
-	UInt16			tempStartTimes[kEHCIMaxPollingInterval];
-	int				frameIndex, bestFrame;
-	UInt16			bestStartTimeFound = kEHCIFSMinStartTime;
-	UInt16			bestTimeUsedFound = kEHCIFSMinStartTime;
-	UInt16			bestStartTimeFrame = kEHCIMaxPollingInterval;
-	UInt16			bestTimeUsedFrame = kEHCIMaxPollingInterval;
-	UInt32			timeUsedForBestStartTimeFrame = 0;
-	UInt32			timeUsedForBestTimeUsedFrame = 0;
-	bool			foundStartTimeCandidate = false;
-	bool			foundTimeUsedCandidate = false;
+	UInt16						tempStartTimes[kEHCIMaxPollingInterval];
+	EHCISplitPlacementRequest	req;
+	EHCISplitPlacementResult	result;
+	int							frameIndex;
 	
 	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - _FSBytesUsed (%d)", this, _FSBytesUsed);
 	// first, calculate where I would fit into each frame based on where I would be inserted in that frame
 	CalculateAllFrameStartTimes(tempStartTimes);
 	
-	for (frameIndex=0; frameIndex < _period; frameIndex++)
+	req.timeUsed = _myTT->_FStimeUsed;
+	req.startTimes = tempStartTimes;
+	req.excludedFrames = 0;
+	req.bytesUsed = _FSBytesUsed;
+	req.maxFrameBytes = kEHCIFSMaxFrameBytes;
+	req.minStartTime = kEHCIFSMinStartTime;
+	req.period = _period;
+	req.policy = _myTT->_placementPolicy;
+	
+	// only one large isoch is allowed per frame
+	if (_FSBytesUsed > kEHCIFSLargeIsochPacket)
 	{
-		UInt16			totalTimeUsedThisHarmonic = 0;								// the total of all time used for all EPs in this harmonic
-		UInt16			startTimeThisFrame = kEHCIFSMinStartTime;
-		int				frameIndex2;
-		bool			epWillFit = true;
-
-		// check all of the frames in the overall array which would be on the same harmonic as the earliest one
-		for (frameIndex2 = frameIndex; frameIndex2 < kEHCIMaxPollingInterval; frameIndex2 += _period)
-		{
-			// see if I will fit in this harmonic based on total time used
-			UInt16		startTimeThisHarmonic;
-			UInt16		tempTimeUsed = _myTT->_FStimeUsed[frameIndex2] + _FSBytesUsed;
-
-			if ((_FSBytesUsed > kEHCIFSLargeIsochPacket) && (_myTT->_largeIsoch[frameIndex]))
-			{
-				USBLog(1, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - second large isoc not allowed in frame %d", this, frameIndex2);
-				epWillFit = false;
-				break;				// we won't fit on this harmonic
-			}
-			
-			if (tempTimeUsed > kEHCIFSMaxFrameBytes)
-			{
-				USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - no room in frame(%d) based on time used", this, frameIndex2);
-				epWillFit = false;
-				break;				// we won't fit on this harmonic
-			}
-			
-			// now see if I will also fit based on start time
-			startTimeThisHarmonic = tempStartTimes[frameIndex2];
-			if ((startTimeThisHarmonic + _FSBytesUsed) > kEHCIFSMaxFrameBytes)
-			{
-				USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - no room in frame(%d) based on start time", this, frameIndex2);
-				epWillFit = false;
-				break;
-			}
-			
-			totalTimeUsedThisHarmonic += tempTimeUsed;
-			
-			if (startTimeThisHarmonic > startTimeThisFrame)
-				startTimeThisFrame = startTimeThisHarmonic;
-		}
-		if (epWillFit)
-		{
-			// since we indexed past the array, we know that we fit in every harmonic
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - looks like we fit at frame (%d)", this, (int)frameIndex);
-			if (!foundStartTimeCandidate)
-			{
-				foundStartTimeCandidate = true;
-				bestStartTimeFound = startTimeThisFrame+1;
-			}
-			if (!foundTimeUsedCandidate)
-			{
-				foundTimeUsedCandidate = true;
-				bestTimeUsedFound = totalTimeUsedThisHarmonic+1;
-			}
-			// note. if the below is less than instead of less than or equal, then we will start at the beginning of the possible frames
-			// with <= we gravitate toward the end..
-			if (startTimeThisFrame < bestStartTimeFound)
-			{
-				bestStartTimeFound = startTimeThisFrame;
-				bestStartTimeFrame = frameIndex;
-				timeUsedForBestStartTimeFrame = totalTimeUsedThisHarmonic;
-			}
-			if (totalTimeUsedThisHarmonic < bestTimeUsedFound)
-			{
-				bestTimeUsedFound = totalTimeUsedThisHarmonic;
-				bestTimeUsedFrame = frameIndex;
-			}
-		}
+		for (frameIndex=0; frameIndex < kEHCIMaxPollingInterval; frameIndex++)
+			if (_myTT->_largeIsoch[frameIndex])
+				req.excludedFrames |= ((UInt32)1 << frameIndex);
 	}
 	
-	if (!foundStartTimeCandidate)
+	result = EHCISplitPlacementFind(&req);
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - start frames with room[%08x] large isoch frames[%08x]", this, (uint32_t)result.candidates, (uint32_t)req.excludedFrames);
+	
+	if (!result.found)
 	{
-		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - using Start Time entry found - _startFrame(%d) _startTime(%d)", this, (int)_startFrame, _startTime);
+		USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - no frame found for period(%d)", this, (int)_period);
 		_startTime = 0;
 		_startFrame = kEHCIMaxPollingInterval;			// this is invalid
 		return kIOReturnNoBandwidth;
 	}
-	else
-	{
-		// now see if we got anything
-		if (bestStartTimeFound <= bestTimeUsedFound)
-		{
-			_startTime = bestStartTimeFound;
-			_startFrame = bestStartTimeFrame;
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - using Start Time entry found - _startFrame(%d) _startTime(%d)", this, (int)_startFrame, _startTime);
-		}
-		else
-		{
-			_startTime = bestTimeUsedFound;
-			_startFrame = bestTimeUsedFrame;
-			USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - using Start Frame entry found - _startFrame(%d) _startTime(%d)", this, (int)_startFrame, _startTime);
-		}
-	}
+
+	_startTime = result.startTime;
+	_startFrame = result.startFrame;
+	USBLog(gEHCIBandwidthLogLevel, "AppleUSBEHCISplitPeriodicEndpoint[%p]::FindStartFrameAndStartTime - _startFrame(%d) _startTime(%d)", this, (int)_startFrame, _startTime);
 				
 	return kIOReturnSuccess;
 }
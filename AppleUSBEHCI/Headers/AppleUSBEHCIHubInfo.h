@@ -27,6 +27,7 @@
 
 #include "AppleUSBEHCI.h"
 #include "AppleEHCIListElement.h"
+#include "AppleUSBEHCISplitPlacement.h"
 
 // this structure is used to monitor the hubs which are attached. there will
 // be an instance of this structure for every high speed hub with a FS/LS
@@ -35,6 +36,31 @@
 // will be that instance AND an instance for each active port
 class AppleEHCIIsochEndpoint;
 class AppleUSBEHCISplitPeriodicEndpoint;
+class AppleUSBEHCIHubInfo;
+
+enum
+{
+	kEHCIHubInfoMaxHubAddresses		= 128,					// USB device addresses are 7 bits
+	kEHCIHubInfoTTBuckets			= 8						// a multiTT hub's TTs are hashed on the port number
+};
+
+// the hubs which have a TT in use on one controller, indexed by hub address. the controller keeps one of these (zeroed)
+// and passes it to the static AppleUSBEHCIHubInfo methods
+typedef struct AppleUSBEHCIHubInfoTable
+{
+	AppleUSBEHCIHubInfo		*hubs[kEHCIHubInfoMaxHubAddresses];
+	UInt32					numHubs;						// for diagnostics (see CopyDiagnostics)
+	UInt32					numTTs;							// for diagnostics (see CopyDiagnostics)
+	UInt8					placementPolicy;				// given to each new hub (see SetPlacementPolicyFromProperty)
+} AppleUSBEHCIHubInfoTable;
+
+// the controller property which selects the TT placement policy (see AppleUSBEHCISplitPlacement.h). the controller hands
+// its value to AppleUSBEHCIHubInfo::SetPlacementPolicyFromProperty when it starts and whenever the property is set
+#define kAppleEHCITTPlacementPolicyKey		"EHCI TT Placement Policy"
+
+// the controller property which holds AppleUSBEHCIHubInfo::CopyDiagnostics. it is a snapshot, so the controller sets it
+// again after each AddHubInfo or DeleteHubInfo
+#define kAppleEHCIHubInfoDiagnosticsKey		"EHCI Hub Info"
 
 class AppleUSBEHCITTInfo : public OSObject
 {
@@ -49,6 +75,12 @@ public:
 	// AppleUSBEHCITTInfo methods 
 	IOReturn	AllocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pSPE);
 	IOReturn	DeallocatePeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pSPE);
+	IOReturn	LinkPeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pSPE);
+	
+	// the placement policy (kEHCISplitPlacementPolicyEarliest etc.) and the re-pack which kEHCISplitPlacementPolicyRepack does
+	// when an SPE would otherwise not fit
+	void		SetPlacementPolicy(UInt8 policy);
+	IOReturn	RepackPeriodicBandwidth(AppleUSBEHCISplitPeriodicEndpoint *pNewSPE);
 	
 	// this methods help track time reserved for IN bytes after periodic CS tokens
 	IOReturn	ReserveHSSplitINBytes(int frame, int uFrame, UInt16 bytesToReserve);
@@ -59,6 +91,16 @@ public:
 	IOReturn	ReleaseFSBusBytes(int frame, UInt16 bytesToRelease);
 	
 	IOReturn	CalculateSPEsToAdjustAfterChange(AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added);
+	
+	// these methods hand out the SPEs found by CalculateSPEsToAdjustAfterChange, in the order in which they should be moved.
+	// they replace draining _pSPEsToAdjust with getFirstObject/removeObject, which is no longer filled in
+	AppleUSBEHCISplitPeriodicEndpoint	*GetNextSPEToAdjust(void);
+	UInt32								GetNumSPEsToAdjust(void) { return _numSPEsToAdjust; }
+	
+	// these methods build the adjust list
+	void		AddSPEToAdjust(AppleUSBEHCISplitPeriodicEndpoint *pSPE);
+	void		AddSPEChainToAdjust(AppleUSBEHCISplitPeriodicEndpoint *pSPE, AppleUSBEHCISplitPeriodicEndpoint *pSPEToSkip);
+	void		SortSPEsToAdjust(void);
 
 	// debugging aids
 	void		print(int level, const char *fromStr);
@@ -66,11 +108,15 @@ public:
 	IOReturn	ShowHSSplitTimeUsed(int level, const char *fromStr);
 	
 	
-    AppleUSBEHCITTInfo					*next;
+    AppleUSBEHCITTInfo					*next;												// the next TT in the same bucket of the hub's ttTable
 	AppleUSBEHCISplitPeriodicEndpoint	*_largeIsoch[kEHCIMaxPollingInterval];				// special case large (> half) Isoch xaction
 	AppleUSBEHCISplitPeriodicEndpoint	*_interruptQueue[kEHCIMaxPollingInterval];			// the head of the interrupt list for each frame in the TT
 	AppleUSBEHCISplitPeriodicEndpoint	*_isochQueue[kEHCIMaxPollingInterval];				// the head of the isoch list for each frame  in the TT
-	OSOrderedSet						*_pSPEsToAdjust;									// an ordered set of SPEs to adjust
+	AppleUSBEHCISplitPeriodicEndpoint	*_SPEsToAdjust;										// SPEs to adjust, linked through _nextSPEToAdjust
+	UInt32								_numSPEsToAdjust;
+	OSOrderedSet						*_pSPEsToAdjust;									// DEPRECATED - always NULL, use GetNextSPEToAdjust
+	UInt8								_placementPolicy;
+	bool								_repackPending;										// the adjust list holds the SPEs moved by a re-pack
     UInt8								hubPort;
 	UInt16								_thinkTime;
 	UInt16								_FStimeUsed[kEHCIMaxPollingInterval];				// the amound of time used (in FS bytes) for each frame
@@ -78,28 +124,28 @@ public:
 		
 };
 
-enum 
-{
-	kAppleEHCITTInfoInitialOrderedSetSize =		16
-};
-
-
 class AppleUSBEHCIHubInfo : public OSObject
 {
     OSDeclareDefaultStructors(AppleUSBEHCIHubInfo)
 	
 public:
-	static AppleUSBEHCIHubInfo *FindHubInfo(AppleUSBEHCIHubInfo *hubList, USBDeviceAddress hubAddress);	
-	static AppleUSBEHCIHubInfo *AddHubInfo(AppleUSBEHCIHubInfo **hubList, USBDeviceAddress hubAddress, UInt32 flags);
-	static IOReturn				DeleteHubInfo(AppleUSBEHCIHubInfo **hubList, USBDeviceAddress hubAddress);
+	static AppleUSBEHCIHubInfo *FindHubInfo(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddress);	
+	static AppleUSBEHCIHubInfo *AddHubInfo(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddress, UInt32 flags);
+	static IOReturn				DeleteHubInfo(AppleUSBEHCIHubInfoTable *hubTable, USBDeviceAddress hubAddress);
+	static IOReturn				SetPlacementPolicyFromProperty(AppleUSBEHCIHubInfoTable *hubTable, OSObject *policyProperty);
+	static OSDictionary			*CopyDiagnostics(AppleUSBEHCIHubInfoTable *hubTable);
 
 	AppleUSBEHCITTInfo			*GetTTInfo(int portAddress);
+	void						SetPlacementPolicy(UInt8 policy);
 
 private:
-    AppleUSBEHCIHubInfo		*next;
-	AppleUSBEHCITTInfo		*ttList;
-    bool					multiTT;
-    UInt8					hubAddr;
+	void						ReleaseTTs(void);
+	
+	AppleUSBEHCIHubInfoTable	*hubTable;						// the table which this hub is in
+	AppleUSBEHCITTInfo			*ttTable[kEHCIHubInfoTTBuckets];	// chained through the TT's next
+    bool						multiTT;
+    UInt8						hubAddr;
+	UInt8						placementPolicy;				// given to each TT on this hub
 	
 };
 
@@ -130,6 +176,7 @@ public:
 	AppleEHCIQueueHead						*_intEP;				// only valid if _epType == kUSBInterrupt
 	AppleEHCIIsochEndpoint					*_isochEP;				// only valid is _epType == kUSBIsoch
 	AppleUSBEHCITTInfo						*_myTT;					// pointer to the transaction translator for this EP
+	AppleUSBEHCISplitPeriodicEndpoint		*_nextSPEToAdjust;		// link in the TT's adjust list
 
 	UInt16									_epType;
 	UInt16									_FSBytesUsed;			// number of bytes used on the FS bus (including bit stuffing)
@@ -142,6 +189,9 @@ public:
 	UInt8									_SSflags;				// SS flags for the hardware programming
 	UInt									_CSflags;				// CS flags for the hardware programming
 	bool									_wraparound;			// do we need to wrap around to the next frame
+	bool									_onAdjustList;			// already in the TT's adjust list (which holds a retain on us)
+	UInt8									_previousStartFrame;	// where a re-pack moved this EP from
+	UInt16									_previousStartTime;
 	
 	
 };
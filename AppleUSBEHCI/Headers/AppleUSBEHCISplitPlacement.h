@@ -0,0 +1,288 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _APPLEUSBEHCISPLITPLACEMENT_H
+#define _APPLEUSBEHCISPLITPLACEMENT_H
+
+#include <stdint.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+// The start frame / start time search used by AppleUSBEHCISplitPeriodicEndpoint::FindStartFrameAndStartTime.
+// Instead of walking every harmonic of every candidate frame with a branch per check, the per-frame budget vectors
+// (time used and start time) are folded in half until they are _period wide, keeping the sum and the maximum of
+// each harmonic, and then every candidate frame is checked at once into a bitmap. Periods which are not a power of 2
+// check each harmonic mask against a bitmap of the frames with room instead. This header only depends on
+// <stdint.h>, so the same code can be built into Tools/EHCISplitPlacementBench, which checks it against the
+// original loop, and into Tools/EHCISplitScheduleSim, which compares the placement policies.
+enum
+{
+	kEHCISplitPlacementFrames		= 32					// must match kEHCIMaxPollingInterval
+};
+
+// how a TT picks the start frame for a new split EP
+enum
+{
+	kEHCISplitPlacementPolicyEarliest		= 0,			// the lowest start time or time used (the original policy)
+	kEHCISplitPlacementPolicyBestFit		= 1,			// the fullest harmonic which still has room
+	kEHCISplitPlacementPolicyRepack			= 2,			// earliest, and re-pack the whole TT when that fails
+	kEHCISplitPlacementPolicyCount			= 3
+};
+
+typedef struct EHCISplitPlacementRequest
+{
+	const uint16_t	*timeUsed;								// FS bytes already used in each frame (_FStimeUsed)
+	const uint16_t	*startTimes;							// where this EP would start in each frame (CalculateAllFrameStartTimes)
+	uint32_t		excludedFrames;							// frames which may not be the start frame (a second large isoch)
+	uint16_t		bytesUsed;								// FS bytes used by this EP
+	uint16_t		maxFrameBytes;
+	uint16_t		minStartTime;
+	uint8_t			period;
+	uint8_t			policy;									// kEHCISplitPlacementPolicyEarliest etc.
+} EHCISplitPlacementRequest;
+
+typedef struct EHCISplitPlacementResult
+{
+	uint32_t		candidates;								// start frames where every harmonic has room for this EP
+	uint16_t		startTime;
+	uint8_t			startFrame;								// kEHCISplitPlacementFrames if nothing fits
+	bool			found;
+} EHCISplitPlacementResult;
+
+// the per-harmonic vectors, only the first min(period, kEHCISplitPlacementFrames) entries are used
+typedef struct EHCISplitPlacementHarmonics
+{
+	uint16_t		sums[kEHCISplitPlacementFrames];		// total time used in the harmonic, including this EP
+	uint16_t		maxTime[kEHCISplitPlacementFrames];		// the most time used in any one frame, including this EP
+	uint16_t		maxStart[kEHCISplitPlacementFrames];	// the latest start time in any one frame
+} EHCISplitPlacementHarmonics;
+
+
+
+static inline bool
+EHCISplitPlacementIsPowerOf2(uint8_t period)
+{
+	return (period != 0) && ((period & (period - 1)) == 0);
+}
+
+
+
+#define EHCISplitPlacementMax(a, b)		((a) > (b) ? (a) : (b))
+
+// Fold the budget vectors for a power of 2 period (or any period of a whole schedule or more, where every frame is
+// its own harmonic). Entry i ends up covering frames i, i+period, i+2*period...
+static inline void
+EHCISplitPlacementFold(const EHCISplitPlacementRequest *req, EHCISplitPlacementHarmonics *h)
+{
+	int				frame, width;
+
+	if (req->period >= kEHCISplitPlacementFrames)
+	{
+		for (frame = 0; frame < kEHCISplitPlacementFrames; frame++)
+		{
+			uint16_t	timeUsed = req->timeUsed[frame] + req->bytesUsed;
+
+			h->sums[frame] = timeUsed;
+			h->maxTime[frame] = timeUsed;
+			h->maxStart[frame] = req->startTimes[frame];
+		}
+		return;
+	}
+
+	// the first fold is done while loading the vectors
+	width = kEHCISplitPlacementFrames / 2;
+	for (frame = 0; frame < width; frame++)
+	{
+		uint16_t	timeUsed0 = req->timeUsed[frame] + req->bytesUsed;
+		uint16_t	timeUsed1 = req->timeUsed[frame + width] + req->bytesUsed;
+
+		h->sums[frame] = timeUsed0 + timeUsed1;
+		h->maxTime[frame] = EHCISplitPlacementMax(timeUsed0, timeUsed1);
+		h->maxStart[frame] = EHCISplitPlacementMax(req->startTimes[frame], req->startTimes[frame + width]);
+	}
+	for (width /= 2; width >= req->period; width /= 2)
+	{
+		for (frame = 0; frame < width; frame++)
+		{
+			h->sums[frame] += h->sums[frame + width];
+			h->maxTime[frame] = EHCISplitPlacementMax(h->maxTime[frame], h->maxTime[frame + width]);
+			h->maxStart[frame] = EHCISplitPlacementMax(h->maxStart[frame], h->maxStart[frame + width]);
+		}
+	}
+}
+
+
+
+// Any other period walks each harmonic. These periods do not come from the USB descriptors, but the search has to
+// give the same answer for them as the original loop did.
+static inline void
+EHCISplitPlacementWalk(const EHCISplitPlacementRequest *req, EHCISplitPlacementHarmonics *h)
+{
+	int				frame, frame2;
+
+	for (frame = 0; frame < req->period; frame++)
+	{
+		h->sums[frame] = 0;
+		h->maxTime[frame] = 0;
+		h->maxStart[frame] = 0;
+		for (frame2 = frame; frame2 < kEHCISplitPlacementFrames; frame2 += req->period)
+		{
+			uint16_t	timeUsed = req->timeUsed[frame2] + req->bytesUsed;
+
+			h->sums[frame] += timeUsed;
+			h->maxTime[frame] = EHCISplitPlacementMax(h->maxTime[frame], timeUsed);
+			h->maxStart[frame] = EHCISplitPlacementMax(h->maxStart[frame], req->startTimes[frame2]);
+		}
+	}
+}
+
+
+
+// the frame number goes in the low bits of the keys which are compared, so that the lowest key is the lowest value
+// in the earliest frame. Six bits, so that the frame past the end of the schedule fits as well
+enum
+{
+	kEHCISplitPlacementKeyShift		= 6,
+	kEHCISplitPlacementKeyFrameMask	= (1 << kEHCISplitPlacementKeyShift) - 1
+};
+
+#define kEHCISplitPlacementNoKey		0xFFFFFFFFU
+
+
+
+// With kEHCISplitPlacementPolicyEarliest, pick the start frame the same way the original loop did: of all of the
+// frames which fit, remember the first one with the lowest start time and the first one with the lowest total time
+// used, and use whichever of those two values is lower (the start time on a tie).
+// kEHCISplitPlacementPolicyRepack places each EP the same way (a re-pack keeps the TT balanced by placing the biggest
+// loads first, not by using a different rule).
+// With kEHCISplitPlacementPolicyBestFit, pick the first frame whose fullest frame has the least room left once this EP
+// is in it. That keeps the emptier harmonics free for the bigger EPs with the same period, but it also fills frames which
+// every shorter period EP needs, so Tools/EHCISplitScheduleSim shows it rejecting more on a busy TT.
+static inline EHCISplitPlacementResult
+EHCISplitPlacementFind(const EHCISplitPlacementRequest *req)
+{
+	EHCISplitPlacementResult	result;
+	EHCISplitPlacementHarmonics	h;
+	uint32_t					bestStartKey = kEHCISplitPlacementNoKey, bestTimeUsedKey = kEHCISplitPlacementNoKey;
+	uint32_t					bestFitKey = kEHCISplitPlacementNoKey;
+	uint32_t					startLimit;
+	int							frame, frames;
+
+	result.candidates = 0;
+	result.startTime = 0;
+	result.startFrame = kEHCISplitPlacementFrames;
+	result.found = false;
+
+	if (req->period == 0)
+		return result;
+
+	frames = (req->period < kEHCISplitPlacementFrames) ? (int)req->period : (int)kEHCISplitPlacementFrames;
+
+	// startTimes[frame] + bytesUsed <= maxFrameBytes is the same as startTimes[frame] <= startLimit, and nothing fits
+	// if this EP is bigger than a whole frame
+	if (req->bytesUsed <= req->maxFrameBytes)
+	{
+		startLimit = req->maxFrameBytes - req->bytesUsed;
+
+		if (EHCISplitPlacementIsPowerOf2(req->period) || (req->period >= kEHCISplitPlacementFrames))
+			EHCISplitPlacementFold(req, &h);
+		else
+			EHCISplitPlacementWalk(req, &h);
+
+		// the masked compare: a frame is a candidate when the worst frame in its harmonic has room
+		for (frame = 0; frame < frames; frame++)
+			result.candidates |= (uint32_t)((h.maxTime[frame] <= req->maxFrameBytes) & (h.maxStart[frame] <= startLimit)) << frame;
+		result.candidates &= ~req->excludedFrames;
+	}
+
+	if (result.candidates)
+	{
+		for (frame = 0; frame < frames; frame++)
+		{
+			// all ones for a frame which does not fit, so that its keys never win
+			uint32_t	notCandidate = ((result.candidates >> frame) & 1) - 1;
+			uint32_t	startTime = EHCISplitPlacementMax(h.maxStart[frame], req->minStartTime);
+			uint32_t	startKey = ((startTime << kEHCISplitPlacementKeyShift) | frame) | notCandidate;
+			uint32_t	timeUsedKey = (((uint32_t)h.sums[frame] << kEHCISplitPlacementKeyShift) | frame) | notCandidate;
+			uint32_t	fitKey = (((uint32_t)(req->maxFrameBytes - h.maxTime[frame]) << kEHCISplitPlacementKeyShift) | frame) | notCandidate;
+
+			bestStartKey = startKey < bestStartKey ? startKey : bestStartKey;
+			bestTimeUsedKey = timeUsedKey < bestTimeUsedKey ? timeUsedKey : bestTimeUsedKey;
+			bestFitKey = fitKey < bestFitKey ? fitKey : bestFitKey;
+		}
+	}
+
+	// a start frame past the end of the schedule has no harmonics to check, so it always fits with nothing used.
+	// Only the first of those can ever be picked, and only if nothing else was better
+	if (req->period > kEHCISplitPlacementFrames)
+	{
+		uint32_t	startKey = ((uint32_t)req->minStartTime << kEHCISplitPlacementKeyShift) | kEHCISplitPlacementFrames;
+		uint32_t	timeUsedKey = kEHCISplitPlacementFrames;
+
+		bestStartKey = startKey < bestStartKey ? startKey : bestStartKey;
+		bestTimeUsedKey = timeUsedKey < bestTimeUsedKey ? timeUsedKey : bestTimeUsedKey;
+		if (bestFitKey == kEHCISplitPlacementNoKey)
+			bestFitKey = ((uint32_t)req->maxFrameBytes << kEHCISplitPlacementKeyShift) | kEHCISplitPlacementFrames;
+	}
+
+	if ((req->policy == kEHCISplitPlacementPolicyBestFit) && (bestFitKey != kEHCISplitPlacementNoKey))
+	{
+		result.found = true;
+		result.startFrame = bestFitKey & kEHCISplitPlacementKeyFrameMask;
+		if (result.startFrame < kEHCISplitPlacementFrames)
+			result.startTime = EHCISplitPlacementMax(h.maxStart[result.startFrame], req->minStartTime);
+		else
+			result.startTime = req->minStartTime;
+	}
+	else if (bestStartKey != kEHCISplitPlacementNoKey)
+	{
+		uint32_t	bestKey = ((bestStartKey >> kEHCISplitPlacementKeyShift) <= (bestTimeUsedKey >> kEHCISplitPlacementKeyShift)) ? bestStartKey : bestTimeUsedKey;
+
+		result.found = true;
+		result.startTime = bestKey >> kEHCISplitPlacementKeyShift;
+		result.startFrame = bestKey & kEHCISplitPlacementKeyFrameMask;
+	}
+	return result;
+}
+
+
+
+
+// The order in which a TT is re-packed: the EPs which take the most FS bytes over the whole schedule go first (which
+// puts any large isoch first), then the biggest. Returns a negative value if the first EP should be placed first.
+static inline int
+EHCISplitPlacementRepackCompare(uint8_t period1, uint16_t bytesUsed1, uint8_t period2, uint16_t bytesUsed2)
+{
+	uint32_t		load1 = (uint32_t)bytesUsed1 * ((period1 && (period1 < kEHCISplitPlacementFrames)) ? (kEHCISplitPlacementFrames + period1 - 1) / period1 : 1);
+	uint32_t		load2 = (uint32_t)bytesUsed2 * ((period2 && (period2 < kEHCISplitPlacementFrames)) ? (kEHCISplitPlacementFrames + period2 - 1) / period2 : 1);
+
+	if (load1 != load2)
+		return (load1 > load2) ? -1 : 1;
+	if (bytesUsed1 != bytesUsed2)
+		return (bytesUsed1 > bytesUsed2) ? -1 : 1;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  EHCIAdjustSetCheck
+//
+//  Builds the real AppleUSBEHCIHubInfo.cpp and compares the adjust list which CalculateSPEsToAdjustAfterChange
+//  now builds, by walking only the frames of the SPE which changed, with the OSOrderedSet which it used to build
+//  by scanning all 32 frames. Both are run on the same TT after the same add or remove, over randomized TT loads.
+//
+//  Build:	c++ -O2 -std=c++11 -fno-extended-identifiers -I. -IInclude -I../../Headers -I../../Classes -o EHCIAdjustSetCheck EHCIAdjustSetCheck.cpp
+//		(-fno-extended-identifiers lets gcc through the bullets in the driver's #pragma mark lines; clang doesn't need it)
+//
+//  Usage:	EHCIAdjustSetCheck [-e endpoints] [-n loads] [-s seed] [-v]
+//
+//  Each load is a TT with up to <endpoints> (default 24) split endpoints put on it with AllocatePeriodicBandwidth,
+//  and settled (every SPE given the start time its neighbours give it, until nothing moves), followed by one more
+//  add, or the removal of one of them with DeallocatePeriodicBandwidth. -v prints the first few loads where the
+//  two differ.
+//
+//  The old scan finds SPEs in frames which the change does not touch, so the two sets are not expected to be the
+//  same. What matters is whether moving them gives the same schedule, so each set is also handed to a stand-in
+//  for the UIM's drain, which gives every SPE in it, in order, the start time CalculateNewStartTimeFromChange
+//  returns. A load is a mismatch when the two drains leave any SPE on the TT with a different start time. Both are
+//  also compared with settling the whole TT again, which neither drain is guaranteed to match in one pass.
+//
+//  The exit status is 1 if there were any mismatches.
+//
+
+#include <time.h>
+#include <unistd.h>
+
+#include "EHCIAdjustSetCheckKernel.h"
+#include "AppleUSBEHCIHubInfo.cpp"
+
+enum
+{
+	kCheckDefaultLoads			= 20000,
+	kCheckMaxEndpointsPerLoad	= 24,
+	kCheckMaxSPEs				= 256,
+	kCheckMaxReports			= 10,
+	kCheckMaxSettlePasses		= 64
+};
+
+typedef struct CheckSet
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*spe[kCheckMaxSPEs];
+	int									count;
+} CheckSet;
+
+typedef struct CheckStats
+{
+	long			loads;
+	long			adds;
+	long			removes;
+	long			oldSPEs;								// total size of the old sets
+	long			newSPEs;								// total size of the new lists
+	long			onlyOld;								// SPEs in an old set and not in the new list
+	long			onlyNew;								// SPEs in a new list and not in the old set
+	long			setMismatches;							// loads with an SPE only in the new list
+	long			timeMismatches;							// loads where the drains left different start times
+	long			oldUnsettled;							// loads where the old drain did not match settling the TT
+	long			newUnsettled;							// loads where the new drain did not match settling the TT
+	long			unsettledLoads;							// loads which did not settle before the change (skipped)
+	long			unreachable;							// SPEs the drain could not find in one of their frames
+	double			oldNS;
+	double			newNS;
+} CheckStats;
+
+static bool			gVerbose = false;
+
+
+
+static double
+NowNS(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+
+static bool
+SetContains(const CheckSet *set, const AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	int		i;
+
+	for (i = 0; i < set->count; i++)
+		if (set->spe[i] == pSPE)
+			return true;
+	return false;
+}
+
+
+
+// OSOrderedSet::setObject, which queues an object behind the ones which have the same priority
+static void
+SetInsertOrdered(CheckSet *set, AppleUSBEHCISplitPeriodicEndpoint *pSPE, const AppleUSBEHCITTInfo *tt)
+{
+	int		i;
+
+	if (SetContains(set, pSPE) || (set->count == kCheckMaxSPEs))
+		return;
+
+	for (i = 0; (i < set->count) && (CompareSPEs(set->spe[i], pSPE, tt) >= 0); i++)
+		;
+	memmove(&set->spe[i + 1], &set->spe[i], (set->count - i) * sizeof(set->spe[0]));
+	set->spe[i] = pSPE;
+	set->count++;
+}
+
+
+
+// CalculateSPEsToAdjustAfterChange as it was when it filled in _pSPEsToAdjust, with the logging taken out
+static void
+OldCalculateSPEsToAdjust(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added, CheckSet *set)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+	int									index;
+
+	set->count = 0;
+	if (pSPEChanged->_FSBytesUsed >= kEHCIFSLargeIsochPacket)
+	{
+		for (index = 0; index < kEHCIMaxPollingInterval; index++)
+		{
+			for (pSPE = tt->_isochQueue[index]->_nextSPE; pSPE; pSPE = pSPE->_nextSPE)
+				SetInsertOrdered(set, pSPE, tt);
+			for (pSPE = tt->_interruptQueue[index]->_nextSPE; pSPE; pSPE = pSPE->_nextSPE)
+				SetInsertOrdered(set, pSPE, tt);
+		}
+	}
+	else if (pSPEChanged->_epType == kUSBIsoc)
+	{
+		for (index = 0; index < kEHCIMaxPollingInterval; index++)
+		{
+			pSPE = tt->_isochQueue[index]->_nextSPE;
+			if (!added)
+			{
+				for (; pSPE; pSPE = pSPE->_nextSPE)
+					if ((pSPE != pSPEChanged) && (pSPE->_startTime >= pSPEChanged->_startTime))
+						SetInsertOrdered(set, pSPE, tt);
+			}
+			else
+			{
+				while (pSPE && (pSPEChanged->CheckPlacementBefore(pSPE) == kIOReturnSuccess))
+					pSPE = pSPE->_nextSPE;
+				for (; pSPE; pSPE = pSPE->_nextSPE)
+					SetInsertOrdered(set, pSPE, tt);
+			}
+			for (pSPE = tt->_interruptQueue[index]->_nextSPE; pSPE; pSPE = pSPE->_nextSPE)
+				SetInsertOrdered(set, pSPE, tt);
+		}
+	}
+	else
+	{
+		for (index = 0; index < kEHCIMaxPollingInterval; index++)
+		{
+			pSPE = tt->_interruptQueue[index]->_nextSPE;
+			if (!added)
+			{
+				for (; pSPE; pSPE = pSPE->_nextSPE)
+					if ((pSPE != pSPEChanged) && (pSPE->_startTime >= pSPEChanged->_startTime))
+						SetInsertOrdered(set, pSPE, tt);
+			}
+			else
+			{
+				while (pSPE && (pSPEChanged->CheckPlacementBefore(pSPE) != kIOReturnSuccess))
+					pSPE = pSPE->_nextSPE;
+				for (; pSPE; pSPE = pSPE->_nextSPE)
+					if (pSPE != pSPEChanged)
+						SetInsertOrdered(set, pSPE, tt);
+			}
+		}
+	}
+}
+
+
+
+static IOReturn
+NewCalculateSPEsToAdjust(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added, CheckSet *set)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+	IOReturn							err;
+
+	set->count = 0;
+	err = tt->CalculateSPEsToAdjustAfterChange(pSPEChanged, added);
+	while ((pSPE = tt->GetNextSPEToAdjust()))
+	{
+		if (set->count < kCheckMaxSPEs)
+			set->spe[set->count++] = pSPE;
+		pSPE->release();									// the list's retain, the load still holds one
+	}
+	return err;
+}
+
+
+
+// CalculateNewStartTimeFromChange walks each of the SPE's frames until it finds the SPE, so make sure that it will
+static bool
+ReachableInAllFrames(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*curSPE;
+	int									index;
+
+	for (index = pSPE->_startFrame; index < kEHCIMaxPollingInterval; index += pSPE->_period)
+	{
+		curSPE = (pSPE->_epType == kUSBIsoc) ? tt->_isochQueue[index] : tt->_interruptQueue[index];
+		while (curSPE && (curSPE->_nextSPE != pSPE))
+			curSPE = curSPE->_nextSPE;
+		if (!curSPE)
+			return false;
+	}
+	return true;
+}
+
+
+
+// The UIM's drain, as far as start times go: each SPE, in order, gets the start time which its neighbours now give it
+static void
+DrainSet(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, const CheckSet *set, CheckStats *stats)
+{
+	int		i;
+
+	for (i = 0; i < set->count; i++)
+	{
+		AppleUSBEHCISplitPeriodicEndpoint	*pSPE = set->spe[i];
+
+		if (!ReachableInAllFrames(tt, pSPE))
+		{
+			stats->unreachable++;
+			continue;
+		}
+		pSPE->SetStartFrameAndStartTime(pSPE->_startFrame, pSPE->CalculateNewStartTimeFromChange(pSPEChanged));
+	}
+}
+
+
+
+// Give every SPE on the TT the start time its neighbours give it, until nothing moves. Returns false if that does
+// not happen in kCheckMaxSettlePasses passes
+static bool
+SettleTT(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint **live, int numLive)
+{
+	int		pass, i;
+	bool	moved = true;
+
+	for (pass = 0; moved && (pass < kCheckMaxSettlePasses); pass++)
+	{
+		moved = false;
+		for (i = 0; i < numLive; i++)
+		{
+			UInt16		startTime;
+
+			if (!ReachableInAllFrames(tt, live[i]))
+				continue;
+			startTime = live[i]->CalculateNewStartTimeFromChange(NULL);
+			if (startTime != live[i]->_startTime)
+			{
+				live[i]->SetStartFrameAndStartTime(live[i]->_startFrame, startTime);
+				moved = true;
+			}
+		}
+	}
+	return !moved;
+}
+
+
+
+static uint8_t
+RandomPeriod(bool isoch)
+{
+	// most FS isoch endpoints have a period of 1, and most interrupt ones poll every 8 to 32ms
+	if (isoch)
+		return (rand() % 4) ? 1 : (uint8_t)(1 << (rand() % 4));
+	return (uint8_t)(1 << ((rand() % 3) ? 3 + (rand() % 3) : rand() % 6));
+}
+
+
+
+static AppleUSBEHCISplitPeriodicEndpoint *
+RandomSPE(AppleUSBEHCITTInfo *tt)
+{
+	bool		isoch = ((rand() % 4) == 0);
+	uint16_t	bytes;
+
+	if (isoch)
+		bytes = (uint16_t)(20 + rand() % ((rand() % 8) ? 300 : 900));
+	else
+		bytes = (uint16_t)(10 + rand() % 80);
+	return AppleUSBEHCISplitPeriodicEndpoint::NewSplitPeriodicEndpoint(tt, isoch ? kUSBIsoc : kUSBInterrupt, NULL, bytes, RandomPeriod(isoch));
+}
+
+
+
+static void
+ReportLoad(long load, AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added, const CheckSet *oldSet, const CheckSet *newSet, const char *why)
+{
+	int		i;
+
+	printf("load %ld: %s %s period %d bytes %d frame %d time %d - %s\n", load, added ? "add" : "remove",
+		   (pSPEChanged->_epType == kUSBIsoc) ? "isoch" : "interrupt", pSPEChanged->_period, pSPEChanged->_FSBytesUsed,
+		   pSPEChanged->_startFrame, pSPEChanged->_startTime, why);
+	printf("    old(%d):", oldSet->count);
+	for (i = 0; i < oldSet->count; i++)
+		printf(" %s%d/%d@%d", SetContains(newSet, oldSet->spe[i]) ? "" : "*", oldSet->spe[i]->_period, oldSet->spe[i]->_startFrame, oldSet->spe[i]->_startTime);
+	printf("\n    new(%d):", newSet->count);
+	for (i = 0; i < newSet->count; i++)
+		printf(" %s%d/%d@%d", SetContains(oldSet, newSet->spe[i]) ? "" : "*", newSet->spe[i]->_period, newSet->spe[i]->_startFrame, newSet->spe[i]->_startTime);
+	printf("\n");
+}
+
+
+
+static void
+CheckOneLoad(long load, int maxEndpoints, CheckStats *stats)
+{
+	AppleUSBEHCITTInfo					*tt = AppleUSBEHCITTInfo::NewTTInfo(0);
+	AppleUSBEHCISplitPeriodicEndpoint	*live[kCheckMaxSPEs];
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPEChanged;
+	UInt16								before[kCheckMaxSPEs], afterOld[kCheckMaxSPEs], settled[kCheckMaxSPEs];
+	static CheckSet						oldSet, newSet;
+	int									numLive = 0, endpoints, i;
+	bool								added, timesDiffer = false, oldUnsettled = false, newUnsettled = false;
+	long								onlyNew = 0;
+	double								start;
+
+	if (!tt)
+	{
+		fprintf(stderr, "NewTTInfo failed\n");
+		exit(2);
+	}
+
+	endpoints = rand() % (maxEndpoints + 1);
+	for (i = 0; i < endpoints; i++)
+	{
+		AppleUSBEHCISplitPeriodicEndpoint	*pSPE = RandomSPE(tt);
+
+		if (tt->AllocatePeriodicBandwidth(pSPE) == kIOReturnSuccess)
+			live[numLive++] = pSPE;
+		else
+			pSPE->release();
+	}
+	if (!SettleTT(tt, live, numLive))
+	{
+		stats->unsettledLoads++;
+		goto Done;
+	}
+
+	// add one more, or take one of them off
+	pSPEChanged = NULL;
+	added = (!numLive || (rand() % 2));
+	if (added)
+	{
+		pSPEChanged = RandomSPE(tt);
+		if (tt->AllocatePeriodicBandwidth(pSPEChanged) != kIOReturnSuccess)
+		{
+			pSPEChanged->release();
+			pSPEChanged = NULL;
+			added = false;
+		}
+	}
+	if (!pSPEChanged && numLive)
+	{
+		i = rand() % numLive;
+		pSPEChanged = live[i];
+		live[i] = live[--numLive];
+		tt->DeallocatePeriodicBandwidth(pSPEChanged);
+	}
+
+	if (pSPEChanged)
+	{
+		stats->loads++;
+		if (added)
+			stats->adds++;
+		else
+			stats->removes++;
+
+		start = NowNS();
+		OldCalculateSPEsToAdjust(tt, pSPEChanged, added, &oldSet);
+		stats->oldNS += NowNS() - start;
+
+		start = NowNS();
+		NewCalculateSPEsToAdjust(tt, pSPEChanged, added, &newSet);
+		stats->newNS += NowNS() - start;
+
+		stats->oldSPEs += oldSet.count;
+		stats->newSPEs += newSet.count;
+		for (i = 0; i < oldSet.count; i++)
+			if (!SetContains(&newSet, oldSet.spe[i]))
+				stats->onlyOld++;
+		for (i = 0; i < newSet.count; i++)
+			if (!SetContains(&oldSet, newSet.spe[i]))
+				onlyNew++;
+		stats->onlyNew += onlyNew;
+
+		// drain each one from the same starting point, and compare where everything ended up, with each other and
+		// with settling the whole TT
+		for (i = 0; i < numLive; i++)
+			before[i] = live[i]->_startTime;
+		SettleTT(tt, live, numLive);
+		for (i = 0; i < numLive; i++)
+		{
+			settled[i] = live[i]->_startTime;
+			live[i]->SetStartFrameAndStartTime(live[i]->_startFrame, before[i]);
+		}
+		DrainSet(tt, pSPEChanged, &oldSet, stats);
+		for (i = 0; i < numLive; i++)
+		{
+			afterOld[i] = live[i]->_startTime;
+			if (afterOld[i] != settled[i])
+				oldUnsettled = true;
+			live[i]->SetStartFrameAndStartTime(live[i]->_startFrame, before[i]);
+		}
+		DrainSet(tt, pSPEChanged, &newSet, stats);
+		for (i = 0; i < numLive; i++)
+		{
+			if (live[i]->_startTime != afterOld[i])
+				timesDiffer = true;
+			if (live[i]->_startTime != settled[i])
+				newUnsettled = true;
+		}
+
+		if (onlyNew)
+			stats->setMismatches++;
+		if (timesDiffer)
+			stats->timeMismatches++;
+		if (oldUnsettled)
+			stats->oldUnsettled++;
+		if (newUnsettled)
+			stats->newUnsettled++;
+		if (gVerbose && timesDiffer && (stats->timeMismatches <= kCheckMaxReports))
+			ReportLoad(load, pSPEChanged, added, &oldSet, &newSet, "start times differ after the drain");
+
+		if (added)
+			live[numLive++] = pSPEChanged;
+		else
+			pSPEChanged->release();
+	}
+
+Done:
+	for (i = 0; i < numLive; i++)
+	{
+		tt->DeallocatePeriodicBandwidth(live[i]);
+		live[i]->release();
+	}
+	tt->release();
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+	CheckStats		stats;
+	long			numLoads = kCheckDefaultLoads;
+	int				maxEndpoints = kCheckMaxEndpointsPerLoad;
+	unsigned int	seed = (unsigned int)time(NULL);
+	long			i;
+	int				ch;
+
+	while ((ch = getopt(argc, argv, "e:n:s:v")) != -1)
+	{
+		switch (ch)
+		{
+			case 'e':
+				maxEndpoints = (int)strtol(optarg, NULL, 0);
+				break;
+			case 'n':
+				numLoads = strtol(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				gVerbose = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-e endpoints] [-n loads] [-s seed] [-v]\n", argv[0]);
+				return 2;
+		}
+	}
+	if ((numLoads <= 0) || (maxEndpoints < 0) || (maxEndpoints >= kCheckMaxSPEs))
+	{
+		fprintf(stderr, "%s: the number of loads must be positive and the number of endpoints between 0 and %d\n", argv[0], kCheckMaxSPEs - 1);
+		return 2;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	srand(seed);
+	for (i = 0; i < numLoads; i++)
+		CheckOneLoad(i, maxEndpoints, &stats);
+
+	printf("seed %u: %ld loads (%ld adds, %ld removes, %ld more which did not settle), %ld mismatches\n",
+		   seed, stats.loads, stats.adds, stats.removes, stats.unsettledLoads, stats.timeMismatches);
+	printf("old set %.1f SPEs, new list %.1f SPEs per change; %ld only in the old set, %ld only in the new list (in %ld loads), %ld unreachable\n",
+		   stats.loads ? (double)stats.oldSPEs / stats.loads : 0.0, stats.loads ? (double)stats.newSPEs / stats.loads : 0.0,
+		   stats.onlyOld, stats.onlyNew, stats.setMismatches, stats.unreachable);
+	printf("drain did not match settling the TT: old %ld loads, new %ld loads\n", stats.oldUnsettled, stats.newUnsettled);
+	printf("old scan %.1f ns/change, new walk %.1f ns/change (%.2fx)\n", stats.loads ? stats.oldNS / stats.loads : 0.0,
+		   stats.loads ? stats.newNS / stats.loads : 0.0, stats.newNS > 0 ? stats.oldNS / stats.newNS : 0.0);
+
+	return stats.timeMismatches ? 1 : 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  EHCIAdjustSetCheckKernel.h
+//
+//  Just enough of libkern, the IOUSBFamily KPI and the EHCI UIM for AppleUSBEHCIHubInfo.cpp to build and run as a
+//  user space program. Only what that file uses is here, and only as far as it uses it:
+//
+//  - OSObject is reference counted and zero filled on allocation like the real one, but has no metaclass;
+//    OSDynamicCast is a dynamic_cast. retain() and release() are virtual, as the TT and SPE override release().
+//    OSNumber is only there for the placement policy property, and OSDictionary for CopyDiagnostics - it keeps its
+//    keys and objects in two small arrays.
+//  - AppleEHCIQueueHead and AppleEHCIIsochEndpoint only have the fields which the SPEs read. AppleEHCIListElement.h
+//    is kept out by defining its include guard.
+//  - The EHCI FS frame budget (kEHCIFS...) is not part of this tree. The values here are the same as the ones
+//    EHCISplitPlacementBench uses, and the code does not depend on them being exact.
+//  - USBLog prints when its level is at or below gSimLogLevel; IOSleep does nothing.
+//
+
+#ifndef _EHCIADJUSTSETCHECKKERNEL_H
+#define _EHCIADJUSTSETCHECKKERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+typedef uint8_t				UInt8;
+typedef int8_t				SInt8;
+typedef uint16_t			UInt16;
+typedef int16_t				SInt16;
+typedef uint32_t			UInt32;
+typedef int32_t				SInt32;
+typedef uint64_t			UInt64;
+typedef int64_t				SInt64;
+typedef unsigned int		UInt;
+typedef int					IOReturn;
+typedef UInt16				USBDeviceAddress;
+typedef UInt32				KernelDebugLevel;
+
+#define kIOReturnSuccess			0
+#define kIOReturnInternalError		((IOReturn)0xe00002c9)
+#define kIOReturnBadArgument		((IOReturn)0xe00002c2)
+#define kIOReturnInvalid			((IOReturn)0xe0000001)
+#define kIOReturnNoBandwidth		((IOReturn)0xe00002ec)
+
+enum
+{
+	kUSBControl					= 0,
+	kUSBIsoc					= 1,
+	kUSBBulk					= 2,
+	kUSBInterrupt				= 3
+};
+
+enum
+{
+	kUSBHSHubFlagsMultiTTMask	= (1 << 1)
+};
+
+// From USBEHCI.h, which is not part of this tree
+enum
+{
+	kEHCIMaxPollingInterval		= 32,
+	kEHCIuFramesPerFrame		= 8,
+	kEHCIFSMaxFrameBytes		= 1157,
+	kEHCIFSSOFBytesUsed			= 7,
+	kEHCIFSHubAdjustBytes		= 30,
+	kEHCIFSMinStartTime			= kEHCIFSSOFBytesUsed + kEHCIFSHubAdjustBytes,
+	kEHCIFSLargeIsochPacket		= 579,
+	kEHCIFSBytesPeruFrame		= 188,
+	kEHCISplitTTThinkTime		= 1
+};
+
+static int			gSimLogLevel = 0;
+KernelDebugLevel	gKernelDebugLevel = 0;
+UInt32				gEHCIBandwidthLogLevel = 7;
+
+static void
+SimLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+SimLog(const char *format, ...)
+{
+	va_list		args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+#define USBLog(LEVEL, FORMAT, ARGS...)		do { if ((int)(LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+#define USBError(LEVEL, FORMAT, ARGS...)	do { if ((int)(LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+
+static inline void
+IOSleep(unsigned milliseconds)
+{
+	(void)milliseconds;
+}
+
+
+#pragma mark libkern
+
+class OSObject
+{
+public:
+	OSObject() : _retainCount(1) {}
+	virtual ~OSObject() {}
+
+	// kalloc'ed objects start out zeroed, and the drivers rely on it
+	static void *					operator new(size_t size)			{ return ::calloc(1, size); }
+	static void						operator delete(void *mem)			{ ::free(mem); }
+
+	virtual void					free()								{ delete this; }
+	virtual void					retain() const						{ ((OSObject*)this)->_retainCount++; }
+	virtual void					release() const						{ if (--((OSObject*)this)->_retainCount == 0) ((OSObject*)this)->free(); }
+	int								getRetainCount() const				{ return _retainCount; }
+
+	int								_retainCount;
+};
+
+class OSOrderedSet;
+
+#define OSDeclareDefaultStructors(className)
+#define OSDefineMetaClassAndStructors(className, superclassName)
+#define OSDynamicCast(type, inst)			dynamic_cast<type *>((OSObject *)(inst))
+
+class OSNumber : public OSObject
+{
+public:
+	static OSNumber *				withNumber(unsigned long long value, unsigned int numberOfBits)
+	{
+		OSNumber *me = new OSNumber;
+
+		me->_value = value;
+		me->_bits  = numberOfBits;
+		return me;
+	}
+
+	UInt32							unsigned32BitValue() const			{ return (UInt32)_value; }
+
+	UInt64							_value;
+	unsigned int					_bits;
+};
+
+class OSDictionary : public OSObject
+{
+public:
+	enum { kSimMaxEntries = 8 };
+
+	static OSDictionary *			withCapacity(unsigned int capacity)	{ (void)capacity; return new OSDictionary; }
+
+	virtual void					free()
+	{
+		for (UInt32 i = 0; i < _count; i++)
+			_objects[i]->release();
+		OSObject::free();
+	}
+
+	bool							setObject(const char *key, const OSObject *object)
+	{
+		if ((object == NULL) || (_count == kSimMaxEntries))
+			return false;
+
+		object->retain();
+		_keys[_count]		= key;
+		_objects[_count++]	= (OSObject*)object;
+		return true;
+	}
+
+	OSObject *						getObject(const char *key) const
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+				return _objects[i];
+		}
+		return NULL;
+	}
+
+	const char *					_keys[kSimMaxEntries];				// CopyDiagnostics only uses string constants
+	OSObject *						_objects[kSimMaxEntries];
+	UInt32							_count;
+};
+
+
+#pragma mark EHCI UIM
+
+#define _IOKIT_AppleEHCIListElement_H
+
+// The fields of the UIM endpoints which an SPE reads
+class AppleEHCIQueueHead : public OSObject
+{
+public:
+	UInt16							_functionNumber;
+	UInt16							_endpointNumber;
+	UInt8							_direction;
+};
+
+class AppleEHCIIsochEndpoint : public OSObject
+{
+public:
+	short							functionAddress;
+	short							endpointNumber;
+	UInt8							direction;
+};
+
+#endif
@@ -0,0 +1,5 @@
+//
+//  EHCIAdjustSetCheck stand-in for <IOKit/IOTypes.h>, see EHCIAdjustSetCheckKernel.h
+//
+
+#include "EHCIAdjustSetCheckKernel.h"
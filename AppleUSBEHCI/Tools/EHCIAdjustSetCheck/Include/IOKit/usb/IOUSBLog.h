@@ -0,0 +1,5 @@
+//
+//  EHCIAdjustSetCheck stand-in for <IOKit/usb/IOUSBLog.h>, see EHCIAdjustSetCheckKernel.h
+//
+
+#include "EHCIAdjustSetCheckKernel.h"
@@ -0,0 +1,5 @@
+//
+//  EHCIAdjustSetCheck stand-in for "USBTracepoints.h", see EHCIAdjustSetCheckKernel.h
+//
+
+#include "EHCIAdjustSetCheckKernel.h"
@@ -0,0 +1,5 @@
+//
+//  EHCIAdjustSetCheck stand-in for <libkern/c++/OSDictionary.h>, see EHCIAdjustSetCheckKernel.h
+//
+
+#include "EHCIAdjustSetCheckKernel.h"
@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  EHCISplitPlacementBench
+//
+//  Runs the bitmap split placement search in AppleUSBEHCISplitPlacement.h and the per-harmonic loop which
+//  FindStartFrameAndStartTime used before it over the same randomized TT loads. It reports any load where the two
+//  pick a different start frame or start time, and how long each takes.
+//
+//  Build:	cc -O2 -I../../Headers -o EHCISplitPlacementBench EHCISplitPlacementBench.c
+//
+//  Usage:	EHCISplitPlacementBench [-e endpoints] [-n loads] [-s seed]
+//
+//  Each load is a TT with up to <endpoints> (default 24) endpoints already on it. Lightly loaded TTs, which is
+//  what most real ones are, are where the per-harmonic loop has to check every frame.
+//
+//  The exit status is 1 if the two searches disagreed on any load.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "AppleUSBEHCISplitPlacement.h"
+
+// These are in the range of the EHCI driver's FS frame budget. The search does not depend on the exact values.
+enum
+{
+	kBenchMaxFrameBytes			= 1157,
+	kBenchMinStartTime			= 37,
+	kBenchLargeIsochPacket		= 579,
+	kBenchDefaultLoads			= 200000,
+	kBenchMaxEndpointsPerLoad	= 24,
+	kBenchTimingPasses			= 5
+};
+
+typedef struct BenchLoad
+{
+	uint16_t		timeUsed[kEHCISplitPlacementFrames];
+	uint16_t		startTimes[kEHCISplitPlacementFrames];
+	uint32_t		largeIsochFrames;
+	uint16_t		bytesUsed;
+	uint8_t			period;
+} BenchLoad;
+
+
+
+// The loop from AppleUSBEHCISplitPeriodicEndpoint::FindStartFrameAndStartTime before it used the bitmap search,
+// with the TT and SPE fields passed in. Note that the large isoch check is made against the first frame of the
+// harmonic on every pass, as it was in the driver.
+static EHCISplitPlacementResult
+ScalarFind(const BenchLoad *load)
+{
+	EHCISplitPlacementResult	result;
+	int							frameIndex;
+	uint16_t					bestStartTimeFound = kBenchMinStartTime;
+	uint16_t					bestTimeUsedFound = kBenchMinStartTime;
+	uint16_t					bestStartTimeFrame = kEHCISplitPlacementFrames;
+	uint16_t					bestTimeUsedFrame = kEHCISplitPlacementFrames;
+	bool						foundStartTimeCandidate = false;
+	bool						foundTimeUsedCandidate = false;
+
+	for (frameIndex = 0; frameIndex < load->period; frameIndex++)
+	{
+		uint16_t		totalTimeUsedThisHarmonic = 0;
+		uint16_t		startTimeThisFrame = kBenchMinStartTime;
+		int				frameIndex2;
+		bool			epWillFit = true;
+
+		for (frameIndex2 = frameIndex; frameIndex2 < kEHCISplitPlacementFrames; frameIndex2 += load->period)
+		{
+			uint16_t	startTimeThisHarmonic;
+			uint16_t	tempTimeUsed = load->timeUsed[frameIndex2] + load->bytesUsed;
+
+			if ((load->bytesUsed > kBenchLargeIsochPacket) && (load->largeIsochFrames & ((uint32_t)1 << frameIndex)))
+			{
+				epWillFit = false;
+				break;
+			}
+			if (tempTimeUsed > kBenchMaxFrameBytes)
+			{
+				epWillFit = false;
+				break;
+			}
+			startTimeThisHarmonic = load->startTimes[frameIndex2];
+			if ((startTimeThisHarmonic + load->bytesUsed) > kBenchMaxFrameBytes)
+			{
+				epWillFit = false;
+				break;
+			}
+			totalTimeUsedThisHarmonic += tempTimeUsed;
+			if (startTimeThisHarmonic > startTimeThisFrame)
+				startTimeThisFrame = startTimeThisHarmonic;
+		}
+		if (epWillFit)
+		{
+			if (!foundStartTimeCandidate)
+			{
+				foundStartTimeCandidate = true;
+				bestStartTimeFound = startTimeThisFrame+1;
+			}
+			if (!foundTimeUsedCandidate)
+			{
+				foundTimeUsedCandidate = true;
+				bestTimeUsedFound = totalTimeUsedThisHarmonic+1;
+			}
+			if (startTimeThisFrame < bestStartTimeFound)
+			{
+				bestStartTimeFound = startTimeThisFrame;
+				bestStartTimeFrame = frameIndex;
+			}
+			if (totalTimeUsedThisHarmonic < bestTimeUsedFound)
+			{
+				bestTimeUsedFound = totalTimeUsedThisHarmonic;
+				bestTimeUsedFrame = frameIndex;
+			}
+		}
+	}
+
+	memset(&result, 0, sizeof(result));
+	result.startFrame = kEHCISplitPlacementFrames;
+	if (foundStartTimeCandidate)
+	{
+		result.found = true;
+		if (bestStartTimeFound <= bestTimeUsedFound)
+		{
+			result.startTime = bestStartTimeFound;
+			result.startFrame = bestStartTimeFrame;
+		}
+		else
+		{
+			result.startTime = bestTimeUsedFound;
+			result.startFrame = bestTimeUsedFrame;
+		}
+	}
+	return result;
+}
+
+
+
+static EHCISplitPlacementResult
+BitmapFind(const BenchLoad *load)
+{
+	EHCISplitPlacementRequest	req;
+
+	req.timeUsed = load->timeUsed;
+	req.startTimes = load->startTimes;
+	req.excludedFrames = (load->bytesUsed > kBenchLargeIsochPacket) ? load->largeIsochFrames : 0;
+	req.bytesUsed = load->bytesUsed;
+	req.maxFrameBytes = kBenchMaxFrameBytes;
+	req.minStartTime = kBenchMinStartTime;
+	req.period = load->period;
+	req.policy = kEHCISplitPlacementPolicyEarliest;
+
+	return EHCISplitPlacementFind(&req);
+}
+
+
+
+static uint8_t
+RandomPeriod(void)
+{
+	static const uint8_t	oddPeriods[] = { 0, 3, 5, 6, 12, 33, 64, 255 };
+	int						r = rand() % 100;
+
+	// almost all of the real ones are powers of 2, but make sure the other path gets some exercise
+	if (r < 90)
+		return (uint8_t)(1 << (rand() % 6));
+
+	return oddPeriods[rand() % (sizeof(oddPeriods) / sizeof(oddPeriods[0]))];
+}
+
+
+
+// Build a TT which looks like one with a number of endpoints already on it: each of them lands on all of the
+// harmonics of a random start frame, so the frames which share a harmonic have similar loads. The start times
+// are somewhere between the minimum and the time used in that frame, plus some noise to cover the rest.
+static void
+RandomLoad(BenchLoad *load, int maxEndpoints)
+{
+	int			ep, frame;
+	int			endpoints = rand() % (maxEndpoints + 1);
+
+	memset(load, 0, sizeof(*load));
+	for (frame = 0; frame < kEHCISplitPlacementFrames; frame++)
+		load->timeUsed[frame] = kBenchMinStartTime;
+
+	for (ep = 0; ep < endpoints; ep++)
+	{
+		uint8_t		period = (uint8_t)(1 << (rand() % 6));
+		int			startFrame = rand() % period;
+		uint16_t	bytes = (uint16_t)(1 + rand() % ((rand() % 4) ? 200 : 1000));
+
+		for (frame = startFrame; frame < kEHCISplitPlacementFrames; frame += period)
+		{
+			if (load->timeUsed[frame] + bytes <= kBenchMaxFrameBytes + (rand() % 64))
+				load->timeUsed[frame] += bytes;
+		}
+		if ((bytes > kBenchLargeIsochPacket) && (rand() % 2))
+			load->largeIsochFrames |= ((uint32_t)1 << startFrame);
+	}
+
+	for (frame = 0; frame < kEHCISplitPlacementFrames; frame++)
+	{
+		int		span = load->timeUsed[frame] - kBenchMinStartTime + 1;
+
+		load->startTimes[frame] = (uint16_t)(kBenchMinStartTime + rand() % span);
+		if ((rand() % 16) == 0)
+			load->startTimes[frame] = (uint16_t)(rand() % (kBenchMaxFrameBytes + 100));
+	}
+
+	load->bytesUsed = (uint16_t)(1 + rand() % ((rand() % 4) ? 190 : 1023));
+	load->period = RandomPeriod();
+}
+
+
+
+static double
+NowNS(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+	BenchLoad					*loads;
+	long						numLoads = kBenchDefaultLoads;
+	int							maxEndpoints = kBenchMaxEndpointsPerLoad;
+	unsigned int				seed = (unsigned int)time(NULL);
+	long						i, mismatches = 0, placed = 0;
+	volatile uint32_t			sink = 0;
+	double						start, scalarNS = 0, bitmapNS = 0;
+	int							ch, pass;
+
+	while ((ch = getopt(argc, argv, "e:n:s:")) != -1)
+	{
+		switch (ch)
+		{
+			case 'e':
+				maxEndpoints = (int)strtol(optarg, NULL, 0);
+				break;
+			case 'n':
+				numLoads = strtol(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-e endpoints] [-n loads] [-s seed]\n", argv[0]);
+				return 2;
+		}
+	}
+	if ((numLoads <= 0) || (maxEndpoints < 0))
+	{
+		fprintf(stderr, "%s: the number of loads must be positive and the number of endpoints must not be negative\n", argv[0]);
+		return 2;
+	}
+
+	loads = (BenchLoad*)calloc((size_t)numLoads, sizeof(BenchLoad));
+	if (!loads)
+	{
+		fprintf(stderr, "%s: could not allocate %ld loads\n", argv[0], numLoads);
+		return 2;
+	}
+
+	srand(seed);
+	for (i = 0; i < numLoads; i++)
+		RandomLoad(&loads[i], maxEndpoints);
+
+	for (i = 0; i < numLoads; i++)
+	{
+		EHCISplitPlacementResult	scalar = ScalarFind(&loads[i]);
+		EHCISplitPlacementResult	bitmap = BitmapFind(&loads[i]);
+
+		if (scalar.found)
+			placed++;
+
+		if ((scalar.found != bitmap.found) || (scalar.startFrame != bitmap.startFrame) || (scalar.startTime != bitmap.startTime))
+		{
+			if (mismatches++ < 10)
+				printf("load %ld (period %d bytes %d): scalar %s frame %d time %d, bitmap %s frame %d time %d\n", i, loads[i].period, loads[i].bytesUsed,
+					   scalar.found ? "placed" : "rejected", scalar.startFrame, scalar.startTime,
+					   bitmap.found ? "placed" : "rejected", bitmap.startFrame, bitmap.startTime);
+		}
+	}
+
+	// take the best of a few passes, so that one interruption does not skew the numbers
+	for (pass = 0; pass < kBenchTimingPasses; pass++)
+	{
+		double		elapsed;
+
+		start = NowNS();
+		for (i = 0; i < numLoads; i++)
+			sink += ScalarFind(&loads[i]).startTime;
+		elapsed = NowNS() - start;
+		if ((pass == 0) || (elapsed < scalarNS))
+			scalarNS = elapsed;
+
+		start = NowNS();
+		for (i = 0; i < numLoads; i++)
+			sink += BitmapFind(&loads[i]).startTime;
+		elapsed = NowNS() - start;
+		if ((pass == 0) || (elapsed < bitmapNS))
+			bitmapNS = elapsed;
+	}
+
+	printf("seed %u: %ld loads, %ld placed, %ld mismatches\n", seed, numLoads, placed, mismatches);
+	printf("scalar %.1f ns/search, bitmap %.1f ns/search (%.2fx)\n", scalarNS / numLoads, bitmapNS / numLoads, bitmapNS > 0 ? scalarNS / bitmapNS : 0.0);
+
+	free(loads);
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,694 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  EHCISplitScheduleSim
+//
+//  Builds the real AppleUSBEHCIHubInfo.cpp, with the stand-ins from Tools/EHCIAdjustSetCheck, and plays a sequence of
+//  split endpoint adds and removes against one of its TTs once for each placement policy in
+//  AppleUSBEHCISplitPlacement.h. It reports how many of the adds each policy had to reject. A rejection is counted as
+//  fragmentation when the TT still had enough free FS time over the 32 frame schedule for the endpoint, just not in
+//  the frames it would have to use.
+//
+//  Build:	c++ -O2 -std=c++11 -fno-extended-identifiers -I../EHCIAdjustSetCheck -I../EHCIAdjustSetCheck/Include -I../../Headers -I../../Classes -o EHCISplitScheduleSim EHCISplitScheduleSim.cpp
+//		(-fno-extended-identifiers lets gcc through the bullets in the driver's #pragma mark lines; clang doesn't need it)
+//
+//  Usage:	EHCISplitScheduleSim [-v] [script]
+//			EHCISplitScheduleSim [-v] -r events [-s seed]
+//
+//  A script has one event per line ('#' starts a comment):
+//
+//		add <id> <period> <FS bytes> [isoch]
+//		remove <id>
+//
+//  With -r, <events> random adds and removes are generated instead, mostly small interrupt endpoints with some
+//  audio sized isoch ones, at the churn of devices coming and going on a busy hub. -v prints each rejection.
+//  Periods are rounded down to a power of 2 of at most 32 before the SPE is made, as the UIM does.
+//
+//  Each policy gets a new hub table, with the policy handed to it the way the controller hands it the value of
+//  kAppleEHCITTPlacementPolicyKey, and the TT comes from the hub. An add is AllocatePeriodicBandwidth and a remove is
+//  DeallocatePeriodicBandwidth. Either is followed by CalculateSPEsToAdjustAfterChange and a stand-in for the UIM's
+//  drain of the adjust list: an SPE which a re-pack moved is counted and given back its _previousStartFrame, and any
+//  other gets the start time CalculateNewStartTimeFromChange returns. After every event the TT is checked:
+//
+//  - _FStimeUsed in each frame is the SOF time plus the FS bytes of the endpoints in that frame, and within the budget
+//  - every endpoint is linked into each of its frames (or is the large isoch there), and nothing else is linked
+//  - the adjust list is empty, and no re-pack is left pending
+//  - an add which was rejected left the lists, the large isoch slots, _FStimeUsed and every start frame and start
+//    time exactly as they were
+//
+//  The hub table's CopyDiagnostics is also checked to count the one hub and TT while the policy runs, and none after.
+//
+//  The exit status is 1 if any of those checks failed.
+//
+
+#include <time.h>
+#include <unistd.h>
+
+#include "EHCIAdjustSetCheckKernel.h"
+#include "AppleUSBEHCIHubInfo.cpp"
+
+enum
+{
+	kSimMaxEndpoints			= 4096,
+	kSimMaxEvents				= 1000000,
+	kSimMaxIDs					= 1000000,
+	kSimMaxListLength			= 512,
+	kSimMaxReports				= 10,
+	kSimHubAddress				= 1
+};
+
+typedef struct SimEvent
+{
+	uint32_t		id;
+	uint16_t		bytesUsed;
+	uint8_t			period;
+	bool			add;
+	bool			isoch;
+} SimEvent;
+
+typedef struct SimTT
+{
+	AppleUSBEHCITTInfo					*tt;
+	AppleUSBEHCISplitPeriodicEndpoint	*live[kSimMaxEndpoints];
+	uint32_t							liveID[kSimMaxEndpoints];
+	int									numLive;
+} SimTT;
+
+// what a rejected add must leave alone
+typedef struct SimSnapshot
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*isoch[kEHCIMaxPollingInterval][kSimMaxListLength];
+	AppleUSBEHCISplitPeriodicEndpoint	*interrupt[kEHCIMaxPollingInterval][kSimMaxListLength];
+	int									numIsoch[kEHCIMaxPollingInterval];
+	int									numInterrupt[kEHCIMaxPollingInterval];
+	AppleUSBEHCISplitPeriodicEndpoint	*largeIsoch[kEHCIMaxPollingInterval];
+	UInt16								timeUsed[kEHCIMaxPollingInterval];
+	UInt8								startFrame[kSimMaxEndpoints];
+	UInt16								startTime[kSimMaxEndpoints];
+} SimSnapshot;
+
+typedef struct SimStats
+{
+	long			adds;
+	long			rejected;
+	long			fragmented;								// rejected with enough total free time
+	long			repacks;								// re-packs which made room
+	long			moved;									// endpoints given a new start frame or time by those re-packs
+	long			peakEndpoints;
+	long			unreachable;							// adjust list SPEs which the drain could not find in one of their frames
+	long			failures;								// events after which the TT did not pass its checks
+} SimStats;
+
+static const char	*gPolicyNames[kEHCISplitPlacementPolicyCount] = { "earliest", "best fit", "repack" };
+static bool			gVerbose = false;
+
+
+
+static void
+ReportFailure(SimStats *stats, uint8_t policy, long event, const char *what)
+{
+	if (++stats->failures <= kSimMaxReports)
+		printf("%-8s event %ld: %s\n", gPolicyNames[policy], event, what);
+}
+
+
+
+// does CopyDiagnostics agree with what the simulation put in the table
+static bool
+DiagnosticsAre(AppleUSBEHCIHubInfoTable *hubTable, UInt32 hubs, UInt32 tts, uint8_t policy)
+{
+	OSDictionary	*diagnostics = AppleUSBEHCIHubInfo::CopyDiagnostics(hubTable);
+	OSNumber		*number;
+	bool			same = false;
+
+	if (diagnostics)
+	{
+		same = true;
+		number = OSDynamicCast(OSNumber, diagnostics->getObject("Hubs"));
+		same = same && number && (number->unsigned32BitValue() == hubs);
+		number = OSDynamicCast(OSNumber, diagnostics->getObject("TTs"));
+		same = same && number && (number->unsigned32BitValue() == tts);
+		number = OSDynamicCast(OSNumber, diagnostics->getObject("Placement Policy"));
+		same = same && number && (number->unsigned32BitValue() == policy);
+		diagnostics->release();
+	}
+	return same;
+}
+
+
+
+static int
+ListSPEs(AppleUSBEHCISplitPeriodicEndpoint *head, AppleUSBEHCISplitPeriodicEndpoint **list)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+	int									count = 0;
+
+	for (pSPE = head->_nextSPE; pSPE && (count < kSimMaxListLength); pSPE = pSPE->_nextSPE)
+		list[count++] = pSPE;
+	return count;
+}
+
+
+
+static void
+TakeSnapshot(const SimTT *sim, SimSnapshot *snap)
+{
+	AppleUSBEHCITTInfo		*tt = sim->tt;
+	int						frame, i;
+
+	for (frame = 0; frame < kEHCIMaxPollingInterval; frame++)
+	{
+		snap->numIsoch[frame] = ListSPEs(tt->_isochQueue[frame], snap->isoch[frame]);
+		snap->numInterrupt[frame] = ListSPEs(tt->_interruptQueue[frame], snap->interrupt[frame]);
+		snap->largeIsoch[frame] = tt->_largeIsoch[frame];
+		snap->timeUsed[frame] = tt->_FStimeUsed[frame];
+	}
+	for (i = 0; i < sim->numLive; i++)
+	{
+		snap->startFrame[i] = sim->live[i]->_startFrame;
+		snap->startTime[i] = sim->live[i]->_startTime;
+	}
+}
+
+
+
+static bool
+SameAsSnapshot(const SimTT *sim, const SimSnapshot *snap)
+{
+	static SimSnapshot		now;
+	int						frame, i;
+
+	TakeSnapshot(sim, &now);
+	for (frame = 0; frame < kEHCIMaxPollingInterval; frame++)
+	{
+		if ((now.numIsoch[frame] != snap->numIsoch[frame]) || (now.numInterrupt[frame] != snap->numInterrupt[frame]) ||
+			(now.largeIsoch[frame] != snap->largeIsoch[frame]) || (now.timeUsed[frame] != snap->timeUsed[frame]))
+			return false;
+		if (memcmp(now.isoch[frame], snap->isoch[frame], now.numIsoch[frame] * sizeof(now.isoch[0][0])) ||
+			memcmp(now.interrupt[frame], snap->interrupt[frame], now.numInterrupt[frame] * sizeof(now.interrupt[0][0])))
+			return false;
+	}
+	for (i = 0; i < sim->numLive; i++)
+		if ((now.startFrame[i] != snap->startFrame[i]) || (now.startTime[i] != snap->startTime[i]))
+			return false;
+	return true;
+}
+
+
+
+static bool
+LinkedInFrame(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPE, int frame)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*curSPE;
+
+	if (tt->_largeIsoch[frame] == pSPE)
+		return true;
+	curSPE = (pSPE->_epType == kUSBIsoc) ? tt->_isochQueue[frame] : tt->_interruptQueue[frame];
+	for (curSPE = curSPE->_nextSPE; curSPE; curSPE = curSPE->_nextSPE)
+		if (curSPE == pSPE)
+			return true;
+	return false;
+}
+
+
+
+static bool
+IsLive(const SimTT *sim, const AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	int		i;
+
+	for (i = 0; i < sim->numLive; i++)
+		if (sim->live[i] == pSPE)
+			return true;
+	return false;
+}
+
+
+
+static bool
+UsesFrame(const AppleUSBEHCISplitPeriodicEndpoint *pSPE, int frame)
+{
+	return (frame >= pSPE->_startFrame) && (((frame - pSPE->_startFrame) % pSPE->_period) == 0);
+}
+
+
+
+// Returns NULL if the TT passes, or what is wrong with it
+static const char *
+CheckTT(const SimTT *sim)
+{
+	AppleUSBEHCITTInfo					*tt = sim->tt;
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+	UInt32								expected[kEHCIMaxPollingInterval];
+	int									frame, i, length;
+
+	if (tt->GetNumSPEsToAdjust() || tt->_SPEsToAdjust || tt->_repackPending)
+		return "the adjust list was not empty after the drain";
+
+	for (frame = 0; frame < kEHCIMaxPollingInterval; frame++)
+		expected[frame] = kEHCIFSMinStartTime;
+	for (i = 0; i < sim->numLive; i++)
+	{
+		pSPE = sim->live[i];
+		for (frame = pSPE->_startFrame; frame < kEHCIMaxPollingInterval; frame += pSPE->_period)
+		{
+			expected[frame] += pSPE->_FSBytesUsed;
+			if (!LinkedInFrame(tt, pSPE, frame))
+				return "an endpoint was missing from one of its frames";
+		}
+	}
+
+	for (frame = 0; frame < kEHCIMaxPollingInterval; frame++)
+	{
+		if (tt->_FStimeUsed[frame] != expected[frame])
+			return "_FStimeUsed did not match the endpoints in the frame";
+		if (tt->_FStimeUsed[frame] > kEHCIFSMaxFrameBytes)
+			return "a frame was over the FS budget";
+		if (tt->_largeIsoch[frame] && !IsLive(sim, tt->_largeIsoch[frame]))
+			return "a large isoch slot held an endpoint which is not on the TT";
+
+		length = 0;
+		for (pSPE = tt->_isochQueue[frame]->_nextSPE; pSPE && (length <= kSimMaxListLength); pSPE = pSPE->_nextSPE, length++)
+		{
+			if (!IsLive(sim, pSPE))
+				return "an isoch list held an endpoint which is not on the TT";
+			if (!UsesFrame(pSPE, frame))
+				return "an isoch list held an endpoint which does not use the frame";
+		}
+		for (pSPE = tt->_interruptQueue[frame]->_nextSPE; pSPE && (length <= kSimMaxListLength); pSPE = pSPE->_nextSPE, length++)
+		{
+			if (!IsLive(sim, pSPE))
+				return "an interrupt list held an endpoint which is not on the TT";
+			if (!UsesFrame(pSPE, frame))
+				return "an interrupt list held an endpoint which does not use the frame";
+		}
+		if (length > kSimMaxListLength)
+			return "a frame's lists did not end";
+	}
+	return NULL;
+}
+
+
+
+// CalculateNewStartTimeFromChange walks each of the SPE's frames until it finds the SPE, so make sure that it will
+static bool
+ReachableInAllFrames(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPE)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*curSPE;
+	int									frame;
+
+	for (frame = pSPE->_startFrame; frame < kEHCIMaxPollingInterval; frame += pSPE->_period)
+	{
+		curSPE = (pSPE->_epType == kUSBIsoc) ? tt->_isochQueue[frame] : tt->_interruptQueue[frame];
+		while (curSPE && (curSPE->_nextSPE != pSPE))
+			curSPE = curSPE->_nextSPE;
+		if (!curSPE)
+			return false;
+	}
+	return true;
+}
+
+
+
+// The UIM's drain of the adjust list, as far as the TT goes. An SPE which the re-pack moved already has its new start
+// frame and start time, and the UIM would move its hardware endpoint and HS split reservations
+static void
+DrainAdjustList(AppleUSBEHCITTInfo *tt, AppleUSBEHCISplitPeriodicEndpoint *pSPEChanged, bool added, SimStats *stats)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+
+	tt->CalculateSPEsToAdjustAfterChange(pSPEChanged, added);
+	while ((pSPE = tt->GetNextSPEToAdjust()))
+	{
+		if (pSPE->_previousStartFrame != kEHCIMaxPollingInterval)
+		{
+			stats->moved++;
+			pSPE->_previousStartFrame = kEHCIMaxPollingInterval;
+		}
+		else if (!ReachableInAllFrames(tt, pSPE))
+			stats->unreachable++;
+		else
+			pSPE->SetStartFrameAndStartTime(pSPE->_startFrame, pSPE->CalculateNewStartTimeFromChange(pSPEChanged));
+		pSPE->release();
+	}
+}
+
+
+
+// The UIM hands the TT a polling interval rounded down to a power of 2, and no more than the 32 frame schedule. The TT's
+// lists share their tails the way the hardware tree does, which only works for those
+static UInt8
+SPEPeriod(UInt8 period)
+{
+	UInt8	spePeriod = kEHCIMaxPollingInterval;
+
+	while (spePeriod > period)
+		spePeriod >>= 1;
+	return spePeriod;
+}
+
+
+
+static long
+FreeTime(AppleUSBEHCITTInfo *tt)
+{
+	long	freeTime = 0;
+	int		frame;
+
+	for (frame = 0; frame < kEHCIMaxPollingInterval; frame++)
+		freeTime += kEHCIFSMaxFrameBytes - tt->_FStimeUsed[frame];
+	return freeTime;
+}
+
+
+
+static void
+RemoveFromTT(SimTT *sim, int index, SimStats *stats)
+{
+	AppleUSBEHCISplitPeriodicEndpoint	*pSPE = sim->live[index];
+
+	sim->live[index] = sim->live[sim->numLive - 1];
+	sim->liveID[index] = sim->liveID[sim->numLive - 1];
+	sim->numLive--;
+
+	sim->tt->DeallocatePeriodicBandwidth(pSPE);
+	DrainAdjustList(sim->tt, pSPE, false, stats);
+	pSPE->release();
+}
+
+
+
+static void
+RunPolicy(const SimEvent *events, long numEvents, uint8_t policy, SimStats *stats)
+{
+	static SimTT				sim;
+	static SimSnapshot			before;
+	AppleUSBEHCIHubInfoTable	hubTable;
+	AppleUSBEHCIHubInfo			*hub;
+	OSNumber					*policyProperty;
+	const char					*problem;
+	long						e;
+	int							i;
+
+	memset(&sim, 0, sizeof(sim));
+	memset(&hubTable, 0, sizeof(hubTable));
+	memset(stats, 0, sizeof(*stats));
+
+	policyProperty = OSNumber::withNumber(policy, 8);
+	AppleUSBEHCIHubInfo::SetPlacementPolicyFromProperty(&hubTable, policyProperty);
+	policyProperty->release();
+	hub = AppleUSBEHCIHubInfo::AddHubInfo(&hubTable, kSimHubAddress, 0);
+	sim.tt = hub ? hub->GetTTInfo(0) : NULL;
+	if (!sim.tt)
+	{
+		fprintf(stderr, "EHCISplitScheduleSim: could not get a TT\n");
+		exit(2);
+	}
+	if (sim.tt->_placementPolicy != policy)
+		ReportFailure(stats, policy, 0, "the TT did not get the policy from the hub table");
+	if (!DiagnosticsAre(&hubTable, 1, 1, policy))
+		ReportFailure(stats, policy, 0, "the hub table diagnostics do not count the hub and its TT");
+
+	for (e = 0; e < numEvents; e++)
+	{
+		const SimEvent	*event = &events[e];
+
+		if (!event->add)
+		{
+			// removing an endpoint which was rejected (or never added) is fine
+			for (i = 0; i < sim.numLive; i++)
+			{
+				if (sim.liveID[i] == event->id)
+				{
+					RemoveFromTT(&sim, i, stats);
+					break;
+				}
+			}
+		}
+		else
+		{
+			AppleUSBEHCISplitPeriodicEndpoint	*pSPE;
+			long								needed;
+			long								movedBefore = stats->moved;
+			bool								placed = false;
+
+			stats->adds++;
+			pSPE = AppleUSBEHCISplitPeriodicEndpoint::NewSplitPeriodicEndpoint(sim.tt, event->isoch ? kUSBIsoc : kUSBInterrupt, NULL,
+																				event->bytesUsed, SPEPeriod(event->period));
+			if (pSPE && (sim.numLive < kSimMaxEndpoints))
+			{
+				TakeSnapshot(&sim, &before);
+				if (sim.tt->AllocatePeriodicBandwidth(pSPE) == kIOReturnSuccess)
+				{
+					placed = true;
+					sim.live[sim.numLive] = pSPE;
+					sim.liveID[sim.numLive++] = event->id;
+					DrainAdjustList(sim.tt, pSPE, true, stats);
+					if (stats->moved != movedBefore)
+						stats->repacks++;
+				}
+				else if (!SameAsSnapshot(&sim, &before))
+					ReportFailure(stats, policy, e, "a rejected add changed the TT");
+			}
+
+			if (!placed)
+			{
+				needed = (long)event->bytesUsed * (kEHCIMaxPollingInterval / SPEPeriod(event->period));
+				stats->rejected++;
+				if (FreeTime(sim.tt) >= needed)
+					stats->fragmented++;
+				if (gVerbose)
+					printf("%-8s rejected add %u (period %d bytes %d%s) with %ld bytes free\n", gPolicyNames[policy], event->id, event->period,
+						   event->bytesUsed, event->isoch ? " isoch" : "", FreeTime(sim.tt));
+				if (pSPE)
+					pSPE->release();
+			}
+		}
+
+		problem = CheckTT(&sim);
+		if (problem)
+		{
+			ReportFailure(stats, policy, e, problem);
+			break;
+		}
+		if (sim.numLive > stats->peakEndpoints)
+			stats->peakEndpoints = sim.numLive;
+	}
+
+	while (sim.numLive)
+		RemoveFromTT(&sim, sim.numLive - 1, stats);
+	AppleUSBEHCIHubInfo::DeleteHubInfo(&hubTable, kSimHubAddress);
+	if (!DiagnosticsAre(&hubTable, 0, 0, policy))
+		ReportFailure(stats, policy, numEvents, "the hub table diagnostics still count a hub or TT after it was deleted");
+}
+
+
+
+static long
+ReadScript(FILE *fp, const char *name, SimEvent *events)
+{
+	char		line[256];
+	long		numEvents = 0, lineNumber = 0;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		char			verb[16], kind[16];
+		unsigned int	id, period, bytes;
+		char			*comment = strchr(line, '#');
+		int				fields;
+
+		lineNumber++;
+		if (comment)
+			*comment = 0;
+		if (sscanf(line, "%15s", verb) != 1)
+			continue;
+
+		if (numEvents >= kSimMaxEvents)
+		{
+			fprintf(stderr, "%s:%ld: too many events\n", name, lineNumber);
+			return -1;
+		}
+		memset(&events[numEvents], 0, sizeof(SimEvent));
+
+		if (!strcmp(verb, "add"))
+		{
+			fields = sscanf(line, "%*s %u %u %u %15s", &id, &period, &bytes, kind);
+			if ((fields < 3) || (id >= kSimMaxIDs) || !period || (period > 255) || !bytes || (bytes >= kEHCIFSMaxFrameBytes) || ((fields == 4) && strcmp(kind, "isoch")))
+			{
+				fprintf(stderr, "%s:%ld: expected add <id> <period 1-255> <bytes> [isoch]\n", name, lineNumber);
+				return -1;
+			}
+			events[numEvents].add = true;
+			events[numEvents].period = (uint8_t)period;
+			events[numEvents].bytesUsed = (uint16_t)bytes;
+			events[numEvents].isoch = (fields == 4);
+		}
+		else if (!strcmp(verb, "remove") && (sscanf(line, "%*s %u", &id) == 1) && (id < kSimMaxIDs))
+		{
+			events[numEvents].add = false;
+		}
+		else
+		{
+			fprintf(stderr, "%s:%ld: expected add or remove\n", name, lineNumber);
+			return -1;
+		}
+		events[numEvents++].id = id;
+	}
+	return numEvents;
+}
+
+
+
+// Adds and removes on a busy hub: the number of endpoints hovers around a level where the TT is fairly full, so
+// that the policies differ in what they reject.
+static long
+RandomScript(long numEvents, SimEvent *events)
+{
+	static uint32_t		live[kSimMaxEndpoints];
+	int					numLive = 0;
+	uint32_t			nextID = 0;
+	long				e;
+
+	for (e = 0; e < numEvents; e++)
+	{
+		SimEvent		*event = &events[e];
+
+		memset(event, 0, sizeof(*event));
+		if (numLive && ((numLive >= kSimMaxEndpoints) || ((rand() % 100) < 20 + numLive * 2)))
+		{
+			int		which = rand() % numLive;
+
+			event->id = live[which];
+			live[which] = live[--numLive];
+			continue;
+		}
+
+		event->add = true;
+		event->id = nextID++ % kSimMaxIDs;
+		if ((rand() % 5) == 0)
+		{
+			// audio and the like: every frame, a few hundred bytes, and now and then a big one
+			event->isoch = true;
+			event->period = 1;
+			event->bytesUsed = (uint16_t)(((rand() % 8) == 0) ? 600 + rand() % 400 : 50 + rand() % 250);
+		}
+		else
+		{
+			static const uint8_t	periods[] = { 1, 2, 4, 8, 8, 16, 32, 32, 10, 255 };
+
+			event->period = periods[rand() % (sizeof(periods) / sizeof(periods[0]))];
+			event->bytesUsed = (uint16_t)(((rand() % 6) == 0) ? 100 + rand() % 300 : 10 + rand() % 70);
+		}
+		live[numLive++] = event->id;
+	}
+	return numEvents;
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+	SimEvent			*events;
+	SimStats			stats;
+	long				numEvents = 0, randomEvents = 0, failures = 0;
+	unsigned int		seed = (unsigned int)time(NULL);
+	int					ch, policy;
+
+	while ((ch = getopt(argc, argv, "r:s:v")) != -1)
+	{
+		switch (ch)
+		{
+			case 'r':
+				randomEvents = strtol(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				gVerbose = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-v] [script]\n       %s [-v] -r events [-s seed]\n", argv[0], argv[0]);
+				return 2;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((randomEvents < 0) || (randomEvents > kSimMaxEvents) || (randomEvents && argc))
+	{
+		fprintf(stderr, "EHCISplitScheduleSim: use either a script or -r with up to %d events\n", kSimMaxEvents);
+		return 2;
+	}
+
+	events = (SimEvent*)calloc(kSimMaxEvents, sizeof(SimEvent));
+	if (!events)
+	{
+		fprintf(stderr, "EHCISplitScheduleSim: could not allocate the events\n");
+		return 2;
+	}
+
+	if (randomEvents)
+	{
+		srand(seed);
+		numEvents = RandomScript(randomEvents, events);
+		printf("seed %u: ", seed);
+	}
+	else
+	{
+		FILE	*fp = argc ? fopen(argv[0], "r") : stdin;
+
+		if (!fp)
+		{
+			perror(argv[0]);
+			free(events);
+			return 2;
+		}
+		numEvents = ReadScript(fp, argc ? argv[0] : "stdin", events);
+		if (fp != stdin)
+			fclose(fp);
+		if (numEvents < 0)
+		{
+			free(events);
+			return 2;
+		}
+	}
+	printf("%ld events\n", numEvents);
+
+	printf("%-10s %8s %8s %7s %11s %8s %8s %6s %9s\n", "policy", "adds", "rejected", "rate", "fragmented", "repacks", "moved", "peak", "failures");
+	for (policy = 0; policy < kEHCISplitPlacementPolicyCount; policy++)
+	{
+		RunPolicy(events, numEvents, (uint8_t)policy, &stats);
+		printf("%-10s %8ld %8ld %6.2f%% %11ld %8ld %8ld %6ld %9ld\n", gPolicyNames[policy], stats.adds, stats.rejected,
+			   stats.adds ? 100.0 * stats.rejected / stats.adds : 0.0, stats.fragmented, stats.repacks, stats.moved, stats.peakEndpoints,
+			   stats.failures);
+		if (stats.unreachable)
+			printf("%-10s %ld adjust list SPEs could not be found in one of their frames\n", "", stats.unreachable);
+		failures += stats.failures;
+	}
+
+	free(events);
+	return failures ? 1 : 0;
+}
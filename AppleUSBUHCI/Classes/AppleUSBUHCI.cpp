@@ -43,8 +43,6 @@ extern "C" {
 #include <libkern/OSAtomic.h>
 
 #include "AppleUSBUHCI.h"
-#include "AppleUHCItdMemoryBlock.h"
-#include "AppleUHCIqhMemoryBlock.h"
 #include "USBTracepoints.h"
 
 #define super IOUSBControllerV3
@@ -1505,34 +1503,22 @@ AppleUSBUHCI::AllocateTD(AppleUHCIQueueHead *pQH)
 	
     if (freeTD == NULL)
     {
-		// i need to allocate another page of EDs
-		AppleUHCItdMemoryBlock 		*memBlock;
-		UInt32						numTDs, i;
+		// carve another one out of the TD slab, which allocates more memory when it runs out
+		UHCITransferDescriptorSharedPtr	sharedLogical;
+		IOPhysicalAddress				sharedPhysical;
 		
-		memBlock = AppleUHCItdMemoryBlock::NewMemoryBlock();
-		if (!memBlock)
+		sharedLogical = _tdSlab.Allocate(&sharedPhysical, NULL);
+		if (!sharedLogical)
 		{
-			USBError(1, "AppleUSBUHCI::AllocateTD - unable to allocate a new memory block!");
+			USBError(1, "AppleUSBUHCI::AllocateTD - unable to allocate TD memory!");
 			return NULL;
 		}
-		// link it in to my list of ED memory blocks
-		memBlock->SetNextBlock(_tdMBHead);
-		_tdMBHead = memBlock;
-		numTDs = memBlock->NumTDs();
-		_pLastFreeTD = AppleUHCITransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(0), memBlock->GetPhysicalPtr(0));
-        _pFreeTD = _pLastFreeTD;
-		for (i=1; i < numTDs; i++)
+		freeTD = AppleUHCITransferDescriptor::WithSharedMemory(sharedLogical, sharedPhysical);
+		if (!freeTD)
 		{
-			freeTD = AppleUHCITransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(i), memBlock->GetPhysicalPtr(i));
-			if (!freeTD)
-			{
-				USBError(1, "AppleUSBUHCI::AllocateTD - hmm. ran out of TDs in a memory block");
-				freeTD = _pFreeTD;
-				break;
-			}
-			freeTD->_logicalNext = _pFreeTD;
-			_pFreeTD = freeTD;
-			// in a normal loop termination, freeED and _pFreeED are the same, just like when we don't use this code
+			USBError(1, "AppleUSBUHCI::AllocateTD - could not create a TD");
+			_tdSlab.Free(sharedLogical);
+			return NULL;
 		}
     }
     if (freeTD)
@@ -1595,34 +1581,22 @@ AppleUSBUHCI::AllocateITD(void)
 	
     if (freeITD == NULL)
     {
-		// i need to allocate another page of EDs
-		AppleUHCItdMemoryBlock 		*memBlock;
-		UInt32						numTDs, i;
+		// carve another one out of the TD slab, which allocates more memory when it runs out
+		UHCITransferDescriptorSharedPtr	sharedLogical;
+		IOPhysicalAddress				sharedPhysical;
 		
-		memBlock = AppleUHCItdMemoryBlock::NewMemoryBlock();
-		if (!memBlock)
+		sharedLogical = _tdSlab.Allocate(&sharedPhysical, NULL);
+		if (!sharedLogical)
 		{
-			USBError(1, "AppleUSBUHCI::AllocateITD - unable to allocate a new memory block!");
+			USBError(1, "AppleUSBUHCI::AllocateITD - unable to allocate TD memory!");
 			return NULL;
 		}
-		// link it in to my list of ED memory blocks
-		memBlock->SetNextBlock(_tdMBHead);
-		_tdMBHead = memBlock;
-		numTDs = memBlock->NumTDs();
-		_pLastFreeITD = AppleUHCIIsochTransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(0), memBlock->GetPhysicalPtr(0));
-        _pFreeITD = _pLastFreeITD;
-		for (i=1; i < numTDs; i++)
+		freeITD = AppleUHCIIsochTransferDescriptor::WithSharedMemory(sharedLogical, sharedPhysical);
+		if (!freeITD)
 		{
-			freeITD = AppleUHCIIsochTransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(i), memBlock->GetPhysicalPtr(i));
-			if (!freeITD)
-			{
-				USBError(1, "AppleUSBUHCI::AllocateITD - hmm. ran out of TDs in a memory block");
-				freeITD = _pFreeITD;
-				break;
-			}
-			freeITD->_logicalNext = _pFreeITD;
-			_pFreeITD = freeITD;
-			// in a normal loop termination, freeED and _pFreeED are the same, just like when we don't use this code
+			USBError(1, "AppleUSBUHCI::AllocateITD - could not create an ITD");
+			_tdSlab.Free(sharedLogical);
+			return NULL;
 		}
     }
     if (freeITD)
@@ -1687,36 +1661,24 @@ AppleUSBUHCI::AllocateQH(UInt16 functionNumber, UInt16 endpointNumber, UInt8 dir
 	
     if (freeQH == NULL)
     {
-		// i need to allocate another page of EDs
-		AppleUHCIqhMemoryBlock 		*memBlock;
-		UInt32						numQHs, i;
+		// carve another one out of the QH slab, which allocates more memory when it runs out
+		UHCIQueueHeadSharedPtr		sharedLogical;
+		IOPhysicalAddress			sharedPhysical;
 		
-		memBlock = AppleUHCIqhMemoryBlock::NewMemoryBlock();
-		if (!memBlock)
+		sharedLogical = _qhSlab.Allocate(&sharedPhysical, NULL);
+		if (!sharedLogical)
 		{
-			USBLog(1, "AppleUSBUHCI[%p]::AllocateQH - unable to allocate a new memory block!",  this);
+			USBLog(1, "AppleUSBUHCI[%p]::AllocateQH - unable to allocate QH memory!",  this);
 			USBTrace( kUSBTUHCI,  kTPUHCIAllocateQH, functionNumber, endpointNumber, direction, type);
 			return NULL;
 		}
-		// link it in to my list of ED memory blocks
-		memBlock->SetNextBlock(_qhMBHead);
-		_qhMBHead = memBlock;
-		numQHs = memBlock->NumQHs();
-		_pLastFreeQH = AppleUHCIQueueHead::WithSharedMemory(memBlock->GetLogicalPtr(0), memBlock->GetPhysicalPtr(0));
-		_pFreeQH = _pLastFreeQH;
-		for (i=1; i < numQHs; i++)
+		freeQH = AppleUHCIQueueHead::WithSharedMemory(sharedLogical, sharedPhysical);
+		if (!freeQH)
 		{
-			freeQH = AppleUHCIQueueHead::WithSharedMemory(memBlock->GetLogicalPtr(i), memBlock->GetPhysicalPtr(i));
-			if (!freeQH)
-			{
-				USBLog(1, "AppleUSBUHCI[%p]::AllocateED - hmm. ran out of EDs in a memory block",  this);
-				USBTrace( kUSBTUHCI,  kTPUHCIAllocateQH, (uintptr_t)this, i, numQHs, 1 );
-				freeQH = _pFreeQH;
-				break;
-			}
-			freeQH->_logicalNext = _pFreeQH;
-			_pFreeQH = freeQH;
-			// in a normal loop termination, freeQH and _pFreeQH are the same, just like when we don't use this code
+			USBLog(1, "AppleUSBUHCI[%p]::AllocateQH - could not create a QH",  this);
+			USBTrace( kUSBTUHCI,  kTPUHCIAllocateQH, (uintptr_t)this, 0, 0, 1 );
+			_qhSlab.Free(sharedLogical);
+			return NULL;
 		}
     }
     if (freeQH)
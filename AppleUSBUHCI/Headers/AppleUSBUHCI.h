@@ -51,10 +51,13 @@ extern "C" {
 
 #include "UHCI.h"
 #include "AppleUSBEHCI.h"
+#include "IOUSBControllerDescriptorSlab.h"
+
+// Descriptor memory. The non shared data lives in the AppleUHCI list elements, which are kept on their own free lists
+typedef IOUSBControllerDescriptorSlab<UHCITransferDescriptorShared, IOUSBControllerDescriptorSlabNoPrivate, kUHCIStructureAllocationPhysicalMask, 16, 4, ' utd'>	AppleUHCItdSlab;
+typedef IOUSBControllerDescriptorSlab<UHCIQueueHeadShared, IOUSBControllerDescriptorSlabNoPrivate, kUHCIStructureAllocationPhysicalMask, 16, 1, ' uqh'>		AppleUHCIqhSlab;
 
 // forward declarations
-class AppleUHCItdMemoryBlock;
-class AppleUHCIqhMemoryBlock;
 class AppleUHCIQueueHead;
 class AppleUHCITransferDescriptor;
 class AppleUHCIIsochTransferDescriptor;
@@ -330,8 +333,8 @@ protected:
 	AppleUHCITransferDescriptor			*_pLastFreeTD;
 	AppleUHCIIsochTransferDescriptor	*_pFreeITD;
 	AppleUHCIIsochTransferDescriptor	*_pLastFreeITD;
-    AppleUHCIqhMemoryBlock				*_qhMBHead;
-    AppleUHCItdMemoryBlock				*_tdMBHead;
+    AppleUHCIqhSlab						_qhSlab;				// shared memory for the QHs
+    AppleUHCItdSlab						_tdSlab;				// shared memory for the TDs and ITDs
     
 	// Queue Heads
 	AppleUHCIQueueHead					*_pFreeQH;
@@ -59,6 +59,7 @@ AppleXHCIAsyncTransferDescriptor::init()
 	ret = OSObject::init();
     
     bzero(immediateBuffer, kMaxImmediateTRBTransferSize);
+    timeoutTimer.owner = this;
 
 	return ret;
 }
@@ -88,8 +89,16 @@ AppleXHCIAsyncTransferDescriptor::reinit()
     lastFlushedTD     = false;
     lastInRing        = false;
     remAfterThisTD    = 0;
+    doorbellTime      = 0;
 
     _logicalNext = NULL;				// the next element in the list
+    _activePrev  = NULL;
+    _retireNext  = NULL;
+    _retirePrev  = NULL;
+    activeSequence = 0;
+    _commandNext = NULL;
+    _commandLast = NULL;
+    scheduled    = false;
     bzero(immediateBuffer, kMaxImmediateTRBTransferSize);
     
 }
@@ -117,253 +126,1037 @@ AppleXHCIAsyncTransferDescriptor::print(int level)
 }
 
 
-OSDefineMetaClassAndStructors(AppleXHCIAsyncEndpoint, OSObject)
-
-
-#pragma mark •••••••• Queue Management ••••••••
+OSDefineMetaClassAndStructors(AppleXHCIAsyncTDPool, OSObject)
 
-void 
-AppleXHCIAsyncEndpoint::validateLists(int level)
+//
+// There is one pool per controller. It is kept as a property of the controller so that the 
+// endpoints can find it without the controller having to know about it, and so that the
+// counters show up in the IORegistry (see serialize).
+//
+AppleXHCIAsyncTDPool *
+AppleXHCIAsyncTDPool::ForController(AppleUSBXHCI *controller)
 {
-    AppleXHCIAsyncTransferDescriptor *freeATD = freeQueue;
-    int count = 0;
+    AppleXHCIAsyncTDPool *me = OSDynamicCast(AppleXHCIAsyncTDPool, controller->getProperty(kAppleXHCIAsyncTDPoolKey));
     
-    while (freeATD)
+    if (me)
     {
-        count++;
-        if (freeATD == freeEnd)
-        	break;
-
-        freeATD = (AppleXHCIAsyncTransferDescriptor*)freeATD->_logicalNext;
+        me->retain();
+        return me;
     }
-
-    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::validateLists freeQueue count: %d ",  this, count );
+    
+    me = OSTypeAlloc(AppleXHCIAsyncTDPool);
+    
+    if (!me || !me->init())
+    {
+        if (me)
+            me->release();
+        return NULL;
+    }
+    
+    controller->setProperty(kAppleXHCIAsyncTDPoolKey, me);
+    
+    return me;
 }
 
 void
-AppleXHCIAsyncEndpoint::print(int level)
+AppleXHCIAsyncTDPool::free(void)
 {
-    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - ring(%lx) readyQueue(%lx) readyEnd(%lx) onReadyQueue(%d)", 
-           this, (uintptr_t)_ring, (uintptr_t)readyQueue, (uintptr_t)readyEnd, (int)onReadyQueue);
-    
-    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - activeQueue(%lx) activeEnd(%lx) onActiveQueue(%d)", 
-           this, (uintptr_t)activeQueue, (uintptr_t)activeEnd, (int)onActiveQueue);
+    while (_cacheQueue != NULL)
+    {
+        AppleXHCIAsyncTransferDescriptor *pTD = _cacheQueue;
+        
+        _cacheQueue = (pTD == _cacheEnd) ? NULL : pTD->_logicalNext;
+        pTD->release();
+    }
     
-    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - doneQueue(%lx) doneEnd(%lx) onDoneQueue(%d)", 
-           this, (uintptr_t)doneQueue, (uintptr_t)doneEnd, (int)onDoneQueue);
-
-    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - freeQueue(%lx) freeEnd(%lx) onFreeQueue(%d)", 
-           this, (uintptr_t)freeQueue, (uintptr_t)freeEnd, (int)onFreeQueue);
+    _cacheEnd       = NULL;
+    _onCacheQueue   = 0;
     
-	USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - aborting(%d) maxPacketSize(%d) maxBurst(%d) actualFragmentSize(%d)", 
-           this, (int)_aborting, (int)_maxPacketSize, (int)_maxBurst, (int)_actualFragmentSize);
+    OSObject::free();
 }
 
-bool
-AppleXHCIAsyncEndpoint::init()
+UInt32
+AppleXHCIAsyncTDPool::FillEndpoint(AppleXHCIAsyncEndpoint *endpoint, UInt32 count)
 {
-    bool		ret;
-
-	ret = OSObject::init();
-
-    return ret;
+    UInt32  filled = 0;
+    
+    while (filled < count)
+    {
+        AppleXHCIAsyncTransferDescriptor *pTD = _cacheQueue;
+        
+        if (pTD)
+        {
+            _cacheQueue = (pTD == _cacheEnd) ? NULL : pTD->_logicalNext;
+            if (_cacheQueue == NULL)
+                _cacheEnd = NULL;
+            
+            _onCacheQueue--;
+            _cacheHits++;
+            pTD->_endpoint = endpoint;
+        }
+        else
+        {
+            pTD = AppleXHCIAsyncTransferDescriptor::ForEndpoint(endpoint);
+            if (pTD == NULL)
+                break;
+            
+            _allocated++;
+            _totalAllocated++;
+        }
+        
+        pTD->_logicalNext = NULL;
+        endpoint->PutTD(&endpoint->freeQueue, &endpoint->freeEnd, pTD, &endpoint->onFreeQueue);
+        filled++;
+    }
+    
+    return filled;
 }
 
-bool
-AppleXHCIAsyncEndpoint::init(AppleUSBXHCI *controller, XHCIRing *pRing, UInt16 maxPacketSize, UInt16 maxBurst, UInt16 mult)
+void
+AppleXHCIAsyncTDPool::ReturnTD(AppleXHCIAsyncTransferDescriptor *pTD)
 {
-	bool		ret = init();
-    UInt32      maxBurstPayload = 0;
-    UInt32      numberOfMaxBursts = 0;
-	
-    if(!ret)
+    pTD->_endpoint      = NULL;
+    pTD->_logicalNext   = NULL;
+    
+    if (_onCacheQueue >= kAsyncTDPoolHighWater)
     {
-        return false;
+        pTD->release();
+        _allocated--;
+        _reclaimed++;
+        return;
     }
     
-    USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncEPAlloc, (uintptr_t)this, (uintptr_t)pRing, maxBurst, mult );
-    
-    _xhciUIM        = controller;
-    _ring           = pRing;
-    _maxPacketSize  = maxPacketSize;
-    _maxBurst       = maxBurst;
-    _mult           = mult;
-    
-    maxBurstPayload      = _maxPacketSize * (_maxBurst+1) * (_mult+1);              // MPS could be 0
-    
-    if (maxBurstPayload)
-        numberOfMaxBursts    = kAsyncMaxFragmentSize / maxBurstPayload;
+    if (_cacheQueue == NULL)
+        _cacheQueue = pTD;
+    else
+        _cacheEnd->_logicalNext = pTD;
     
-    _actualFragmentSize         = numberOfMaxBursts * maxBurstPayload;
-
-    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPAlloc, (uintptr_t)this, maxBurstPayload, numberOfMaxBursts, _actualFragmentSize );
-
-	return ret;
+    _cacheEnd = pTD;
+    _onCacheQueue++;
 }
 
+bool
+AppleXHCIAsyncTDPool::serialize(OSSerialize *s) const
+{
+	OSDictionary *	dictionary;
+	bool			ok;
+	
+	dictionary = OSDictionary::withCapacity(5);
+	if (!dictionary)
+		return false;
+    
+	UpdateNumberEntry(dictionary, _allocated, "Allocated");
+	UpdateNumberEntry(dictionary, _onCacheQueue, "Cached");
+	UpdateNumberEntry(dictionary, _reclaimed, "Reclaimed");
+	UpdateNumberEntry(dictionary, _totalAllocated, "Allocated (Total)");
+	UpdateNumberEntry(dictionary, _cacheHits, "Cache Hits");
+    
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
+}
 
-void									
-AppleXHCIAsyncEndpoint::free(void)
+void
+AppleXHCIAsyncTDPool::UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const
 {
-    USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncEPFree, (uintptr_t)this, onReadyQueue, onActiveQueue, onDoneQueue );
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber(value, 32);
+	if (!number)
+		return;
+    
+	dictionary->setObject(name, number);
+	number->release();
+}
 
-    USBLog(7,"+AppleXHCIAsyncEndpoint[%p]::free",  this );
 
-    _aborting            = true;
-    _ring->beingReturned = true;
+OSDefineMetaClassAndStructors(AppleXHCIAsyncTimerWheel, OSObject)
 
-    MoveAllTDsFromReadyQToDoneQ();
+//
+// Like the ATD pool there is one wheel per controller, kept as a property of the controller.
+// The timers themselves are embedded in the endpoints, which cancel them before going away,
+// so the wheel never owns anything it would have to release.
+//
+AppleXHCIAsyncTimerWheel *
+AppleXHCIAsyncTimerWheel::ForController(AppleUSBXHCI *controller)
+{
+    AppleXHCIAsyncTimerWheel *me = OSDynamicCast(AppleXHCIAsyncTimerWheel, controller->getProperty(kAppleXHCIAsyncTimerWheelKey));
     
-    // If TDs are in Done Queue then complete only the last fragment
-    if (onDoneQueue)
+    if (me)
     {
-        USBLog(1,"AppleXHCIAsyncEndpoint[%p]::free %d ATDs in doneQueue returning as 0x%08x",  this, (int)onDoneQueue, kIOReturnAborted );
-        Complete(kIOReturnAborted);
+        me->retain();
+        return me;
     }
     
-    do
-    {
-        AppleXHCIAsyncTransferDescriptor *freeATD = GetTDFromFreeQueue(false);
-        
-        if (freeATD)
-        {
-            USBLog(7,"+AppleXHCIAsyncEndpoint[%p]::free freeATD: %p ",  this, freeATD );
-
-            freeATD->release();
-            freeATD = NULL;
-        }
-        
-    } while (freeQueue != NULL);
+    me = OSTypeAlloc(AppleXHCIAsyncTimerWheel);
     
-    print(7);
-
-    USBLog(7,"-AppleXHCIAsyncEndpoint[%p]::free",  this );
+    if (!me || !me->init())
+    {
+        if (me)
+            me->release();
+        return NULL;
+    }
     
-    _aborting            = false;
-    _ring->beingReturned = false;
+    controller->setProperty(kAppleXHCIAsyncTimerWheelKey, me);
     
-    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPFree, (uintptr_t)this, 0, 0, 0 );
-
-	OSObject::free();
+    return me;
 }
 
-void 
-AppleXHCIAsyncEndpoint::PutTDAtHead(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, AppleXHCIAsyncTransferDescriptor *pTD, UInt32 *qCount)
+void
+AppleXHCIAsyncTimerWheel::Insert(AppleXHCIAsyncTimer *timer)
 {
-    // Link TD into queue
-    if (*qStart == NULL)
+    AppleXHCIAsyncTimer     **slot;
+    SInt32                  delta = (SInt32)(timer->deadline - _currentFrame);
+    
+    if (delta <= 0)
     {
-		// as the head of a new queue and new qEnd
-		*qEnd = *qStart = pTD;
+        slot = &_expired;
+        _expirations++;
+    }
+    else if (delta < kAsyncTimerWheelSlots)
+    {
+        slot = &_level0[timer->deadline & kAsyncTimerWheelMask];
+    }
+    else if (((timer->deadline >> kAsyncTimerWheelBits) - (_currentFrame >> kAsyncTimerWheelBits)) < kAsyncTimerWheelSlots)
+    {
+        slot = &_level1[(timer->deadline >> kAsyncTimerWheelBits) & kAsyncTimerWheelMask];
     }
     else
     {
-		// at the head of the old queue
-        pTD->_logicalNext = *qStart;
+        slot = &_overflow;
     }
     
-    // no matter what we are the new head
-    *qStart = pTD;
-	(*qCount)++;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot       = timer;
+    timer->slot = slot;
+    
+    _armedTimers++;
 }
 
-void 
-AppleXHCIAsyncEndpoint::PutTD(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, AppleXHCIAsyncTransferDescriptor *pTD, UInt32 *qCount)
+void
+AppleXHCIAsyncTimerWheel::Unlink(AppleXHCIAsyncTimer *timer)
 {
-    // Link TD into queue
-    if (*qStart == NULL)
-    {
-		// as the head of a new queue
-		*qStart = pTD;
-    }
+    if (timer->prev)
+        timer->prev->next = timer->next;
     else
+        *timer->slot = timer->next;
+    
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+    
+    _armedTimers--;
+}
+
+void
+AppleXHCIAsyncTimerWheel::Arm(AppleXHCIAsyncTimer *timer, UInt32 deadline)
+{
+    if (timer->slot)
     {
-		// at the tail of the old queue
-		(*qEnd)->_logicalNext = pTD;
+        if (timer->deadline == deadline)
+            return;
+        
+        Unlink(timer);
     }
     
-    // no matter what we are the new tail
-    *qEnd = pTD;
-	(*qCount)++;
+    timer->deadline = deadline;
+    _totalArmed++;
+    
+    Insert(timer);
 }
 
-AppleXHCIAsyncTransferDescriptor * 
-AppleXHCIAsyncEndpoint::GetTD(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, UInt32 *qCount)
+void
+AppleXHCIAsyncTimerWheel::Cancel(AppleXHCIAsyncTimer *timer)
 {
-    AppleXHCIAsyncTransferDescriptor	*pTD;
+    if (timer->slot)
+        Unlink(timer);
+}
+
+//
+// Re-file every timer on slot against the current frame, which puts them on a lower level
+// (or expires them) now that their deadline is closer
+//
+void
+AppleXHCIAsyncTimerWheel::Cascade(AppleXHCIAsyncTimer **slot)
+{
+    AppleXHCIAsyncTimer     *timer = *slot;
     
-    pTD = *qStart;
-    if (pTD)
+    *slot = NULL;
+    
+    while (timer)
     {
-		if (pTD == *qEnd)
-			*qStart = *qEnd = NULL;
-		else
-			*qStart = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pTD->_logicalNext);
+        AppleXHCIAsyncTimer *next = timer->next;
         
-        if (*qCount == 0)
+        timer->next = NULL;
+        timer->prev = NULL;
+        timer->slot = NULL;
+        _armedTimers--;
+        _cascaded++;
+        
+        Insert(timer);
+        timer = next;
+    }
+}
+
+void
+AppleXHCIAsyncTimerWheel::Advance(UInt32 curFrame)
+{
+    // First call, or a jump larger than the wheel (e.g. across a sleep) - just re-file everything
+    if (!_started || ((curFrame - _currentFrame) >= kAsyncTimerWheelSpan))
+    {
+        AdvanceAll(curFrame);
+        return;
+    }
+    
+    while (_currentFrame != curFrame)
+    {
+        UInt32  index;
+        
+        _currentFrame++;
+        index = _currentFrame & kAsyncTimerWheelMask;
+        
+        if (index == 0)
         {
-		    USBLog(1,"AppleXHCIAsyncEndpoint[%p]::GetTD underflow",  this);
-		    print(5);
+            UInt32  index1 = (_currentFrame >> kAsyncTimerWheelBits) & kAsyncTimerWheelMask;
+            
+            if (index1 == 0)
+                Cascade(&_overflow);
+            
+            Cascade(&_level1[index1]);
         }
         
-		(*qCount)--;
+        // Everything left on this slot is due now, so Insert puts it on _expired
+        while (_level0[index] != NULL)
+        {
+            AppleXHCIAsyncTimer *timer = _level0[index];
+            
+            Unlink(timer);
+            Insert(timer);
+        }
     }
-    
-    return pTD;
 }
 
-void
-AppleXHCIAsyncEndpoint::PutTDonFreeQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+UInt32
+AppleXHCIAsyncTimerWheel::ServiceTimeouts(UInt32 curFrame)
 {
-    PutTD(&freeQueue, &freeEnd, pTD, &onFreeQueue);
+    UInt32  expired = 0;
+    
+    Advance(curFrame);
+    
+    // TimeoutExpired can complete commands, which cancels their timers and arms the next ones, so take the
+    // expired timers off one at a time
+    while (_expired != NULL)
+    {
+        AppleXHCIAsyncTimer *timer = _expired;
+        
+        Unlink(timer);
+        expired++;
+        
+        timer->owner->_endpoint->TimeoutExpired(timer->owner, curFrame);
+    }
+    
+    return expired;
 }
 
-AppleXHCIAsyncTransferDescriptor *
-AppleXHCIAsyncEndpoint::GetTDFromFreeQueue(bool allocate)
+void
+AppleXHCIAsyncTimerWheel::AdvanceAll(UInt32 curFrame)
 {
-    if (freeQueue == NULL && allocate)
+    AppleXHCIAsyncTimer     *pending = NULL;
+    int                     i;
+    
+    // Pull everything still to come off the wheel, chained through next
+    for (i = 0; i < (2 * kAsyncTimerWheelSlots) + 1; i++)
     {
-        // Allocate TDs and add them to FreeQueue
-        for (int i=0; i < kFreeTDs; i++)
+        AppleXHCIAsyncTimer **slot = (i < kAsyncTimerWheelSlots) ? &_level0[i] : 
+                                     (i < (2 * kAsyncTimerWheelSlots)) ? &_level1[i - kAsyncTimerWheelSlots] : &_overflow;
+        
+        while (*slot != NULL)
         {
-            AppleXHCIAsyncTransferDescriptor *newATD = AppleXHCIAsyncTransferDescriptor::ForEndpoint(this);
-            if (newATD)
-            {
-                PutTDonFreeQueue(newATD);
-            }
+            AppleXHCIAsyncTimer *timer = *slot;
+            
+            Unlink(timer);
+            timer->next = pending;
+            pending     = timer;
         }
     }
-
-    AppleXHCIAsyncTransferDescriptor *pFreeATD = GetTD(&freeQueue, &freeEnd, &onFreeQueue);
     
-    if (pFreeATD)
+    _currentFrame   = curFrame;
+    _started        = true;
+    
+    while (pending)
     {
-        pFreeATD->reinit();
+        AppleXHCIAsyncTimer *timer = pending;
+        
+        pending     = timer->next;
+        timer->next = NULL;
+        Insert(timer);
     }
-    
-    return pFreeATD;
 }
 
-void 
-AppleXHCIAsyncEndpoint::PutTDonReadyQueueAtHead(AppleXHCIAsyncTransferDescriptor *pTD)
+bool
+AppleXHCIAsyncTimerWheel::serialize(OSSerialize *s) const
 {
-    PutTDAtHead(&readyQueue, &readyEnd, pTD, &onReadyQueue);
+	OSDictionary *	dictionary;
+	bool			ok;
+	
+	dictionary = OSDictionary::withCapacity(5);
+	if (!dictionary)
+		return false;
+    
+	UpdateNumberEntry(dictionary, _armedTimers, "Armed");
+	UpdateNumberEntry(dictionary, _totalArmed, "Armed (Total)");
+	UpdateNumberEntry(dictionary, _expirations, "Expirations");
+	UpdateNumberEntry(dictionary, _cascaded, "Cascaded");
+	UpdateNumberEntry(dictionary, _currentFrame, "Current Frame");
+    
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
 }
 
 void
-AppleXHCIAsyncEndpoint::PutTDonReadyQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+AppleXHCIAsyncTimerWheel::UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const
 {
-    PutTD(&readyQueue, &readyEnd, pTD, &onReadyQueue);
-}
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber(value, 32);
+	if (!number)
+		return;
+    
+	dictionary->setObject(name, number);
+	number->release();
+}
+
+
+OSDefineMetaClassAndStructors(AppleXHCIAsyncTelemetry, OSObject)
+
+AppleXHCIAsyncTelemetry *
+AppleXHCIAsyncTelemetry::WithEndpoint(AppleXHCIAsyncEndpoint *endpoint)
+{
+    AppleXHCIAsyncTelemetry *me = OSTypeAlloc(AppleXHCIAsyncTelemetry);
+    
+    if (!me || !me->init())
+    {
+        if (me)
+            me->release();
+        return NULL;
+    }
+    
+    me->_startTime      = mach_absolute_time();
+    me->_lastSample     = me->_startTime;
+    me->_windowStart    = me->_startTime;
+    nanoseconds_to_absolutetime(kAsyncTelemetryRateWindowNS, &me->_windowLength);
+    me->SampleQueues(endpoint);
+    
+    return me;
+}
+
+void
+AppleXHCIAsyncTelemetry::SampleQueues(AppleXHCIAsyncEndpoint *endpoint)
+{
+    UInt64      now = mach_absolute_time();
+    UInt64      elapsed = now - _lastSample;
+    UInt32      depths[kAsyncTelemetryQueues];
+    int         i;
+    
+    depths[kAsyncTelemetryReadyQueue]   = endpoint->onReadyQueue;
+    depths[kAsyncTelemetryActiveQueue]  = endpoint->onActiveQueue;
+    depths[kAsyncTelemetryDoneQueue]    = endpoint->onDoneQueue;
+    depths[kAsyncTelemetryFreeQueue]    = endpoint->onFreeQueue;
+    
+    for (i=0; i < kAsyncTelemetryQueues; i++)
+    {
+        _queues[i].depthTime += (UInt64)_queues[i].depth * elapsed;
+        _queues[i].depth = depths[i];
+        if (depths[i] > _queues[i].maxDepth)
+            _queues[i].maxDepth = depths[i];
+    }
+    
+    _lastSample     = now;
+    _fragmentSize   = endpoint->_actualFragmentSize;
+    _fragmentPolicy = endpoint->_fragmentPolicy;
+    
+    // nothing left to schedule, so whatever stall there was is over
+    if (_ringFullSince && (endpoint->onReadyQueue == 0))
+        RingAvailable();
+    
+    if ((now - _windowStart) >= _windowLength)
+    {
+        UInt64      windowNS;
+        
+        absolutetime_to_nanoseconds(now - _windowStart, &windowNS);
+        if (windowNS)
+        {
+            _bytesPerSec = (UInt32)(((_bytes - _windowBytes) * 1000000000ULL) / windowNS);
+            if (_bytesPerSec > _maxBytesPerSec)
+                _maxBytesPerSec = _bytesPerSec;
+        }
+        _windowStart = now;
+        _windowBytes = _bytes;
+    }
+}
+
+void
+AppleXHCIAsyncTelemetry::RingFull(void)
+{
+    if (_ringFullSince == 0)
+    {
+        _ringFullSince = mach_absolute_time();
+        _ringFullStalls++;
+    }
+}
+
+void
+AppleXHCIAsyncTelemetry::RingAvailable(void)
+{
+    if (_ringFullSince)
+    {
+        _ringFullTime += mach_absolute_time() - _ringFullSince;
+        _ringFullSince = 0;
+    }
+}
+
+bool
+AppleXHCIAsyncTelemetry::serialize(OSSerialize *s) const
+{
+    static const char * const   queueNames[kAsyncTelemetryQueues] = { "Ready", "Active", "Done", "Free" };
+	OSDictionary *              dictionary;
+    char                        name[48];
+    UInt64                      elapsed = _lastSample - _startTime;
+    UInt64                      sinceWindow = mach_absolute_time() - _windowStart;
+    UInt64                      bytesPerSec = _bytesPerSec;
+    UInt64                      ns;
+	bool                        ok;
+    int                         i;
+	
+	dictionary = OSDictionary::withCapacity(20);
+	if (!dictionary)
+		return false;
+    
+    for (i=0; i < kAsyncTelemetryQueues; i++)
+    {
+        // in hundredths, since the registry only holds integers
+        snprintf(name, sizeof(name), "%s Queue Average Depth (x100)", queueNames[i]);
+        UpdateNumberEntry(dictionary, elapsed ? ((_queues[i].depthTime * 100) / elapsed) : 0, name);
+        snprintf(name, sizeof(name), "%s Queue Max Depth", queueNames[i]);
+        UpdateNumberEntry(dictionary, _queues[i].maxDepth, name);
+    }
+    
+    // an endpoint which has gone quiet isn't sampled, so don't keep showing the rate from before it did
+    if (sinceWindow >= _windowLength)
+    {
+        absolutetime_to_nanoseconds(sinceWindow, &ns);
+        bytesPerSec = ns ? (((_bytes - _windowBytes) * 1000000000ULL) / ns) : 0;
+    }
+    
+	UpdateNumberEntry(dictionary, _bytes, "Bytes");
+	UpdateNumberEntry(dictionary, bytesPerSec, "Bytes/sec");
+	UpdateNumberEntry(dictionary, _maxBytesPerSec, "Bytes/sec (Max)");
+	UpdateNumberEntry(dictionary, _commands, "Commands");
+	UpdateNumberEntry(dictionary, _commandsCompleted, "Commands Completed");
+	UpdateNumberEntry(dictionary, _fragmentedCommands, "Fragmented Commands");
+	UpdateNumberEntry(dictionary, _fragmentsCreated, "Fragments Created");
+	UpdateNumberEntry(dictionary, _fragmentsScheduled, "Fragments Scheduled");
+	UpdateNumberEntry(dictionary, _fragmentSize, "Fragment Size");
+	UpdateNumberEntry(dictionary, _fragmentPolicy, "Fragment Policy");
+	UpdateNumberEntry(dictionary, _ringFullStalls, "Ring Full Stalls");
+    absolutetime_to_nanoseconds(_ringFullTime, &ns);
+	UpdateNumberEntry(dictionary, ns / 1000, "Ring Full Time (us)");
+    absolutetime_to_nanoseconds(elapsed, &ns);
+	UpdateNumberEntry(dictionary, ns / 1000000, "Sampled Time (ms)");
+    
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
+}
+
+void
+AppleXHCIAsyncTelemetry::UpdateNumberEntry(OSDictionary *dictionary, UInt64 value, const char *name) const
+{
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber(value, 64);
+	if (!number)
+		return;
+    
+	dictionary->setObject(name, number);
+	number->release();
+}
+
+
+OSDefineMetaClassAndStructors(AppleXHCIAsyncEndpoint, OSObject)
+
+
+#pragma mark •••••••• Queue Management ••••••••
+
+void 
+AppleXHCIAsyncEndpoint::validateLists(int level)
+{
+    AppleXHCIAsyncTransferDescriptor *freeATD = freeQueue;
+    int count = 0;
+    
+    while (freeATD)
+    {
+        count++;
+        if (freeATD == freeEnd)
+        	break;
+
+        freeATD = (AppleXHCIAsyncTransferDescriptor*)freeATD->_logicalNext;
+    }
+
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::validateLists freeQueue count: %d ",  this, count );
+}
+
+void
+AppleXHCIAsyncEndpoint::print(int level)
+{
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - ring(%lx) readyQueue(%lx) readyEnd(%lx) onReadyQueue(%d)", 
+           this, (uintptr_t)_ring, (uintptr_t)readyQueue, (uintptr_t)readyEnd, (int)onReadyQueue);
+    
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - activeQueue(%lx) activeEnd(%lx) onActiveQueue(%d)", 
+           this, (uintptr_t)activeQueue, (uintptr_t)activeEnd, (int)onActiveQueue);
+    
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - doneQueue(%lx) doneEnd(%lx) onDoneQueue(%d)", 
+           this, (uintptr_t)doneQueue, (uintptr_t)doneEnd, (int)onDoneQueue);
+
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - freeQueue(%lx) freeEnd(%lx) onFreeQueue(%d)", 
+           this, (uintptr_t)freeQueue, (uintptr_t)freeEnd, (int)onFreeQueue);
+    
+	USBLog(level, "AppleXHCIAsyncEndpoint[%p]::print - aborting(%d) maxPacketSize(%d) maxBurst(%d) actualFragmentSize(%d)", 
+           this, (int)_aborting, (int)_maxPacketSize, (int)_maxBurst, (int)_actualFragmentSize);
+    
+    PrintStreams(level);
+}
+
+bool
+AppleXHCIAsyncEndpoint::init()
+{
+    bool		ret;
+
+	ret = OSObject::init();
+
+    return ret;
+}
+
+bool
+AppleXHCIAsyncEndpoint::init(AppleUSBXHCI *controller, XHCIRing *pRing, UInt16 maxPacketSize, UInt16 maxBurst, UInt16 mult)
+{
+	bool		ret = init();
+    UInt32      maxBurstPayload = 0;
+    UInt32      numberOfMaxBursts = 0;
+    OSNumber    *policyProp;
+    OSNumber    *moderationProp;
+    OSNumber    *inFlightProp;
+	
+    if(!ret)
+    {
+        return false;
+    }
+    
+    USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncEPAlloc, (uintptr_t)this, (uintptr_t)pRing, maxBurst, mult );
+    
+    _xhciUIM        = controller;
+    _ring           = pRing;
+    _maxPacketSize  = maxPacketSize;
+    _maxBurst       = maxBurst;
+    _mult           = mult;
+    
+    _coalesceDoorbells  = true;
+    _doorbellsSaved     = 0;
+    
+    _tdPool         = AppleXHCIAsyncTDPool::ForController(controller);
+    if (_tdPool == NULL)
+    {
+        USBLog(1, "AppleXHCIAsyncEndpoint[%p]::init - no ATD pool, ATDs will be allocated per endpoint", this);
+    }
+    
+    _timerWheel     = AppleXHCIAsyncTimerWheel::ForController(controller);
+    if (_timerWheel == NULL)
+    {
+        USBLog(1, "AppleXHCIAsyncEndpoint[%p]::init - no timer wheel, timeouts will be checked on every call", this);
+    }
+    
+    AdvertiseImmediateData(controller);
+    
+    maxBurstPayload      = _maxPacketSize * (_maxBurst+1) * (_mult+1);              // MPS could be 0
+    
+    if (maxBurstPayload)
+        numberOfMaxBursts    = kAsyncMaxFragmentSize / maxBurstPayload;
+    
+    _actualFragmentSize         = numberOfMaxBursts * maxBurstPayload;
+    _maxBurstPayload            = maxBurstPayload;
+    _baseFragmentSize           = _actualFragmentSize;
+    _fragmentPolicy             = kXHCIAsyncFragmentPolicyFixed;
+    
+    policyProp = OSDynamicCast(OSNumber, controller->getProperty(kAppleXHCIAsyncFragmentPolicyKey));
+    if (policyProp && (policyProp->unsigned32BitValue() == kXHCIAsyncFragmentPolicyAdaptive))
+    {
+        SetFragmentPolicy(kXHCIAsyncFragmentPolicyAdaptive);
+    }
+    
+    ApplyFragmentSizeOverride(controller);
+    
+    _fragmentsPerInterrupt      = kAsyncDefaultFragmentsPerInterrupt;
+    
+    moderationProp = OSDynamicCast(OSNumber, controller->getProperty(kAppleXHCIAsyncFragmentsPerInterruptKey));
+    if (moderationProp)
+    {
+        SetInterruptModeration(moderationProp->unsigned32BitValue());
+    }
+    
+    _streamMaxInFlight          = kAsyncStreamUnlimitedInFlight;
+    
+    inFlightProp = OSDynamicCast(OSNumber, controller->getProperty(kAppleXHCIAsyncStreamMaxInFlightKey));
+    if (inFlightProp)
+    {
+        SetStreamMaxInFlight(inFlightProp->unsigned32BitValue());
+    }
+    
+    _telemetry = AppleXHCIAsyncTelemetry::WithEndpoint(this);
+    if (_telemetry)
+    {
+        char    key[48];
+        
+        TelemetryKey(key, sizeof(key));
+        controller->setProperty(key, _telemetry);
+    }
+
+    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPAlloc, (uintptr_t)this, maxBurstPayload, numberOfMaxBursts, _actualFragmentSize );
+
+	return ret;
+}
+
+
+//
+// Tell IOUSBController::Write that bulk and interrupt OUT payloads of up to kMaxImmediateTRBTransferSize bytes
+// are carried as Immediate Data (see CreateTDs), so it can leave them unmapped. Only set once per controller
+//
+void
+AppleXHCIAsyncEndpoint::AdvertiseImmediateData(AppleUSBXHCI *controller)
+{
+    if (controller->getProperty(kUSBControllerImmediateDataKey) != kOSBooleanTrue)
+    {
+        controller->setProperty(kUSBControllerImmediateDataKey, kOSBooleanTrue);
+    }
+}
+
+
+void									
+AppleXHCIAsyncEndpoint::free(void)
+{
+    USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncEPFree, (uintptr_t)this, onReadyQueue, onActiveQueue, onDoneQueue );
+
+    USBLog(7,"+AppleXHCIAsyncEndpoint[%p]::free",  this );
+
+    _aborting            = true;
+    _ring->beingReturned = true;
+
+    MoveAllTDsFromReadyQToDoneQ();
+    
+    // If TDs are in Done Queue then complete only the last fragment
+    if (onDoneQueue)
+    {
+        USBLog(1,"AppleXHCIAsyncEndpoint[%p]::free %d ATDs in doneQueue returning as 0x%08x",  this, (int)onDoneQueue, kIOReturnAborted );
+        Complete(kIOReturnAborted);
+    }
+    
+    do
+    {
+        AppleXHCIAsyncTransferDescriptor *freeATD = GetTDFromFreeQueue(false);
+        
+        if (freeATD)
+        {
+            USBLog(7,"+AppleXHCIAsyncEndpoint[%p]::free freeATD: %p ",  this, freeATD );
+
+            if (_tdPool)
+                _tdPool->ReturnTD(freeATD);
+            else
+                freeATD->release();
+            freeATD = NULL;
+        }
+        
+    } while (freeQueue != NULL);
+    
+    if (_tdPool)
+    {
+        _tdPool->release();
+        _tdPool = NULL;
+    }
+    
+    if (_timerWheel)
+    {
+        _timerWheel->release();
+        _timerWheel = NULL;
+    }
+    
+    if (_telemetry)
+    {
+        char    key[48];
+        
+        TelemetryKey(key, sizeof(key));
+        _xhciUIM->removeProperty(key);
+        _telemetry->release();
+        _telemetry = NULL;
+    }
+    
+    print(7);
+
+    USBLog(7,"-AppleXHCIAsyncEndpoint[%p]::free",  this );
+    
+    _aborting            = false;
+    _ring->beingReturned = false;
+    
+    if (_activeIndexTable)
+    {
+        IOFree(_activeIndexTable, _activeIndexTableSize * sizeof(AppleXHCIAsyncTransferDescriptor*));
+        _activeIndexTable       = NULL;
+        _activeIndexTableSize   = 0;
+    }
+    
+    FreeStreamQueues();
+    
+    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPFree, (uintptr_t)this, 0, 0, 0 );
+
+	OSObject::free();
+}
+
+void
+AppleXHCIAsyncEndpoint::TelemetryKey(char *key, size_t keySize)
+{
+    snprintf(key, keySize, kAppleXHCIAsyncTelemetryKeyPrefix "%d.%d", (int)_ring->slotID, (int)_ring->endpointID);
+}
+
+//
+// A known device can have its fragment size pinned with a kAppleXHCIAsyncFragmentSizeKeyPrefix "slot.endpoint"
+// property on the controller, read as the endpoint is created. The size in use shows up in the telemetry
+//
+void
+AppleXHCIAsyncEndpoint::ApplyFragmentSizeOverride(AppleUSBXHCI *controller)
+{
+    char        key[48];
+    OSNumber    *sizeProp;
+    
+    snprintf(key, sizeof(key), kAppleXHCIAsyncFragmentSizeKeyPrefix "%d.%d", (int)_ring->slotID, (int)_ring->endpointID);
+    sizeProp = OSDynamicCast(OSNumber, controller->getProperty(key));
+    if (sizeProp && (SetFragmentPolicy(kXHCIAsyncFragmentPolicyPinned, sizeProp->unsigned32BitValue()) == kIOReturnSuccess))
+    {
+        USBLog(3, "AppleXHCIAsyncEndpoint[%p]::ApplyFragmentSizeOverride - (%d, %d) pinned at %d bytes", this, _ring->slotID, _ring->endpointID, (int)_actualFragmentSize);
+    }
+}
+
+void 
+AppleXHCIAsyncEndpoint::PutTDAtHead(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, AppleXHCIAsyncTransferDescriptor *pTD, UInt32 *qCount)
+{
+    // Link TD into queue
+    if (*qStart == NULL)
+    {
+		// as the head of a new queue and new qEnd
+		*qEnd = *qStart = pTD;
+    }
+    else
+    {
+		// at the head of the old queue
+        pTD->_logicalNext = *qStart;
+    }
+    
+    // no matter what we are the new head
+    *qStart = pTD;
+	(*qCount)++;
+}
+
+void 
+AppleXHCIAsyncEndpoint::PutTD(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, AppleXHCIAsyncTransferDescriptor *pTD, UInt32 *qCount)
+{
+    // Link TD into queue
+    if (*qStart == NULL)
+    {
+		// as the head of a new queue
+		*qStart = pTD;
+    }
+    else
+    {
+		// at the tail of the old queue
+		(*qEnd)->_logicalNext = pTD;
+    }
+    
+    // no matter what we are the new tail
+    *qEnd = pTD;
+	(*qCount)++;
+}
+
+AppleXHCIAsyncTransferDescriptor * 
+AppleXHCIAsyncEndpoint::GetTD(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, UInt32 *qCount)
+{
+    AppleXHCIAsyncTransferDescriptor	*pTD;
+    
+    pTD = *qStart;
+    if (pTD)
+    {
+		if (pTD == *qEnd)
+			*qStart = *qEnd = NULL;
+		else
+			*qStart = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pTD->_logicalNext);
+        
+        if (*qCount == 0)
+        {
+		    USBLog(1,"AppleXHCIAsyncEndpoint[%p]::GetTD underflow",  this);
+		    print(5);
+        }
+        
+		(*qCount)--;
+    }
+    
+    return pTD;
+}
+
+void
+AppleXHCIAsyncEndpoint::PutTDonFreeQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    // The command is done with, so is its timeout
+    if (_timerWheel)
+    {
+        _timerWheel->Cancel(&pTD->timeoutTimer);
+    }
+    
+    PutTD(&freeQueue, &freeEnd, pTD, &onFreeQueue);
+    
+    // Don't let an endpoint which had a burst hang on to all of its ATDs
+    if (_tdPool && (onFreeQueue > kAsyncTDEndpointHighWater))
+    {
+        TrimFreeQueue(kAsyncTDEndpointLowWater);
+    }
+}
+
+void
+AppleXHCIAsyncEndpoint::TrimFreeQueue(UInt32 keep)
+{
+    while (onFreeQueue > keep)
+    {
+        AppleXHCIAsyncTransferDescriptor *freeATD = GetTD(&freeQueue, &freeEnd, &onFreeQueue);
+        
+        if (freeATD == NULL)
+            break;
+        
+        _tdPool->ReturnTD(freeATD);
+    }
+}
+
+AppleXHCIAsyncTransferDescriptor *
+AppleXHCIAsyncEndpoint::GetTDFromFreeQueue(bool allocate)
+{
+    if (freeQueue == NULL && allocate)
+    {
+        if (_tdPool)
+        {
+            // Refill from the controller wide pool, which only allocates when it is empty itself
+            _tdPool->FillEndpoint(this, kAsyncTDMagazineSize);
+        }
+        else
+        {
+            // Allocate TDs and add them to FreeQueue
+            for (int i=0; i < kFreeTDs; i++)
+            {
+                AppleXHCIAsyncTransferDescriptor *newATD = AppleXHCIAsyncTransferDescriptor::ForEndpoint(this);
+                if (newATD)
+                {
+                    PutTDonFreeQueue(newATD);
+                }
+            }
+        }
+    }
+
+    AppleXHCIAsyncTransferDescriptor *pFreeATD = GetTD(&freeQueue, &freeEnd, &onFreeQueue);
+    
+    if (pFreeATD)
+    {
+        pFreeATD->reinit();
+    }
+    
+    return pFreeATD;
+}
+
+void 
+AppleXHCIAsyncEndpoint::PutTDonReadyQueueAtHead(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    AppleXHCIAsyncStreamQueue *pStream = (pTD->streamID != 0) ? GetStreamQueue(pTD->streamID, false) : NULL;
+    
+    if (pStream == NULL)
+    {
+        PutTDAtHead(&readyQueue, &readyEnd, pTD, &onReadyQueue);
+        return;
+    }
+    
+    // ScheduleTDs couldn't put it on the ring, let this stream go first next time. If it is still on the round
+    // it gets back the credit GetTDFromReadyQueue took for the ATD. If taking the ATD emptied it, it left the
+    // round and its credit with it, so it comes back part way through its turn with just enough for this ATD
+    PutTDAtHead(&pStream->readyQueue, &pStream->readyEnd, pTD, &pStream->onReadyQueue);
+    onReadyQueue++;
+    if (pStream->onRound)
+    {
+        pStream->deficit       += pTD->transferSize;
+    }
+    else
+    {
+        pStream->deficit        = pTD->transferSize;
+        pStream->turnStarted    = true;
+    }
+    AddStreamToRound(pStream, true);
+}
+
+void
+AppleXHCIAsyncEndpoint::PutTDonReadyQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    AppleXHCIAsyncStreamQueue *pStream = (pTD->streamID != 0) ? GetStreamQueue(pTD->streamID, true) : NULL;
+    
+    if (pStream == NULL)
+    {
+        PutTD(&readyQueue, &readyEnd, pTD, &onReadyQueue);
+        return;
+    }
+    
+    PutTD(&pStream->readyQueue, &pStream->readyEnd, pTD, &pStream->onReadyQueue);
+    onReadyQueue++;
+    
+    if (pStream->onReadyQueue > pStream->maxReadyQueue)
+        pStream->maxReadyQueue = pStream->onReadyQueue;
+    
+    AddStreamToRound(pStream, false);
+}
 
 AppleXHCIAsyncTransferDescriptor *
 AppleXHCIAsyncEndpoint::GetTDFromReadyQueue()
 {
-    return GetTD(&readyQueue, &readyEnd, &onReadyQueue);
+    AppleXHCIAsyncStreamQueue           *pStream;
+    AppleXHCIAsyncTransferDescriptor    *pTD;
+    
+    // ATDs without a stream go first, in order
+    if (readyQueue != NULL)
+        return GetTD(&readyQueue, &readyEnd, &onReadyQueue);
+    
+    pStream = SelectReadyStream();
+    if (pStream == NULL)
+        return NULL;
+    
+    pTD = GetTDFromStreamReadyQueue(pStream);
+    
+    // A stream which has run out of ATDs leaves the round and its credit with it
+    if (pTD && pStream->onRound)
+        pStream->deficit -= pTD->transferSize;
+    
+    return pTD;
 }
 
 void
-AppleXHCIAsyncEndpoint::PutTDonDoneQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+AppleXHCIAsyncEndpoint::FindDoneEnd()
 {
 	if ((doneQueue != NULL) && (doneEnd == NULL))
 	{
@@ -374,7 +1167,7 @@ AppleXHCIAsyncEndpoint::PutTDonDoneQueue(AppleXHCIAsyncTransferDescriptor *pTD)
 		{
 			if (count++ > onDoneQueue)
 			{
-			    USBLog(1,"AppleXHCIAsyncEndpoint[%p]::PutTDonDoneQueue doneEnd not found",  this);
+			    USBLog(1,"AppleXHCIAsyncEndpoint[%p]::FindDoneEnd doneEnd not found",  this);
 			    print(5);
 				lastTD = NULL;
 				break; 
@@ -384,6 +1177,12 @@ AppleXHCIAsyncEndpoint::PutTDonDoneQueue(AppleXHCIAsyncTransferDescriptor *pTD)
 
 		doneEnd = lastTD;
 	}
+}
+
+void
+AppleXHCIAsyncEndpoint::PutTDonDoneQueue(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    FindDoneEnd();
 	
     PutTD(&doneQueue, &doneEnd, pTD, &onDoneQueue);
 }
@@ -394,77 +1193,248 @@ AppleXHCIAsyncEndpoint::GetTDFromDoneQueue()
     return GetTD(&doneQueue, &doneEnd, &onDoneQueue);
 }
 
+//
+// The activeQueue is shadowed by _activeIndexTable, indexed by the completionIndex that the 
+// transfer event will report, so that the event path does not have to walk the activeQueue.
+// The table is (re)sized lazily to follow _ring->transferRingSize.
+//
+void
+AppleXHCIAsyncEndpoint::RebuildActiveIndexTable()
+{
+    AppleXHCIAsyncTransferDescriptor *pActiveATD;
+    UInt32                           newSize = (_ring->transferRingSize > 0) ? (UInt32)_ring->transferRingSize : 0;
+    
+    if (_activeIndexTable)
+    {
+        IOFree(_activeIndexTable, _activeIndexTableSize * sizeof(AppleXHCIAsyncTransferDescriptor*));
+        _activeIndexTable       = NULL;
+        _activeIndexTableSize   = 0;
+    }
+    
+    if (newSize == 0)
+        return;
+    
+    _activeIndexTable = (AppleXHCIAsyncTransferDescriptor **)IOMalloc(newSize * sizeof(AppleXHCIAsyncTransferDescriptor*));
+    if (_activeIndexTable == NULL)
+    {
+        // Don't try again (or log again) until the ring changes size
+        _activeIndexTableFailedSize = newSize;
+        USBLog(1, "AppleXHCIAsyncEndpoint[%p]::RebuildActiveIndexTable - could not allocate %d entries, falling back to list walk", this, (int)newSize);
+        return;
+    }
+    
+    bzero(_activeIndexTable, newSize * sizeof(AppleXHCIAsyncTransferDescriptor*));
+    _activeIndexTableSize       = newSize;
+    _activeIndexTableFailedSize = 0;
+    
+    for (pActiveATD = activeQueue; pActiveATD != NULL; pActiveATD = (pActiveATD == activeEnd) ? NULL : pActiveATD->_logicalNext)
+    {
+        if ((pActiveATD->completionIndex >= 0) && ((UInt32)pActiveATD->completionIndex < _activeIndexTableSize))
+            _activeIndexTable[pActiveATD->completionIndex] = pActiveATD;
+    }
+}
+
 void
 AppleXHCIAsyncEndpoint::PutTDonActiveQueue(AppleXHCIAsyncTransferDescriptor *pTD)
 {
+    pTD->_activePrev    = (activeQueue != NULL) ? activeEnd : NULL;
+    pTD->scheduled      = true;
+    pTD->activeSequence = _activeSequence++;
+    
     PutTD(&activeQueue, &activeEnd, pTD, &onActiveQueue);
+    
+    if (!pTD->interruptThisTD)
+    {
+        AppleXHCIAsyncTransferDescriptor **qStart, **qEnd;
+        
+        GetRetireQueue(pTD->streamID, &qStart, &qEnd);
+        
+        pTD->_retirePrev = *qEnd;
+        pTD->_retireNext = NULL;
+        
+        if (*qEnd)
+            (*qEnd)->_retireNext = pTD;
+        else
+            *qStart = pTD;
+        
+        *qEnd = pTD;
+    }
+    
+    if (_activeIndexTableSize != (UInt32)_ring->transferRingSize)
+    {
+        // Also picks up pTD since it is already on the activeQueue. After a failed allocation the
+        // list walk is used until the ring is resized, rather than retrying on every enqueue
+        if (_activeIndexTableFailedSize != (UInt32)_ring->transferRingSize)
+            RebuildActiveIndexTable();
+    }
+    else if ((pTD->completionIndex >= 0) && ((UInt32)pTD->completionIndex < _activeIndexTableSize))
+    {
+        _activeIndexTable[pTD->completionIndex] = pTD;
+    }
 }
 
 AppleXHCIAsyncTransferDescriptor *
 AppleXHCIAsyncEndpoint::GetTDFromActiveQueue()
 {
-    return GetTD(&activeQueue, &activeEnd, &onActiveQueue);
+    AppleXHCIAsyncTransferDescriptor *pActiveATD = activeQueue;
+    
+    if (pActiveATD)
+    {
+        UnlinkTDFromActiveQueue(pActiveATD);
+    }
+    
+    return pActiveATD;
 }
 
-AppleXHCIAsyncTransferDescriptor * 
-AppleXHCIAsyncEndpoint::GetTDFromActiveQueueWithIndex(UInt16 completionIndex)
+//
+// Remove pTD from anywhere in the activeQueue in constant time
+//
+void
+AppleXHCIAsyncEndpoint::UnlinkTDFromActiveQueue(AppleXHCIAsyncTransferDescriptor *pTD)
 {
-    AppleXHCIAsyncTransferDescriptor *pActiveATD, *pPrevActiveATD;
-
-    bool    foundMatchingTD      = false;
+    AppleXHCIAsyncTransferDescriptor *pPrevActiveATD = pTD->_activePrev;
+    AppleXHCIAsyncTransferDescriptor *pNextActiveATD = (pTD == activeEnd) ? NULL : pTD->_logicalNext;
     
-    pPrevActiveATD = pActiveATD = activeQueue;
+    if (pPrevActiveATD)
+        pPrevActiveATD->_logicalNext = pNextActiveATD;
+    else
+        activeQueue = pNextActiveATD;
     
-    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex trbIndex: %d", this, completionIndex);
+    if (pNextActiveATD)
+        pNextActiveATD->_activePrev = pPrevActiveATD;
+    else
+        activeEnd = pPrevActiveATD;
     
-    while (pActiveATD != NULL)
+    if (_activeIndexTable && (pTD->completionIndex >= 0) && ((UInt32)pTD->completionIndex < _activeIndexTableSize))
+    {
+        if (_activeIndexTable[pTD->completionIndex] == pTD)
+            _activeIndexTable[pTD->completionIndex] = NULL;
+    }
+    
+    pTD->_activePrev  = NULL;
+    pTD->_logicalNext = NULL;
+    pTD->scheduled    = false;
+    
+    if (!pTD->interruptThisTD)
     {
-        USBLog(7, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex ATD: %p USBCommand: %p completionIndex: ( %d , %d )", 
-               this, pActiveATD, pActiveATD->activeCommand, (int)pActiveATD->completionIndex, (int)completionIndex);
+        AppleXHCIAsyncTransferDescriptor **qStart, **qEnd;
         
-        if (completionIndex == pActiveATD->completionIndex) 
-        {                        
-            if (pActiveATD == activeEnd)
-            {
-                // End
-                if (activeQueue == activeEnd)
-                {
-                    activeQueue = activeEnd = NULL;
-                }
-                else
-                {
-                    activeEnd = pPrevActiveATD;
-                }
-            }
-            else if (pActiveATD == activeQueue)
-            {
-                // Start
-                activeQueue = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pActiveATD->_logicalNext);
-            }
-            else
-            {
-                // Chain previous to the next and disconnect the active one.
-                pPrevActiveATD->_logicalNext = pActiveATD->_logicalNext;
-            }
+        GetRetireQueue(pTD->streamID, &qStart, &qEnd);
+        
+        if (pTD->_retirePrev)
+            pTD->_retirePrev->_retireNext = pTD->_retireNext;
+        else if (*qStart == pTD)
+            *qStart = pTD->_retireNext;
+        
+        if (pTD->_retireNext)
+            pTD->_retireNext->_retirePrev = pTD->_retirePrev;
+        else if (*qEnd == pTD)
+            *qEnd = pTD->_retirePrev;
+        
+        pTD->_retireNext = NULL;
+        pTD->_retirePrev = NULL;
+    }
+    
+    if (pTD->streamID != 0)
+    {
+        AppleXHCIAsyncStreamQueue *pStream = GetStreamQueue(pTD->streamID, false);
+        
+        if (pStream && pStream->inFlight)
+            pStream->inFlight--;
+        
+        if (pStream)
+            pStream->trbsInFlight = (pStream->trbsInFlight > pTD->trbCount) ? (pStream->trbsInFlight - pTD->trbCount) : 0;
+    }
+    
+    if (onActiveQueue == 0)
+    {
+        USBLog(1,"AppleXHCIAsyncEndpoint[%p]::UnlinkTDFromActiveQueue underflow",  this);
+        print(5);
+    }
+    else
+    {
+        onActiveQueue--;
+    }
+}
+
+//
+// With interrupt moderation, fragments which were scheduled without IOC do not generate a
+// transfer event when they complete successfully. The xHC processes a ring in order, so once
+// the event for pTD arrives, the ATDs ahead of it on the same stream without IOC are done with
+// no shortfall. Move them to the doneQueue ahead of pTD.
+//
+// Those ATDs are kept on their stream's retire queue in the order they went on the ring, so this
+// stops at the first one scheduled after pTD and only looks at the ATDs it retires, however many
+// of the other streams' ATDs are on the activeQueue in between.
+//
+void
+AppleXHCIAsyncEndpoint::RetireTDsBefore(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    AppleXHCIAsyncTransferDescriptor **qStart, **qEnd;
+    AppleXHCIAsyncTransferDescriptor *pActiveATD;
+    
+    GetRetireQueue(pTD->streamID, &qStart, &qEnd);
+    pActiveATD = *qStart;
+    
+    while ((pActiveATD != NULL) && (pActiveATD != pTD) && ((SInt32)(pActiveATD->activeSequence - pTD->activeSequence) < 0))
+    {
+        AppleXHCIAsyncTransferDescriptor *pNextActiveATD = pActiveATD->_retireNext;
+        
+        // Only a stream without a stream queue can share the endpoint's retire queue with others
+        if (pActiveATD->streamID == pTD->streamID)
+        {
+            USBLog(7, "AppleXHCIAsyncEndpoint[%p]::RetireTDsBefore - ATD: %p USBCommand: %p completionIndex: %d", this, pActiveATD, pActiveATD->activeCommand, (int)pActiveATD->completionIndex);
             
-            foundMatchingTD = true;
-            onActiveQueue--;
-            break;
+            UnlinkTDFromActiveQueue(pActiveATD);
+            pActiveATD->shortfall = 0;
+            PutTDonDoneQueue(pActiveATD);
         }
         
-        pPrevActiveATD  = pActiveATD;
-        // next item
-        pActiveATD      = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pActiveATD->_logicalNext);
+        pActiveATD = pNextActiveATD;
+    }
+}
+
+AppleXHCIAsyncTransferDescriptor * 
+AppleXHCIAsyncEndpoint::GetTDFromActiveQueueWithIndex(UInt16 completionIndex)
+{
+    AppleXHCIAsyncTransferDescriptor *pActiveATD = NULL;
+
+    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex trbIndex: %d", this, completionIndex);
+    
+    if (_activeIndexTable)
+    {
+        if (completionIndex < _activeIndexTableSize)
+        {
+            pActiveATD = _activeIndexTable[completionIndex];
+        }
+    }
+    else
+    {
+        // No index table (allocation failed), walk the activeQueue
+        for (pActiveATD = activeQueue; pActiveATD != NULL; pActiveATD = (pActiveATD == activeEnd) ? NULL : pActiveATD->_logicalNext)
+        {
+            if (completionIndex == (UInt16)pActiveATD->completionIndex)
+                break;
+        }
     }
     
-    if (!foundMatchingTD)
+    if (pActiveATD)
+    {
+        // Nothing is ahead of the head of the activeQueue
+        if (pActiveATD != activeQueue)
+        {
+            RetireTDsBefore(pActiveATD);
+        }
+        
+        UnlinkTDFromActiveQueue(pActiveATD);
+    }
+    else
     {
-        pActiveATD = NULL;
 	    USBLog(1, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex not found ActiveTD @index: %d", this, completionIndex);
         print(1);
     }
     
-    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex activeQueue %p pActiveATD %p foundMatchingTD: %d", this, activeQueue, pActiveATD, foundMatchingTD);
+    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::GetTDFromActiveQueueWithIndex activeQueue %p pActiveATD %p", this, activeQueue, pActiveATD);
     
     return pActiveATD;
 }
@@ -482,21 +1452,118 @@ AppleXHCIAsyncEndpoint::MoveAllTDsFromReadyQToDoneQ()
         }   
         
     } while (readyQueue != NULL);
+    
+    while (_streamRound != NULL)
+    {
+        AppleXHCIAsyncTransferDescriptor *pReadyATD = GetTDFromStreamReadyQueue(_streamRound);
+        
+        if (pReadyATD)
+        {
+            PutTDonDoneQueue(pReadyATD);
+        }
+    }
 }
 
+//
+// The ATDs keep their order, so the doneQueue still has every command's fragments ahead of its last one.
+// Only the per ATD state which says they are on the ring needs to be cleared, the links are moved as a whole.
+//
 void 
 AppleXHCIAsyncEndpoint::MoveAllTDsFromActiveQToDoneQ()
 {
-    do
+    AppleXHCIAsyncTransferDescriptor *pActiveATD;
+    
+    if (activeQueue == NULL)
+        return;
+    
+    for (pActiveATD = activeQueue; pActiveATD != NULL; pActiveATD = (pActiveATD == activeEnd) ? NULL : pActiveATD->_logicalNext)
+    {
+        pActiveATD->_activePrev = NULL;
+        pActiveATD->_retireNext = NULL;
+        pActiveATD->_retirePrev = NULL;
+        pActiveATD->scheduled   = false;
+        
+        if (pActiveATD->streamID != 0)
+        {
+            AppleXHCIAsyncStreamQueue *pStream = GetStreamQueue(pActiveATD->streamID, false);
+            
+            if (pStream)
+            {
+                pStream->inFlight       = 0;
+                pStream->trbsInFlight   = 0;
+                pStream->retireQueue    = NULL;
+                pStream->retireEnd      = NULL;
+            }
+        }
+    }
+    
+    if (_activeIndexTable)
+    {
+        bzero(_activeIndexTable, _activeIndexTableSize * sizeof(AppleXHCIAsyncTransferDescriptor*));
+    }
+    _retireQueue = NULL;
+    _retireEnd   = NULL;
+    
+    FindDoneEnd();
+    
+    if (doneQueue == NULL)
+        doneQueue = activeQueue;
+    else
+        doneEnd->_logicalNext = activeQueue;
+    
+    doneEnd         = activeEnd;
+    onDoneQueue     += onActiveQueue;
+    
+    activeQueue     = NULL;
+    activeEnd       = NULL;
+    onActiveQueue   = 0;
+}
+
+//
+// Moves pTD and the fragments of the same command after it to the doneQueue, for as long as they are on the ring,
+// and returns the last one moved (NULL if pTD was not on the ring). The rest of the command, if any, is at the head
+// of its ready queue (see MoveCommandFromReadyQToDoneQ).
+//
+AppleXHCIAsyncTransferDescriptor *
+AppleXHCIAsyncEndpoint::MoveCommandFromActiveQToDoneQ(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    IOUSBCommand                        *pUSBCommand = pTD ? pTD->activeCommand : NULL;
+    AppleXHCIAsyncTransferDescriptor    *pLastATD = NULL;
+    
+    while ((pTD != NULL) && pTD->scheduled && (pTD->activeCommand == pUSBCommand))
+    {
+        AppleXHCIAsyncTransferDescriptor *pNextATD = pTD->_commandNext;
+        
+        UnlinkTDFromActiveQueue(pTD);
+        PutTDonDoneQueue(pTD);
+        pLastATD = pTD;
+        
+        pTD = pNextATD;
+    }
+    
+    return pLastATD;
+}
+
+//
+// Only the command scheduled last from a ready queue can have been split between the ring and that queue,
+// so if pUSBCommand has fragments left on it they are at the head. pStream is NULL for readyQueue.
+//
+void
+AppleXHCIAsyncEndpoint::MoveCommandFromReadyQToDoneQ(IOUSBCommand *pUSBCommand, AppleXHCIAsyncStreamQueue *pStream)
+{
+    if (pStream == NULL)
     {
-        AppleXHCIAsyncTransferDescriptor *pActiveATD = GetTDFromActiveQueue();
-        
-        if (pActiveATD)
+        while ((readyQueue != NULL) && (readyQueue->activeCommand == pUSBCommand))
         {
-            PutTDonDoneQueue(pActiveATD);
-        }   
-
-    } while (activeQueue != NULL);
+            PutTDonDoneQueue(GetTD(&readyQueue, &readyEnd, &onReadyQueue));
+        }
+        return;
+    }
+    
+    while ((pStream->readyQueue != NULL) && (pStream->readyQueue->activeCommand == pUSBCommand))
+    {
+        PutTDonDoneQueue(GetTDFromStreamReadyQueue(pStream));
+    }
 }
 
 void 
@@ -530,6 +1597,23 @@ AppleXHCIAsyncEndpoint::MoveTDsFromReadyQToDoneQ(IOUSBCommand *pUSBCommand)
         }   
         
     } while (readyQueue != NULL);
+    
+    //
+    // On a streams endpoint the rest of the command is at the head of its stream's queue
+    //
+    AppleXHCIAsyncStreamQueue *pStream = _streamRound;
+    
+    while (pStream != NULL)
+    {
+        AppleXHCIAsyncStreamQueue *pNextStream = pStream->roundNext;
+        
+        while ((pStream->readyQueue != NULL) && ((pUSBCommand == NULL) || (pStream->readyQueue->activeCommand == pUSBCommand)))
+        {
+            PutTDonDoneQueue(GetTDFromStreamReadyQueue(pStream));
+        }
+        
+        pStream = pNextStream;
+    }
 }
 
 #if 0
@@ -562,21 +1646,489 @@ AppleXHCIAsyncEndpoint::FindNearByActiveTD(int deQueueIndex)
             foundNearByATD = true;
             break;
         }
-        
-        // next item
-        pActiveATD      = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pActiveATD->_logicalNext);
+        
+        // next item
+        pActiveATD      = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pActiveATD->_logicalNext);
+    }
+    
+    if (!foundNearByATD)
+    {
+        pActiveATD = NULL;
+    }
+    
+    return pActiveATD;
+}
+
+#endif
+
+#pragma mark •••••••• Stream Queues ••••••••
+
+AppleXHCIAsyncStreamQueue *
+AppleXHCIAsyncEndpoint::GetStreamQueue(UInt16 streamID, bool allocate)
+{
+    AppleXHCIAsyncStreamQueue   *pStream;
+    
+    if (streamID >= _streamQueuesSize)
+    {
+        AppleXHCIAsyncStreamQueue   **newTable;
+        UInt32                      newSize = _streamQueuesSize ? _streamQueuesSize : kAsyncMinStreamQueues;
+        
+        if (!allocate)
+            return NULL;
+        
+        while ((newSize <= streamID) && (newSize < kAsyncMaxStreamQueues))
+            newSize <<= 1;
+        
+        newTable = (AppleXHCIAsyncStreamQueue**)IOMalloc(newSize * sizeof(AppleXHCIAsyncStreamQueue*));
+        if (newTable == NULL)
+        {
+            USBLog(1, "AppleXHCIAsyncEndpoint[%p]::GetStreamQueue - could not grow the stream table to %d, stream %d will share readyQueue", this, (int)newSize, streamID);
+            return NULL;
+        }
+        
+        bzero(newTable, newSize * sizeof(AppleXHCIAsyncStreamQueue*));
+        
+        if (_streamQueues)
+        {
+            bcopy(_streamQueues, newTable, _streamQueuesSize * sizeof(AppleXHCIAsyncStreamQueue*));
+            IOFree(_streamQueues, _streamQueuesSize * sizeof(AppleXHCIAsyncStreamQueue*));
+        }
+        
+        _streamQueues       = newTable;
+        _streamQueuesSize   = newSize;
+    }
+    
+    pStream = _streamQueues[streamID];
+    
+    if ((pStream == NULL) && allocate)
+    {
+        pStream = (AppleXHCIAsyncStreamQueue*)IOMalloc(sizeof(AppleXHCIAsyncStreamQueue));
+        if (pStream == NULL)
+        {
+            USBLog(1, "AppleXHCIAsyncEndpoint[%p]::GetStreamQueue - could not allocate stream %d, it will share readyQueue", this, streamID);
+            return NULL;
+        }
+        
+        bzero(pStream, sizeof(AppleXHCIAsyncStreamQueue));
+        pStream->streamID           = streamID;
+        _streamQueues[streamID]     = pStream;
+    }
+    
+    return pStream;
+}
+
+//
+// The retire queue the ATDs of streamID go on while they are on the ring without IOC. A stream
+// which could not get a stream queue shares the endpoint's, as it shares readyQueue.
+//
+void
+AppleXHCIAsyncEndpoint::GetRetireQueue(UInt16 streamID, AppleXHCIAsyncTransferDescriptor ***qStart, AppleXHCIAsyncTransferDescriptor ***qEnd)
+{
+    AppleXHCIAsyncStreamQueue *pStream = (streamID != 0) ? GetStreamQueue(streamID, false) : NULL;
+    
+    if (pStream)
+    {
+        *qStart = &pStream->retireQueue;
+        *qEnd   = &pStream->retireEnd;
+    }
+    else
+    {
+        *qStart = &_retireQueue;
+        *qEnd   = &_retireEnd;
+    }
+}
+
+void
+AppleXHCIAsyncEndpoint::FreeStreamQueues()
+{
+    if (_streamQueues == NULL)
+        return;
+    
+    for (UInt32 i = 0; i < _streamQueuesSize; i++)
+    {
+        if (_streamQueues[i])
+        {
+            if (_streamQueues[i]->onReadyQueue)
+            {
+                USBLog(1, "AppleXHCIAsyncEndpoint[%p]::FreeStreamQueues - stream %d still has %d ATDs", this, (int)i, (int)_streamQueues[i]->onReadyQueue);
+            }
+            IOFree(_streamQueues[i], sizeof(AppleXHCIAsyncStreamQueue));
+        }
+    }
+    
+    IOFree(_streamQueues, _streamQueuesSize * sizeof(AppleXHCIAsyncStreamQueue*));
+    
+    _streamQueues       = NULL;
+    _streamQueuesSize   = 0;
+    _streamRound        = NULL;
+    _streamRoundEnd     = NULL;
+    _streamsOnRound     = 0;
+}
+
+void
+AppleXHCIAsyncEndpoint::AddStreamToRound(AppleXHCIAsyncStreamQueue *pStream, bool atHead)
+{
+    if (pStream->onRound)
+    {
+        if (!atHead || (_streamRound == pStream))
+            return;
+        
+        RemoveStreamFromRound(pStream);
+    }
+    
+    if (atHead)
+    {
+        pStream->roundPrev = NULL;
+        pStream->roundNext = _streamRound;
+        if (_streamRound)
+            _streamRound->roundPrev = pStream;
+        else
+            _streamRoundEnd = pStream;
+        _streamRound = pStream;
+    }
+    else
+    {
+        pStream->roundNext = NULL;
+        pStream->roundPrev = _streamRoundEnd;
+        if (_streamRoundEnd)
+            _streamRoundEnd->roundNext = pStream;
+        else
+            _streamRound = pStream;
+        _streamRoundEnd = pStream;
+    }
+    
+    pStream->onRound = true;
+    _streamsOnRound++;
+}
+
+void
+AppleXHCIAsyncEndpoint::RemoveStreamFromRound(AppleXHCIAsyncStreamQueue *pStream)
+{
+    if (!pStream->onRound)
+        return;
+    
+    if (pStream->roundPrev)
+        pStream->roundPrev->roundNext = pStream->roundNext;
+    else
+        _streamRound = pStream->roundNext;
+    
+    if (pStream->roundNext)
+        pStream->roundNext->roundPrev = pStream->roundPrev;
+    else
+        _streamRoundEnd = pStream->roundPrev;
+    
+    pStream->roundNext  = NULL;
+    pStream->roundPrev  = NULL;
+    pStream->onRound    = false;
+    _streamsOnRound--;
+}
+
+//
+// The stream at the head of the round has had its turn, move it to the end
+//
+void
+AppleXHCIAsyncEndpoint::RotateStreamRound()
+{
+    AppleXHCIAsyncStreamQueue *pStream = _streamRound;
+    
+    if (pStream == NULL)
+        return;
+    
+    pStream->turnStarted = false;
+    
+    if (pStream != _streamRoundEnd)
+    {
+        RemoveStreamFromRound(pStream);
+        AddStreamToRound(pStream, false);
+    }
+}
+
+//
+// The streams share one transfer ring, so the DRR credit alone does not stop a stream that got
+// in first from filling the ring and making the others wait for all of its ATDs to complete.
+// While more than one stream has ATDs ready each is held to an equal share of the ring's TRBs.
+// Returns 0 (no limit) when there is only one stream to serve.
+//
+UInt32
+AppleXHCIAsyncEndpoint::StreamRingShare()
+{
+    if ((_streamsOnRound < 2) || (_ring->transferRingSize < 2))
+        return 0;
+    
+    return (UInt32)(_ring->transferRingSize - 1) / _streamsOnRound;
+}
+
+//
+// Deficit round robin over the streams with ATDs ready. The stream at the head of the round gets
+// a fragment's worth of credit when its turn starts, and keeps the turn for as long as the credit
+// covers the ATD at the head of its queue. Streams at _streamMaxInFlight, or which would go over
+// their StreamRingShare, are passed over without credit. A stream with nothing in flight is never
+// held back by its share, so a share smaller than one ATD can't stall it. Returns NULL if every 
+// stream with ATDs ready is at its limit.
+//
+AppleXHCIAsyncStreamQueue *
+AppleXHCIAsyncEndpoint::SelectReadyStream()
+{
+    AppleXHCIAsyncStreamQueue   *pStream;
+    SInt32                      quantum = _actualFragmentSize ? _actualFragmentSize : kAsyncMaxFragmentSize;
+    UInt32                      ringShare = StreamRingShare();
+    UInt32                      blocked = 0;
+    
+    while ((pStream = _streamRound) != NULL)
+    {
+        if (((_streamMaxInFlight != kAsyncStreamUnlimitedInFlight) && (pStream->inFlight >= _streamMaxInFlight)) ||
+            ((ringShare != 0) && (pStream->trbsInFlight != 0) && ((pStream->trbsInFlight + pStream->readyQueue->maxTRBs) > ringShare)))
+        {
+            if (++blocked >= _streamsOnRound)
+                return NULL;
+            
+            RotateStreamRound();
+            continue;
+        }
+        
+        if (!pStream->turnStarted)
+        {
+            pStream->turnStarted = true;
+            pStream->deficit    += quantum;
+        }
+        
+        if (pStream->deficit >= (SInt32)pStream->readyQueue->transferSize)
+            return pStream;
+        
+        blocked = 0;
+        RotateStreamRound();
+    }
+    
+    return NULL;
+}
+
+AppleXHCIAsyncTransferDescriptor *
+AppleXHCIAsyncEndpoint::GetTDFromStreamReadyQueue(AppleXHCIAsyncStreamQueue *pStream)
+{
+    AppleXHCIAsyncTransferDescriptor *pTD = GetTD(&pStream->readyQueue, &pStream->readyEnd, &pStream->onReadyQueue);
+    
+    if (pTD)
+    {
+        if (onReadyQueue == 0)
+        {
+            USBLog(1,"AppleXHCIAsyncEndpoint[%p]::GetTDFromStreamReadyQueue underflow",  this);
+            print(5);
+        }
+        else
+        {
+            onReadyQueue--;
+        }
+    }
+    
+    if (pStream->readyQueue == NULL)
+    {
+        RemoveStreamFromRound(pStream);
+        pStream->deficit        = 0;
+        pStream->turnStarted    = false;
+    }
+    
+    return pTD;
+}
+
+//
+// The ATD GetTDFromReadyQueue would return next (this may move the round on)
+//
+AppleXHCIAsyncTransferDescriptor *
+AppleXHCIAsyncEndpoint::PeekTDOnReadyQueue()
+{
+    AppleXHCIAsyncStreamQueue *pStream;
+    
+    if (readyQueue != NULL)
+        return readyQueue;
+    
+    pStream = SelectReadyStream();
+    
+    return pStream ? pStream->readyQueue : NULL;
+}
+
+//
+// The oldest ATD waiting, without disturbing the round
+//
+AppleXHCIAsyncTransferDescriptor *
+AppleXHCIAsyncEndpoint::FirstTDOnReadyQueue()
+{
+    if (readyQueue != NULL)
+        return readyQueue;
+    
+    return _streamRound ? _streamRound->readyQueue : NULL;
+}
+
+IOReturn
+AppleXHCIAsyncEndpoint::SetStreamMaxInFlight(UInt32 maxInFlight)
+{
+    USBLog(5, "AppleXHCIAsyncEndpoint[%p]::SetStreamMaxInFlight - %d (was %d)", this, (int)maxInFlight, (int)_streamMaxInFlight);
+    
+    _streamMaxInFlight = maxInFlight;
+    
+    return kIOReturnSuccess;
+}
+
+void
+AppleXHCIAsyncEndpoint::PrintStreams(int level)
+{
+    if (_streamQueues == NULL)
+        return;
+    
+    USBLog(level, "AppleXHCIAsyncEndpoint[%p]::PrintStreams - streamsOnRound(%d) streamMaxInFlight(%d)", this, (int)_streamsOnRound, (int)_streamMaxInFlight);
+    
+    for (UInt32 i = 0; i < _streamQueuesSize; i++)
+    {
+        AppleXHCIAsyncStreamQueue *pStream = _streamQueues[i];
+        
+        if (pStream)
+        {
+            USBLog(level, "AppleXHCIAsyncEndpoint[%p]::PrintStreams - stream(%d) onReadyQueue(%d) maxReadyQueue(%d) inFlight(%d) trbsInFlight(%d) scheduled(%d) deficit(%d)", 
+                   this, (int)pStream->streamID, (int)pStream->onReadyQueue, (int)pStream->maxReadyQueue, (int)pStream->inFlight, (int)pStream->trbsInFlight, (int)pStream->scheduled, (int)pStream->deficit);
+        }
+    }
+}
+
+
+#pragma mark •••••••• Interrupt Moderation ••••••••
+
+IOReturn
+AppleXHCIAsyncEndpoint::SetInterruptModeration(UInt32 fragmentsPerInterrupt)
+{
+    if ((fragmentsPerInterrupt == 0) || (fragmentsPerInterrupt > kAsyncMaxFragmentsPerInterrupt))
+    {
+        USBLog(3, "AppleXHCIAsyncEndpoint[%p]::SetInterruptModeration - fragmentsPerInterrupt %d out of range", this, (int)fragmentsPerInterrupt);
+        return kIOReturnBadArgument;
+    }
+    
+    _fragmentsPerInterrupt = fragmentsPerInterrupt;
+    
+    return kIOReturnSuccess;
+}
+
+#pragma mark •••••••• Fragment Sizing ••••••••
+
+UInt32
+AppleXHCIAsyncEndpoint::RoundFragmentSize(UInt32 fragmentSize)
+{
+    UInt32  numberOfMaxBursts;
+    
+    if (_maxBurstPayload == 0)
+        return _actualFragmentSize;
+    
+    if (fragmentSize > kAsyncMaxAdaptiveFragmentSize)
+        fragmentSize = kAsyncMaxAdaptiveFragmentSize;
+    
+    // leave room on the ring for kAsyncFragmentsOnRing fragments, counting TRBs the way CreateTDs does for maxTRBs
+    if (_ring && (((_ring->transferRingSize - 1) / kAsyncFragmentsOnRing) > kAccountForAlignment))
+    {
+        UInt32  ringLimit = ((((_ring->transferRingSize - 1) / kAsyncFragmentsOnRing) - kAccountForAlignment) * PAGE_SIZE);
+        
+        if (fragmentSize > ringLimit)
+            fragmentSize = ringLimit;
+    }
+    
+    // always a whole number of bursts, and at least one
+    numberOfMaxBursts = fragmentSize / _maxBurstPayload;
+    if (numberOfMaxBursts == 0)
+        numberOfMaxBursts = 1;
+    
+    return numberOfMaxBursts * _maxBurstPayload;
+}
+
+IOReturn
+AppleXHCIAsyncEndpoint::SetFragmentPolicy(UInt32 policy, UInt32 fragmentSize)
+{
+    USBLog(5, "AppleXHCIAsyncEndpoint[%p]::SetFragmentPolicy - policy: %d fragmentSize: %d", this, (int)policy, (int)fragmentSize);
+    
+    switch (policy)
+    {
+        case kXHCIAsyncFragmentPolicyFixed:
+            _actualFragmentSize = _baseFragmentSize;
+            break;
+            
+        case kXHCIAsyncFragmentPolicyAdaptive:
+            // start from the fixed size and let the traffic move it
+            _actualFragmentSize = _baseFragmentSize;
+            _largeCommandRun    = 0;
+            _fragmentLatencyUS  = 0;
+            _lastFragmentDoneTime = 0;
+            _ringContended      = false;
+            break;
+            
+        case kXHCIAsyncFragmentPolicyPinned:
+            if (fragmentSize == 0)
+                return kIOReturnBadArgument;
+            
+            _actualFragmentSize = RoundFragmentSize(fragmentSize);
+            break;
+            
+        default:
+            return kIOReturnBadArgument;
+    }
+    
+    _fragmentPolicy = policy;
+    
+    return kIOReturnSuccess;
+}
+
+//
+//  Grow the fragment size while the endpoint sees a run of large (multi fragment) commands, up to
+//  what RoundFragmentSize allows, and shrink it when a small command has to wait behind large fragments
+//  or when the ring is contended and the device takes over kAsyncFragmentLatencyTargetUS per fragment.
+//
+void
+AppleXHCIAsyncEndpoint::AdaptFragmentSize(IOUSBCommand *pUSBCommand)
+{
+    IOByteCount     reqCount        = pUSBCommand->GetReqCount();
+    UInt32          newFragmentSize = _actualFragmentSize;
+    bool            shrink          = false;
+    
+    if (reqCount > _actualFragmentSize)
+    {
+        _largeCommandRun++;
+    }
+    else
+    {
+        // a small command queued behind large fragments will wait for all of them
+        if ((_largeCommandRun > 0) && ((onReadyQueue + onActiveQueue) > 0))
+        {
+            shrink = true;
+        }
+        _largeCommandRun = 0;
     }
     
-    if (!foundNearByATD)
+    if (_ringContended && (_fragmentLatencyUS > kAsyncFragmentLatencyTargetUS))
     {
-        pActiveATD = NULL;
+        shrink = true;
     }
     
-    return pActiveATD;
+    if (shrink)
+    {
+        newFragmentSize = _actualFragmentSize / 2;
+        
+        if (newFragmentSize < kAsyncMinFragmentSize)
+            newFragmentSize = kAsyncMinFragmentSize;
+    }
+    else if ((_largeCommandRun >= kAsyncFragmentGrowThreshold) && (_fragmentLatencyUS < (kAsyncFragmentLatencyTargetUS / 2)))
+    {
+        newFragmentSize  = _actualFragmentSize * 2;
+        _largeCommandRun = 0;
+    }
+    
+    _ringContended = false;
+    
+    newFragmentSize = RoundFragmentSize(newFragmentSize);
+    
+    if (newFragmentSize != _actualFragmentSize)
+    {
+        USBLog(6, "AppleXHCIAsyncEndpoint[%p]::AdaptFragmentSize - (%d, %d) fragment size %d -> %d fragmentLatencyUS: %d", 
+               this, _ring->slotID, _ring->endpointID, (int)_actualFragmentSize, (int)newFragmentSize, (int)_fragmentLatencyUS);
+        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPCreateTD, (uintptr_t)this, _actualFragmentSize, newFragmentSize, 3);
+        
+        _actualFragmentSize = newFragmentSize;
+    }
 }
 
-#endif
-
 #define PRINT_RINGS 0
 
 #pragma mark •••••••• ATDs Management ••••••••
@@ -587,6 +2139,8 @@ IOReturn
 AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32 offsC, UInt8 immediateTransferSize, UInt8 *immediateBuffer)
 {
     AppleXHCIAsyncTransferDescriptor    *pNewATD            = NULL;
+    AppleXHCIAsyncTransferDescriptor    *pPrevATD           = NULL;
+    AppleXHCIAsyncTransferDescriptor    *pFirstATD          = NULL;
     IOByteCount                         totalTransferSize   = command->GetReqCount();
     UInt32                              numberOfTDs         = kMinimumTDs;
     IOByteCount                         transferThisTD      = 0;
@@ -594,6 +2148,7 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
     bool                                immediateTransfer   = false;
     bool                                interruptNeeded     = false;
     IOByteCount                         fragmentSize        = 0, residual = 0, sizeQueued = 0, transferOffset = 0; 
+    UInt8                               promotedBuffer[kMaxImmediateTRBTransferSize];
 
     if (_aborting)
     {
@@ -609,7 +2164,26 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
     }
 #endif
     
-    if ((command->GetReqCount() > 0) && (!command->GetDMACommand() || !command->GetDMACommand()->getMemoryDescriptor()))
+    //
+    // IOUSBController::Write leaves small OUT payloads unmapped when we advertise kUSBControllerImmediateDataKey,
+    // pick the bytes up here so they go in the TRB
+    if ((immediateTransferSize > kMaxImmediateTRBTransferSize) && command->GetImmediateData() && (command->GetSelector() == WRITE))
+    {
+        IOMemoryDescriptor  *buffer     = command->GetBuffer();
+        IOByteCount         reqCount    = command->GetReqCount();
+        
+        if (!buffer || (reqCount > kMaxImmediateTRBTransferSize) || (buffer->readBytes(0, promotedBuffer, reqCount) != reqCount))
+        {
+            USBError(1, "AppleXHCIAsyncEndpoint::CreateTDs - could not read %d bytes of immediate data from %p", (int)reqCount, buffer);
+            return kIOReturnBadArgument;
+        }
+        
+        immediateTransferSize   = (UInt8)reqCount;
+        immediateBuffer         = promotedBuffer;
+        _immediatePromotions++;
+    }
+    
+    if ((command->GetReqCount() > 0) && (immediateTransferSize > kMaxImmediateTRBTransferSize) && (!command->GetDMACommand() || !command->GetDMACommand()->getMemoryDescriptor()))
     {
         USBError(1, "AppleXHCIAsyncEndpoint::CreateTDs - no DMA Command or missing memory descriptor");
         return kIOReturnBadArgument;
@@ -632,6 +2206,11 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
     }
     else
     {   
+        if (_fragmentPolicy == kXHCIAsyncFragmentPolicyAdaptive)
+        {
+            AdaptFragmentSize(command);
+        }
+        
         // kAsyncMaxFragmentSize per TD
         fragmentSize = _actualFragmentSize;  
         
@@ -669,10 +2248,11 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
         }
         
         //
-        // set IOC bit for each fragment
+        // set IOC bit for each fragment, or every _fragmentsPerInterrupt fragments when moderating
+        // the last fragment is always set below, and ScheduleTDs will add one if the ring is about to run dry
         if ((sizeQueued % _actualFragmentSize) == 0)
         {
-            interruptNeeded = true;
+            interruptNeeded = ((_fragmentsPerInterrupt <= 1) || ((numberOfTDs % _fragmentsPerInterrupt) == 0));
         }
 
         pNewATD->activeCommand      = command;
@@ -697,6 +2277,16 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
                                         this, pNewATD, (int)transferThisTD, (int)residual, (int)transferOffset);
         
         PutTDonReadyQueue(pNewATD);
+        
+        if (pPrevATD)
+        {
+            pPrevATD->_commandNext = pNewATD;
+        }
+        else
+        {
+            pFirstATD = pNewATD;
+        }
+        pPrevATD = pNewATD;
 
         // print(5);
         
@@ -747,6 +2337,28 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
     pNewATD->last            = true;
 	pNewATD->remAfterThisTD  = 0;
     
+    if (_telemetry)
+    {
+        _telemetry->_commands++;
+        _telemetry->_fragmentsCreated += numberOfTDs;
+        if (numberOfTDs > 1)
+            _telemetry->_fragmentedCommands++;
+        _telemetry->SampleQueues(this);
+    }
+    
+    if (_timerWheel)
+    {
+        for (pPrevATD = pFirstATD; pPrevATD != NULL; pPrevATD = pPrevATD->_commandNext)
+        {
+            pPrevATD->_commandLast = pNewATD;
+        }
+        
+        // The completion timeout runs from now, the no data timeout from when the command gets to the head of the queue
+        command->SetUIMScratch(kXHCI_ScratchFirstSeen, _timerWheel->CurrentFrame());
+        command->SetUIMScratch(kXHCI_ScratchTRTime, 0);
+        ArmTimeout(pNewATD);
+    }
+    
     USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPCreateTD, (uintptr_t)this, numberOfTDs, sizeQueued, (uintptr_t)0);
  
     USBLog(7, "-AppleXHCIAsyncEndpoint[%p]::CreateTDs", this);
@@ -759,16 +2371,24 @@ AppleXHCIAsyncEndpoint::CreateTDs(IOUSBCommand *command, UInt16 streamID, UInt32
 //  Schedule the ATDs from readyQueue to the ring and add them to the HW ring
 //  Called from ScavengeTDs & CreatTransfer
 //
+//  When _coalesceDoorbells is set, the doorbell is rung once for each run of ATDs with the 
+//  same streamID instead of once per ATD, since the xHC will consume every TRB up to the 
+//  enqueue pointer after a single doorbell write. ATDs from the stream queues are picked 
+//  round robin, so those streams are rung once each at the end instead.
+//
 void    
 AppleXHCIAsyncEndpoint::ScheduleTDs()
 {
     IOReturn      status = kIOReturnSuccess;
+    bool          doorbellPending = false;
+    UInt16        doorbellStreamID = 0;
+    AppleXHCIAsyncStreamQueue *doorbellStreams = NULL;
 
     USBLog(7, "+AppleXHCIAsyncEndpoint[%p]::ScheduleTDs", this);
     
     USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, _aborting, _ring->beingReturned, onReadyQueue );
 
-    if (readyQueue == NULL)
+    if (onReadyQueue == 0)
     {
 		USBLog(7, "AppleXHCIAsyncEndpoint[%p]::Schedule - readyQueue is empty slot:%d epID:%d", this, _ring->slotID, _ring->endpointID);
 		return;
@@ -788,21 +2408,70 @@ AppleXHCIAsyncEndpoint::ScheduleTDs()
     {
         bool	spaceAvailable;
         UInt16  spaceForTD;
+        UInt32  fitSize = _actualFragmentSize;
+        
+        AppleXHCIAsyncTransferDescriptor *pNextATD = PeekTDOnReadyQueue();
+        
+        if (pNextATD == NULL)
+        {
+            USBLog(7, "AppleXHCIAsyncEndpoint[%p]::Schedule - every stream with ATDs ready is at its in flight limit", this);
+            break;
+        }
+        
+        // ATDs chunked before an adaptive resize may be larger than the current fragment size
+        if (pNextATD->transferSize > fitSize)
+        {
+            fitSize = pNextATD->transferSize;
+        }
         
-        spaceAvailable = _xhciUIM->CanTDFragmentFit(_ring, _actualFragmentSize);
+        spaceAvailable = _xhciUIM->CanTDFragmentFit(_ring, fitSize);
         
         if (!spaceAvailable )
         {
+            _ringContended = true;
+            
+            if (_telemetry)
+                _telemetry->RingFull();
+
             USBLog(7, "AppleXHCIAsyncEndpoint[%p]::Schedule - no more space available on Xfer Ring", this);
             USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, spaceAvailable, onReadyQueue, 0);
             // print(5);
             break;
         }
+        
+        if (_telemetry)
+            _telemetry->RingAvailable();
                 
         AppleXHCIAsyncTransferDescriptor *pReadyATD = GetTDFromReadyQueue();
         
         if (pReadyATD)
         {            
+            AppleXHCIAsyncStreamQueue *pStream = (pReadyATD->streamID != 0) ? GetStreamQueue(pReadyATD->streamID, false) : NULL;
+            
+            if (!pReadyATD->interruptThisTD)
+            {
+                // If there is more to schedule and this is the last fragment which will fit for now, we 
+                // need its completion event to come back and refill the ring. Likewise for the last one
+                // its stream is allowed to have in flight.
+                if ((onReadyQueue != 0) && !_xhciUIM->CanTDFragmentFit(_ring, fitSize * 2))
+                {
+                    pReadyATD->interruptThisTD = true;
+                }
+                else if (pStream && (_streamMaxInFlight != kAsyncStreamUnlimitedInFlight) && ((pStream->inFlight + 1) >= _streamMaxInFlight))
+                {
+                    pReadyATD->interruptThisTD = true;
+                }
+                else if (pStream && (StreamRingShare() != 0) && ((pStream->trbsInFlight + (2 * pReadyATD->maxTRBs)) > StreamRingShare()))
+                {
+                    // Last one within the stream's share of the ring
+                    pReadyATD->interruptThisTD = true;
+                }
+                else
+                {
+                    _interruptsSaved++;
+                }
+            }
+            
             status = _xhciUIM->_createTransfer(pReadyATD, 
                                               false,
                                               pReadyATD->transferSize, 
@@ -829,6 +2498,25 @@ AppleXHCIAsyncEndpoint::ScheduleTDs()
                 
                 PutTDonActiveQueue(pReadyATD);
                 
+                // A deadline which went by while the command was waiting for an empty ring could not time it out (see TimeoutExpired)
+                if (_timerWheel && (activeQueue == pReadyATD) && (pReadyATD->_commandLast->timeoutTimer.slot == NULL))
+                    ArmTimeout(pReadyATD);
+                
+                if (_telemetry)
+                    _telemetry->_fragmentsScheduled++;
+                
+                if (pStream)
+                {
+                    pStream->inFlight++;
+                    pStream->trbsInFlight += pReadyATD->trbCount;
+                    pStream->scheduled++;
+                }
+                
+                if (_fragmentPolicy == kXHCIAsyncFragmentPolicyAdaptive)
+                {
+                    pReadyATD->doorbellTime = mach_absolute_time();
+                }
+                
                 USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, _ring->slotID, _ring->endpointID, 4);
                 USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, (uintptr_t)pReadyATD, (uintptr_t)pReadyATD->activeCommand, 5);
                 USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, pReadyATD->completionIndex, 0, 6);
@@ -837,14 +2525,66 @@ AppleXHCIAsyncEndpoint::ScheduleTDs()
                 {
                     _ring->needsDoorbell = true;
                 }
-                else
+                else if (!_coalesceDoorbells)
                 {
                     _xhciUIM->StartEndpoint(_ring->slotID, _ring->endpointID, pReadyATD->streamID);
                 }
+                else if (pStream)
+                {
+                    if (pStream->doorbellPending)
+                    {
+                        _doorbellsSaved++;
+                    }
+                    else
+                    {
+                        pStream->doorbellPending    = true;
+                        pStream->doorbellNext       = doorbellStreams;
+                        doorbellStreams             = pStream;
+                    }
+                }
+                else
+                {
+                    if (doorbellPending)
+                    {
+                        if (doorbellStreamID != pReadyATD->streamID)
+                        {
+                            // Different stream, ring for the TDs we have queued so far on the previous one
+                            _xhciUIM->StartEndpoint(_ring->slotID, _ring->endpointID, doorbellStreamID);
+                        }
+                        else
+                        {
+                            _doorbellsSaved++;
+                        }
+                    }
+                    
+                    doorbellPending  = true;
+                    doorbellStreamID = pReadyATD->streamID;
+                }
             }
         }
         
-    } while (readyQueue != NULL);
+    } while (onReadyQueue != 0);
+    
+    if (doorbellPending)
+    {
+        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, doorbellStreamID, _doorbellsSaved, 7);
+        _xhciUIM->StartEndpoint(_ring->slotID, _ring->endpointID, doorbellStreamID);
+    }
+    
+    while (doorbellStreams != NULL)
+    {
+        AppleXHCIAsyncStreamQueue *pStream = doorbellStreams;
+        
+        doorbellStreams             = pStream->doorbellNext;
+        pStream->doorbellNext       = NULL;
+        pStream->doorbellPending    = false;
+        
+        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, pStream->streamID, _doorbellsSaved, 7);
+        _xhciUIM->StartEndpoint(_ring->slotID, _ring->endpointID, pStream->streamID);
+    }
+    
+    if (_telemetry)
+        _telemetry->SampleQueues(this);
     
     USBTrace_End( kUSBTXHCI, kTPXHCIAsyncEPScheduleTD, (uintptr_t)this, (uintptr_t)onReadyQueue, (uintptr_t)onActiveQueue, (uintptr_t)onDoneQueue );
     
@@ -855,17 +2595,40 @@ AppleXHCIAsyncEndpoint::ScheduleTDs()
 
 
 
+//
+//  Point the ring of pTD's stream past pTD, once the ATDs up to it have been taken off the activeQueue
+//
+void
+AppleXHCIAsyncEndpoint::SetDequeueAfter(AppleXHCIAsyncTransferDescriptor *pTD)
+{
+    int     flushedDequeueIndex = pTD->completionIndex+1;
+    
+    if (flushedDequeueIndex >= (_ring->transferRingSize-1))
+    {
+        flushedDequeueIndex    =  0;
+    }
+    
+    if (_xhciUIM->_controllerAvailable)
+    {
+        USBTrace( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, pTD->streamID, flushedDequeueIndex, 0);
+        _xhciUIM->SetTRDQPtr(_ring->slotID, _ring->endpointID, pTD->streamID, flushedDequeueIndex);
+    }
+    else
+    {
+        USBTrace( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, (uintptr_t)_ring, 0, 1);
+        _ring->needsSetTRDQPtr = true;
+    }
+}
+
+
+
 void 
 AppleXHCIAsyncEndpoint::FlushTDsWithStatus(IOUSBCommandPtr pUSBCommand, IOReturn status)
 {
 #pragma unused(status)
     
-    int     currentIndex = 0;
-    int     flushedDequeueIndex = 0;
-    int     dequeueStreamID = 0;
-    bool    updateDequeueIndex = false;
-
     AppleXHCIAsyncTransferDescriptor *pActiveATD;
+    AppleXHCIAsyncTransferDescriptor *pLastATD = NULL;
     
     USBTrace_Start( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, (uintptr_t)pUSBCommand, (uintptr_t)status, 0);
     pActiveATD = activeQueue;
@@ -888,68 +2651,26 @@ AppleXHCIAsyncEndpoint::FlushTDsWithStatus(IOUSBCommandPtr pUSBCommand, IOReturn
     
     USBLog(7, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - pUSBCommand: %p", this, pUSBCommand);
     
-    while (pActiveATD != NULL)
+    //
+    // Only the command at the head of the ring can be flushed, moving the dequeue pointer past anything
+    // else would lose the TDs ahead of it
+    //
+    if (pActiveATD->activeCommand == pUSBCommand)
     {
-        USBLog(7, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - ATD: %p USBCommand: %p onActiveQueue: %d", this, pActiveATD, pActiveATD->activeCommand, (int)onActiveQueue);
-        
-        if (pUSBCommand == pActiveATD->activeCommand)
-        {
-            if (pActiveATD == activeEnd)
-            {
-                // End
-                activeQueue = activeEnd = NULL;
-            }
-            else if (pActiveATD == activeQueue)
-            {
-                // Start
-                activeQueue = OSDynamicCast(AppleXHCIAsyncTransferDescriptor, pActiveATD->_logicalNext);
-            }
-            
-            flushedDequeueIndex = pActiveATD->completionIndex+1;
-            dequeueStreamID     = pActiveATD->streamID;
-            updateDequeueIndex  = true;
-            
-            if (flushedDequeueIndex >= (_ring->transferRingSize-1))
-            {
-                flushedDequeueIndex    =  0;
-            }
-            
-            PutTDonDoneQueue(pActiveATD);
-            if(onActiveQueue == 0)
-            {
-                USBLog(5, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - activeQueue underflow", this);
-                print(5);
-            }
-            onActiveQueue--;
-            
-            // Start from head again
-            pActiveATD = activeQueue;
-            continue;
-        }
-        else
-        {
-            USBLog(5, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - TDs still scheduled for other USBCommands enqueueIndex %d flushedDequeueIndex %d", this, enqueueIndex, flushedDequeueIndex);
-            break;
-        }
+        pLastATD = MoveCommandFromActiveQToDoneQ(pActiveATD);
+    }
+    else
+    {
+        USBLog(5, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - TDs still scheduled for other USBCommands enqueueIndex %d", this, enqueueIndex);
     }
     
-    if (updateDequeueIndex)
+    if (pLastATD)
     {
-		if (_xhciUIM->_controllerAvailable)
-		{
-			USBTrace( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, dequeueStreamID, flushedDequeueIndex, 0);
-			_xhciUIM->SetTRDQPtr(_ring->slotID, _ring->endpointID, dequeueStreamID, flushedDequeueIndex);
-		}
-		
-		else
-		{
-			USBTrace( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, (uintptr_t)_ring, 0, 1);
-			_ring->needsSetTRDQPtr = true;
-		}
+        SetDequeueAfter(pLastATD);
     }
  
-    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - Done enqueueIndex %d flushedDequeueIndex %d", this, enqueueIndex, flushedDequeueIndex);
-    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, enqueueIndex, flushedDequeueIndex, 0);
+    USBLog(7, "AppleXHCIAsyncEndpoint[%p]::FlushTDsWithStatus - Done enqueueIndex %d flushedDequeueIndex %d", this, enqueueIndex, pLastATD ? (int)pLastATD->completionIndex+1 : 0);
+    USBTrace_End( kUSBTXHCI, kTPXHCIAsyncFlushTDsWithStatus, (uintptr_t)this, enqueueIndex, pLastATD ? pLastATD->completionIndex+1 : 0, 0);
 }
 
 
@@ -967,21 +2688,40 @@ AppleXHCIAsyncEndpoint::ScavengeTDs(AppleXHCIAsyncTransferDescriptor *pActiveATD
     USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScavengeTD, (uintptr_t)this, (uintptr_t)pActiveATD, (uintptr_t)pActiveATD->activeCommand, 0);
     USBTrace(kUSBTXHCI, kTPXHCIAsyncEPScavengeTD, (uintptr_t)this, complete, flush, 1);
 
-    // TDs are off the hardware
+    // TDs are off the hardware. On the timeout path pActiveATD is still the head of the activeQueue,
+    // take it off (and out of the index table) before it can be recycled
+    bool    timedOut = pActiveATD->scheduled;
+    
+    if (timedOut)
+    {
+        UnlinkTDFromActiveQueue(pActiveATD);
+    }
     PutTDonDoneQueue(pActiveATD);
     
     //
     // Walk readyQueue and activeQueue, move TDs matching pUSBCommand to doneQueue 
     if (flush)
     {
-        bool flushReadyQueue = true;
+        AppleXHCIAsyncTransferDescriptor *pLastATD;
         
         // Stop the endpoint
         _xhciUIM->QuiesceEndpoint(_ring->slotID, _ring->endpointID);
         
-        FlushTDsWithStatus(pActiveATD->activeCommand, status);
+        // pActiveATD is the oldest fragment of its command still around, so the rest follow it
+        pLastATD = MoveCommandFromActiveQToDoneQ(pActiveATD->_commandNext);
+        
+        // Move the dequeue pointer once, past the last fragment of the command that was taken off the ring. An error
+        // or short packet on the only fragment left needs no Set TR Dequeue, but a timed out one is still on the ring
+        if (pLastATD)
+        {
+            SetDequeueAfter(pLastATD);
+        }
+        else if (timedOut)
+        {
+            SetDequeueAfter(pActiveATD);
+        }
         
-        MoveTDsFromReadyQToDoneQ(pActiveATD->activeCommand);
+        MoveCommandFromReadyQToDoneQ(pActiveATD->activeCommand, (pActiveATD->streamID != 0) ? GetStreamQueue(pActiveATD->streamID, false) : NULL);
         
         // Start the endpoint
         if (activeQueue)
@@ -1027,6 +2767,8 @@ void
 AppleXHCIAsyncEndpoint::Complete(IOReturn status)
 {
     IOByteCount  shortfall = 0;
+    UInt64       firstDoorbellTime = 0;
+    UInt32       timedFragments = 0;
     
     do
     {
@@ -1034,6 +2776,20 @@ AppleXHCIAsyncEndpoint::Complete(IOReturn status)
         
         if (pDoneATD)
         {
+            if (pDoneATD->doorbellTime && (status == kIOReturnSuccess))
+            {
+                if ((timedFragments == 0) || (pDoneATD->doorbellTime < firstDoorbellTime))
+                    firstDoorbellTime = pDoneATD->doorbellTime;
+                timedFragments++;
+            }
+            pDoneATD->doorbellTime = 0;
+            
+            // A fragment came back, so the device is moving: restart the command's no data timeout (see ArmTimeout)
+            if (!pDoneATD->last)
+            {
+                pDoneATD->activeCommand->SetUIMScratch(kXHCI_ScratchTRTime, 0);
+            }
+            
             shortfall  = pDoneATD->activeCommand->GetUIMScratch(kXHCI_ScratchShortfall);
 
             shortfall += pDoneATD->shortfall;
@@ -1067,6 +2823,11 @@ AppleXHCIAsyncEndpoint::Complete(IOReturn status)
                     
                     
                     _xhciUIM->_UIMDiagnostics.totalBytes += done;
+                    if (_telemetry)
+                    {
+                        _telemetry->_bytes += done;
+                        _telemetry->_commandsCompleted++;
+                    }
                     if( (gUSBStackDebugFlags & kUSBEnableErrorLogMask) != 0)
                     {
                         // Only do per port count if error log mask is set
@@ -1087,6 +2848,36 @@ AppleXHCIAsyncEndpoint::Complete(IOReturn status)
 
     } while (doneQueue != NULL);
     
+    if (timedFragments)
+    {
+        // The ring runs its TDs in order, so the device only started on the first of these when its doorbell was
+        // rung or when the ATDs ahead of it completed, whichever was later. Time spent queued behind them on a
+        // deep ring is not the fragment's latency
+        UInt64  now = mach_absolute_time();
+        UInt64  started = (firstDoorbellTime > _lastFragmentDoneTime) ? firstDoorbellTime : _lastFragmentDoneTime;
+        UInt64  elapsedNS;
+        
+        absolutetime_to_nanoseconds(now - started, &elapsedNS);
+        
+        // running average of the time per fragment, weighting the new sample by 1/8
+        _fragmentLatencyUS = (UInt32)((((UInt64)_fragmentLatencyUS * 7) + ((elapsedNS / 1000) / timedFragments)) / 8);
+        _lastFragmentDoneTime = now;
+    }
+    
+    if (_telemetry)
+        _telemetry->SampleQueues(this);
+    
+    // The head of the queue has probably changed or moved on, which starts or restarts its no data timeout
+    if (_timerWheel)
+    {
+        AppleXHCIAsyncTransferDescriptor *pHeadATD = activeQueue ? activeQueue : FirstTDOnReadyQueue();
+        
+        if (pHeadATD)
+        {
+            ArmTimeout(pHeadATD);
+        }
+    }
+    
     return;
 }
 
@@ -1122,19 +2913,59 @@ AppleXHCIAsyncEndpoint::Abort()
     // Leave the new commands that are in the readyQueue intact.
     // They will be scheduled from Reinittransferring
     //
-    AppleXHCIAsyncTransferDescriptor *pActiveATD = activeQueue;
+    // One pass over the activeQueue finds the last ATD on each stream's ring, which is where that ring's
+    // dequeue pointer has to go, then the whole activeQueue is spliced onto the doneQueue. The command
+    // scheduled last from each ready queue may still have fragments at its head, and those go on the
+    // doneQueue behind the rest of their command.
+    //
+    AppleXHCIAsyncTransferDescriptor    *pActiveATD;
+    AppleXHCIAsyncTransferDescriptor    *pLastATD = NULL;       // the last ATD which came from readyQueue
+    AppleXHCIAsyncStreamQueue           *abortStreams = NULL;
     
-    while (pActiveATD != NULL)
+    for (pActiveATD = activeQueue; pActiveATD != NULL; pActiveATD = (pActiveATD == activeEnd) ? NULL : pActiveATD->_logicalNext)
     {
-        IOUSBCommandPtr  pUSBCommand = pActiveATD->activeCommand;
-
-        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPAbort,  (uintptr_t)this, (uintptr_t)pActiveATD, (uintptr_t)pActiveATD->activeCommand, (uint32_t)pActiveATD->completionIndex );
+        AppleXHCIAsyncStreamQueue *pStream = (pActiveATD->streamID != 0) ? GetStreamQueue(pActiveATD->streamID, false) : NULL;
         
-        FlushTDsWithStatus(pUSBCommand, status);
-
-        MoveTDsFromReadyQToDoneQ(pUSBCommand);
-
-        pActiveATD = activeQueue;
+        if (pStream)
+        {
+            if (pStream->abortLast == NULL)
+            {
+                pStream->abortNext  = abortStreams;
+                abortStreams        = pStream;
+            }
+            pStream->abortLast = pActiveATD;
+            continue;
+        }
+        
+        // streams without a queue of their own share readyQueue, but each still has its own ring
+        if (pLastATD && (pLastATD->streamID != pActiveATD->streamID))
+        {
+            SetDequeueAfter(pLastATD);
+        }
+        pLastATD = pActiveATD;
+    }
+    
+    MoveAllTDsFromActiveQToDoneQ();
+    
+    if (pLastATD)
+    {
+        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPAbort,  (uintptr_t)this, (uintptr_t)pLastATD, (uintptr_t)pLastATD->activeCommand, (uint32_t)pLastATD->completionIndex );
+        SetDequeueAfter(pLastATD);
+        MoveCommandFromReadyQToDoneQ(pLastATD->activeCommand, NULL);
+    }
+    
+    while (abortStreams != NULL)
+    {
+        AppleXHCIAsyncStreamQueue *pStream = abortStreams;
+        
+        abortStreams        = pStream->abortNext;
+        pLastATD            = pStream->abortLast;
+        pStream->abortNext  = NULL;
+        pStream->abortLast  = NULL;
+        
+        USBTrace(kUSBTXHCI, kTPXHCIAsyncEPAbort,  (uintptr_t)this, (uintptr_t)pLastATD, (uintptr_t)pLastATD->activeCommand, (uint32_t)pLastATD->completionIndex );
+        SetDequeueAfter(pLastATD);
+        MoveCommandFromReadyQToDoneQ(pLastATD->activeCommand, pStream);
     }
 	
     _ring->beingReturned = false;
@@ -1145,6 +2976,10 @@ AppleXHCIAsyncEndpoint::Abort()
     {
         Complete(status);
     }
+    else if (_telemetry)
+    {
+        _telemetry->SampleQueues(this);
+    }
 
     USBLog(7, "-AppleXHCIAsyncEndpoint[%p]::Abort", this);
 
@@ -1188,7 +3023,101 @@ AppleXHCIAsyncEndpoint::NeedTimeouts()
 }
 
 //
-// Walk the activeQueue and Update the timeout for the activeCommands in the TDs
+// Each command with a timeout has one timer, on its last ATD, armed for the earlier of its two deadlines:
+//
+// - completion     firstSeen + completionTimeout + 1, with firstSeen stamped by CreateTDs
+// - no data        TRTime + noDataTimeout + 1, only while the command is at the head of the queue. TRTime is
+//                  stamped here when the command gets to the head, and again whenever Complete takes one of its
+//                  fragments off the ring (which clears it) or UpdateTimeouts sees the Stop TRB move
+//
+// A command which is not at the head when its completion deadline goes by is left until it gets there, and
+// is timed out on the next ServiceTimeouts after that. If the wheel has not been serviced yet, firstSeen is 0
+// and the timer is armed for the next frame, so that UpdateTimeouts can stamp it.
+//
+void
+AppleXHCIAsyncEndpoint::ArmTimeout(AppleXHCIAsyncTransferDescriptor *pATD)
+{
+    AppleXHCIAsyncTransferDescriptor    *pHeadATD = activeQueue ? activeQueue : FirstTDOnReadyQueue();
+    IOUSBCommandPtr                     pUSBCommand = pATD->activeCommand;
+    UInt32                              completionTimeout = pUSBCommand->GetCompletionTimeout();
+    UInt32                              noDataTimeout = pUSBCommand->GetNoDataTimeout();
+    UInt32                              firstSeen = pUSBCommand->GetUIMScratch(kXHCI_ScratchFirstSeen);
+    UInt32                              curFrame;
+    UInt32                              deadline = 0;
+    bool                                haveDeadline = false;
+    
+    if ((_timerWheel == NULL) || (pATD->_commandLast == NULL))
+        return;
+    
+    curFrame    = _timerWheel->CurrentFrame();
+    pATD        = pATD->_commandLast;
+    
+    // Don't have no data timeouts for streams endpoints, or if the completion timeout would go first anyway (see NeedTimeouts)
+    if ((pATD->streamID != 0) || ((noDataTimeout >= completionTimeout) && (completionTimeout > 0)))
+        noDataTimeout = 0;
+    
+    if ((completionTimeout == 0) && (noDataTimeout == 0))
+    {
+        _timerWheel->Cancel(&pATD->timeoutTimer);
+        return;
+    }
+    
+    if (firstSeen == 0)
+    {
+        deadline        = curFrame + 1;
+        haveDeadline    = true;
+    }
+    else if (completionTimeout != 0)
+    {
+        deadline        = firstSeen + completionTimeout + 1;
+        haveDeadline    = true;
+    }
+    
+    if ((noDataTimeout != 0) && (firstSeen != 0) && pHeadATD && (pHeadATD->activeCommand == pUSBCommand))
+    {
+        UInt32  TRTime = pUSBCommand->GetUIMScratch(kXHCI_ScratchTRTime);
+        
+        if (TRTime == 0)
+        {
+            TRTime = curFrame;
+            pUSBCommand->SetUIMScratch(kXHCI_ScratchTRTime, TRTime);
+            pUSBCommand->SetUIMScratch(kXHCI_ScratchStopDeq, kAsyncStopDeqUntouched);
+        }
+        
+        if (!haveDeadline || ((SInt32)((TRTime + noDataTimeout + 1) - deadline) < 0))
+        {
+            deadline        = TRTime + noDataTimeout + 1;
+            haveDeadline    = true;
+        }
+    }
+    
+    if (haveDeadline)
+        _timerWheel->Arm(&pATD->timeoutTimer, deadline);
+    else
+        _timerWheel->Cancel(&pATD->timeoutTimer);
+}
+
+//
+// Only the command at the head of the activeQueue can be timed out, the others wait until they get there
+// (ArmTimeout is called again from Complete when they do)
+//
+void
+AppleXHCIAsyncEndpoint::TimeoutExpired(AppleXHCIAsyncTransferDescriptor *pATD, UInt32 curFrame)
+{
+    if ((activeQueue == NULL) || (activeQueue->activeCommand != pATD->activeCommand))
+    {
+        USBLog(6, "AppleXHCIAsyncEndpoint[%p]::TimeoutExpired - command %p is not at the head of the queue yet", this, pATD->activeCommand);
+        return;
+    }
+    
+    UpdateTimeouts(false, curFrame, false);
+}
+
+//
+// Update the timeout for the activeCommand at the head of the activeQueue
+//
+// With a timer wheel this is only called from TimeoutExpired, once the command's deadline has gone by, and
+// for abortAll. The command's timer is re-armed for its next deadline at the end if it is still there.
 // 
 void
 AppleXHCIAsyncEndpoint::UpdateTimeouts(bool abortAll, UInt32 curFrame, bool stopped) 
@@ -1299,6 +3228,13 @@ AppleXHCIAsyncEndpoint::UpdateTimeouts(bool abortAll, UInt32 curFrame, bool stop
                 bytesTransferred    = pUSBCommand->GetUIMScratch(kXHCI_ScratchBytes);
                 TRTime              = pUSBCommand->GetUIMScratch(kXHCI_ScratchTRTime);
                 
+                if ((UInt32)savedStopDeq == kAsyncStopDeqUntouched)
+                {
+                    // Nothing sampled since ArmTimeout started the clock, when the device had not got past the start of the oldest ATD
+                    savedStopDeq        = pActiveATD->trbIndex;
+                    bytesTransferred    = USBToHostLong(_ring->transferRing[pActiveATD->trbIndex].offs8) & kXHCITRB_TR_Len_Mask;
+                }
+                
                 if ((TRTime             == 0) ||        // Unintialised, first note of time
                     (savedStopDeq       != stopDeq) ||  // xHC is making progress since last time we checked
                     (bytesTransferred   != shortFall))  // Some data has transferred since last time we checked
@@ -1350,17 +3286,10 @@ AppleXHCIAsyncEndpoint::UpdateTimeouts(bool abortAll, UInt32 curFrame, bool stop
 
         }
         
-        int  timedOutDequeueIndex = pActiveATD->completionIndex+1;
-
-        if (timedOutDequeueIndex >= (_ring->transferRingSize-1))
-        {
-            timedOutDequeueIndex    =  0;
-        }
-        
         //
         // Endpoint will be stopped only if there is valid no data timeout.
         // For completion timeout make sure we stop the endpoint before
-        // we call SetTRDQPtr
+        // ScavengeTDs moves the dequeue pointer past the timed out command.
         // ScavengeTDs will restart the endpoint if there are activeTDs 
         // in the activeQueue so we should be safe.
         if (stopped == false)
@@ -1368,10 +3297,12 @@ AppleXHCIAsyncEndpoint::UpdateTimeouts(bool abortAll, UInt32 curFrame, bool stop
             _xhciUIM->QuiesceEndpoint(_ring->slotID, _ring->endpointID);
         }
         
-        _xhciUIM->SetTRDQPtr(_ring->slotID, _ring->endpointID, pActiveATD->streamID, timedOutDequeueIndex);
-        
         //  Scavenge the readyQueue -> doneQueue and complete
         //
         ScavengeTDs(pActiveATD, status, true, true);
     }
+    else if (pActiveATD && !abortAll)
+    {
+        ArmTimeout(pActiveATD);
+    }
 }
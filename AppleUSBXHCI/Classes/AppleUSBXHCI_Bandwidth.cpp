@@ -0,0 +1,451 @@
+/*
+ * Copyright © 2011-2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "AppleUSBXHCI_Bandwidth.h"
+
+
+#pragma mark •••••••• AppleXHCIBandwidthLedger ••••••••
+
+OSDefineMetaClassAndStructors(AppleXHCIBandwidthLedger, OSObject)
+
+//
+// There is one ledger per controller. It is kept as a property of the controller so that the
+// code which configures endpoints can find it without the controller having to know about it,
+// and so that the headroom on each port shows up in the IORegistry (see serialize).
+//
+AppleXHCIBandwidthLedger *
+AppleXHCIBandwidthLedger::ForController(AppleUSBXHCI *controller)
+{
+	AppleXHCIBandwidthLedger *me = OSDynamicCast(AppleXHCIBandwidthLedger, controller->getProperty(kAppleXHCIBandwidthLedgerKey));
+	
+	if (me)
+	{
+		me->retain();
+		return me;
+	}
+	
+	// OSObject allocations are zero filled, so there are no ports and no TTs to start with
+	me = OSTypeAlloc(AppleXHCIBandwidthLedger);
+	
+	if (!me || !me->init())
+	{
+		if (me)
+			me->release();
+		return NULL;
+	}
+	
+	controller->setProperty(kAppleXHCIBandwidthLedgerKey, me);
+	
+	return me;
+}
+
+
+
+void
+AppleXHCIBandwidthLedger::free(void)
+{
+	int		i;
+	
+	for (i=0; i < kBandwidthLedgerMaxRootPorts; i++)
+	{
+		if (_ports[i])
+		{
+			FreeCosts(&_ports[i]->costs);
+			IOFree(_ports[i], sizeof(AppleXHCIBandwidthPort));
+			_ports[i] = NULL;
+		}
+	}
+	
+	for (i=0; i < kBandwidthLedgerTTHashSize; i++)
+		FreeCosts(&_tts[i].costs);
+	
+	OSObject::free();
+}
+
+
+
+bool
+AppleXHCIBandwidthLedger::NeedsTT(const AppleXHCIBandwidthRequest *request)
+{
+	return BandwidthModelNeedsTT(request);
+}
+
+
+
+// ReserveCost
+// Makes room for one more cost in the endpoint's interval, so that Admit finds out it is out of memory before it
+// has charged anything rather than half way through
+bool
+AppleXHCIBandwidthLedger::ReserveCost(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost)
+{
+	UInt32		count = budget->interval[cost->interval].endpoints;
+	UInt32		capacity = costs->capacity[cost->interval];
+	UInt16 *	blocks;
+	
+	if (count < capacity)
+		return true;
+	
+	capacity = capacity ? (2 * capacity) : 8;
+	blocks = (UInt16 *)IOMalloc(capacity * sizeof(UInt16));
+	if (!blocks)
+		return false;
+	
+	if (costs->blocks[cost->interval])
+	{
+		bcopy(costs->blocks[cost->interval], blocks, count * sizeof(UInt16));
+		IOFree(costs->blocks[cost->interval], costs->capacity[cost->interval] * sizeof(UInt16));
+	}
+	costs->blocks[cost->interval] = blocks;
+	costs->capacity[cost->interval] = capacity;
+	
+	return true;
+}
+
+
+
+// Charge
+// ReserveCost must have been called first
+void
+AppleXHCIBandwidthLedger::Charge(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost)
+{
+	UInt16 *	blocks = costs->blocks[cost->interval];
+	UInt32		i = budget->interval[cost->interval].endpoints;
+	
+	// keep them in order, so the largest is always the last one
+	for (; (i > 0) && (blocks[i-1] > cost->blocks); i--)
+		blocks[i] = blocks[i-1];
+	blocks[i] = cost->blocks;
+	
+	BandwidthModelCharge(budget, cost);
+}
+
+
+
+// Credit
+// Returns false, and leaves the budget alone, if nothing in the endpoint's interval costs what the endpoint does
+bool
+AppleXHCIBandwidthLedger::Credit(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost)
+{
+	UInt16 *	blocks = costs->blocks[cost->interval];
+	UInt32		count = budget->interval[cost->interval].endpoints;
+	UInt32		low = 0;
+	UInt32		high = count;
+	UInt32		middle;
+	
+	while (low < high)
+	{
+		middle = (low + high) / 2;
+		if (blocks[middle] < cost->blocks)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	
+	if ((low == count) || (blocks[low] != cost->blocks))
+	{
+		USBLog(1, "AppleXHCIBandwidthLedger::Credit - none of the %d endpoints in interval %d cost %d blocks", (int)count, (int)cost->interval, (int)cost->blocks);
+		return false;
+	}
+	
+	count--;
+	if (low < count)
+		bcopy(&blocks[low + 1], &blocks[low], (count - low) * sizeof(UInt16));
+	
+	return BandwidthModelCredit(budget, cost, count ? blocks[count - 1] : 0);
+}
+
+
+
+void
+AppleXHCIBandwidthLedger::FreeCosts(AppleXHCIBandwidthCosts *costs)
+{
+	int		i;
+	
+	for (i=0; i < kMaxIntervalTableSize; i++)
+	{
+		if (costs->blocks[i])
+		{
+			IOFree(costs->blocks[i], costs->capacity[i] * sizeof(UInt16));
+			costs->blocks[i] = NULL;
+			costs->capacity[i] = 0;
+		}
+	}
+}
+
+
+
+AppleXHCIBandwidthPort *
+AppleXHCIBandwidthLedger::GetPort(UInt8 rhPort, UInt8 rhPortSpeed, bool create)
+{
+	AppleXHCIBandwidthPort *	port = _ports[rhPort];
+	
+	if (port)
+	{
+		UInt32		limit = BandwidthModelLimitInBlocks(rhPortSpeed);
+		
+		if ((port->budget.endpoints == 0) && (port->budget.limitBlocks != limit))
+		{
+			// the port has been reused at a different speed
+			bzero(&port->budget, sizeof(port->budget));
+			port->budget.limitBlocks = limit;
+		}
+		return port;
+	}
+	
+	if (!create)
+		return NULL;
+	
+	port = (AppleXHCIBandwidthPort *)IOMalloc(sizeof(AppleXHCIBandwidthPort));
+	if (port)
+	{
+		bzero(port, sizeof(AppleXHCIBandwidthPort));
+		port->budget.limitBlocks = BandwidthModelLimitInBlocks(rhPortSpeed);
+		_ports[rhPort] = port;
+	}
+	return port;
+}
+
+
+
+// GetTT
+// Open addressed hash on the hub slot and port (the port is 0 for a single TT hub, since all ports share the TT).
+// Entries are never marked unused again, so a probe can always stop at the first unused entry. A TT whose endpoints
+// have all been released stays where it is, so that it is found again if the hub comes back, but when a new TT is
+// needed and the probe passed an empty one, the empty one is given to the new TT rather than using up another entry.
+AppleXHCIBandwidthTT *
+AppleXHCIBandwidthLedger::GetTT(const AppleXHCIBandwidthRequest *request, bool create)
+{
+	UInt8					hubPort = request->mtt ? request->hubPort : 0;
+	UInt32					hash = ((UInt32)request->hubSlot * 31) + hubPort;
+	AppleXHCIBandwidthTT *	empty = NULL;
+	AppleXHCIBandwidthTT *	tt = NULL;
+	UInt32					i;
+	
+	for (i=0; i < kBandwidthLedgerTTHashSize; i++)
+	{
+		tt = &_tts[(hash + i) & (kBandwidthLedgerTTHashSize - 1)];
+		
+		if (!tt->inUse)
+			break;
+		
+		if ((tt->hubSlot == request->hubSlot) && (tt->hubPort == hubPort))
+			return tt;
+		
+		if (!empty && (tt->budget.endpoints == 0))
+			empty = tt;
+		
+		tt = NULL;
+	}
+	
+	if (!create)
+		return NULL;
+	
+	if (empty)
+		tt = empty;
+	
+	if (!tt)
+		return NULL;									// every entry holds a TT with endpoints on it
+	
+	// the costs are kept, with their capacity, for the next TT to use the entry
+	tt->inUse = true;
+	tt->rhPort = request->rhPort;
+	tt->hubSlot = request->hubSlot;
+	tt->hubPort = hubPort;
+	bzero(&tt->budget, sizeof(tt->budget));
+	tt->budget.limitBlocks = kLSFSBandwidthLimitInBlocks;
+	return tt;
+}
+
+
+
+IOReturn
+AppleXHCIBandwidthLedger::Admit(const AppleXHCIBandwidthRequest *request)
+{
+	AppleXHCIBandwidthPort *	port;
+	AppleXHCIBandwidthTT *		tt = NULL;
+	AppleXHCIBandwidthCost		portCost;
+	AppleXHCIBandwidthCost		ttCost;
+	
+	BandwidthModelPortCost(request, &portCost);
+	
+	port = GetPort(request->rhPort, request->rhPortSpeed, true);
+	if (!port)
+		return kIOReturnNoMemory;
+	
+	if (!BandwidthModelFits(&port->budget, &portCost))
+	{
+		USBLog(3, "AppleXHCIBandwidthLedger[%p]::Admit - port %d would need %d of its %d blocks", this, (int)request->rhPort, (int)BandwidthModelBlocksWith(&port->budget, &portCost), (int)port->budget.limitBlocks);
+		_rejected++;
+		return kIOReturnNoBandwidth;
+	}
+	
+	if (NeedsTT(request))
+	{
+		tt = GetTT(request, true);
+		if (!tt)
+		{
+			USBLog(1, "AppleXHCIBandwidthLedger[%p]::Admit - no room for the TT on hub slot %d port %d", this, (int)request->hubSlot, (int)request->hubPort);
+			_rejected++;
+			return kIOReturnNoResources;
+		}
+		
+		BandwidthModelTTCost(request, &ttCost);
+		if (!BandwidthModelFits(&tt->budget, &ttCost))
+		{
+			USBLog(3, "AppleXHCIBandwidthLedger[%p]::Admit - TT on hub slot %d port %d would need %d of its %d blocks", this, (int)request->hubSlot, (int)tt->hubPort, (int)BandwidthModelBlocksWith(&tt->budget, &ttCost), (int)tt->budget.limitBlocks);
+			_rejected++;
+			return kIOReturnNoBandwidth;
+		}
+		
+		if (!ReserveCost(&tt->budget, &tt->costs, &ttCost))
+			return kIOReturnNoMemory;
+	}
+	
+	if (!ReserveCost(&port->budget, &port->costs, &portCost))
+		return kIOReturnNoMemory;
+	
+	if (tt)
+		Charge(&tt->budget, &tt->costs, &ttCost);
+	
+	Charge(&port->budget, &port->costs, &portCost);
+	_admitted++;
+	
+	return kIOReturnSuccess;
+}
+
+
+
+// Release
+// An endpoint which can't have been admitted - there is nothing on its port or TT which costs what it does in its
+// interval - leaves that budget alone
+void
+AppleXHCIBandwidthLedger::Release(const AppleXHCIBandwidthRequest *request)
+{
+	AppleXHCIBandwidthPort *	port = GetPort(request->rhPort, request->rhPortSpeed, false);
+	AppleXHCIBandwidthCost		cost;
+	bool						balanced = true;
+	
+	if (!port)
+	{
+		USBLog(1, "AppleXHCIBandwidthLedger[%p]::Release - nothing was admitted on port %d", this, (int)request->rhPort);
+		return;
+	}
+	
+	BandwidthModelPortCost(request, &cost);
+	if (!Credit(&port->budget, &port->costs, &cost))
+		balanced = false;
+	
+	if (NeedsTT(request))
+	{
+		AppleXHCIBandwidthTT *		tt = GetTT(request, false);
+		
+		if (tt)
+		{
+			BandwidthModelTTCost(request, &cost);
+			if (!Credit(&tt->budget, &tt->costs, &cost))
+				balanced = false;
+		}
+		else
+		{
+			USBLog(1, "AppleXHCIBandwidthLedger[%p]::Release - nothing was admitted on the TT on hub slot %d port %d", this, (int)request->hubSlot, (int)request->hubPort);
+			balanced = false;
+		}
+	}
+	
+	if (balanced && _admitted)
+		_admitted--;
+}
+
+
+
+void
+AppleXHCIBandwidthLedger::UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const
+{
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber(value, 32);
+	if (!number)
+		return;
+	
+	dictionary->setObject(name, number);
+	number->release();
+}
+
+
+
+void
+AppleXHCIBandwidthLedger::SerializeBudget(OSDictionary *dictionary, const AppleXHCIBandwidthBudget *budget, const char *name) const
+{
+	OSDictionary *	budgetDictionary = OSDictionary::withCapacity(4);
+	
+	if (!budgetDictionary)
+		return;
+	
+	UpdateNumberEntry(budgetDictionary, budget->limitBlocks, "Limit");
+	UpdateNumberEntry(budgetDictionary, budget->totalBlocks, "Used");
+	UpdateNumberEntry(budgetDictionary, budget->limitBlocks - budget->totalBlocks, "Headroom");
+	UpdateNumberEntry(budgetDictionary, budget->endpoints, "Endpoints");
+	
+	dictionary->setObject(name, budgetDictionary);
+	budgetDictionary->release();
+}
+
+
+
+bool
+AppleXHCIBandwidthLedger::serialize(OSSerialize *s) const
+{
+	OSDictionary *	dictionary = OSDictionary::withCapacity(4);
+	char			name[32];
+	bool			ok;
+	int				i;
+	
+	if (!dictionary)
+		return false;
+	
+	UpdateNumberEntry(dictionary, _admitted, "Admitted");
+	UpdateNumberEntry(dictionary, _rejected, "Rejected");
+	
+	for (i=0; i < kBandwidthLedgerMaxRootPorts; i++)
+	{
+		if (_ports[i] && _ports[i]->budget.endpoints)
+		{
+			snprintf(name, sizeof(name), "Port %d", i);
+			SerializeBudget(dictionary, &_ports[i]->budget, name);
+		}
+	}
+	
+	for (i=0; i < kBandwidthLedgerTTHashSize; i++)
+	{
+		if (_tts[i].inUse && _tts[i].budget.endpoints)
+		{
+			snprintf(name, sizeof(name), "TT %d.%d", (int)_tts[i].hubSlot, (int)_tts[i].hubPort);
+			SerializeBudget(dictionary, &_tts[i].budget, name);
+		}
+	}
+	
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
+}
@@ -24,6 +24,8 @@
 #include "AppleUSBXHCI_IsocQueues.h"
 #include "AppleUSBXHCIUIM.h"
 
+#include <libkern/OSAtomic.h>
+
 
 #ifndef XHCI_USE_KPRINTF 
 #define XHCI_USE_KPRINTF 0
@@ -57,6 +59,75 @@ void kprintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
 	(typeof(*(registerPtr)))fTempReg)
 #endif
 
+#undef super
+#define super OSObject
+// -----------------------------------------------------------------
+//		AppleXHCIIsocStreamCounters
+// -----------------------------------------------------------------
+OSDefineMetaClassAndStructors(AppleXHCIIsocStreamCounters, OSObject)
+
+AppleXHCIIsocStreamCounters *
+AppleXHCIIsocStreamCounters::ForController(AppleUSBXHCI *controller)
+{
+	AppleXHCIIsocStreamCounters *me = OSDynamicCast(AppleXHCIIsocStreamCounters, controller->getProperty(kAppleXHCIIsocStreamCountersKey));
+	
+	if (me)
+	{
+		me->retain();
+		return me;
+	}
+	
+	me = OSTypeAlloc(AppleXHCIIsocStreamCounters);
+	if (!me || !me->init())
+	{
+		if (me)
+			me->release();
+		return NULL;
+	}
+	
+	// the registry reads the counts through serialize() from now on, so they are never published again
+	controller->setProperty(kAppleXHCIIsocStreamCountersKey, me);
+	return me;
+}
+
+
+
+bool
+AppleXHCIIsocStreamCounters::serialize(OSSerialize *s) const
+{
+	OSDictionary *	dictionary;
+	bool			ok;
+	
+	dictionary = OSDictionary::withCapacity(2);
+	if (!dictionary)
+		return false;
+	
+	UpdateNumberEntry(dictionary, _underruns, "Underruns (OUT)");
+	UpdateNumberEntry(dictionary, _overruns, "Overruns (IN)");
+	
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
+}
+
+
+
+void
+AppleXHCIIsocStreamCounters::UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const
+{
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber(value, 32);
+	if (!number)
+		return;
+	
+	dictionary->setObject(name, number);
+	number->release();
+}
+
+
+
 #undef super
 #define super IOUSBControllerIsochListElement
 // -----------------------------------------------------------------
@@ -207,40 +278,166 @@ AppleXHCIIsochTransferDescriptor::MungeXHCIIsochTDStatus(UInt32 status, UInt16 *
 
 
 
+// BuildEventIndexMap
+// Called by AddIsocFramesToSchedule once all of the TRBs for this TD are on the ring. Records where each frame's TRBs
+// start and end, as an offset from the first TRB of the TD, so that FrameForEventIndex can do a binary search at
+// interrupt time instead of a scan. The offsets are taken modulo the ring size so a TD which wraps still sorts.
+void
+AppleXHCIIsochTransferDescriptor::BuildEventIndexMap(UInt32 ringSize)
+{
+	int			i;
+	
+	eventMapFrames = 0;
+	if ((ringSize == 0) || (_framesInTD == 0) || (_framesInTD > kMaxTransfersPerFrame))
+		return;
+	
+	for (i=0; i < _framesInTD; i++)
+	{
+		frameStartOffset[i] = (trbIndex[i] + ringSize - trbIndex[0]) % ringSize;
+		frameEndOffset[i] = frameStartOffset[i] + numTRBs[i];
+	}
+	eventMapRingSize = ringSize;
+	eventMapFrames = _framesInTD;
+}
+
+
+
 int
 AppleXHCIIsochTransferDescriptor::FrameForEventIndex(UInt32 eventIndex)
 {
-	int i;
+	UInt32		offset;
+	int			lo, hi;
 	
-	for (i=0; i < _framesInTD; i++)
+	if (eventMapFrames == 0)
 	{
-		if ((eventIndex >= trbIndex[i] && (eventIndex < (trbIndex[i] + numTRBs[i]))))
-			return i;
+		int i;
+		
+		// the map has not been built (the TD never made it to the ring), so fall back on the scan
+		for (i=0; i < _framesInTD; i++)
+		{
+			if ((eventIndex >= trbIndex[i] && (eventIndex < (trbIndex[i] + numTRBs[i]))))
+				return i;
+		}
+		return -1;
 	}
-			
+	
+	offset = (eventIndex + eventMapRingSize - trbIndex[0]) % eventMapRingSize;
+	
+	// find the last frame which starts at or before offset
+	lo = 0;
+	hi = eventMapFrames - 1;
+	while (lo < hi)
+	{
+		int		mid = (lo + hi + 1) >> 1;
+		
+		if (frameStartOffset[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	
+	if ((offset >= frameStartOffset[lo]) && (offset < frameEndOffset[lo]))
+		return lo;
+	
 	return -1;
 }
 
 
 
+// SetFramesComplete
+// Marks frames [first, last) which have not been updated yet as having transferred everything they asked for, or as
+// not sent. The low latency test is made once for the whole run so the frame stores are back to back.
+void
+AppleXHCIIsochTransferDescriptor::SetFramesComplete(int first, int last, IOReturn frStatus, AbsoluteTime timeStamp)
+{
+	int		i;
+	
+	if (_lowLatency)
+	{
+		IOUSBLowLatencyIsocFrame *		pLLFrames = &((IOUSBLowLatencyIsocFrame*)_pFrames)[_frameIndex];
+		
+		for (i=first; i < last; i++)
+		{
+			if (statusUpdated[i])
+				continue;
+			pLLFrames[i].frActCount = (frStatus == kIOReturnSuccess) ? pLLFrames[i].frReqCount : 0;
+			pLLFrames[i].frStatus = frStatus;
+			pLLFrames[i].frTimeStamp = timeStamp;
+			statusUpdated[i] = true;
+		}
+	}
+	else
+	{
+		IOUSBIsocFrame *				pFrames = &_pFrames[_frameIndex];
+		
+		for (i=first; i < last; i++)
+		{
+			if (statusUpdated[i])
+				continue;
+			pFrames[i].frActCount = (frStatus == kIOReturnSuccess) ? pFrames[i].frReqCount : 0;
+			pFrames[i].frStatus = frStatus;
+			statusUpdated[i] = true;
+		}
+	}
+	
+	if (last > firstPendingFrame)
+		firstPendingFrame = last;
+}
+
+
+
 IOReturn
 AppleXHCIIsochTransferDescriptor::UpdateFrameList(AbsoluteTime timeStamp)
 {
-#pragma unused(timeStamp)
+	return UpdateFrameListWithEvents(&eventTRB, 1, timeStamp);
+}
+
+
+
+// UpdateFrameListWithEvents
+// Processes every event the filter interrupt routine found for this TD in one pass of the event ring. The events are
+// in ring order, so each one only has to look at the frames between the previous event's frame and its own.
+// The return value is that of the last event which did not return kIOReturnSuccess, or kIOReturnSuccess.
+// The filter interrupt routine in AppleUSBXHCIUIM.cpp (not part of this tree) still calls UpdateFrameList once per
+// event, so for now this only ever sees the one eventTRB. It needs to collect a TD's events before it can batch them.
+IOReturn
+AppleXHCIIsochTransferDescriptor::UpdateFrameListWithEvents(const TRB *events, UInt32 numEvents, AbsoluteTime timeStamp)
+{
+	IOReturn		ret = kIOReturnSuccess;
+	UInt32			i;
 	
-	UInt64							phys = ((UInt64)USBToHostLong(eventTRB.offs0)) + (((UInt64)USBToHostLong(eventTRB.offs4)) << 32);
+	//			WARNING
+	//
+	//	UpdateFrameListWithEvents is called a primary interrupt time, so logging (except kprintf) is prohibited
+	//
+	
+	completionTime = *(UInt64*)&timeStamp;
+	for (i=0; i < numEvents; i++)
+	{
+		IOReturn	eventRet = UpdateFrameListForEvent(&events[i], timeStamp);
+		
+		if ((eventRet != kIOReturnSuccess) || (ret == kIOReturnSuccess))
+			ret = eventRet;
+		
+		if (firstPendingFrame >= _framesInTD)
+			break;
+	}
+	
+	USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameListWithEvents - %d events - returning(%08x)\n", this, (int)numEvents, ret);
+	return ret;
+}
+
+
+
+IOReturn
+AppleXHCIIsochTransferDescriptor::UpdateFrameListForEvent(const TRB *event, AbsoluteTime timeStamp)
+{
+	UInt64							phys = ((UInt64)USBToHostLong(event->offs0)) + (((UInt64)USBToHostLong(event->offs4)) << 32);
 	XHCIRing *						ringX = ((AppleXHCIIsochEndpoint *)_pEndpoint)->ring;
 	IOUSBLowLatencyIsocFrame *		pLLFrames = (IOUSBLowLatencyIsocFrame*)_pFrames;
 	int								eventIndex;
 	int								frameForEvent;
-	UInt32							myTDIndex;
 	IOReturn						ret = kIOReturnSuccess;
-	int								i;
-	
-	//			WARNING
-	//
-	//	UpdateFrameList is called a primary interrupt time, so logging (except kprintf) is prohibited
-	//
 	
     ret = _pEndpoint->accumulatedStatus;
 	
@@ -248,26 +445,7 @@ AppleXHCIIsochTransferDescriptor::UpdateFrameList(AbsoluteTime timeStamp)
 	{
 		// this will be the case if we did not actually send this request to the hardware (i.e. it came in too late)
 		USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList - no real event - erroring out pFrames\n", this);
-		for (i=0; i < _framesInTD; i++)
-		{
-			if (!statusUpdated[i])
-			{
-				int		frIdx = _frameIndex + i;
-
-				if (_lowLatency)
-				{
-					pLLFrames[frIdx].frActCount = 0;
-					pLLFrames[frIdx].frStatus = kIOUSBNotSent1Err;
-					pLLFrames[frIdx].frTimeStamp = timeStamp;
-				}
-				else
-				{
-					_pFrames[frIdx].frActCount = 0;
-					_pFrames[frIdx].frStatus = kIOUSBNotSent1Err;
-				}
-				statusUpdated[i] = true;
-			}
-		}
+		SetFramesComplete(firstPendingFrame, _framesInTD, kIOUSBNotSent1Err, timeStamp);
 		return kIOUSBNotSent1Err;
 	}
 	
@@ -284,144 +462,97 @@ AppleXHCIIsochTransferDescriptor::UpdateFrameList(AbsoluteTime timeStamp)
 	if (frameForEvent < 0)
 	{
 		USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList - event does not match any of my frames - assuming all is good!\n", this);
-		for (i=0; i < _framesInTD; i++)
+		SetFramesComplete(firstPendingFrame, _framesInTD, kIOReturnSuccess, timeStamp);
+		return kIOReturnSuccess;
+	}
+	
+	if (frameForEvent < firstPendingFrame)
+	{
+		// this will allow us to process only one TRB per microframe
+		USBLogKP(5, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList - the event frame(%d) has already been updated - done\n", this, frameForEvent);
+		return ret;
+	}
+	
+	// the event occured after (possibly long after) the earlier frames were processed This is a good thing in that
+	// it means that there were no errors on those frames (for OUT or IN) and that there were no short packets (for IN)
+	// so we can update all of the status to good and the actCount to the ReqCount
+	USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList frames(%d-%d) long ago - making all statii good!\n", this, firstPendingFrame, frameForEvent);
+	SetFramesComplete(firstPendingFrame, frameForEvent, kIOReturnSuccess, timeStamp);
+	
+	if (!statusUpdated[frameForEvent])
+	{
+		// the event points to a TRB within my TD
+		int								frIdx = _frameIndex + frameForEvent;
+		UInt8							condCode = 	((USBToHostLong(event->offs8) & kXHCITRB_CC_Mask) >> kXHCITRB_CC_Shift);
+		UInt32							eventLen = USBToHostLong(event->offs8) & kXHCITRB_TR_Len_Mask;
+		IOReturn						frStatus = MungeXHCIIsochTDStatus(condCode, NULL, 0, 0);
+		bool							edEvent = ((USBToHostLong(event->offsC) & kXHCITRB_ED) != 0);
+
+		if (condCode == kXHCITRB_CC_XActErr)
 		{
-			if (!statusUpdated[i])
+			AppleXHCIIsochEndpoint *		pEP = (AppleXHCIIsochEndpoint *)_pEndpoint;
+			
+			if ((pEP->direction == kUSBIn) && (pEP->speed == kUSBDeviceSpeedHigh) && (pEP->mult > 1))
 			{
-				int		frIdx = _frameIndex + i;
+				// similar to what EHCI does here.. Some old High Speed Isoc devices issue the incorrect PID when they are doing High Bandwidth
+				// transfers (more than 1 IN token in the same uFrame). They still transfer good data, so we need to try to figure out
+				// exactly how many of those data actually came in
 				
-				if (_lowLatency)
-				{
-					pLLFrames[frIdx].frActCount = pLLFrames[frIdx].frReqCount;
-					pLLFrames[frIdx].frStatus = kIOReturnSuccess;
-					pLLFrames[frIdx].frTimeStamp = timeStamp;
-				}
-				else
-				{
-					_pFrames[frIdx].frActCount = _pFrames[frIdx].frReqCount;
-					_pFrames[frIdx].frStatus = kIOReturnSuccess;
-				}
-				statusUpdated[i] = true;
-				USBLogKP(7, "XHCI Isoc frame (%d.%d) frIdx(%d) FULL\n", (int)((UInt32)_frameNumber & 0x7ff), i, (int)_frameIndex);
+				// if this is a multi-TRB TD, then we will skip any event which comes in which is not an edEvent. Otherwise, we will just
+				// fake the status and process things normally
+				
+				if ((numTRBs[frameForEvent] > 1) && !edEvent)
+					return ret;									// we know that the ed is coming
+				
+				frStatus = kIOReturnUnderrun;					// change this to an underrun so we keep going
 			}
+			
 		}
-		return kIOReturnSuccess;
-	}
-	
-	for (i=0; i < _framesInTD; i++)
-	{
-		if (statusUpdated[i])
+		if (frStatus != kIOReturnSuccess)
 		{
-            // this will allow us to process only one TRB per microframe
-			continue;
+			if (frStatus != kIOReturnUnderrun)
+			{
+				USBLogKP(2, "XHCI: bad frStatus condCode(%d) eventLen(%d) edEvent(%s) frame (%d.%d) numTRBs(%d) [%08x] [%08x] [%08x] [%08x]\n", (int)condCode, (int)eventLen, edEvent ? "true" : "false", (int)((UInt32)_frameNumber & 0x7ff), frameForEvent, (int)numTRBs[frameForEvent], (int)event->offs0, (int)event->offs4, (int)event->offs8, (int)event->offsC);
+				_pEndpoint->accumulatedStatus = frStatus;
+				eventLen = 0;                                  // this will be an XACT err, e.g. (munged to NotSent)
+				edEvent = true;                                // just to make sure that that we interpret the length correctly - it will use the eventLen
+			}
+			else if (_pEndpoint->accumulatedStatus == kIOReturnSuccess)
+			{
+				_pEndpoint->accumulatedStatus = kIOReturnUnderrun;
+			}
+			ret = frStatus;
 		}
-		
-		if (i > frameForEvent)
+			
+		USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList frame(%d.%d) frIdx(%d) frStatus(%08x) eventLen(%d) edEvent(%s)\n", this, (int)((UInt32)_frameNumber & 0x7ff), frameForEvent, frIdx, (int)frStatus, (int)eventLen, edEvent ? "true" : "false");
+		if (_lowLatency)
 		{
-			USBLogKP(5, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList - the event frame(%d) in earlier than this frame(%d) - done\n", this, frameForEvent, i);
-			break;
+			// the event will either point to an Event TRB that we put into the list or to an Isoch TRB
+			// if the former, then edEvent will be T and the length will be the total length transferred
+			// otherwise evenLength will be the bytes remaining from the Isoch TD
+			
+			if (edEvent)
+				pLLFrames[frIdx].frActCount = eventLen;
+			else
+				pLLFrames[frIdx].frActCount = pLLFrames[frIdx].frReqCount - eventLen;
+				
+			pLLFrames[frIdx].frStatus = frStatus;
+			pLLFrames[frIdx].frTimeStamp = timeStamp;						// update time stamp last always
+			USBLogKP(7, "XHCI Isoc(LL) frame (%d.%d) frIdx (%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), frameForEvent, (int)frIdx, pLLFrames[frIdx].frReqCount, pLLFrames[frIdx].frActCount, pLLFrames[frIdx].frStatus);
 		}
 		else
 		{
-			
-			int			frIdx = _frameIndex + i;
-
-			if (i == frameForEvent)
-			{
-				// the event points to a TRB within my TD
-				UInt8							condCode = 	((USBToHostLong(eventTRB.offs8) & kXHCITRB_CC_Mask) >> kXHCITRB_CC_Shift);
-				UInt32							eventLen = USBToHostLong(eventTRB.offs8) & kXHCITRB_TR_Len_Mask;
-				IOReturn						frStatus = MungeXHCIIsochTDStatus(condCode, NULL, 0, 0);
-				bool							edEvent = ((USBToHostLong(eventTRB.offsC) & kXHCITRB_ED) != 0);
-
-				if (condCode == kXHCITRB_CC_XActErr)
-				{
-					AppleXHCIIsochEndpoint *		pEP = (AppleXHCIIsochEndpoint *)_pEndpoint;
-					
-					if ((pEP->direction == kUSBIn) && (pEP->speed == kUSBDeviceSpeedHigh) && (pEP->mult > 1))
-					{
-						// similar to what EHCI does here.. Some old High Speed Isoc devices issue the incorrect PID when they are doing High Bandwidth
-						// transfers (more than 1 IN token in the same uFrame). They still transfer good data, so we need to try to figure out
-						// exactly how many of those data actually came in
-						
-						// if this is a multi-TRB TD, then we will skip any event which comes in which is not an edEvent. Otherwise, we will just
-						// fake the status and process things normally
-						
-						if ((numTRBs[i] > 1) && !edEvent)
-							break;										// break out of the for loop since we know that the ed is coming
-						
-						frStatus = kIOReturnUnderrun;					// change this to an underrun so we keep going
-					}
-					
-				}
-				if (frStatus != kIOReturnSuccess)
-				{
-					if (frStatus != kIOReturnUnderrun)
-					{
-						USBLogKP(2, "XHCI: bad frStatus condCode(%d) eventLen(%d) edEvent(%s) frame (%d.%d) numTRBs(%d) [%08x] [%08x] [%08x] [%08x]\n", (int)condCode, (int)eventLen, edEvent ? "true" : "false", (int)((UInt32)_frameNumber & 0x7ff), i, (int)numTRBs[i], (int)eventTRB.offs0, (int)eventTRB.offs4, (int)eventTRB.offs8, (int)eventTRB.offsC);
-						_pEndpoint->accumulatedStatus = frStatus;
-                        eventLen = 0;                                  // this will be an XACT err, e.g. (munged to NotSent)
-                        edEvent = true;                                // just to make sure that that we interpret the length correctly - it will use the eventLen
-					}
-					else if (_pEndpoint->accumulatedStatus == kIOReturnSuccess)
-					{
-						_pEndpoint->accumulatedStatus = kIOReturnUnderrun;
-					}
-					ret = frStatus;
-				}
-					
-				USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList frame(%d.%d) frIdx(%d) frStatus(%08x) eventLen(%d) edEvent(%s)\n", this, (int)((UInt32)_frameNumber & 0x7ff), i, frIdx, (int)frStatus, (int)eventLen, edEvent ? "true" : "false");
-				if (_lowLatency)
-				{
-					// the eventTRB will either point to an Event TRB that we put into the list or to an Isoch TRB
-					// if the former, then edEvent will be T and the length will be the total length transferred
-					// otherwise evenLength will be the bytes remaining from the Isoch TD
-					
-					if (edEvent)
-						pLLFrames[frIdx].frActCount = eventLen;
-					else
-						pLLFrames[frIdx].frActCount = pLLFrames[frIdx].frReqCount - eventLen;
-						
-					pLLFrames[frIdx].frStatus = frStatus;
-					pLLFrames[frIdx].frTimeStamp = timeStamp;						// update time stamp last always
-					USBLogKP(7, "XHCI Isoc(LL) frame (%d.%d) frIdx (%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), i, (int)frIdx, pLLFrames[frIdx].frReqCount, pLLFrames[frIdx].frActCount, pLLFrames[frIdx].frStatus);
-				}
-				else
-				{
-					if (edEvent)
-						_pFrames[frIdx].frActCount = eventLen;
-					else
-						_pFrames[frIdx].frActCount = _pFrames[frIdx].frReqCount - eventLen;
-					
-					_pFrames[frIdx].frStatus = frStatus;
-					
-					USBLogKP(7, "XHCI Isoc frame (%d.%d) frIdx(%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), i, (int)frIdx, _pFrames[frIdx].frReqCount, _pFrames[frIdx].frActCount, _pFrames[frIdx].frStatus);
-				}
-				statusUpdated[i] = true;
-				break;						// break out of the for loop as we won't be able to process any more frames in this TD
-			}
+			if (edEvent)
+				_pFrames[frIdx].frActCount = eventLen;
 			else
-			{
-				USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList frIdx(%d) long ago - making all statii good!\n", this, frIdx);
-				// the event occured after (possibly long after) my TD was processed This is a good thing in that
-				// it means that there were no errors on my TD (for OUT or IN) and that there were no short packets (for IN)
-				// so we can update all of the status to good and the actCount to the ReqCount
-				if (_lowLatency)
-				{
-					pLLFrames[frIdx].frActCount = pLLFrames[frIdx].frReqCount;
-					pLLFrames[frIdx].frStatus = kIOReturnSuccess;
-					pLLFrames[frIdx].frTimeStamp = timeStamp;
-					USBLogKP(7, "XHCI Isoc(LL) frame (%d.%d) frIdx (%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), i, (int)frIdx, pLLFrames[frIdx].frReqCount, pLLFrames[frIdx].frActCount, pLLFrames[frIdx].frStatus);
-				}
-				else
-				{
-					_pFrames[frIdx].frActCount = _pFrames[frIdx].frReqCount;
-					_pFrames[frIdx].frStatus = kIOReturnSuccess;					
-					USBLogKP(7, "XHCI Isoc frame (%d.%d) frIdx(%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), i, (int)frIdx, _pFrames[frIdx].frReqCount, _pFrames[frIdx].frActCount, _pFrames[frIdx].frStatus);
-				}
-				statusUpdated[i] = true;
-			}
+				_pFrames[frIdx].frActCount = _pFrames[frIdx].frReqCount - eventLen;
+			
+			_pFrames[frIdx].frStatus = frStatus;
+			
+			USBLogKP(7, "XHCI Isoc frame (%d.%d) frIdx(%d) frReq(%d) frAct(%d) frStat(%x)\n", (int)((UInt32)_frameNumber & 0x7ff), frameForEvent, (int)frIdx, _pFrames[frIdx].frReqCount, _pFrames[frIdx].frActCount, _pFrames[frIdx].frStatus);
 		}
+		statusUpdated[frameForEvent] = true;
+		firstPendingFrame = frameForEvent + 1;
 	}
 
 	USBLogKP(7, "AppleXHCIIsochTransferDescriptor[%p]::UpdateFrameList - returning(%08x)\n", this, ret);
@@ -460,7 +591,6 @@ OSDefineMetaClassAndStructors(AppleXHCIIsochEndpoint, IOUSBControllerIsochEndpoi
 bool
 AppleXHCIIsochEndpoint::init()
 {
-	int			i;
 	bool		ret;
 	
 	ret = super::init();
@@ -468,12 +598,27 @@ AppleXHCIIsochEndpoint::init()
 	{
 		wdhLock = IOSimpleLockAlloc();
 		if (!wdhLock)
+			return false;
+		tdSlots = NULL;
+		numTDSlots = 0;
+		lookaheadMS = kIsocRingSizeinMS;
+		doneRing = NULL;
+		doneRingSize = 0;
+		doneRingProducer = 0;
+		doneRingConsumer = 0;
+		doneRingFull = 0;
+		streamStarted = false;
+		streamStartLeadFrames = 0;
+		streamUnderruns = 0;
+		streamOverruns = 0;
+		streamCounters = NULL;
+		keepAwayFrames = 0;
+		keepAwayHeadroomSamples = 0;
+		lastScheduleLatencyUS = 0;
+		maxScheduleLatencyUS = 0;
+		diagnostics = NULL;
+		if (SizeTDSlots(kNumTDSlots) != kIOReturnSuccess)
 			ret = false;
-		else
-		{
-			inSlot = kNumTDSlots+1;
-			outSlot = kNumTDSlots + 1;
-		}
 	}
 	return ret;
 }
@@ -484,6 +629,26 @@ void
 AppleXHCIIsochEndpoint::free(void)
 {
 	USBLog(7, "AppleXHCIIsochEndpoint[%p]::free", this);
+	if (tdSlots)
+	{
+		IOFree(tdSlots, numTDSlots * sizeof(AppleXHCIIsochTransferDescriptor*));
+		tdSlots = NULL;
+	}
+	if (doneRing)
+	{
+		IOFree((void*)doneRing, doneRingSize * sizeof(AppleXHCIIsochTransferDescriptor*));
+		doneRing = NULL;
+	}
+	if (diagnostics)
+	{
+		diagnostics->release();
+		diagnostics = NULL;
+	}
+	if (streamCounters)
+	{
+		streamCounters->release();
+		streamCounters = NULL;
+	}
 	if (wdhLock)
 	{
 		IOSimpleLockFree(wdhLock);
@@ -494,6 +659,200 @@ AppleXHCIIsochEndpoint::free(void)
 
 
 
+// TDSlotsForLookahead
+// How big the slot table needs to be to hold lookaheadMS worth of TDs, as a power of 2 between kNumTDSlots and
+// kMaxTDSlots. One slot is always left empty so that a full table can be told apart from an empty one. There is no
+// point in having more slots than the transfer ring has room for TDs, and maxTRBs already takes the number of
+// transactions per frame into account.
+UInt32
+AppleXHCIIsochEndpoint::TDSlotsForLookahead(UInt32 lookaheadMS, UInt32 ringSize)
+{
+	UInt32		msPerTD = msBetweenTDs ? msBetweenTDs : 1;
+	UInt32		tdsNeeded = ((lookaheadMS + msPerTD - 1) / msPerTD) + 1;
+	UInt32		slots = kNumTDSlots;
+	
+	while ((slots < tdsNeeded) && (slots < kMaxTDSlots))
+		slots <<= 1;
+	
+	if ((maxTRBs > 0) && (ringSize > 0))
+	{
+		UInt32		tdsOnRing = (ringSize / maxTRBs) + 1;
+		
+		while ((slots > kNumTDSlots) && ((slots >> 1) >= tdsOnRing))
+			slots >>= 1;
+	}
+	
+	return slots;
+}
+
+
+
+// SizeTDSlots
+// (Re)allocates the slot table and the done ring which goes with it. The filter interrupt routine walks tdSlots and
+// fills doneRing without taking any lock, so this is only safe once the ring has stopped (it ran dry, was stopped, or
+// was never started) with nothing left on it or waiting to be scavenged - then there are no events left to come in
+// for this endpoint.
+IOReturn
+AppleXHCIIsochEndpoint::SizeTDSlots(UInt32 slots)
+{
+	AppleXHCIIsochTransferDescriptor **				newSlots;
+	AppleXHCIIsochTransferDescriptor * volatile *	newDoneRing;
+	UInt32											i;
+	
+	if ((slots < kNumTDSlots) || (slots > kMaxTDSlots) || (slots & (slots-1)))
+		return kIOReturnBadArgument;
+	
+	if (slots == numTDSlots)
+		return kIOReturnSuccess;
+	
+	if (ringRunning || (scheduledTDs != 0) || (DoneRingCount() != 0))
+		return kIOReturnBusy;
+	
+	for (i=0; i < numTDSlots; i++)
+	{
+		if (tdSlots[i] != NULL)
+			return kIOReturnBusy;
+	}
+	
+	newSlots = (AppleXHCIIsochTransferDescriptor **)IOMalloc(slots * sizeof(AppleXHCIIsochTransferDescriptor*));
+	if (!newSlots)
+		return kIOReturnNoMemory;
+	
+	newDoneRing = (AppleXHCIIsochTransferDescriptor * volatile *)IOMalloc(2 * slots * sizeof(AppleXHCIIsochTransferDescriptor*));
+	if (!newDoneRing)
+	{
+		IOFree(newSlots, slots * sizeof(AppleXHCIIsochTransferDescriptor*));
+		return kIOReturnNoMemory;
+	}
+	
+	bzero(newSlots, slots * sizeof(AppleXHCIIsochTransferDescriptor*));
+	bzero((void*)newDoneRing, 2 * slots * sizeof(AppleXHCIIsochTransferDescriptor*));
+	
+	if (tdSlots)
+		IOFree(tdSlots, numTDSlots * sizeof(AppleXHCIIsochTransferDescriptor*));
+	if (doneRing)
+		IOFree((void*)doneRing, doneRingSize * sizeof(AppleXHCIIsochTransferDescriptor*));
+	
+	tdSlots = newSlots;
+	numTDSlots = slots;
+	doneRing = newDoneRing;
+	doneRingSize = 2 * slots;
+	inSlot = numTDSlots + 1;
+	outSlot = numTDSlots + 1;
+	
+	return kIOReturnSuccess;
+}
+
+
+
+// PutTDOnDoneRing
+// Called only from the filter interrupt routine, which is the single producer. The TD is stored before the
+// producer count is published, so the workloop never sees a slot which has not been filled in yet.
+// Returns false if the ring is full, in which case the caller must leave the TD where it is.
+// The filter in AppleUSBXHCIUIM.cpp still pushes onto savedDoneQueueHead under wdhLock, and ScavengeIsocTransactions
+// drains both until it is converted to call this instead.
+bool
+AppleXHCIIsochEndpoint::PutTDOnDoneRing(AppleXHCIIsochTransferDescriptor *pTD)
+{
+	UInt32		producer = doneRingProducer;
+	
+	//			WARNING
+	//
+	//	This is called a primary interrupt time, so logging (except kprintf) is prohibited
+	//
+	if ((producer - doneRingConsumer) >= doneRingSize)
+	{
+		doneRingFull++;
+		return false;
+	}
+	
+	doneRing[producer & (doneRingSize-1)] = pTD;
+	OSIncrementAtomic(&onProducerQ);
+	OSMemoryBarrier();												// the TD must be visible before the new producer count
+	doneRingProducer = producer + 1;
+	
+	return true;
+}
+
+
+
+// GetTDFromDoneRing
+// Called only on the workloop, which is the single consumer. Returns the oldest completed TD, or NULL
+// if the filter has not completed anything since the last call.
+AppleXHCIIsochTransferDescriptor *
+AppleXHCIIsochEndpoint::GetTDFromDoneRing(void)
+{
+	UInt32								consumer = doneRingConsumer;
+	UInt32								index;
+	AppleXHCIIsochTransferDescriptor *	pTD;
+	
+	if (consumer == doneRingProducer)
+		return NULL;
+	
+	OSMemoryBarrier();												// don't read the slot before we have seen the producer count
+	index = consumer & (doneRingSize-1);
+	pTD = doneRing[index];
+	doneRing[index] = NULL;
+	OSDecrementAtomic(&onProducerQ);
+	OSMemoryBarrier();												// finish with the slot before handing it back to the filter
+	doneRingConsumer = consumer + 1;
+	
+	return pTD;
+}
+
+
+
+UInt32
+AppleXHCIIsochEndpoint::DoneRingCount(void)
+{
+	return (doneRingProducer - doneRingConsumer) + (producerCount - consumerCount);
+}
+
+
+
+// UpdateKeepAway
+// Called from AddIsocFramesToSchedule with preemption disabled, with the time it took from reading MFINDEX to having the
+// first TD on the ring. A TD must not be scheduled for a frame which will have started by the time its TRBs are written,
+// so the window needs the whole (rounded up) number of frames the latency covers. The frame we may already be in is not
+// counted here, since the "<=" test in AddIsocFramesToSchedule already skips one more frame than the window.
+// The window grows as soon as a sample needs it, since a window which is too small costs the client kIOUSBNotSent
+// errors, but it only shrinks by one frame after kIsocKeepAwayShrinkSamples samples in a row would have fit.
+void
+AppleXHCIIsochEndpoint::UpdateKeepAway(UInt64 scheduleLatencyNS)
+{
+	UInt32		latencyUS = (scheduleLatencyNS > (UInt64)0xFFFFFFFF * 1000) ? 0xFFFFFFFF : (UInt32)(scheduleLatencyNS / 1000);
+	UInt32		needed = (latencyUS + kIsocFrameLengthUS - 1) / kIsocFrameLengthUS;
+	
+	lastScheduleLatencyUS = latencyUS;
+	if (latencyUS > maxScheduleLatencyUS)
+		maxScheduleLatencyUS = latencyUS;
+	
+	if (needed < kIsocMinKeepAwayFrames)
+		needed = kIsocMinKeepAwayFrames;
+	if (needed > kIsocMaxKeepAwayFrames)
+		needed = kIsocMaxKeepAwayFrames;
+	
+	if (needed > keepAwayFrames)
+	{
+		keepAwayFrames = needed;
+		keepAwayHeadroomSamples = 0;
+	}
+	else if (needed < keepAwayFrames)
+	{
+		if (++keepAwayHeadroomSamples >= kIsocKeepAwayShrinkSamples)
+		{
+			keepAwayFrames--;
+			keepAwayHeadroomSamples = 0;
+		}
+	}
+	else
+	{
+		keepAwayHeadroomSamples = 0;
+	}
+}
+
+
+
 void
 AppleXHCIIsochEndpoint::print(int level)
 {
@@ -505,12 +864,24 @@ AppleXHCIIsochEndpoint::print(int level)
 	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - transactionsPerFrame(%d)", this, (int)transactionsPerFrame);
 	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - inSlot(%d)", this, (int)inSlot);
 	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - outSlot(%d)", this, (int)outSlot);
+	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - numTDSlots(%d)", this, (int)numTDSlots);
+	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - doneRing producer(%d) consumer(%d) size(%d) full(%d)", this, (int)doneRingProducer, (int)doneRingConsumer, (int)doneRingSize, (int)doneRingFull);
+	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - keepAwayFrames(%d) lastScheduleLatencyUS(%d) maxScheduleLatencyUS(%d)", this, (int)keepAwayFrames, (int)lastScheduleLatencyUS, (int)maxScheduleLatencyUS);
+	USBLog(level, "AppleXHCIIsochEndpoint[%p]::print - continuousStream(%s) streamStartLeadFrames(%d) streamUnderruns(%d) streamOverruns(%d)", this, continuousStream ? "true" : "false", (int)streamStartLeadFrames, (int)streamUnderruns, (int)streamOverruns);
 }
 
 
 
 #undef super
 #define super IOUSBControllerV3
+
+static void
+IsochDiagnosticsKey(AppleXHCIIsochEndpoint *pEP, char *key, size_t keySize)
+{
+	snprintf(key, keySize, kAppleXHCIIsocDiagnosticsKeyPrefix "%d.%d.%s", (int)pEP->functionAddress, (int)pEP->endpointNumber, (pEP->direction == kUSBIn) ? "In" : "Out");
+}
+
+
 // -----------------------------------------------------------------
 //		AppleUSBXHCI
 // -----------------------------------------------------------------
@@ -534,6 +905,7 @@ AppleUSBXHCI::AbortIsochEP(AppleXHCIIsochEndpoint* pEP)
 	}
 	
 	pEP->aborting = true;
+	pEP->streamStarted = false;										// the client has stopped streaming, so the ring stopping is expected
     USBLog(7, "AppleUSBXHCI[%p]::AbortIsochEP (%p)", this, pEP);
 	
 	// XHCI is way cleaner than any of the earlier controllers, because each endpoint is serviced independently on XHCI
@@ -565,7 +937,7 @@ AppleUSBXHCI::AbortIsochEP(AppleXHCIIsochEndpoint* pEP)
 	
 	// now get all of the transactions which had already been placed on the ring for processing, but which had not yet generated an event
     
-    if ((pEP->outSlot < kNumTDSlots) && (pEP->inSlot < kNumTDSlots))
+    if ((pEP->outSlot < pEP->numTDSlots) && (pEP->inSlot < pEP->numTDSlots))
     {
 		bool			stopAdvancing = false;
 		UInt32			stopSlot;
@@ -577,7 +949,7 @@ AppleUSBXHCI::AbortIsochEP(AppleXHCIIsochEndpoint* pEP)
         {
 			UInt32							nextSlot;
             
-			nextSlot = (slot+1) & (kNumTDSlots-1);
+			nextSlot = (slot+1) & (pEP->numTDSlots-1);
 			pTD = pEP->tdSlots[slot];
 			
 			if (pTD == NULL && (nextSlot != pEP->inSlot))
@@ -604,8 +976,8 @@ AppleUSBXHCI::AbortIsochEP(AppleXHCIIsochEndpoint* pEP)
             }
             slot = nextSlot;
         }
-		pEP->outSlot = kNumTDSlots+1;
-		pEP->inSlot = kNumTDSlots+1;
+		pEP->outSlot = pEP->numTDSlots+1;
+		pEP->inSlot = pEP->numTDSlots+1;
     }
     
     // now transfer any transactions from the todo list to the done queue
@@ -621,7 +993,7 @@ AppleUSBXHCI::AbortIsochEP(AppleXHCIIsochEndpoint* pEP)
 	{
 		// since we have no Isoch xactions on the endpoint, we can reset the counter
 		pEP->firstAvailableFrame = 0;
-		pEP->inSlot = kNumTDSlots + 1;    
+		pEP->inSlot = pEP->numTDSlots + 1;    
 	}
 	
     
@@ -683,6 +1055,14 @@ AppleUSBXHCI::DeleteIsochEP(AppleXHCIIsochEndpoint* pEP)
 		curEP = curEP->nextEP;
     }
     
+	if (pEP->diagnostics)
+	{
+		char		key[64];
+		
+		IsochDiagnosticsKey(pEP, key, sizeof(key));
+		removeProperty(key);
+	}
+	
 	// Save the current max packet size, as DeallocateIsochBandwidth will set the ep->mps to 0
 	// currentMaxPacketSize = pEP->maxPacketSize;
 	pEP->release();
@@ -702,6 +1082,14 @@ AppleUSBXHCI::ScavengeAnIsocTD(AppleXHCIIsochEndpoint *pEP,  AppleXHCIIsochTrans
 	// in EHCI and the other UIMs, we would update the frame list (pTD->UpdateFrameList) here.
 	// XHCI has already done so in the filter interrupt routine
 
+	if (pEP->diagnostics && pTD->completionTime)
+	{
+		uint64_t		latencyNS;
+		
+		absolutetime_to_nanoseconds(mach_absolute_time() - pTD->completionTime, &latencyNS);
+		AppleUSBIsochDiagnostics::Record(&pEP->diagnostics->completionLatency, (UInt32)(latencyNS / 1000));
+	}
+	
 	PutTDonDoneQueue(pEP, pTD, true);
 
     return kIOReturnSuccess;
@@ -765,6 +1153,16 @@ AppleUSBXHCI::ScavengeIsocTransactions(AppleXHCIIsochEndpoint *pEP, bool reQueue
 			pDoneTD = nextTD;
 		}
     }
+	
+    // The filter interrupt routine is the only producer on the done ring and we (the workloop) are the only
+    // consumer, so the TDs can be taken off in the order they completed without taking a lock or disabling
+    // interrupts. Anything which completes while we are in the loop will simply be picked up as well.
+    //
+	while ((pDoneTD = pEP->GetTDFromDoneRing()) != NULL)
+	{
+		USBLog(7, "AppleUSBXHCI[%p]::scavengeIsocTransactions - about to scavenge TD %p", this, pDoneTD);
+		ScavengeAnIsocTD(pEP, pDoneTD);
+	}
     
     USBTrace(kUSBTXHCI, kTPXHCIScavengeIsocTransactions, (uintptr_t)pEP, reQueueTransactions, 0, 1);
     if ( reQueueTransactions )
@@ -813,6 +1211,8 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 	UInt64										runningOffset;
 	int											i;
 	bool										deviceRemoved = false;
+	bool										latencyMeasured = false;
+	UInt64										nowFrame;
 	
     USBTrace(kUSBTXHCI, kTPXHCIAddIsochFramesToSchedule, (uintptr_t)this, (uintptr_t)pEP, (uintptr_t)pEP->toDoList, 11);
     if (_lostRegisterAccess)
@@ -841,6 +1241,82 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 		return;
 	}
 	
+	if (pEP->continuousStream)
+	{
+		if (pEP->streamStartLeadFrames == 0)
+		{
+			OSNumber *	leadProp = OSDynamicCast(OSNumber, getProperty(kAppleXHCIIsocStreamStartLeadKey));
+			UInt32		lead = leadProp ? leadProp->unsigned32BitValue() : (UInt32)kIsocStreamStartLeadMS;
+			
+			if (lead < 1)
+				lead = 1;
+			if (lead > kIsocStreamMaxStartLeadMS)
+				lead = kIsocStreamMaxStartLeadMS;
+			pEP->streamStartLeadFrames = lead;
+		}
+		
+		if (!pEP->streamCounters)
+			pEP->streamCounters = AppleXHCIIsocStreamCounters::ForController(this);
+		
+		if (pEP->streamStarted && !pEP->ringRunning)
+		{
+			// the client is still streaming but the ring ran dry before this request showed up, so there is a gap
+			// in the stream. For an IN endpoint the device had data which nobody took (a ring overrun), for an OUT
+			// endpoint the device went without data (a ring underrun)
+			const char *	what;
+			UInt32			count;
+			
+			if (pEP->direction == kUSBIn)
+			{
+				count = ++pEP->streamOverruns;
+				what = "overrun";
+				if (pEP->streamCounters)
+					pEP->streamCounters->_overruns++;
+			}
+			else
+			{
+				count = ++pEP->streamUnderruns;
+				what = "underrun";
+				if (pEP->streamCounters)
+					pEP->streamCounters->_underruns++;
+			}
+			USBLog(2, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - continuous stream EP (%p) ran dry (%s %d) - restarting %d ms beyond the keep away window", this, pEP, what, (int)count, (int)pEP->streamStartLeadFrames);
+		}
+	}
+	
+	if (!pEP->ringRunning && (pEP->scheduledTDs == 0) && (pEP->DoneRingCount() == 0) && pEP->ring)
+	{
+		// the ring is stopped with nothing on it, which is the only time the slot table can change size. Make it big
+		// enough for the endpoint's lookahead, or for everything the client has already queued if that is more
+		UInt32		lookahead = pEP->lookaheadMS;
+		UInt32		queued = pEP->onToDoList * (pEP->msBetweenTDs ? pEP->msBetweenTDs : 1);
+		UInt32		slots;
+		
+		if (queued > lookahead)
+			lookahead = queued;
+		
+		slots = pEP->TDSlotsForLookahead(lookahead, pEP->ring->transferRingSize);
+		if (slots > pEP->numTDSlots)
+		{
+			UInt32		oldSlots = pEP->numTDSlots;
+			IOReturn	err = pEP->SizeTDSlots(slots);
+			
+			USBLog(5, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - EP (%p) lookahead %d ms - growing tdSlots from %d to %d (0x%x)", this, pEP, (int)lookahead, (int)oldSlots, (int)slots, err);
+		}
+	}
+	
+	if (!pEP->diagnostics && (gUSBStackDebugFlags & kUSBEnableErrorLogMask))
+	{
+		pEP->diagnostics = AppleUSBIsochDiagnostics::create();
+		if (pEP->diagnostics)
+		{
+			char		key[64];
+			
+			IsochDiagnosticsKey(pEP, key, sizeof(key));
+			setProperty(key, pEP->diagnostics);
+		}
+	}
+	
 	// rdar://6693796 Test to see if the pEP is inconsistent at this point. If so, log a message..
 	if ((pEP->doneQueue != NULL) && (pEP->doneEnd == NULL))
 	{
@@ -886,9 +1362,18 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 		currFrame = currFrame >> 3;
 	}
 	timeStamp = mach_absolute_time();
+	if (pEP->keepAwayFrames == 0)
+	{
+		// start out with the static value for the controller and let UpdateKeepAway adjust it from there
+		pEP->keepAwayFrames = _istKeepAwayFrames;
+		if (pEP->keepAwayFrames < kIsocMinKeepAwayFrames)
+			pEP->keepAwayFrames = kIsocMinKeepAwayFrames;
+		if (pEP->keepAwayFrames > kIsocMaxKeepAwayFrames)
+			pEP->keepAwayFrames = kIsocMaxKeepAwayFrames;
+	}
 	if (!pEP->continuousStream)
 	{
-		while (pEP->toDoList->_frameNumber <= (currFrame + _istKeepAwayFrames))		// Add keepaway, and use <= so you never put in a new frame 
+		while (pEP->toDoList->_frameNumber <= (currFrame + pEP->keepAwayFrames))		// Add keepaway, and use <= so you never put in a new frame 
                                                                                     // at less than 2 ahead of now. (EHCI spec, 7.2.1)
 		{
 			IOReturn	ret;
@@ -898,6 +1383,9 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 			pTD = GetTDfromToDoList(pEP);
 			pXTD = (AppleXHCIIsochTransferDescriptor *)pTD;
 			
+			if (pEP->diagnostics)
+				AppleUSBIsochDiagnostics::Record(&pEP->diagnostics->missedFrames, (UInt32)((currFrame + pEP->keepAwayFrames + 1) - pTD->_frameNumber));
+			
 			pXTD->eventTRB.offs0 = 0;
 			pXTD->eventTRB.offs4 = 0;
 			pXTD->eventTRB.offs8 = 0;
@@ -948,6 +1436,7 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 		}
 	}
 
+	nowFrame = currFrame;
 	if (!_lostRegisterAccess && !deviceRemoved && pEP->toDoList)
 	{
 		// this code will now grab TDs from the ToDo list and assign them to a list of "slots" which 
@@ -958,7 +1447,7 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 		
 		currFrame = pEP->toDoList->_frameNumber;										// start looking at the first available number
 		
-        if (pEP->inSlot > kNumTDSlots)
+        if (pEP->inSlot > pEP->numTDSlots)
         {
             pEP->inSlot = 0;
             
@@ -1005,7 +1494,7 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                 // in case the period of the endpoint is not 1ms, we need to make sure we don't jump over the outSlot
                 for (i=0; i < pEP->msBetweenTDs; i++)
                 {
-                    nextSlot = (pEP->inSlot + 1) & (kNumTDSlots-1);
+                    nextSlot = (pEP->inSlot + 1) & (pEP->numTDSlots-1);
                     if ( nextSlot == pEP->outSlot) 							// weve caught up with our tail
                         break;                                              // break out of the mini loop    
                 }
@@ -1026,6 +1515,14 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                     break;
                 }
 
+                if ((pEP->DoneRingCount() + (UInt32)pEP->scheduledTDs) >= pEP->doneRingSize)
+                {
+                    // every TD we put on the ring needs a place on the done ring when it completes, and the
+                    // workloop has fallen far enough behind that there might not be one
+                    USBTrace(kUSBTXHCI, kTPXHCIAddIsochFramesToSchedule, (uintptr_t)pEP, (uint32_t)pEP->DoneRingCount(), (uint32_t)pEP->scheduledTDs, 16);
+                    break;
+                }
+
                 spaceAvailable = FreeSlotsOnRing(pEP->ring);
                 
                 USBLogKP(7, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - spaceAvailable(%d)\n", this, (int)spaceAvailable);
@@ -1039,7 +1536,7 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                 pTD = GetTDfromToDoList(pEP);
                 USBLogKP(7, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - got TD (%p) for frame (%d)", this, pTD, (int)pTD->_frameNumber);
                 // pTD->print(2);
-                if (pEP->outSlot > kNumTDSlots)
+                if (pEP->outSlot > pEP->numTDSlots)
                 {
                     pEP->outSlot = 0;								// this is the only time this routine is allowed to change outslot
                     USBLogKP(7, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - changed outSlot for pEP(%p) to (%d)\n", this, pEP, (int)pEP->outSlot);
@@ -1047,7 +1544,7 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                 pXTD = (AppleXHCIIsochTransferDescriptor*)pTD;
                 
                 if (pEP->continuousStream)
-                    hwFrame = GetFrameNumber() + _istKeepAwayFrames + 10;           // continuous streams will start ASAP
+                    hwFrame = GetFrameNumber() + pEP->keepAwayFrames + pEP->streamStartLeadFrames;   // continuous streams will start ASAP
                 else
                     hwFrame = (UInt16)pXTD->_frameNumber;
 				
@@ -1061,6 +1558,10 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                 // hand the TRBs over to the hardware
                 OSIncrementAtomic(&(pEP->scheduledTDs));
                 pEP->lastScheduledFrame = pTD->_frameNumber;
+                pXTD->firstPendingFrame = 0;
+                pXTD->completionTime = 0;
+                if (pEP->diagnostics && !pEP->continuousStream)
+                    AppleUSBIsochDiagnostics::Record(&pEP->diagnostics->scheduleLead, (UInt32)(pTD->_frameNumber - nowFrame));
                 for (i=0; i < pTD->_framesInTD; i++)
                 {
                     IOUSBIsocFrame *			pFrames = pTD->_pFrames;    
@@ -1131,6 +1632,17 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
                     runningOffset += thisReq;
 
                 }
+                pXTD->BuildEventIndexMap(pEP->ring->transferRingSize);
+                
+                if (!latencyMeasured)
+                {
+                    uint64_t		latencyNS;
+                    
+                    // the first TD is the one closest to the current frame, so it is the one the keep away window protects
+                    absolutetime_to_nanoseconds(mach_absolute_time() - timeStamp, &latencyNS);
+                    pEP->UpdateKeepAway(latencyNS);
+                    latencyMeasured = true;
+                }
                 
                 
             } while (pEP->toDoList != NULL);
@@ -1157,6 +1669,8 @@ AppleUSBXHCI::AddIsocFramesToSchedule(AppleXHCIIsochEndpoint* pEP)
 		USBTrace(kUSBTXHCI, kTPXHCIAddIsochFramesToSchedule, (uintptr_t)pEP, 0, 0, 14);
 		pEP->ringRunning = true;
 	}
+	if (pEP->continuousStream)
+		pEP->streamStarted = true;
 	
     USBTrace(kUSBTXHCI, kTPXHCIAddIsochFramesToSchedule, (uintptr_t)pEP, (uintptr_t)pEP->toDoList, (uint32_t)pEP->onDoneQueue, 7);
 	USBLog(7, "AppleUSBXHCI[%p]::AddIsocFramesToSchedule - finished,  currFrame: %qx, deferred TDs(%d) onDoneQueue(%d)", this, GetFrameNumber(), (int)pEP->deferredTDs, (int)pEP->onDoneQueue );
@@ -1179,6 +1693,13 @@ AppleUSBXHCI::AllocateIsochEP()
 			pEP->release();
 			pEP = NULL;
 		}
+		else
+		{
+			OSNumber *	lookaheadProp = OSDynamicCast(OSNumber, getProperty(kAppleXHCIIsocLookaheadKey));
+			
+			if (lookaheadProp)
+				pEP->lookaheadMS = lookaheadProp->unsigned32BitValue();
+		}
 	}
 	return pEP;
 }
@@ -11,6 +11,10 @@
 #include "AppleUSBXHCIUIM.h"
 
 class AppleXHCIAsyncEndpoint;
+class AppleXHCIAsyncTransferDescriptor;
+class AppleXHCIAsyncTDPool;
+class AppleXHCIAsyncTimerWheel;
+class AppleXHCIAsyncTelemetry;
 class AppleUSBXHCI;
 
 #define kFreeTDs                        1
@@ -21,6 +25,61 @@ class AppleUSBXHCI;
 #define kAccountForAlignment            2                 // For Event DATA trb & unaligned buffer
 #define kMinimumTDs                     1
 
+// Fragment sizing policies for AppleXHCIAsyncEndpoint::SetFragmentPolicy
+#define kAppleXHCIAsyncFragmentPolicyKey    "AsyncFragmentPolicy"       // controller property, default policy for new endpoints
+enum
+{
+    kXHCIAsyncFragmentPolicyFixed       = 0,                    // fragment size computed once in init (the default)
+    kXHCIAsyncFragmentPolicyAdaptive    = 1,                    // grow/shrink with the traffic seen on the endpoint
+    kXHCIAsyncFragmentPolicyPinned      = 2                     // fragment size set explicitly (kAppleXHCIAsyncFragmentSizeKeyPrefix)
+};
+#define kAppleXHCIAsyncFragmentSizeKeyPrefix "AsyncFragmentSize "     // controller property + "slot.endpoint", pins that endpoint's fragment size when it is created
+#define kAsyncMinFragmentSize           PAGE_SIZE*4       // adaptive lower bound
+#define kAsyncMaxAdaptiveFragmentSize   PAGE_SIZE*128     // adaptive/pinned upper bound, see RoundFragmentSize for the ring space limit
+#define kAsyncFragmentsOnRing           4                 // an adaptive/pinned fragment never takes more than this share of the ring
+#define kAsyncFragmentGrowThreshold     8                 // consecutive large commands before growing
+#define kAsyncFragmentLatencyTargetUS   2000              // shrink if the average fragment takes longer than this
+
+// Interrupt moderation for fragmented transfers
+#define kAppleXHCIAsyncFragmentsPerInterruptKey "AsyncFragmentsPerInterrupt"   // controller property, default for new endpoints
+#define kAsyncDefaultFragmentsPerInterrupt      1                               // IOC on every fragment
+#define kAsyncMaxFragmentsPerInterrupt          32
+
+// Per stream ready queues for streams endpoints
+#define kAppleXHCIAsyncStreamMaxInFlightKey     "AsyncStreamMaxInFlight"        // controller property, default for new endpoints
+#define kAsyncStreamUnlimitedInFlight           0                               // no per stream limit (the default)
+#define kAsyncMinStreamQueues                   16                              // initial size of the stream table
+#define kAsyncMaxStreamQueues                   65536
+
+// AppleXHCIAsyncTDPool - controller wide cache of ATDs shared by the endpoints' freeQueues
+#define kAppleXHCIAsyncTDPoolKey        "AppleXHCIAsyncTDPool"
+#define kAsyncTDMagazineSize            8                 // ATDs moved between the pool and an endpoint freeQueue at a time
+#define kAsyncTDEndpointHighWater       64                // an endpoint freeQueue above this is trimmed ...
+#define kAsyncTDEndpointLowWater        16                // ... back down to this
+#define kAsyncTDPoolHighWater           1024              // ATDs cached in the pool above this are released
+
+// AppleXHCIAsyncTimerWheel - controller wide timeout deadlines for the async endpoints, in frames (ms)
+#define kAppleXHCIAsyncTimerWheelKey    "AppleXHCIAsyncTimerWheel"
+#define kAsyncTimerWheelBits            8
+#define kAsyncTimerWheelSlots           (1 << kAsyncTimerWheelBits)       // 256 slots per level
+#define kAsyncTimerWheelMask            (kAsyncTimerWheelSlots - 1)
+#define kAsyncTimerWheelSpan            (kAsyncTimerWheelSlots * kAsyncTimerWheelSlots)   // frames covered before the overflow list
+#define kAsyncStopDeqUntouched          0xFFFFFFFF        // kXHCI_ScratchStopDeq: no Stop TRB sampled since the command last moved, see UpdateTimeouts
+
+// AppleXHCIAsyncTelemetry - per endpoint queue and throughput counters, published on the controller as kAppleXHCIAsyncTelemetryKeyPrefix "slot.endpoint"
+#define kAppleXHCIAsyncTelemetryKeyPrefix   "Async Telemetry "
+#define kAsyncTelemetryRateWindowNS         1000000000ULL     // Bytes/sec is recomputed once at least this much time has gone by
+
+// AppleXHCIAsyncTimer - a deadline on an AppleXHCIAsyncTimerWheel, embedded in the ATD it times
+struct AppleXHCIAsyncTimer
+{
+    AppleXHCIAsyncTimer                 *next;
+    AppleXHCIAsyncTimer                 *prev;
+    AppleXHCIAsyncTimer                 **slot;                     // wheel slot (or the expired list) we are linked on, NULL when not armed
+    UInt32                              deadline;                   // frame number
+    AppleXHCIAsyncTransferDescriptor    *owner;
+};
+
 // AppleXHCIAsyncTransferDescriptors - ATDs
 class AppleXHCIAsyncTransferDescriptor : public OSObject
 {
@@ -54,15 +113,230 @@ public:
     bool            flushed;
     bool            lastFlushedTD;
     bool            lastInRing;
+    
+    UInt64          doorbellTime;       // when this ATD went on the ring (its doorbell is rung before ScheduleTDs returns), only kept for the adaptive fragment policy
         
     AppleXHCIAsyncEndpoint              *_endpoint;
     AppleXHCIAsyncTransferDescriptor	*_logicalNext;				// the next element in the list
+    AppleXHCIAsyncTransferDescriptor	*_activePrev;				// the previous element, only maintained while on the activeQueue
+    AppleXHCIAsyncTransferDescriptor	*_retireNext;				// the next ATD without IOC on the same retire queue (see RetireTDsBefore)
+    AppleXHCIAsyncTransferDescriptor	*_retirePrev;
+    UInt32                              activeSequence;             // order it went on the activeQueue, the ring order within its stream
+    AppleXHCIAsyncTransferDescriptor	*_commandNext;				// the next fragment of activeCommand, in the order CreateTDs made them
+    AppleXHCIAsyncTransferDescriptor	*_commandLast;				// the last fragment of activeCommand, which carries its timeoutTimer
+    AppleXHCIAsyncTimer                 timeoutTimer;               // activeCommand's next timeout deadline, only armed on the last fragment (see ArmTimeout)
+    bool                                scheduled;                  // on the activeQueue
     
 
     // constructor method
     static AppleXHCIAsyncTransferDescriptor 	*ForEndpoint(AppleXHCIAsyncEndpoint *endpoint);
 };
 
+// AppleXHCIAsyncTDPool - one per controller, published in the IORegistry under kAppleXHCIAsyncTDPoolKey
+class AppleXHCIAsyncTDPool : public OSObject
+{
+    OSDeclareDefaultStructors(AppleXHCIAsyncTDPool)
+
+public:
+    static AppleXHCIAsyncTDPool         *ForController(AppleUSBXHCI *controller);
+
+    virtual void                        free(void);
+    virtual bool                        serialize(OSSerialize *s) const;
+
+    //
+    // Move up to count ATDs from the pool (allocating if it is empty) onto the endpoint freeQueue
+    //
+    UInt32                              FillEndpoint(AppleXHCIAsyncEndpoint *endpoint, UInt32 count);
+
+    //
+    // Take back an ATD which is no longer on any endpoint queue
+    //
+    void                                ReturnTD(AppleXHCIAsyncTransferDescriptor *pTD);
+
+    AppleXHCIAsyncTransferDescriptor    *_cacheQueue;
+    AppleXHCIAsyncTransferDescriptor    *_cacheEnd;
+    UInt32                              _onCacheQueue;              // ATDs currently held by the pool
+
+    UInt32                              _allocated;                 // ATDs currently in existence, wherever they are
+    UInt32                              _totalAllocated;            // ATDs ever allocated from the general allocator
+    UInt32                              _reclaimed;                 // ATDs released back to the general allocator
+    UInt32                              _cacheHits;                 // ATDs handed to an endpoint without allocating
+
+protected:
+    void                                UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const;
+};
+
+// AppleXHCIAsyncStreamQueue - the readyQueue for one stream of a streams endpoint
+//
+// Streams with ATDs waiting are linked on the endpoint's round, which ScheduleTDs serves with
+// deficit round robin: each stream gets a fragment's worth of credit per turn, so a stream 
+// with a long backlog of large transfers can't hold off the small commands on the others.
+// All the streams share the endpoint's one transfer ring, so while more than one stream is
+// waiting each is also held to its share of the ring's TRBs (see StreamRingShare).
+//
+struct AppleXHCIAsyncStreamQueue
+{
+    AppleXHCIAsyncTransferDescriptor    *readyQueue;
+    AppleXHCIAsyncTransferDescriptor    *readyEnd;
+    UInt32                              onReadyQueue;               // queue depth
+    UInt32                              maxReadyQueue;              // deepest the queue has been
+    UInt32                              inFlight;                   // ATDs of this stream on the activeQueue
+    UInt32                              trbsInFlight;               // ring TRBs taken by those ATDs
+    UInt32                              scheduled;                  // ATDs ever scheduled
+    SInt32                              deficit;                    // DRR credit in bytes
+    bool                                turnStarted;                // already got its quantum for this turn
+    bool                                onRound;
+    bool                                doorbellPending;            // needs a doorbell at the end of ScheduleTDs
+    UInt16                              streamID;
+    AppleXHCIAsyncStreamQueue           *roundNext;
+    AppleXHCIAsyncStreamQueue           *roundPrev;
+    AppleXHCIAsyncStreamQueue           *doorbellNext;
+    AppleXHCIAsyncTransferDescriptor    *abortLast;                 // Abort - the last ATD of this stream on the ring
+    AppleXHCIAsyncTransferDescriptor    *retireQueue;               // ATDs of this stream on the ring without IOC, in ring order
+    AppleXHCIAsyncTransferDescriptor    *retireEnd;
+    AppleXHCIAsyncStreamQueue           *abortNext;
+};
+
+// AppleXHCIAsyncTimerWheel - one per controller, published in the IORegistry under kAppleXHCIAsyncTimerWheelKey
+//
+// Two levels of kAsyncTimerWheelSlots slots (1 frame and kAsyncTimerWheelSlots frames per slot) plus an overflow
+// list for anything further out than kAsyncTimerWheelSpan. Arm and Cancel are O(1), and Advance only touches the
+// slots for the frames that went by and the timers that are in them.
+//
+// Every async command with a timeout has one timer, armed by CreateTDs for its deadline and cancelled when its
+// last ATD goes back on a freeQueue. The UIM calls ServiceTimeouts once a frame, which is the only work done for
+// timeouts until a deadline actually goes by.
+//
+class AppleXHCIAsyncTimerWheel : public OSObject
+{
+    OSDeclareDefaultStructors(AppleXHCIAsyncTimerWheel)
+
+public:
+    static AppleXHCIAsyncTimerWheel     *ForController(AppleUSBXHCI *controller);
+
+    virtual bool                        serialize(OSSerialize *s) const;
+
+    //
+    // (Re)arm timer to expire once the wheel has been advanced to deadline. A deadline which has already
+    // passed expires the timer straight away.
+    //
+    void                                Arm(AppleXHCIAsyncTimer *timer, UInt32 deadline);
+
+    void                                Cancel(AppleXHCIAsyncTimer *timer);
+
+    //
+    // Bring the wheel up to curFrame and hand each timer whose deadline went by to its endpoint's TimeoutExpired.
+    // Returns the number of timers which expired
+    //
+    UInt32                              ServiceTimeouts(UInt32 curFrame);
+
+    UInt32                              CurrentFrame()              { return _currentFrame; }
+
+protected:
+    void                                Advance(UInt32 curFrame);
+    void                                Insert(AppleXHCIAsyncTimer *timer);
+    void                                Unlink(AppleXHCIAsyncTimer *timer);
+    void                                Cascade(AppleXHCIAsyncTimer **slot);
+    void                                AdvanceAll(UInt32 curFrame);
+    void                                UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const;
+
+    AppleXHCIAsyncTimer                 *_level0[kAsyncTimerWheelSlots];    // deadline within kAsyncTimerWheelSlots frames
+    AppleXHCIAsyncTimer                 *_level1[kAsyncTimerWheelSlots];    // deadline within kAsyncTimerWheelSpan frames
+    AppleXHCIAsyncTimer                 *_overflow;
+    AppleXHCIAsyncTimer                 *_expired;                  // deadline went by, waiting for ServiceTimeouts
+    
+    UInt32                              _currentFrame;
+    bool                                _started;                   // _currentFrame is valid
+
+    UInt32                              _armedTimers;               // timers currently on the wheel
+    UInt32                              _totalArmed;
+    UInt32                              _expirations;
+    UInt32                              _cascaded;                  // timers moved down from _level1 or _overflow
+};
+
+// AppleXHCIAsyncTelemetry - one per async endpoint
+//
+// Always kept, since it only costs a few adds and one mach_absolute_time per operation on the endpoint. The queue
+// depths are sampled as CreateTDs, ScheduleTDs, Complete and Abort finish, which is when they settle, and each
+// sample is weighted by how long the queue stayed at that depth. Only ever written on the workloop, so serialize()
+// may see a sample which is half way in, which is fine for telemetry.
+//
+enum
+{
+    kAsyncTelemetryReadyQueue       = 0,
+    kAsyncTelemetryActiveQueue,
+    kAsyncTelemetryDoneQueue,
+    kAsyncTelemetryFreeQueue,
+    kAsyncTelemetryQueues
+};
+
+class AppleXHCIAsyncTelemetry : public OSObject
+{
+    OSDeclareDefaultStructors(AppleXHCIAsyncTelemetry)
+
+public:
+    static AppleXHCIAsyncTelemetry      *WithEndpoint(AppleXHCIAsyncEndpoint *endpoint);
+
+    virtual bool                        serialize(OSSerialize *s) const;
+
+    //
+    // Take the endpoint's queue depths, crediting the previous depths with the time since the last sample
+    //
+    void                                SampleQueues(AppleXHCIAsyncEndpoint *endpoint);
+
+    //
+    // ScheduleTDs could not fit the next fragment (start a stall), or could again (end it)
+    //
+    void                                RingFull(void);
+    void                                RingAvailable(void);
+
+    struct
+    {
+        UInt32                          depth;                      // at the last sample
+        UInt32                          maxDepth;
+        UInt64                          depthTime;                  // sum of depth * mach_absolute_time units at that depth
+    } _queues[kAsyncTelemetryQueues];
+
+    UInt64                              _startTime;
+    UInt64                              _lastSample;
+
+    UInt64                              _bytes;                     // bytes completed
+    UInt64                              _windowStart;
+    UInt64                              _windowLength;              // kAsyncTelemetryRateWindowNS in mach_absolute_time units
+    UInt64                              _windowBytes;               // _bytes at _windowStart
+    UInt32                              _bytesPerSec;               // over the last complete window
+    UInt32                              _maxBytesPerSec;
+
+    UInt32                              _commands;                  // commands chunked by CreateTDs
+    UInt32                              _fragmentedCommands;        // ... which took more than one ATD
+    UInt32                              _fragmentsCreated;
+    UInt32                              _fragmentsScheduled;        // ATDs put on the ring
+    UInt32                              _commandsCompleted;
+    UInt32                              _fragmentSize;              // the endpoint's _actualFragmentSize at the last sample
+    UInt32                              _fragmentPolicy;            // ... and its _fragmentPolicy
+
+    UInt32                              _ringFullStalls;            // times ScheduleTDs stopped with ATDs ready for lack of ring space
+    UInt64                              _ringFullTime;              // mach_absolute_time units spent stalled
+    UInt64                              _ringFullSince;             // 0 when not stalled
+
+protected:
+    void                                UpdateNumberEntry(OSDictionary *dictionary, UInt64 value, const char *name) const;
+};
+
+//
+// AppleXHCIAsyncEndpoint only reaches the hardware through its AppleUSBXHCI, so this is all that a stand-in
+// controller has to provide to drive CreateTDs/ScheduleTDs/ScavengeTDs/FlushTDsWithStatus/Abort without one:
+//
+//  ring:       _createTransfer, CanTDFragmentFit, DiffTRBIndex, SetTRDQPtr
+//  endpoint:   StartEndpoint, QuiesceEndpoint, IsStreamsEndpoint, RestartStreams
+//  completion: Complete (the IOUSBCompletion callout)
+//  state:      _slots[slotID].deviceNeedsReset, _controllerAvailable, _UIMDiagnostics, getRootPortNumber
+//  registry:   getProperty/setProperty, for the controller wide objects and defaults above
+//  logging:    PrintTRB, PrintRing, PrintContext, CheckBuf (DEBUG_BUFFER / PRINT_RINGS only)
+//
+// Transfer events come back in through GetTDFromActiveQueueWithIndex (by TRB index) and ScavengeTDs, and
+// timeouts through AppleXHCIAsyncTimerWheel::ServiceTimeouts (or UpdateTimeouts, for abortAll).
+//
 class AppleXHCIAsyncEndpoint : public OSObject
 {
     friend class AppleUSBXHCI;
@@ -76,6 +350,8 @@ public:
     virtual bool                        init();
 	virtual void						free(void);
     
+    static void                         AdvertiseImmediateData(AppleUSBXHCI *controller);  // called by init
+    
     
     void                                validateLists(int level);
 	void								print(int level);
@@ -108,7 +384,42 @@ public:
     
     UInt32                              _actualFragmentSize;
     
+    UInt32                              _fragmentPolicy;            // kXHCIAsyncFragmentPolicy*
+    UInt32                              _maxBurstPayload;           // fragment sizes are always a multiple of this
+    UInt32                              _baseFragmentSize;          // _actualFragmentSize as computed in init
+    UInt32                              _largeCommandRun;           // consecutive commands larger than _actualFragmentSize
+    UInt32                              _fragmentLatencyUS;         // running average of the time the device spent on each ATD (see Complete)
+    UInt64                              _lastFragmentDoneTime;      // when Complete last took ATDs off the ring, for the adaptive policy
+    bool                                _ringContended;             // ScheduleTDs ran out of ring space since the last adjustment
+    
+    UInt32                              _fragmentsPerInterrupt;     // intermediate fragments only set IOC every this many fragments
+    UInt32                              _interruptsSaved;           // fragments scheduled without IOC
+    
+    UInt32                              _immediatePromotions;       // OUT commands IOUSBController::Write left unmapped for Immediate Data
+    
+    bool                                _coalesceDoorbells;         // ring the doorbell once per ScheduleTDs batch instead of once per ATD
+    UInt32                              _doorbellsSaved;            // number of doorbell writes avoided by coalescing
+    
+    AppleXHCIAsyncTransferDescriptor    **_activeIndexTable;        // activeQueue ATDs indexed by completionIndex (TRB index within _ring)
+    UInt32                              _activeIndexTableSize;      // number of entries, tracks _ring->transferRingSize
+    UInt32                              _activeIndexTableFailedSize; // ring size the table could not be allocated for, not retried until the ring is resized
+    UInt32                              _activeSequence;            // next ATD activeSequence
+    AppleXHCIAsyncTransferDescriptor    *_retireQueue;              // ATDs on the ring without IOC and without a stream queue, in ring order
+    AppleXHCIAsyncTransferDescriptor    *_retireEnd;
+    
     AppleUSBXHCI                        *_xhciUIM;
+    AppleXHCIAsyncTDPool                *_tdPool;                   // controller wide ATD cache backing the freeQueue
+    
+    AppleXHCIAsyncStreamQueue           **_streamQueues;            // indexed by streamID, allocated on first use
+    UInt32                              _streamQueuesSize;
+    AppleXHCIAsyncStreamQueue           *_streamRound;              // streams with ATDs ready, head is being served
+    AppleXHCIAsyncStreamQueue           *_streamRoundEnd;
+    UInt32                              _streamsOnRound;
+    UInt32                              _streamMaxInFlight;         // per stream limit on ATDs in the ring, 0 is unlimited
+    
+    AppleXHCIAsyncTimerWheel            *_timerWheel;               // controller wide timeout wheel
+    
+    AppleXHCIAsyncTelemetry             *_telemetry;                // published on the controller, NULL if it could not be allocated
 
     void PutTDAtHead(AppleXHCIAsyncTransferDescriptor **qStart, AppleXHCIAsyncTransferDescriptor **qEnd, AppleXHCIAsyncTransferDescriptor *pTD, UInt32 *qCount);
     
@@ -120,6 +431,8 @@ public:
 
     AppleXHCIAsyncTransferDescriptor *GetTDFromFreeQueue(bool allocate = true);
 
+    void    TrimFreeQueue(UInt32 keep);
+
     void PutTDonReadyQueueAtHead(AppleXHCIAsyncTransferDescriptor *pTD);
 
     void PutTDonReadyQueue(AppleXHCIAsyncTransferDescriptor *pTD);
@@ -136,14 +449,91 @@ public:
 
     AppleXHCIAsyncTransferDescriptor *GetTDFromActiveQueueWithIndex(UInt16 trbIndex);
 
+    void    UnlinkTDFromActiveQueue(AppleXHCIAsyncTransferDescriptor *pTD);
+
+    void    RetireTDsBefore(AppleXHCIAsyncTransferDescriptor *pTD);
+
+    void    GetRetireQueue(UInt16 streamID, AppleXHCIAsyncTransferDescriptor ***qStart, AppleXHCIAsyncTransferDescriptor ***qEnd);
+
+    void    RebuildActiveIndexTable();
+
+    void    TelemetryKey(char *key, size_t keySize);
+    
+    void    ApplyFragmentSizeOverride(AppleUSBXHCI *controller);
+
+    //
+    // Per stream ready queues. ATDs with a non zero streamID are kept on their stream's queue rather than
+    // readyQueue; the ready queue routines above hide the difference, and onReadyQueue counts both.
+    //
+    AppleXHCIAsyncStreamQueue *GetStreamQueue(UInt16 streamID, bool allocate);
+
+    AppleXHCIAsyncStreamQueue *SelectReadyStream();
+
+    UInt32  StreamRingShare();
+
+    AppleXHCIAsyncTransferDescriptor *GetTDFromStreamReadyQueue(AppleXHCIAsyncStreamQueue *pStream);
+
+    AppleXHCIAsyncTransferDescriptor *PeekTDOnReadyQueue();
+
+    AppleXHCIAsyncTransferDescriptor *FirstTDOnReadyQueue();
+
+    void    AddStreamToRound(AppleXHCIAsyncStreamQueue *pStream, bool atHead);
+
+    void    RemoveStreamFromRound(AppleXHCIAsyncStreamQueue *pStream);
+
+    void    RotateStreamRound();
+
+    void    FreeStreamQueues();
+
+    IOReturn    SetStreamMaxInFlight(UInt32 maxInFlight);
+
+    void    PrintStreams(int level);
+
     void    MoveTDsFromReadyQToDoneQ(IOUSBCommand *pUSBCommand = NULL);
 
     // AppleXHCIAsyncTransferDescriptor *FindNearByActiveTD(int deQueueIndex);
 
     void    MoveAllTDsFromReadyQToDoneQ();
     
+    //
+    // Splice the whole activeQueue onto the doneQueue
+    //
     void    MoveAllTDsFromActiveQToDoneQ();
     
+    //
+    // Per command spans. A command's fragments are linked through _commandNext, the ones on the ring are in
+    // order on the activeQueue (interleaved with other streams) and the rest are at the head of its ready queue,
+    // so flushing a command only touches its own fragments.
+    //
+    AppleXHCIAsyncTransferDescriptor *MoveCommandFromActiveQToDoneQ(AppleXHCIAsyncTransferDescriptor *pTD);
+    
+    void    MoveCommandFromReadyQToDoneQ(IOUSBCommand *pUSBCommand, AppleXHCIAsyncStreamQueue *pStream);
+    
+    void    SetDequeueAfter(AppleXHCIAsyncTransferDescriptor *pTD);
+    
+    void    FindDoneEnd();
+    
+    //
+    //  Select how _actualFragmentSize is chosen. fragmentSize is only used for kXHCIAsyncFragmentPolicyPinned
+    //
+    IOReturn    SetFragmentPolicy(UInt32 policy, UInt32 fragmentSize = 0);
+    
+    UInt32      GetFragmentPolicy()         { return _fragmentPolicy; }
+    
+    UInt32      GetFragmentSize()           { return _actualFragmentSize; }
+    
+    //
+    //  Only interrupt on every fragmentsPerInterrupt-th intermediate fragment (1 interrupts on all of them)
+    //
+    IOReturn    SetInterruptModeration(UInt32 fragmentsPerInterrupt);
+    
+    //
+    //  Adjust _actualFragmentSize for kXHCIAsyncFragmentPolicyAdaptive before chunking pUSBCommand
+    //
+    void        AdaptFragmentSize(IOUSBCommand *pUSBCommand);
+    
+    UInt32      RoundFragmentSize(UInt32 fragmentSize);
+    
     //
     //  Create ATDs by chunking the IOUSBCommand and add them to the readyQueue
     //
@@ -183,10 +573,20 @@ public:
     IOReturn    Abort();
 
     //
-    // Walk the activeQueue and Update the timeout for the activeCommands in the TDs
+    // Update the timeout for the activeCommand at the head of the activeQueue
     // 
     void UpdateTimeouts(bool abortAll, UInt32 curFrame, bool stopped);  
 
+    //
+    // Put the timeoutTimer of pATD's command on the wheel for the command's next deadline
+    //
+    void ArmTimeout(AppleXHCIAsyncTransferDescriptor *pATD);
+
+    //
+    // The wheel went past the deadline of pATD's command
+    //
+    void TimeoutExpired(AppleXHCIAsyncTransferDescriptor *pATD, UInt32 curFrame);
+
     //
     // Evaluate and set the IOUSBCommand to have noDataTimeouts or not
     //
@@ -14,32 +14,8 @@
 
 #include "AppleUSBXHCIUIM.h"
 
-enum 
-{
-	kMaxFSIsochInterval				= 18,				
-	kMaxFSLSInterruptInterval		= 10,
-	kMaxHSSSInterval				= 15,
-	kMaxIntervalTableSize			= 15,
-	
-	// these are Intels numbers of overhead measured in blocks
-	kLSPacketOverheadInBlocks		= 128,
-	kFSPacketOverheadInBlocks		= 20,
-	kHSPacketOverheadInBlocks		= 26,
-	kSSInitialOverheadInBlocks		= 32,
-	kSSBurstOverheadInBlocks		= 8,
-	
-	// these value already take into account encoding (for SS and DMI) and bit stuffing (for the others)
-	kSSBytesPerBlock				= 16,
-	kHSBytesPerBlock				= 4,
-	kFSBytesPerBlock				= 1,
-	kUplinkDMIBytesPerBlock			= 32,
-	
-	// these values already take into account the cost of bit stuffing so we can actually use normal MPS
-	// instead of adding in the bitstuffing again (Table 3 Section 2.4)
-	kLSFSBandwidthLimitInBlocks		= 1156,									// 1285 blocks (including bitstuffing) * 90% (this is per ms)
-	kHSBandwidthLimitInBlocks		= 1285,									// 1607 blocks (including bitstuffing) * 80% (this is per uSec)
-	kSSBandwidthLimitInBlocks		= 3515									// 3906 blocks * 90% (this is per uFrame)
-};
+// the constants and the cost math are shared with user space tools
+#include "AppleUSBXHCI_BandwidthModel.h"
 
 
 
@@ -95,5 +71,79 @@ TTBandwidthTable *GetTTBandwidthTable(OSArray *ttArray, UInt32 hubSlot, UInt32 h
 
 
 
+// AppleXHCIBandwidthLedger - one per controller, published in the IORegistry under kAppleXHCIBandwidthLedgerKey
+//
+// Keeps a running total of the periodic bandwidth committed on each root hub port and each TT, so that admitting
+// or releasing an endpoint only touches that endpoint's interval, instead of rebuilding the tables, and so that
+// the TT for an endpoint is found by hashing the hub slot and port rather than by scanning an OSArray.
+// The cost of each endpoint, and how it is spread over the (micro)frames of its interval, comes from
+// AppleUSBXHCI_BandwidthModel.h. Each interval also keeps the costs of its endpoints in order, so that the largest
+// is known again when it is released. All of the methods must be called on the workloop.
+//
+// Nothing calls the ledger yet - the endpoint create and delete paths are in the UIM (AppleUSBXHCIUIM.cpp, which is
+// not part of this tree), which would Admit before a Configure Endpoint command and Release after it drops the
+// endpoint. Tools/XHCIBandwidthLedgerCheck drives it against a rebuild of the tables from scratch in the meantime.
+#define kAppleXHCIBandwidthLedgerKey		"AppleXHCIBandwidthLedger"
+
+enum
+{
+	kBandwidthLedgerMaxRootPorts	= 256,				// root hub port numbers are 1 based and 8 bits
+	kBandwidthLedgerTTHashSize		= 128				// power of 2 - more than the number of hubs which can be on one controller
+};
+
+// the cost of every endpoint in each interval of a budget, smallest first - budget.interval[i].endpoints of them
+typedef struct AppleXHCIBandwidthCosts
+{
+	UInt16 *					blocks[kMaxIntervalTableSize];
+	UInt32						capacity[kMaxIntervalTableSize];	// never shrinks
+} AppleXHCIBandwidthCosts;
+
+typedef struct AppleXHCIBandwidthPort
+{
+	AppleXHCIBandwidthBudget	budget;
+	AppleXHCIBandwidthCosts		costs;
+} AppleXHCIBandwidthPort;
+
+typedef struct AppleXHCIBandwidthTT
+{
+	bool						inUse;
+	UInt8						rhPort;
+	UInt8						hubSlot;
+	UInt8						hubPort;				// 0 for a single TT hub
+	AppleXHCIBandwidthBudget	budget;
+	AppleXHCIBandwidthCosts		costs;
+} AppleXHCIBandwidthTT;
+
+class AppleXHCIBandwidthLedger : public OSObject
+{
+	OSDeclareDefaultStructors(AppleXHCIBandwidthLedger)
+public:
+	static AppleXHCIBandwidthLedger *	ForController(AppleUSBXHCI *controller);
+	
+	virtual void	free(void);
+	virtual bool	serialize(OSSerialize *s) const;
+	
+	IOReturn		Admit(const AppleXHCIBandwidthRequest *request);
+	void			Release(const AppleXHCIBandwidthRequest *request);
+	
+protected:
+	AppleXHCIBandwidthPort *	GetPort(UInt8 rhPort, UInt8 rhPortSpeed, bool create);
+	AppleXHCIBandwidthTT *		GetTT(const AppleXHCIBandwidthRequest *request, bool create);
+	static bool					NeedsTT(const AppleXHCIBandwidthRequest *request);
+	static bool					ReserveCost(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost);
+	static void					Charge(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost);
+	static bool					Credit(AppleXHCIBandwidthBudget *budget, AppleXHCIBandwidthCosts *costs, const AppleXHCIBandwidthCost *cost);
+	static void					FreeCosts(AppleXHCIBandwidthCosts *costs);
+	void						UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const;
+	void						SerializeBudget(OSDictionary *dictionary, const AppleXHCIBandwidthBudget *budget, const char *name) const;
+	
+	AppleXHCIBandwidthPort *	_ports[kBandwidthLedgerMaxRootPorts];
+	AppleXHCIBandwidthTT		_tts[kBandwidthLedgerTTHashSize];
+	UInt32						_admitted;
+	UInt32						_rejected;
+};
+
+
+
 
 #endif
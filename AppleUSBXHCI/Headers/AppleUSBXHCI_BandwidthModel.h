@@ -0,0 +1,315 @@
+//
+//  AppleUSBXHCI_BandwidthModel.h
+//  AppleUSBXHCI
+//
+//  Copyright 2011-2013 Apple Inc. All rights reserved.
+//
+//  The periodic bandwidth constants and cost math used by AppleXHCIBandwidthLedger. This header only depends on
+//  <stdint.h>, so the same math can be built into user space tools (see Tools/XHCIBandwidthPlanner) to check a
+//  planned topology before it is plugged in, and to check the ledger (see Tools/XHCIBandwidthLedgerCheck).
+//
+
+#ifndef AppleUSBXHCI_AppleUSBXHCI_BandwidthModel_h
+#define AppleUSBXHCI_AppleUSBXHCI_BandwidthModel_h
+
+#include <stdint.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+enum 
+{
+	kMaxFSIsochInterval				= 18,				
+	kMaxFSLSInterruptInterval		= 10,
+	kMaxHSSSInterval				= 15,
+	kMaxIntervalTableSize			= 15,
+	
+	// these are Intels numbers of overhead measured in blocks
+	kLSPacketOverheadInBlocks		= 128,
+	kFSPacketOverheadInBlocks		= 20,
+	kHSPacketOverheadInBlocks		= 26,
+	kSSInitialOverheadInBlocks		= 32,
+	kSSBurstOverheadInBlocks		= 8,
+	
+	// these value already take into account encoding (for SS and DMI) and bit stuffing (for the others)
+	kSSBytesPerBlock				= 16,
+	kHSBytesPerBlock				= 4,
+	kFSBytesPerBlock				= 1,
+	kUplinkDMIBytesPerBlock			= 32,
+	
+	// these values already take into account the cost of bit stuffing so we can actually use normal MPS
+	// instead of adding in the bitstuffing again (Table 3 Section 2.4)
+	kLSFSBandwidthLimitInBlocks		= 1156,									// 1285 blocks (including bitstuffing) * 90% (this is per ms)
+	kHSBandwidthLimitInBlocks		= 1285,									// 1607 blocks (including bitstuffing) * 80% (this is per uSec)
+	kSSBandwidthLimitInBlocks		= 3515									// 3906 blocks * 90% (this is per uFrame)
+};
+
+// the same values as kUSBDeviceSpeedLow ... kUSBDeviceSpeedSuper, which are not available outside of IOKit
+enum
+{
+	kBandwidthModelSpeedLow			= 0,
+	kBandwidthModelSpeedFull		= 1,
+	kBandwidthModelSpeedHigh		= 2,
+	kBandwidthModelSpeedSuper		= 3
+};
+
+// one periodic endpoint, as it would be put in the endpoint context
+typedef struct AppleXHCIBandwidthRequest
+{
+	uint8_t			rhPort;								// root hub port number (1 based)
+	uint8_t			rhPortSpeed;						// the speed at which the root hub port is operating
+	uint8_t			epSpeed;							// the speed of the device, which is different from rhPortSpeed behind a TT
+	uint8_t			epInterval;							// the endpoint context Interval (an exponent)
+	uint16_t		mps;
+	uint8_t			maxBurst;							// 0 based, as in the endpoint context
+	uint8_t			mult;								// 0 based, as in the endpoint context
+	uint8_t			hubSlot;							// the HS hub with the TT, if any
+	uint8_t			hubPort;
+	bool			mtt;
+} AppleXHCIBandwidthRequest;
+
+// what has been committed in one interval of a budget - the same three things the xHCI bandwidth tables keep
+typedef struct AppleXHCIBandwidthInterval
+{
+	uint32_t		endpoints;
+	uint32_t		blocks;								// what one service opportunity of every endpoint costs
+	uint32_t		largestBlocks;						// the most expensive endpoint
+} AppleXHCIBandwidthInterval;
+
+// what has been committed on one root hub port or one TT
+typedef struct AppleXHCIBandwidthBudget
+{
+	AppleXHCIBandwidthInterval	interval[kMaxIntervalTableSize];	// indexed by BandwidthModelBudgetInterval
+	uint32_t		totalBlocks;						// the busiest (micro)frame, see BandwidthModelUsedBlocks
+	uint32_t		limitBlocks;
+	uint32_t		endpoints;
+} AppleXHCIBandwidthBudget;
+
+// what one endpoint costs one budget
+typedef struct AppleXHCIBandwidthCost
+{
+	uint8_t			interval;							// serviced once every 2^interval (micro)frames of the budget
+	uint32_t		blocks;								// the cost of one service opportunity
+} AppleXHCIBandwidthCost;
+
+
+
+static inline uint32_t
+BandwidthModelBlocksForBytes(uint32_t bytes, uint32_t bytesPerBlock)
+{
+	return (bytes + bytesPerBlock - 1) / bytesPerBlock;
+}
+
+
+
+static inline uint32_t
+BandwidthModelLimitInBlocks(uint8_t speed)
+{
+	switch (speed)
+	{
+		case kBandwidthModelSpeedSuper:
+			return kSSBandwidthLimitInBlocks;
+			
+		case kBandwidthModelSpeedHigh:
+			return kHSBandwidthLimitInBlocks;
+			
+		default:
+			return kLSFSBandwidthLimitInBlocks;
+	}
+}
+
+
+
+static inline bool
+BandwidthModelNeedsTT(const AppleXHCIBandwidthRequest *request)
+{
+	return (request->rhPortSpeed == kBandwidthModelSpeedHigh) && (request->hubSlot != 0) &&
+		   ((request->epSpeed == kBandwidthModelSpeedFull) || (request->epSpeed == kBandwidthModelSpeedLow));
+}
+
+
+
+// the cost of one LS or FS transaction on the classic bus, in FS blocks - LS packets are 8 times as long
+static inline uint32_t
+BandwidthModelTTBlocks(const AppleXHCIBandwidthRequest *request)
+{
+	if (request->epSpeed == kBandwidthModelSpeedLow)
+		return kLSPacketOverheadInBlocks + (8 * BandwidthModelBlocksForBytes(request->mps, kFSBytesPerBlock));
+	
+	return kFSPacketOverheadInBlocks + BandwidthModelBlocksForBytes(request->mps, kFSBytesPerBlock);
+}
+
+
+
+// the cost of one service opportunity of the endpoint on its root hub port, in the blocks of that port's speed
+static inline uint32_t
+BandwidthModelPortBlocks(const AppleXHCIBandwidthRequest *request)
+{
+	uint32_t		packets;
+	
+	switch (request->rhPortSpeed)
+	{
+		case kBandwidthModelSpeedSuper:
+			packets = (request->maxBurst + 1) * (request->mult + 1);
+			return kSSInitialOverheadInBlocks + ((request->mult + 1) * kSSBurstOverheadInBlocks) + BandwidthModelBlocksForBytes(packets * request->mps, kSSBytesPerBlock);
+			
+		case kBandwidthModelSpeedHigh:
+			if (BandwidthModelNeedsTT(request))
+			{
+				// a start split and a complete split, with the data in one of them
+				return (2 * kHSPacketOverheadInBlocks) + BandwidthModelBlocksForBytes(request->mps, kHSBytesPerBlock);
+			}
+			// for HS periodic endpoints the Max Burst field holds the additional transactions per uFrame
+			packets = request->maxBurst + 1;
+			return packets * (kHSPacketOverheadInBlocks + BandwidthModelBlocksForBytes(request->mps, kHSBytesPerBlock));
+			
+		default:
+			return BandwidthModelTTBlocks(request);
+	}
+}
+
+
+
+// The endpoint context Interval is an exponent of 125us for every speed, but the LS/FS limit is per 1ms frame, so
+// the intervals of a LS/FS budget (a LS/FS root hub port, or a TT) are counted in frames. Anything longer than the
+// table is counted in its last entry, which only makes it look more frequent than it is.
+static inline uint8_t
+BandwidthModelBudgetInterval(uint8_t epInterval, uint8_t budgetSpeed)
+{
+	if ((budgetSpeed == kBandwidthModelSpeedLow) || (budgetSpeed == kBandwidthModelSpeedFull))
+		epInterval = (epInterval > 3) ? (epInterval - 3) : 0;
+	
+	return (epInterval < kMaxIntervalTableSize) ? epInterval : (kMaxIntervalTableSize - 1);
+}
+
+
+
+static inline void
+BandwidthModelTTCost(const AppleXHCIBandwidthRequest *request, AppleXHCIBandwidthCost *cost)
+{
+	cost->interval = BandwidthModelBudgetInterval(request->epInterval, kBandwidthModelSpeedFull);
+	cost->blocks = BandwidthModelTTBlocks(request);
+}
+
+
+
+static inline void
+BandwidthModelPortCost(const AppleXHCIBandwidthRequest *request, AppleXHCIBandwidthCost *cost)
+{
+	cost->interval = BandwidthModelBudgetInterval(request->epInterval, request->rhPortSpeed);
+	cost->blocks = BandwidthModelPortBlocks(request);
+}
+
+
+
+// The most one interval can add to any single (micro)frame, if the xHC spreads the endpoints of that interval evenly
+// over the 2^index (micro)frames of their period: no frame gets more than endpoints / 2^index of them (rounded up),
+// and none of them costs more than the largest. That is never more than all of the interval's blocks, which is what
+// it costs when the period is 1. Endpoints rather than packets are spread, as the packets of a HS burst or an SS
+// service opportunity all go in the same (micro)frame.
+static inline uint32_t
+BandwidthModelIntervalBlocks(const AppleXHCIBandwidthInterval *interval, uint8_t index)
+{
+	uint32_t		perFrame = (interval->endpoints + (1U << index) - 1) >> index;
+	uint32_t		worst = perFrame * interval->largestBlocks;
+	
+	return (worst < interval->blocks) ? worst : interval->blocks;
+}
+
+
+
+// the busiest (micro)frame of the budget, which is what the limits above are written for
+static inline uint32_t
+BandwidthModelUsedBlocks(const AppleXHCIBandwidthBudget *budget)
+{
+	uint32_t		used = 0;
+	uint8_t			i;
+	
+	for (i = 0; i < kMaxIntervalTableSize; i++)
+		used += BandwidthModelIntervalBlocks(&budget->interval[i], i);
+	
+	return used;
+}
+
+
+
+static inline void
+BandwidthModelAddToInterval(AppleXHCIBandwidthInterval *interval, const AppleXHCIBandwidthCost *cost)
+{
+	interval->endpoints++;
+	interval->blocks += cost->blocks;
+	if (cost->blocks > interval->largestBlocks)
+		interval->largestBlocks = cost->blocks;
+}
+
+
+
+// what totalBlocks would be with the endpoint charged to the budget
+static inline uint32_t
+BandwidthModelBlocksWith(const AppleXHCIBandwidthBudget *budget, const AppleXHCIBandwidthCost *cost)
+{
+	AppleXHCIBandwidthInterval	interval = budget->interval[cost->interval];
+	uint32_t					before = BandwidthModelIntervalBlocks(&interval, cost->interval);
+	
+	BandwidthModelAddToInterval(&interval, cost);
+	
+	return budget->totalBlocks - before + BandwidthModelIntervalBlocks(&interval, cost->interval);
+}
+
+
+
+static inline bool
+BandwidthModelFits(const AppleXHCIBandwidthBudget *budget, const AppleXHCIBandwidthCost *cost)
+{
+	return BandwidthModelBlocksWith(budget, cost) <= budget->limitBlocks;
+}
+
+
+
+static inline void
+BandwidthModelCharge(AppleXHCIBandwidthBudget *budget, const AppleXHCIBandwidthCost *cost)
+{
+	budget->totalBlocks = BandwidthModelBlocksWith(budget, cost);
+	BandwidthModelAddToInterval(&budget->interval[cost->interval], cost);
+	budget->endpoints++;
+}
+
+
+
+// Returns false if the budget did not have that much to give back, in which case it gives back what it had.
+// The budget doesn't keep its endpoints, so the caller passes the cost of the most expensive endpoint left in the
+// interval (0 if there are none) - the planner never gives anything back, and the ledger keeps each interval's costs.
+static inline bool
+BandwidthModelCredit(AppleXHCIBandwidthBudget *budget, const AppleXHCIBandwidthCost *cost, uint32_t largestLeft)
+{
+	AppleXHCIBandwidthInterval	*interval = &budget->interval[cost->interval];
+	uint32_t					before = BandwidthModelIntervalBlocks(interval, cost->interval);
+	bool						balanced = true;
+	
+	if ((interval->endpoints == 0) || (interval->blocks < cost->blocks) || (cost->blocks > interval->largestBlocks))
+	{
+		interval->endpoints = 0;
+		balanced = false;
+	}
+	else
+	{
+		interval->endpoints--;
+		interval->blocks -= cost->blocks;
+		interval->largestBlocks = largestLeft;
+	}
+	
+	if (interval->endpoints == 0)
+	{
+		interval->blocks = 0;
+		interval->largestBlocks = 0;
+	}
+	
+	budget->totalBlocks = budget->totalBlocks - before + BandwidthModelIntervalBlocks(interval, cost->interval);
+	if (budget->endpoints)
+		budget->endpoints--;
+	
+	return balanced;
+}
+
+
+#endif
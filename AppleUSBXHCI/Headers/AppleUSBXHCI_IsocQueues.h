@@ -20,12 +20,59 @@ enum
 {
 	kMaxTransfersPerFrame		= 8,
 	kIsocRingSizeinMS			= 100,
-	kNumTDSlots					= 128,						// this number should be a power of 2 and larger than isocRingSizeinMS
+	kNumTDSlots					= 128,						// default and smallest TD slot table - a power of 2 and larger than isocRingSizeinMS
+	kMaxTDSlots					= 1024,						// largest TD slot table - a power of 2
     kMaxFramesWithoutInterrupt	= 8,
+	kIsocStreamStartLeadMS		= 10,						// default ms beyond the keep away window a continuous stream (re)starts at
+	kIsocStreamMaxStartLeadMS	= (kIsocRingSizeinMS / 2),
+	kIsocFrameLengthUS			= 1000,
+	kIsocMinKeepAwayFrames		= 1,						// the "<=" test in AddIsocFramesToSchedule always adds one more frame
+	kIsocMaxKeepAwayFrames		= 16,
+	kIsocKeepAwayShrinkSamples	= 256,						// consecutive schedules with headroom needed before the window shrinks by one frame
 };
 
+// TD slot tables
+// Each endpoint's tdSlots table is sized to hold this many ms of scheduled TDs (or more, if the client has queued more
+// than that by the time the endpoint's ring next stops), limited by what its transfer ring can hold.
+#define kAppleXHCIIsocLookaheadKey			"IsocLookaheadMS"			// controller property, read when an endpoint is created
+
+// Isoch diagnostics
+// When kUSBEnableErrorLogMask is set, each endpoint's AppleUSBIsochDiagnostics is published on the controller under this
+// prefix followed by "<function>.<endpoint>.<In|Out>"
+#define kAppleXHCIIsocDiagnosticsKeyPrefix	"Isoch Diagnostics "
+
+// Continuous streams
+// When the ring of a continuous stream is (re)started, its first TD goes this many ms beyond the keep away window. This
+// only moves the start frame, which used to be a fixed 10 ms out - nothing is queued ahead of the client's requests.
+#define kAppleXHCIIsocStreamStartLeadKey	"IsocStreamStartLeadMS"		// controller property, read when an endpoint first schedules
+#define kAppleXHCIIsocStreamCountersKey		"IsocStreamCounters"		// controller property, the AppleXHCIIsocStreamCounters
+
 
 class AppleXHCIIsochEndpoint;			// forward declaration
+class AppleUSBIsochDiagnostics;
+class AppleUSBXHCI;
+
+// AppleXHCIIsocStreamCounters - one per controller
+//
+// Totals of the per endpoint streamUnderruns and streamOverruns, published once under kAppleXHCIIsocStreamCountersKey.
+// Each continuous stream endpoint holds a reference from the first time it schedules and just bumps the counts, which
+// are only written on the workloop.
+class AppleXHCIIsocStreamCounters : public OSObject
+{
+    OSDeclareDefaultStructors(AppleXHCIIsocStreamCounters)
+
+public:
+    static AppleXHCIIsocStreamCounters	*ForController(AppleUSBXHCI *controller);		// the published one, publishing it the first time
+
+    virtual bool						serialize(OSSerialize *s) const;
+
+    UInt32								_underruns;					// OUT continuous streams which ran dry while streaming
+    UInt32								_overruns;					// IN continuous streams which ran dry while streaming
+
+protected:
+    void								UpdateNumberEntry(OSDictionary *dictionary, UInt32 value, const char *name) const;
+};
+
 
 class AppleXHCIIsochTransferDescriptor : public IOUSBControllerIsochListElement
 {
@@ -40,6 +87,12 @@ public:
 	TRB												eventTRB;									// filled in by the FilterEventRing before calling UpdateFrameList
 	bool											newFrame;									// true if this TD does not come on the next frame (frame + 1) after the previous
 	bool                                            interruptThisTD;                            // True if we want an interrupt to happen for completing this TD.
+	int												firstPendingFrame;							// frames before this one have been updated (statusUpdated is always a prefix)
+	UInt32											eventMapFrames;								// number of valid entries in the frame offset map, 0 until the TD is on the ring
+	UInt32											eventMapRingSize;							// transfer ring size the map was built for
+	UInt32											frameStartOffset[kMaxTransfersPerFrame];	// offset of each frame's first TRB from trbIndex[0], modulo the ring size
+	UInt32											frameEndOffset[kMaxTransfersPerFrame];		// offset just past each frame's last TRB
+	UInt64											completionTime;								// mach_absolute_time of the completion interrupt, 0 until then
 	
     // constructor method
     static AppleXHCIIsochTransferDescriptor 	*ForEndpoint(AppleXHCIIsochEndpoint *endpoint);
@@ -50,14 +103,18 @@ public:
     virtual IOPhysicalAddress		GetPhysicalAddrWithType(void);						// must be implemented even though XHCI doesn't use it
 
     virtual IOReturn				UpdateFrameList(AbsoluteTime timeStamp);
+    IOReturn						UpdateFrameListWithEvents(const TRB *events, UInt32 numEvents, AbsoluteTime timeStamp);	// all events for this TD from one pass of the event ring (only UpdateFrameList calls it yet, with one)
     virtual IOReturn				Deallocate(IOUSBControllerV2 *uim);
     virtual void					print(int level);
     
 public:
 	int					FrameForEventIndex(UInt32 eventIndex);											// which of my TRBs does this one point to
+	void				BuildEventIndexMap(UInt32 ringSize);											// once all of the TRBs are on the ring
 
 private:
     IOReturn			MungeXHCIIsochTDStatus(UInt32 status, UInt16 *transferLen, UInt32 maxPacketSize, UInt8 direction);
+    IOReturn			UpdateFrameListForEvent(const TRB *event, AbsoluteTime timeStamp);
+    void				SetFramesComplete(int first, int last, IOReturn frStatus, AbsoluteTime timeStamp);
 };
 
 
@@ -72,13 +129,35 @@ public:
 	virtual void									free(void);
 
 	void											print(int level);
-	AppleXHCIIsochTransferDescriptor *				tdSlots[kNumTDSlots];		// the TDs which have been placed on the ring are stored here
+
+	// single producer/single consumer done ring - no lock and no interrupt disabling needed
+	// Nothing calls PutTDOnDoneRing yet: the filter interrupt routine is in AppleUSBXHCIUIM.cpp, which is not part of this
+	// tree, and still pushes onto savedDoneQueueHead under wdhLock. ScavengeIsocTransactions drains both until it is converted.
+	bool											PutTDOnDoneRing(AppleXHCIIsochTransferDescriptor *pTD);		// filter interrupt routine only
+	AppleXHCIIsochTransferDescriptor *				GetTDFromDoneRing(void);									// workloop only
+	UInt32											DoneRingCount(void);										// completed TDs not yet scavenged, on the ring or on savedDoneQueueHead
+
+	// TD slot table sizing - only while the ring is stopped and empty, since the filter interrupt routine indexes the table
+	UInt32											TDSlotsForLookahead(UInt32 lookaheadMS, UInt32 ringSize);
+	IOReturn										SizeTDSlots(UInt32 slots);
+
+	// keep away window, adapted from how long it actually takes us to get a TD onto the ring
+	void											UpdateKeepAway(UInt64 scheduleLatencyNS);		// preemption is disabled - no logging
+
+	AppleXHCIIsochTransferDescriptor **				tdSlots;					// the TDs which have been placed on the ring are stored here (numTDSlots entries)
+	UInt32											numTDSlots;					// a power of 2 - indexes wrap with (numTDSlots-1)
+	UInt32											lookaheadMS;				// ms of TDs the slot table is sized for (kAppleXHCIIsocLookaheadKey)
 	struct ringStruct *								ring;						// a.k.a. XHCIRing *
 	
     volatile AppleXHCIIsochTransferDescriptor *		savedDoneQueueHead;			// saved by the Filter Interrupt routine
     volatile UInt32									producerCount;				// Counter used to synchronize reading of the done queue between filter (producer) and action (consumer)
     volatile UInt32									consumerCount;				// Counter used to synchronize reading of the done queue between filter (producer) and action (consumer)
     IOSimpleLock *									wdhLock;					// used around updates of the producer/consumer counts
+    AppleXHCIIsochTransferDescriptor * volatile *	doneRing;					// completed TDs in completion order, written by the filter and read by the workloop
+    UInt32											doneRingSize;				// 2 * numTDSlots - room for a full set of tdSlots plus a full set not yet scavenged
+    volatile UInt32									doneRingProducer;			// only written by the filter interrupt routine (producer) - index of the next free doneRing entry
+    volatile UInt32									doneRingConsumer;			// only written on the workloop (consumer) - index of the next doneRing entry to scavenge
+    UInt32											doneRingFull;				// number of times the filter found doneRing full
 	UInt64											lastScheduledFrame;			// keep track of the last frame we sent to the controller
     UInt8                                           maxBurst;                   // for SS endpoints - 1 based
     UInt8											mult;						// how many bursts to do in a microframe - 1 based
@@ -92,6 +171,16 @@ public:
 	bool											waitForRingToRunDry;		// true if we need to wait for the ring to run dry
 	volatile bool									ringRunning;				// true once we have rung the doorbell and before we run dry or get stopped
 	bool											continuousStream;			// T if the client doesn't really care about frame numbers
+	bool											streamStarted;				// T once a continuous stream has been started, until it is aborted
+	UInt32											streamStartLeadFrames;		// frames beyond keepAwayFrames a continuous stream (re)starts at, 0 until first read
+	UInt32											streamUnderruns;			// times an OUT continuous stream ran dry with the client still streaming
+	UInt32											streamOverruns;				// times an IN continuous stream ran dry with the client still streaming
+	AppleXHCIIsocStreamCounters *					streamCounters;				// the controller's totals, NULL until a continuous stream first schedules
+	UInt32											keepAwayFrames;				// frames ahead of MFINDEX we must stay when scheduling, 0 until first used
+	UInt32											keepAwayHeadroomSamples;	// consecutive schedules which would have fit in a smaller window
+	UInt32											lastScheduleLatencyUS;		// MFINDEX read to first TD on the ring, last time we scheduled
+	UInt32											maxScheduleLatencyUS;		// worst MFINDEX read to first TD on the ring
+	AppleUSBIsochDiagnostics *						diagnostics;				// schedule and completion histograms, NULL unless enabled
 };
 
 
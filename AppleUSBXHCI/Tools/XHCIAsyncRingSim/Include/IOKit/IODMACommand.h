@@ -0,0 +1,5 @@
+//
+//  XHCIAsyncRingSim stand-in for <IOKit/IODMACommand.h>, see XHCIAsyncRingSimKernel.h
+//
+
+#include "XHCIAsyncRingSimKernel.h"
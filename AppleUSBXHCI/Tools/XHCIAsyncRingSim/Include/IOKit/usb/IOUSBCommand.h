@@ -0,0 +1,5 @@
+//
+//  XHCIAsyncRingSim stand-in for <IOKit/usb/IOUSBCommand.h>, see XHCIAsyncRingSimKernel.h
+//
+
+#include "XHCIAsyncRingSimKernel.h"
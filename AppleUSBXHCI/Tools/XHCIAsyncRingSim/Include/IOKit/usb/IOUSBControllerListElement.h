@@ -0,0 +1,5 @@
+//
+//  XHCIAsyncRingSim stand-in for <IOKit/usb/IOUSBControllerListElement.h>, see XHCIAsyncRingSimKernel.h
+//
+
+#include "XHCIAsyncRingSimKernel.h"
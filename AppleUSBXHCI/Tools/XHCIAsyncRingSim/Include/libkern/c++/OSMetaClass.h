@@ -0,0 +1,5 @@
+//
+//  XHCIAsyncRingSim stand-in for <libkern/c++/OSMetaClass.h>, see XHCIAsyncRingSimKernel.h
+//
+
+#include "XHCIAsyncRingSimKernel.h"
@@ -0,0 +1,1367 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  XHCIAsyncRingSim
+//
+//  Builds the real AppleUSBXHCI_AsyncQueues.cpp against a stand-in AppleUSBXHCI and a simulated device, and runs
+//  bulk workloads through AppleXHCIAsyncEndpoint to measure throughput, completion latency and the host time spent
+//  in the queue code per command. It also checks, for every run, that each command completed exactly once, that
+//  the endpoint queues drained, and that the ring and the activeQueue never disagreed about what was on the ring.
+//  The frag column is the fragment size at the end of the run: the adaptive policy has to have grown it for commands
+//  larger than it started at, and a pinned size has to have stuck.
+//
+//  Build:	c++ -O2 -std=c++11 -fno-extended-identifiers -I. -IInclude -I../../Headers -I../../Classes -o XHCIAsyncRingSim XHCIAsyncRingSim.cpp
+//		(-fno-extended-identifiers lets gcc through the bullets in the driver's #pragma mark lines; clang doesn't need it)
+//
+//  Usage:	XHCIAsyncRingSim [-v level] [-t] [scenario ...]		(runs every scenario and the lookup benchmark when none are named)
+//
+//		-v		USBLog level to print (default 0, nothing)
+//		-t		print the ATD pool, timer wheel and endpoint telemetry through their serialize() after each run
+//
+//  The stand-in controller does what the UIM does around the endpoint and nothing else:
+//
+//  - _createTransfer puts one TD on the ring per ATD: one TRB per 4K page plus the Event Data TRB for fragments,
+//    wrapping at the Link TRB, and the simulated device works through the ring in order at a fixed rate.
+//  - A TD with IOC, a short packet or an error posts a transfer event after a fixed latency. The event is looked
+//    up with GetTDFromActiveQueueWithIndex and handed to ScavengeTDs, flushing the command on a short intermediate
+//    fragment or an error, the way the UIM's event handler does.
+//  - The device halts after an error or a short intermediate fragment until the driver moves the dequeue pointer
+//    (SetTRDQPtr stands in for Reset Endpoint + Set TR Dequeue Pointer).
+//  - The timer wheel is serviced every frame (1ms), with the Stop TRB showing where the device is and how much of
+//    the TD is left, as it would after a Stop Endpoint. Every run checks that the wheel only had a timer expire
+//    for a command which then timed out, rather than every frame or every command.
+//  - Completions resubmit, as a client would from its completion routine once it returns. On a streams endpoint
+//    each command goes back on the stream it came from, and streams sending the same commands have to see about the
+//    same worst case latency, which can be no worse than that of a stream sending larger ones.
+//
+
+#include <time.h>
+
+#include "XHCIAsyncRingSimKernel.h"
+#include "XHCI.h"
+
+//
+// What AppleUSBXHCI_AsyncQueues.cpp takes from AppleUSBXHCIUIM.h, which is not part of this tree
+//
+#define kMaxImmediateTRBTransferSize		8
+#define kInvalidImmediateTRBTransferSize	0xFF
+
+enum
+{
+	kXHCI_ScratchFirstSeen	= 0,
+	kXHCI_ScratchShortfall	= 1,
+	kXHCI_ScratchTRTime		= 2,
+	kXHCI_ScratchStopDeq	= 3,
+	kXHCI_ScratchBytes		= 4
+};
+
+// The fields of XHCIRing that the async queues use
+typedef struct ringStruct
+{
+	TRB *						transferRing;
+	USBPhysicalAddress64		transferRingPhys;
+	UInt16						transferRingSize;
+	UInt16						transferRingEnqueueIdx;
+	UInt16						transferRingDequeueIdx;
+	UInt8						transferRingPCS;
+	TRB							stopTRB;
+	bool						needsDoorbell;
+	bool						beingReturned;
+	bool						needsSetTRDQPtr;
+	UInt8						slotID;
+	UInt8						endpointID;
+} XHCIRing;
+
+class AppleXHCIAsyncTransferDescriptor;
+class AppleXHCIAsyncEndpoint;
+class AppleXHCIAsyncTimerWheel;
+
+enum
+{
+	kSimSlotID				= 1,
+	kSimEndpointID			= 3,						// bulk IN 1
+	kSimMaxSlots			= 8,
+	kSimMaxPorts			= 8,
+	kSimMaxHWTDs			= 4096,
+	kSimMaxEvents			= 4096,
+	kSimMaxStreams			= 16,
+	kSimFrameNS				= 1000000,
+	kSimStartNS				= 1000000000ULL,			// frame 0 means "not seen yet" to UpdateTimeouts, so start at frame 1000
+	kSimTimeLimitNS			= 600000000000ULL
+};
+
+#define kSimNever			(~0ULL)
+#define kSimStreamFairness	1.5							// most the worst case latencies of streams sending the same commands may differ by
+
+// A TD on the simulated ring, in the order the device will get to it
+struct SimHWTD
+{
+	AppleXHCIAsyncTransferDescriptor *	atd;
+	IOUSBCommand *						command;			// atd->activeCommand when it went on the ring
+	IOByteCount							startOffset;
+	UInt32								length;
+	UInt32								firstTRB;
+	UInt32								numTRBs;
+	SInt16								completionIndex;
+	bool								ioc;
+	bool								last;
+	UInt64								startedNS;			// 0 until the device gets to it
+	UInt64								doneNS;
+};
+
+struct SimEvent
+{
+	UInt64						timeNS;
+	SInt16						completionIndex;
+	UInt32						residual;
+	IOReturn					status;
+};
+
+struct SimConfig;
+struct SimRun;
+
+//
+// The stand-in controller: the members and methods of AppleUSBXHCI that AppleXHCIAsyncEndpoint calls, plus the
+// simulated device behind one endpoint
+//
+class AppleUSBXHCI
+{
+public:
+	// Called by AppleXHCIAsyncEndpoint
+	IOReturn					_createTransfer(void *pTD, bool isocTransfer, IOByteCount transferSize, UInt32 offsCOverride, IOByteCount startOffset,
+												bool interruptNeeded, bool fragmentedTD, UInt32 *firstTRBIndex, UInt32 *numTRBs, bool noLogging, SInt16 *completionIndex = NULL);
+	bool						CanTDFragmentFit(XHCIRing *ring, UInt32 fragmentTransferSize);
+	static int					DiffTRBIndex(USBPhysicalAddress64 t1, USBPhysicalAddress64 t2);
+	void						SetTRDQPtr(int slotID, int endpointID, UInt32 stream, int dQindex);
+	void						StartEndpoint(int slotID, int endpointID, UInt16 streamID = 0);
+	void						QuiesceEndpoint(int slotID, int endpointID);
+	bool						IsStreamsEndpoint(int slotID, int endpointID);
+	void						RestartStreams(int slotID, int endpointID, UInt32 except);
+	void						Complete(IOUSBCompletion completion, IOReturn status, UInt32 actualByteCount);
+	int							getRootPortNumber(int slotID);
+	void						PrintTRB(int level, TRB *trb, const char *s);
+	void						PrintRing(XHCIRing *ring);
+	OSObject *					getProperty(const char *key);
+	bool						setProperty(const char *key, OSObject *object);
+	void						removeProperty(const char *key);
+
+	bool						_controllerAvailable;
+	struct
+	{
+		bool					deviceNeedsReset;
+	}							_slots[kSimMaxSlots];
+	struct
+	{
+		UInt64					totalBytes;
+		UInt32					timeouts;
+		struct
+		{
+			UInt64				totalBytes;
+			UInt32				timeouts;
+		}						portCounts[kSimMaxPorts];
+	}							_UIMDiagnostics;
+
+	// The simulation
+	bool						SimInit(const SimConfig *config);
+	void						SimFree(void);
+	void						SimDeviceKick(void);
+	void						SimDeviceFinish(void);
+	void						SimDeliverEvent(void);
+	void						SimFrame(UInt32 frame);
+	UInt64						SimNextDeviceNS(void);
+	UInt64						SimNextEventNS(void);
+	UInt32						SimFreeTRBs(void);
+	UInt32						SimNextTRB(UInt32 index);
+	void						SimPostEvent(SInt16 completionIndex, UInt32 residual, IOReturn status);
+
+	const SimConfig *			_config;
+	OSDictionary *				_properties;
+	XHCIRing					_ring;
+	AppleXHCIAsyncEndpoint *	_endpoint;
+	AppleXHCIAsyncTimerWheel *	_timerWheel;
+
+	SimHWTD						_hw[kSimMaxHWTDs];
+	UInt32						_hwHead;
+	UInt32						_hwCount;
+	SimEvent					_events[kSimMaxEvents];
+	UInt32						_eventHead;
+	UInt32						_eventCount;
+	bool						_running;					// doorbell rung and not stopped
+	bool						_halted;					// error or short intermediate fragment, until SetTRDQPtr
+	bool						_silent;					// the device has stopped answering
+	UInt64						_lastEventNS;
+
+	UInt32						_doorbells;
+	UInt32						_eventsPosted;
+	UInt32						_staleEvents;				// events for a completionIndex not on the activeQueue
+	UInt32						_lostTDs;					// TDs dropped by SetTRDQPtr whose ATD was still scheduled
+	UInt32						_setTRDQPtrs;
+	UInt32						_quiesces;
+	UInt32						_createFailures;
+	UInt32						_wheelExpirations;			// timers ServiceTimeouts handed to the endpoint
+	UInt32						_maxExpirationsPerFrame;
+};
+
+#include "AppleUSBXHCI_AsyncQueues.cpp"
+
+
+#pragma mark Workload
+
+struct SimConfig
+{
+	const char *				name;
+	const char *				description;
+	UInt32						commands;					// to complete
+	UInt32						commandSize;
+	UInt32						queueDepth;					// commands outstanding
+	UInt32						streams;					// 0 for a plain bulk endpoint
+	UInt32						heavySize;					// with streams, stream 1's commands are this big
+	UInt32						ringTRBs;
+	UInt16						maxPacketSize;
+	UInt16						maxBurst;
+	UInt16						mult;
+	UInt32						bytesPerUS;					// device rate
+	UInt32						tdOverheadNS;
+	UInt32						eventLatencyNS;
+	UInt32						shortEvery;					// every Nth command comes up short half way through, 0 for never
+	UInt32						stallEvery;					// every Nth command stalls on its first TD, 0 for never
+	UInt32						silentAfter;				// the device stops answering after this many completions, 0 for never
+	UInt32						noDataTimeout;				// ms, on every command
+	UInt32						completionTimeout;			// ms, on every command
+	UInt32						fragmentPolicy;
+	UInt32						fragmentsPerInterrupt;
+	UInt32						pinnedFragmentSize;			// set as the endpoint's kAppleXHCIAsyncFragmentSizeKeyPrefix property, 0 for none
+};
+
+struct SimCommand
+{
+	IOUSBCommand *				command;
+	IODMACommand *				dmaCommand;
+	IOMemoryDescriptor *		memory;
+	SimRun *					run;
+	UInt32						serial;
+	UInt16						streamID;
+	UInt32						reqCount;
+	UInt32						shortAt;					// bytes the device will move before coming up short, reqCount for all of them
+	bool						stall;
+	bool						outstanding;
+	UInt64						submitNS;
+	SimCommand *				resubmitNext;
+};
+
+struct SimRun
+{
+	const SimConfig *			config;
+	AppleUSBXHCI *				controller;
+	SimCommand *				commands;					// queueDepth of them, reused as they complete
+	SimCommand *				resubmitQueue;
+	UInt32						issued;
+	UInt32						completed;
+	UInt32						doubleCompletions;
+	UInt32						wrongByteCounts;
+	UInt32						successes;
+	UInt32						shorts;
+	UInt32						stalls;
+	UInt32						timeouts;
+	UInt32						otherErrors;
+	UInt64						bytes;
+	UInt64 *					latencyNS;					// per completed command
+	UInt64						silentNS;					// when the device stopped answering
+	UInt64						maxTimeoutLateNS;			// longest from the later of submit/silence to a timeout completion
+	UInt64						minTimeoutLateNS;			// ... and shortest
+	UInt64						hostNS;						// host time in CreateTDs/ScheduleTDs/event handling/UpdateTimeouts
+	UInt64						firstSubmitNS;
+	UInt64						lastCompleteNS;
+	UInt32						streamCompleted[kSimMaxStreams];
+	UInt64						streamMaxLatencyNS[kSimMaxStreams];
+};
+
+static bool		gPrintTelemetry = false;
+
+static UInt64
+HostNS(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((UInt64)ts.tv_sec * 1000000000ULL) + (UInt64)ts.tv_nsec;
+}
+
+
+#pragma mark Stand-in AppleUSBXHCI
+
+bool
+AppleUSBXHCI::SimInit(const SimConfig *config)
+{
+	_config					= config;
+	_controllerAvailable	= true;
+	_properties				= OSDictionary::withCapacity(8);
+
+	bzero(&_ring, sizeof(_ring));
+	_ring.transferRingSize	= (UInt16)config->ringTRBs;
+	_ring.transferRing		= (TRB*)calloc(config->ringTRBs, sizeof(TRB));
+	_ring.transferRingPhys	= 0x80000000ULL;
+	_ring.transferRingPCS	= 1;
+	_ring.slotID			= kSimSlotID;
+	_ring.endpointID		= kSimEndpointID;
+
+	if (config->fragmentPolicy != kXHCIAsyncFragmentPolicyFixed)
+	{
+		OSNumber *number = OSNumber::withNumber(config->fragmentPolicy, 32);
+		setProperty(kAppleXHCIAsyncFragmentPolicyKey, number);
+		number->release();
+	}
+	if (config->fragmentsPerInterrupt > 1)
+	{
+		OSNumber *number = OSNumber::withNumber(config->fragmentsPerInterrupt, 32);
+		setProperty(kAppleXHCIAsyncFragmentsPerInterruptKey, number);
+		number->release();
+	}
+	if (config->pinnedFragmentSize)
+	{
+		OSNumber	*number = OSNumber::withNumber(config->pinnedFragmentSize, 32);
+		char		key[48];
+
+		snprintf(key, sizeof(key), kAppleXHCIAsyncFragmentSizeKeyPrefix "%d.%d", (int)kSimSlotID, (int)kSimEndpointID);
+		setProperty(key, number);
+		number->release();
+	}
+
+	// What UIMCreateBulkEndpoint does
+	_endpoint = OSTypeAlloc(AppleXHCIAsyncEndpoint);
+	if (!_endpoint || !_endpoint->init(this, &_ring, config->maxPacketSize, config->maxBurst, config->mult))
+	{
+		fprintf(stderr, "could not create the endpoint\n");
+		return false;
+	}
+
+	// The UIM has been servicing the wheel once a frame since the controller started
+	_timerWheel = OSDynamicCast(AppleXHCIAsyncTimerWheel, getProperty(kAppleXHCIAsyncTimerWheelKey));
+	if (_timerWheel == NULL)
+	{
+		fprintf(stderr, "no timer wheel\n");
+		return false;
+	}
+	_timerWheel->ServiceTimeouts((UInt32)(gSimNowNS / kSimFrameNS));
+
+	return true;
+}
+
+void
+AppleUSBXHCI::SimFree(void)
+{
+	// What UIMDeleteEndpoint does
+	_endpoint->Abort();
+	_endpoint->release();
+	_endpoint = NULL;
+
+	_properties->release();
+	::free(_ring.transferRing);
+}
+
+UInt32
+AppleUSBXHCI::SimNextTRB(UInt32 index)
+{
+	// the last TRB of the ring is the Link TRB
+	return ((index + 1) >= (UInt32)(_ring.transferRingSize - 1)) ? 0 : (index + 1);
+}
+
+UInt32
+AppleUSBXHCI::SimFreeTRBs(void)
+{
+	UInt32	usable	= _ring.transferRingSize - 1;
+	UInt32	used	= ((_ring.transferRingEnqueueIdx + usable) - _ring.transferRingDequeueIdx) % usable;
+
+	return usable - 1 - used;
+}
+
+IOReturn
+AppleUSBXHCI::_createTransfer(void *pTD, bool isocTransfer, IOByteCount transferSize, UInt32 offsCOverride, IOByteCount startOffset,
+							  bool interruptNeeded, bool fragmentedTD, UInt32 *firstTRBIndex, UInt32 *numTRBs, bool noLogging, SInt16 *completionIndex)
+{
+	AppleXHCIAsyncTransferDescriptor	*pATD = (AppleXHCIAsyncTransferDescriptor*)pTD;
+	SimHWTD								*hwTD;
+	UInt32								trbs;
+	UInt32								index;
+	UInt32								lastIndex = 0;
+	UInt32								i;
+
+	(void)isocTransfer; (void)offsCOverride; (void)noLogging;
+
+	if (pATD->immediateTransfer || (transferSize == 0))
+		trbs = 1;
+	else
+		trbs = (UInt32)(((startOffset & (PAGE_SIZE - 1)) + transferSize + PAGE_SIZE - 1) / PAGE_SIZE);
+
+	if (fragmentedTD)
+		trbs++;												// Event Data TRB
+
+	if ((trbs > SimFreeTRBs()) || (_hwCount == kSimMaxHWTDs))
+	{
+		_createFailures++;
+		return kIOReturnNoResources;
+	}
+
+	index = _ring.transferRingEnqueueIdx;
+	*firstTRBIndex = index;
+
+	// TRB lengths aren't modelled, the first TRB stands for the whole TD as the Stop TRB does in SimFrame
+	bzero(&_ring.transferRing[index], sizeof(TRB));
+	_ring.transferRing[index].offs8 = HostToUSBLong((UInt32)transferSize & kXHCITRB_TR_Len_Mask);
+	for (i = 0; i < trbs; i++)
+	{
+		lastIndex	= index;
+		index		= SimNextTRB(index);
+	}
+	_ring.transferRingEnqueueIdx = (UInt16)index;
+
+	*numTRBs = trbs;
+	if (completionIndex)
+		*completionIndex = (SInt16)lastIndex;
+
+	hwTD = &_hw[(_hwHead + _hwCount) % kSimMaxHWTDs];
+	bzero(hwTD, sizeof(*hwTD));
+	hwTD->atd				= pATD;
+	hwTD->command			= pATD->activeCommand;
+	hwTD->startOffset		= startOffset;
+	hwTD->length			= (UInt32)transferSize;
+	hwTD->firstTRB			= *firstTRBIndex;
+	hwTD->numTRBs			= trbs;
+	hwTD->completionIndex	= (SInt16)lastIndex;
+	hwTD->ioc				= interruptNeeded;
+	hwTD->last				= pATD->last;
+	_hwCount++;
+
+	return kIOReturnSuccess;
+}
+
+bool
+AppleUSBXHCI::CanTDFragmentFit(XHCIRing *ring, UInt32 fragmentTransferSize)
+{
+	(void)ring;
+	return SimFreeTRBs() >= ((fragmentTransferSize / PAGE_SIZE) + kAccountForAlignment);
+}
+
+int
+AppleUSBXHCI::DiffTRBIndex(USBPhysicalAddress64 t1, USBPhysicalAddress64 t2)
+{
+	return (int)((t1 - t2) / sizeof(TRB));
+}
+
+void
+AppleUSBXHCI::SetTRDQPtr(int slotID, int endpointID, UInt32 stream, int dQindex)
+{
+	(void)slotID; (void)endpointID; (void)stream;
+
+	_setTRDQPtrs++;
+
+	// Everything between the old and the new dequeue pointer is gone from the ring
+	while ((_hwCount != 0) && (_hw[_hwHead].firstTRB != (UInt32)dQindex))
+	{
+		SimHWTD *hwTD = &_hw[_hwHead];
+
+		if (hwTD->atd->scheduled && (hwTD->atd->activeCommand == hwTD->command))
+			_lostTDs++;
+
+		_hwHead = (_hwHead + 1) % kSimMaxHWTDs;
+		_hwCount--;
+	}
+
+	if (_hwCount != 0)
+	{
+		_hw[_hwHead].startedNS	= 0;
+		_hw[_hwHead].doneNS		= 0;
+	}
+
+	_ring.transferRingDequeueIdx = (UInt16)dQindex;
+	_halted = false;
+}
+
+void
+AppleUSBXHCI::StartEndpoint(int slotID, int endpointID, UInt16 streamID)
+{
+	(void)slotID; (void)endpointID; (void)streamID;
+
+	_doorbells++;
+	_running = true;
+	SimDeviceKick();
+}
+
+void
+AppleUSBXHCI::QuiesceEndpoint(int slotID, int endpointID)
+{
+	(void)slotID; (void)endpointID;
+
+	_quiesces++;
+	_running = false;
+
+	// The TD the device was in the middle of will be started over
+	if (_hwCount != 0)
+	{
+		_hw[_hwHead].startedNS	= 0;
+		_hw[_hwHead].doneNS		= 0;
+	}
+}
+
+bool
+AppleUSBXHCI::IsStreamsEndpoint(int slotID, int endpointID)
+{
+	(void)slotID; (void)endpointID;
+	return _config->streams != 0;
+}
+
+void
+AppleUSBXHCI::RestartStreams(int slotID, int endpointID, UInt32 except)
+{
+	(void)except;
+	StartEndpoint(slotID, endpointID, 0);
+}
+
+void
+AppleUSBXHCI::Complete(IOUSBCompletion completion, IOReturn status, UInt32 actualByteCount)
+{
+	if (completion.action)
+		(*completion.action)(completion.target, completion.parameter, status, actualByteCount);
+}
+
+int
+AppleUSBXHCI::getRootPortNumber(int slotID)
+{
+	(void)slotID;
+	return 1;
+}
+
+void
+AppleUSBXHCI::PrintTRB(int level, TRB *trb, const char *s)
+{
+	USBLog(level, "AppleUSBXHCI::PrintTRB - %s %08x %08x %08x %08x", s, trb->offs0, trb->offs4, trb->offs8, trb->offsC);
+}
+
+void
+AppleUSBXHCI::PrintRing(XHCIRing *ring)
+{
+	USBLog(1, "AppleUSBXHCI::PrintRing - size %d enqueue %d dequeue %d", ring->transferRingSize, ring->transferRingEnqueueIdx, ring->transferRingDequeueIdx);
+}
+
+OSObject *
+AppleUSBXHCI::getProperty(const char *key)
+{
+	return _properties->getObject(key);
+}
+
+bool
+AppleUSBXHCI::setProperty(const char *key, OSObject *object)
+{
+	return _properties->setObject(key, object);
+}
+
+void
+AppleUSBXHCI::removeProperty(const char *key)
+{
+	_properties->removeObject(key);
+}
+
+
+#pragma mark Simulated device
+
+void
+AppleUSBXHCI::SimPostEvent(SInt16 completionIndex, UInt32 residual, IOReturn status)
+{
+	SimEvent	*event;
+	UInt64		when = gSimNowNS + _config->eventLatencyNS;
+
+	if (_eventCount == kSimMaxEvents)
+	{
+		fprintf(stderr, "event ring overflow\n");
+		exit(1);
+	}
+
+	// the event ring is in order
+	if (when < _lastEventNS)
+		when = _lastEventNS;
+	_lastEventNS = when;
+
+	event = &_events[(_eventHead + _eventCount) % kSimMaxEvents];
+	event->timeNS			= when;
+	event->completionIndex	= completionIndex;
+	event->residual			= residual;
+	event->status			= status;
+	_eventCount++;
+	_eventsPosted++;
+}
+
+void
+AppleUSBXHCI::SimDeviceKick(void)
+{
+	SimHWTD		*hwTD;
+
+	if (!_running || _halted || _silent || (_hwCount == 0))
+		return;
+
+	hwTD = &_hw[_hwHead];
+	if (hwTD->startedNS != 0)
+		return;
+
+	hwTD->startedNS	= gSimNowNS;
+	hwTD->doneNS	= gSimNowNS + _config->tdOverheadNS + (((UInt64)hwTD->length * 1000) / _config->bytesPerUS);
+}
+
+UInt64
+AppleUSBXHCI::SimNextDeviceNS(void)
+{
+	if (!_running || _halted || _silent || (_hwCount == 0) || (_hw[_hwHead].startedNS == 0))
+		return kSimNever;
+
+	return _hw[_hwHead].doneNS;
+}
+
+UInt64
+AppleUSBXHCI::SimNextEventNS(void)
+{
+	return _eventCount ? _events[_eventHead].timeNS : kSimNever;
+}
+
+void
+AppleUSBXHCI::SimDeviceFinish(void)
+{
+	SimHWTD		hwTD = _hw[_hwHead];
+	SimCommand	*simCommand = (SimCommand*)hwTD.command->GetUSLCompletion().parameter;
+	UInt32		residual = 0;
+	IOReturn	status = kIOReturnSuccess;
+	bool		event = hwTD.ioc;
+
+	_hwHead = (_hwHead + 1) % kSimMaxHWTDs;
+	_hwCount--;
+
+	if (simCommand->stall && (hwTD.startOffset == 0))
+	{
+		status		= kIOUSBPipeStalled;
+		residual	= hwTD.length;
+		event		= true;
+		_halted		= true;
+	}
+	else if (simCommand->shortAt < (hwTD.startOffset + hwTD.length))
+	{
+		residual	= (UInt32)((hwTD.startOffset + hwTD.length) - ((simCommand->shortAt > hwTD.startOffset) ? simCommand->shortAt : hwTD.startOffset));
+		event		= true;
+		if (!hwTD.last)
+			_halted	= true;
+	}
+
+	if (event)
+		SimPostEvent(hwTD.completionIndex, residual, status);
+
+	SimDeviceKick();
+}
+
+//
+// What the UIM's transfer event handler does for an async endpoint
+//
+void
+AppleUSBXHCI::SimDeliverEvent(void)
+{
+	SimEvent							event = _events[_eventHead];
+	AppleXHCIAsyncTransferDescriptor	*pTD;
+
+	_eventHead = (_eventHead + 1) % kSimMaxEvents;
+	_eventCount--;
+
+	pTD = _endpoint->GetTDFromActiveQueueWithIndex(event.completionIndex);
+	if (pTD == NULL)
+	{
+		_staleEvents++;
+		return;
+	}
+
+	_ring.transferRingDequeueIdx = (UInt16)SimNextTRB(event.completionIndex);
+	pTD->shortfall = event.residual;
+
+	if (event.status != kIOReturnSuccess)
+	{
+		_endpoint->ScavengeTDs(pTD, event.status, true, true);
+	}
+	else if ((event.residual != 0) && !pTD->last)
+	{
+		// short packet on an intermediate fragment, the rest of the command goes back with it
+		_endpoint->ScavengeTDs(pTD, kIOReturnSuccess, true, true);
+	}
+	else
+	{
+		_endpoint->ScavengeTDs(pTD, kIOReturnSuccess, true, false);
+	}
+}
+
+void
+AppleUSBXHCI::SimFrame(UInt32 frame)
+{
+	// What a Stop Endpoint would leave in the Stop TRB: where the device is and how much of that TD is left
+	bzero(&_ring.stopTRB, sizeof(_ring.stopTRB));
+	if (_hwCount != 0)
+	{
+		SimHWTD		*hwTD = &_hw[_hwHead];
+		UInt64		phys = _ring.transferRingPhys + ((UInt64)hwTD->firstTRB * sizeof(TRB));
+		UInt32		left = hwTD->length;
+
+		if ((hwTD->startedNS != 0) && (gSimNowNS > (hwTD->startedNS + _config->tdOverheadNS)))
+		{
+			UInt64 moved = ((gSimNowNS - hwTD->startedNS - _config->tdOverheadNS) * _config->bytesPerUS) / 1000;
+			left = (moved >= left) ? 0 : (UInt32)(left - moved);
+		}
+
+		_ring.stopTRB.offs0 = (UInt32)phys;
+		_ring.stopTRB.offs4 = (UInt32)(phys >> 32);
+		_ring.stopTRB.offs8 = left & kXHCITRB_TR_Len_Mask;
+	}
+
+	// What the UIM's frame timer does for all of its async endpoints
+	UInt32 expired = _timerWheel->ServiceTimeouts(frame);
+
+	_wheelExpirations += expired;
+	if (expired > _maxExpirationsPerFrame)
+		_maxExpirationsPerFrame = expired;
+}
+
+
+#pragma mark Workload
+
+static void		SimCommandDone(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+static void
+SubmitCommand(SimRun *run, SimCommand *simCommand)
+{
+	const SimConfig		*config = run->config;
+	IOUSBCommand		*command = simCommand->command;
+	UInt32				serial = run->issued++;
+	IOReturn			status;
+	UInt64				start;
+
+	simCommand->serial		= serial;
+	simCommand->streamID	= config->streams ? (UInt16)(1 + ((simCommand - run->commands) % config->streams)) : 0;	// each stream keeps its share of the queue depth
+	simCommand->reqCount	= (config->streams && config->heavySize && (simCommand->streamID == 1)) ? config->heavySize : config->commandSize;
+	simCommand->shortAt		= simCommand->reqCount;
+	simCommand->stall		= config->stallEvery && ((serial % config->stallEvery) == (config->stallEvery - 1));
+	simCommand->submitNS	= gSimNowNS;
+	simCommand->outstanding	= true;
+
+	if (config->shortEvery && ((serial % config->shortEvery) == (config->shortEvery - 1)))
+		simCommand->shortAt = (simCommand->reqCount / 2) & ~(UInt32)(config->maxPacketSize - 1);
+
+	bzero(command->_UIMScratch, sizeof(command->_UIMScratch));
+	command->_selector					= READ;
+	command->_reqCount					= simCommand->reqCount;
+	command->_noDataTimeout				= config->noDataTimeout;
+	command->_completionTimeout			= config->completionTimeout;
+	command->_uslCompletion.target		= run;
+	command->_uslCompletion.action		= SimCommandDone;
+	command->_uslCompletion.parameter	= simCommand;
+	simCommand->memory->_length			= simCommand->reqCount;
+
+	if (run->firstSubmitNS == 0)
+		run->firstSubmitNS = gSimNowNS;
+
+	// What UIMCreateBulkTransfer does
+	start = HostNS();
+	status = run->controller->_endpoint->CreateTDs(command, simCommand->streamID);
+	if (status == kIOReturnSuccess)
+		run->controller->_endpoint->ScheduleTDs();
+	run->hostNS += HostNS() - start;
+
+	if (status != kIOReturnSuccess)
+	{
+		fprintf(stderr, "%s: CreateTDs returned 0x%x\n", config->name, status);
+		SimCommandDone(run, simCommand, status, simCommand->reqCount);
+	}
+}
+
+static void
+SimCommandDone(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	SimRun		*run = (SimRun*)target;
+	SimCommand	*simCommand = (SimCommand*)parameter;
+	UInt32		expected;
+	UInt64		latency = gSimNowNS - simCommand->submitNS;
+
+	if (!simCommand->outstanding)
+	{
+		run->doubleCompletions++;
+		return;
+	}
+	simCommand->outstanding = false;
+
+	expected = simCommand->reqCount - simCommand->shortAt;
+
+	if (status == kIOReturnSuccess)
+	{
+		if (bufferSizeRemaining != expected)
+			run->wrongByteCounts++;
+		if (expected)
+			run->shorts++;
+		else
+			run->successes++;
+	}
+	else if (status == kIOUSBPipeStalled)
+		run->stalls++;
+	else if (status == kIOUSBTransactionTimeout)
+	{
+		UInt64 from = (simCommand->submitNS > run->silentNS) ? simCommand->submitNS : run->silentNS;
+
+		run->timeouts++;
+		if ((gSimNowNS - from) > run->maxTimeoutLateNS)
+			run->maxTimeoutLateNS = gSimNowNS - from;
+		if ((run->minTimeoutLateNS == 0) || ((gSimNowNS - from) < run->minTimeoutLateNS))
+			run->minTimeoutLateNS = gSimNowNS - from;
+	}
+	else
+		run->otherErrors++;
+
+	run->bytes += simCommand->reqCount - bufferSizeRemaining;
+	run->latencyNS[run->completed++] = latency;
+	run->lastCompleteNS = gSimNowNS;
+	if (simCommand->streamID < kSimMaxStreams)
+	{
+		run->streamCompleted[simCommand->streamID]++;
+		if (latency > run->streamMaxLatencyNS[simCommand->streamID])
+			run->streamMaxLatencyNS[simCommand->streamID] = latency;
+	}
+
+	if (run->config->silentAfter && (run->completed == run->config->silentAfter))
+	{
+		run->controller->_silent	= true;
+		run->silentNS				= gSimNowNS;
+	}
+
+	// the client sends the next one once its completion routine has returned
+	if (run->issued < run->config->commands)
+	{
+		simCommand->resubmitNext	= run->resubmitQueue;
+		run->resubmitQueue			= simCommand;
+	}
+}
+
+static int
+CompareUInt64(const void *a, const void *b)
+{
+	UInt64	x = *(const UInt64*)a;
+	UInt64	y = *(const UInt64*)b;
+
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void
+PrintSerialized(const char *title, OSObject *object)
+{
+	OSSerialize		s;
+
+	if (object == NULL)
+		return;
+
+	s.out		= stdout;
+	s.prefix	= "        ";
+	printf("    %s\n", title);
+	object->serialize(&s);
+}
+
+static void
+AllocCommands(SimRun *run, UInt32 count)
+{
+	UInt32	i;
+
+	run->commands = (SimCommand*)calloc(count, sizeof(SimCommand));
+
+	for (i = 0; i < count; i++)
+	{
+		SimCommand *simCommand = &run->commands[i];
+
+		simCommand->run						= run;
+		simCommand->command					= new IOUSBCommand;
+		simCommand->dmaCommand				= new IODMACommand;
+		simCommand->memory					= new IOMemoryDescriptor;
+		simCommand->dmaCommand->_memory		= simCommand->memory;
+		simCommand->command->_dmaCommand	= simCommand->dmaCommand;
+		simCommand->command->_buffer		= simCommand->memory;
+	}
+}
+
+static void
+FreeCommands(SimRun *run, UInt32 count)
+{
+	UInt32	i;
+
+	for (i = 0; i < count; i++)
+	{
+		run->commands[i].command->release();
+		run->commands[i].dmaCommand->release();
+		run->commands[i].memory->release();
+	}
+	::free(run->commands);
+	run->commands = NULL;
+}
+
+static bool
+RunScenario(const SimConfig *config)
+{
+	AppleUSBXHCI	*controller = new AppleUSBXHCI;
+	SimRun			run;
+	UInt32			i;
+	UInt32			nextFrame;
+	bool			ok = true;
+	UInt64			elapsedNS;
+	UInt32			startFragmentSize;
+	UInt32			fragmentSize;
+	UInt64			peerWorstNS[2] = { kSimNever, 0 };			// best and worst of the streams' worst case latencies, heavy stream aside
+	double			fairness = 0.0;
+
+	bzero(controller, sizeof(*controller));
+	bzero(&run, sizeof(run));
+
+	gSimNowNS = kSimStartNS;
+
+	if (!controller->SimInit(config))
+		return false;
+
+	startFragmentSize	= controller->_endpoint->GetFragmentSize();
+	run.config			= config;
+	run.controller		= controller;
+	run.latencyNS		= (UInt64*)calloc(config->commands, sizeof(UInt64));
+	AllocCommands(&run, config->queueDepth);
+
+	for (i = 0; (i < config->queueDepth) && (run.issued < config->commands); i++)
+		SubmitCommand(&run, &run.commands[i]);
+
+	nextFrame = (UInt32)(gSimNowNS / kSimFrameNS) + 1;
+
+	while (run.completed < config->commands)
+	{
+		UInt64	deviceNS	= controller->SimNextDeviceNS();
+		UInt64	eventNS		= controller->SimNextEventNS();
+		UInt64	frameNS		= (UInt64)nextFrame * kSimFrameNS;
+		UInt64	start;
+
+		if (frameNS > (kSimStartNS + kSimTimeLimitNS))
+		{
+			fprintf(stderr, "%s: stuck with %d of %d commands completed\n", config->name, (int)run.completed, (int)config->commands);
+			ok = false;
+			break;
+		}
+
+		start = HostNS();
+		if ((eventNS <= deviceNS) && (eventNS <= frameNS))
+		{
+			gSimNowNS = eventNS;
+			controller->SimDeliverEvent();
+		}
+		else if (deviceNS <= frameNS)
+		{
+			gSimNowNS = deviceNS;
+			controller->SimDeviceFinish();
+		}
+		else
+		{
+			gSimNowNS = frameNS;
+			controller->SimFrame(nextFrame++);
+		}
+		run.hostNS += HostNS() - start;
+
+		while (run.resubmitQueue)
+		{
+			SimCommand *simCommand = run.resubmitQueue;
+
+			run.resubmitQueue = simCommand->resubmitNext;
+			SubmitCommand(&run, simCommand);
+		}
+	}
+
+	// Everything went back exactly once, and nothing was left behind on the endpoint or the ring
+	if (run.doubleCompletions || run.wrongByteCounts || controller->_staleEvents || controller->_lostTDs || controller->_createFailures)
+		ok = false;
+	if (controller->_endpoint->onReadyQueue || controller->_endpoint->onActiveQueue || controller->_endpoint->onDoneQueue || controller->_hwCount)
+		ok = false;
+	if (!config->silentAfter && (controller->_ring.transferRingEnqueueIdx != controller->_ring.transferRingDequeueIdx))
+		ok = false;
+	fragmentSize = controller->_endpoint->GetFragmentSize();
+	if ((config->fragmentPolicy == kXHCIAsyncFragmentPolicyAdaptive) && (config->commandSize > startFragmentSize) && (fragmentSize <= startFragmentSize))
+		ok = false;
+	if (config->pinnedFragmentSize && ((startFragmentSize != config->pinnedFragmentSize) || (fragmentSize != config->pinnedFragmentSize)))
+		ok = false;
+	if (config->silentAfter && (run.maxTimeoutLateNS > ((UInt64)((config->noDataTimeout ? config->noDataTimeout : config->completionTimeout) + 2) * kSimFrameNS)))
+		ok = false;
+	if (config->silentAfter && (run.minTimeoutLateNS <= ((UInt64)(config->noDataTimeout ? config->noDataTimeout : config->completionTimeout) * kSimFrameNS)))
+		ok = false;
+	if (controller->_wheelExpirations > run.timeouts)
+		ok = false;
+
+	// Streams sending the same commands have to see about the same worst case, and a heavy stream's backlog must not
+	// make the small commands wait longer than its own
+	if (config->streams > 1)
+	{
+		for (i = (config->heavySize ? 2 : 1); (i <= config->streams) && (i < kSimMaxStreams); i++)
+		{
+			if (run.streamMaxLatencyNS[i] < peerWorstNS[0])
+				peerWorstNS[0] = run.streamMaxLatencyNS[i];
+			if (run.streamMaxLatencyNS[i] > peerWorstNS[1])
+				peerWorstNS[1] = run.streamMaxLatencyNS[i];
+		}
+		fairness = peerWorstNS[0] ? ((double)peerWorstNS[1] / (double)peerWorstNS[0]) : 0.0;
+		if ((fairness == 0.0) || (fairness > kSimStreamFairness))
+			ok = false;
+		if (config->heavySize && (peerWorstNS[1] > run.streamMaxLatencyNS[1]))
+			ok = false;
+	}
+
+	elapsedNS = run.lastCompleteNS - run.firstSubmitNS;
+	qsort(run.latencyNS, run.completed, sizeof(UInt64), CompareUInt64);
+
+	printf("%-18s %6d %8d %3d %7.1f %8.0f %8.1f %8.1f %7d %6d %6d %6d %7.0f  %s\n",
+		   config->name, (int)run.completed, (int)config->commandSize, (int)config->queueDepth,
+		   elapsedNS ? ((double)run.bytes * 1000.0 / (double)elapsedNS) : 0.0,
+		   elapsedNS ? ((double)run.completed * 1e9 / (double)elapsedNS) : 0.0,
+		   run.completed ? (double)run.latencyNS[run.completed / 2] / 1000.0 : 0.0,
+		   run.completed ? (double)run.latencyNS[(run.completed * 99) / 100] / 1000.0 : 0.0,
+		   (int)fragmentSize, (int)controller->_doorbells, (int)controller->_eventsPosted,
+		   (int)controller->_endpoint->_interruptsSaved,
+		   run.completed ? (double)run.hostNS / (double)run.completed : 0.0,
+		   ok ? "ok" : "FAIL");
+
+	if (!ok || (gSimLogLevel > 0))
+	{
+		printf("    completed %d (ok %d short %d stall %d timeout %d other %d) double %d wrong bytes %d stale events %d lost TDs %d ring full %d\n",
+			   (int)run.completed, (int)run.successes, (int)run.shorts, (int)run.stalls, (int)run.timeouts, (int)run.otherErrors,
+			   (int)run.doubleCompletions, (int)run.wrongByteCounts, (int)controller->_staleEvents, (int)controller->_lostTDs, (int)controller->_createFailures);
+		printf("    queues ready %d active %d done %d, ring TDs %d enqueue %d dequeue %d\n",
+			   (int)controller->_endpoint->onReadyQueue, (int)controller->_endpoint->onActiveQueue, (int)controller->_endpoint->onDoneQueue,
+			   (int)controller->_hwCount, (int)controller->_ring.transferRingEnqueueIdx, (int)controller->_ring.transferRingDequeueIdx);
+	}
+	if (config->silentAfter)
+	{
+		printf("    %d timeouts, %.1f to %.1f ms after the device went quiet or the command was sent (limits %d and %d ms)\n",
+			   (int)run.timeouts, (double)run.minTimeoutLateNS / 1e6, (double)run.maxTimeoutLateNS / 1e6,
+			   (int)(config->noDataTimeout ? config->noDataTimeout : config->completionTimeout), (int)((config->noDataTimeout ? config->noDataTimeout : config->completionTimeout) + 2));
+	}
+	if (config->silentAfter || config->noDataTimeout || config->completionTimeout || (gSimLogLevel > 0))
+	{
+		printf("    timer wheel: %d expirations over %d frames, at most %d in a frame (limit: one per timeout)\n",
+			   (int)controller->_wheelExpirations, (int)(elapsedNS / kSimFrameNS), (int)controller->_maxExpirationsPerFrame);
+	}
+	if (config->streams)
+	{
+		printf("    ");
+		for (i = 1; (i <= config->streams) && (i < kSimMaxStreams); i++)
+			printf("stream %d: %d done, worst %.1f us  ", (int)i, (int)run.streamCompleted[i], (double)run.streamMaxLatencyNS[i] / 1000.0);
+		printf("\n    worst case max/min %.2f over the streams sending %dK commands (limit %.1f)\n", fairness, (int)(config->commandSize / 1024), kSimStreamFairness);
+	}
+	if (gPrintTelemetry)
+	{
+		PrintSerialized("ATD pool", controller->getProperty(kAppleXHCIAsyncTDPoolKey));
+		PrintSerialized("timer wheel", controller->getProperty(kAppleXHCIAsyncTimerWheelKey));
+		PrintSerialized("endpoint telemetry", controller->_endpoint->_telemetry);
+	}
+
+	controller->SimFree();
+
+	FreeCommands(&run, config->queueDepth);
+	::free(run.latencyNS);
+	delete controller;
+
+	return ok;
+}
+
+
+#pragma mark Scenarios
+
+//
+//	name				description
+//	commands size qd streams heavy ringTRBs mps burst mult MB/us overheadNS latencyNS shortEvery stallEvery silentAfter noData completion policy moderation [pinned]
+//
+static const SimConfig gScenarios[] =
+{
+	{ "ss-512k-qd4",		"SuperSpeed bulk IN, 512K commands, 4 outstanding",
+	  2000, 512*1024, 4, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-16k-qd32",		"SuperSpeed bulk IN, 16K commands, 32 outstanding",
+	  20000, 16*1024, 32, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-4k-qd1",			"SuperSpeed bulk IN, 4K commands one at a time (completion latency)",
+	  5000, 4*1024, 1, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-1m-moderated",	"SuperSpeed bulk IN, 1M commands, IOC on every 4th intermediate fragment, 1024 TRB ring",
+	  1000, 1024*1024, 2, 0, 0, 1024, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 4 },
+	{ "ss-1m-adaptive",		"SuperSpeed bulk IN, 1M commands, adaptive fragment size",
+	  1000, 1024*1024, 2, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyAdaptive, 1 },
+	{ "ss-1m-adaptive-qd8",	"SuperSpeed bulk IN, 1M commands, 8 outstanding, adaptive fragment size, 1024 TRB ring",
+	  1000, 1024*1024, 8, 0, 0, 1024, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyAdaptive, 1 },
+	{ "ss-1m-pinned",		"SuperSpeed bulk IN, 1M commands, the endpoint's fragment size pinned at 64K",
+	  1000, 1024*1024, 2, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1, 64*1024 },
+	{ "hs-64k-qd8",			"High Speed bulk IN, 64K commands, 8 outstanding",
+	  4000, 64*1024, 8, 0, 0, 256, 512, 0, 0, 40, 1000, 16000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-short",			"512K commands, every 3rd comes up short half way through",
+	  1500, 512*1024, 4, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 3, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-stall",			"512K commands, every 5th stalls on its first TD",
+	  1500, 512*1024, 4, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 5, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-streams",			"4 streams sharing the ring, stream 1 sends 1M commands and the others 4K",
+	  4000, 4*1024, 16, 4, 1024*1024, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-streams-64k",		"4 streams sharing the ring, all sending 64K commands",
+	  4000, 64*1024, 16, 4, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-512k-timeouts",	"512K commands, 4 outstanding, 20ms no data and 1s completion timeouts which never go off",
+	  2000, 512*1024, 4, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 20, 1000, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-nodata-timeout",	"the device stops answering after 10 commands, 30ms no data timeout",
+	  16, 64*1024, 1, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 10, 30, 0, kXHCIAsyncFragmentPolicyFixed, 1 },
+	{ "ss-compl-timeout",	"the device stops answering after 10 commands, 50ms completion timeout",
+	  16, 64*1024, 1, 0, 0, 256, 1024, 15, 0, 400, 2000, 8000, 0, 0, 10, 0, 50, kXHCIAsyncFragmentPolicyFixed, 1 },
+};
+
+#define kNumScenarios	(sizeof(gScenarios) / sizeof(gScenarios[0]))
+
+
+#pragma mark activeQueue lookup
+
+//
+// How long GetTDFromActiveQueueWithIndex takes to find the ATD for a transfer event with the activeQueue this deep:
+//
+// - list walk		no index table, its allocation is failed through gSimIOMallocFailSize
+// - table+retire	the index table, with kLookupStreams streams sharing the ring and stream 1's ATDs scheduled without
+//					IOC, so every event for the other streams has RetireTDsBefore look for ATDs to retire ahead of it
+// - table			the index table, with nothing on the ring scheduled without IOC
+//
+// The ring is filled with 4K commands of one TD each and the device is never let run. Each event is for a random ATD
+// on the ring (one with IOC), and the ATD goes back on the tail so the depth stays the same. RetireTDsBefore only
+// looks at the ATDs it retires, so table+retire should cost about the same as table at any depth.
+//
+enum
+{
+	kLookupListWalk		= 0,
+	kLookupTableRetire	= 1,
+	kLookupTable		= 2,
+	kLookupModes		= 3,
+	kLookupStreams		= 4,
+	kLookupIterations	= 200000
+};
+
+static const SimConfig gLookupConfig =
+	{ "lookup",				"activeQueue lookup by completionIndex (list walk vs index table)",
+	  0, 4*1024, 0, 0, 0, 0, 1024, 15, 0, 400, 2000, 8000, 0, 0, 0, 0, 0, kXHCIAsyncFragmentPolicyFixed, 1 };
+
+static bool
+BenchActiveLookup(UInt32 ringTRBs, UInt32 mode, UInt32 *depth, double *nsPerLookup)
+{
+	SimConfig							config = gLookupConfig;
+	AppleUSBXHCI						*controller = new AppleUSBXHCI;
+	AppleXHCIAsyncEndpoint				*endpoint;
+	AppleXHCIAsyncTransferDescriptor	**active;
+	UInt32								*picks;
+	SimRun								run;
+	UInt32								count = 0;
+	UInt32								mismatches = 0;
+	UInt32								i;
+	UInt64								start;
+	bool								ok = true;
+
+	bzero(controller, sizeof(*controller));
+	bzero(&run, sizeof(run));
+
+	config.ringTRBs		= ringTRBs;
+	config.queueDepth	= ringTRBs;
+	config.commands		= ringTRBs;
+	config.streams		= (mode == kLookupTableRetire) ? kLookupStreams : 0;
+	gSimNowNS			= kSimStartNS;
+	gSimIOMallocFailures	= 0;
+	gSimIOMallocFailSize	= (mode == kLookupListWalk) ? (UInt32)(ringTRBs * sizeof(AppleXHCIAsyncTransferDescriptor*)) : 0;
+
+	if (!controller->SimInit(&config))
+		return false;
+
+	endpoint		= controller->_endpoint;
+	run.config		= &config;
+	run.controller	= controller;
+	run.latencyNS	= (UInt64*)calloc(config.commands, sizeof(UInt64));
+	AllocCommands(&run, config.queueDepth);
+
+	for (i = 0; i < config.queueDepth; i++)
+		SubmitCommand(&run, &run.commands[i]);
+
+	if ((endpoint->_activeIndexTable == NULL) != (mode == kLookupListWalk))
+		ok = false;
+
+	active	= (AppleXHCIAsyncTransferDescriptor**)calloc(endpoint->onActiveQueue + 1, sizeof(AppleXHCIAsyncTransferDescriptor*));
+	picks	= (UInt32*)calloc(kLookupIterations, sizeof(UInt32));
+
+	for (AppleXHCIAsyncTransferDescriptor *pATD = endpoint->activeQueue; pATD != NULL; pATD = (pATD == endpoint->activeEnd) ? NULL : pATD->_logicalNext)
+	{
+		if (!pATD->interruptThisTD)
+			ok = false;
+		active[count++] = pATD;
+	}
+
+	if (mode == kLookupTableRetire)
+	{
+		// put the ring back together in the same order with stream 1's ATDs on its retire queue, which none
+		// of the events retire from since the other streams' ATDs are on their own rings
+		for (i = 0; i < count; i++)
+			endpoint->UnlinkTDFromActiveQueue(active[i]);
+
+		for (i = 0; i < count; i++)
+		{
+			if (active[i]->streamID == 1)
+				active[i]->interruptThisTD = false;
+			endpoint->PutTDonActiveQueue(active[i]);
+		}
+	}
+
+	srandom(1);
+	for (i = 0; i < kLookupIterations; i++)
+	{
+		do
+			picks[i] = (UInt32)random() % count;
+		while (!active[picks[i]]->interruptThisTD);
+	}
+
+	start = HostNS();
+	for (i = 0; i < kLookupIterations; i++)
+	{
+		AppleXHCIAsyncTransferDescriptor *pATD = active[picks[i]];
+		AppleXHCIAsyncTransferDescriptor *pFound = endpoint->GetTDFromActiveQueueWithIndex(pATD->completionIndex);
+
+		if (pFound != pATD)
+		{
+			mismatches++;
+			break;
+		}
+		endpoint->PutTDonActiveQueue(pATD);
+	}
+	*nsPerLookup = (double)(HostNS() - start) / (double)kLookupIterations;
+	*depth = count;
+
+	gSimIOMallocFailSize = 0;
+
+	if (mismatches || (endpoint->onActiveQueue != count) || (endpoint->onDoneQueue != 0))
+		ok = false;
+
+	controller->SimFree();
+	FreeCommands(&run, config.queueDepth);
+	::free(run.latencyNS);
+	::free(active);
+	::free(picks);
+	delete controller;
+
+	return ok;
+}
+
+static bool
+RunLookupBench(void)
+{
+	static const UInt32		ringSizes[] = { 64, 256, 1024, 4096 };
+	static const char *		modeNames[kLookupModes] = { "list walk", "table+retire", "table" };
+	unsigned int			i;
+	UInt32					mode;
+	bool					ok = true;
+
+	printf("\n%-18s %6s %8s", "lookup", "ring", "depth");
+	for (mode = 0; mode < kLookupModes; mode++)
+		printf(" %15s", modeNames[mode]);
+	printf("   (ns per event)\n");
+
+	for (i = 0; i < (sizeof(ringSizes) / sizeof(ringSizes[0])); i++)
+	{
+		double	ns[kLookupModes];
+		UInt32	depth = 0;
+		bool	rowOK = true;
+
+		for (mode = 0; mode < kLookupModes; mode++)
+			rowOK = BenchActiveLookup(ringSizes[i], mode, &depth, &ns[mode]) && rowOK;
+
+		printf("%-18s %6d %8d", "", (int)ringSizes[i], (int)depth);
+		for (mode = 0; mode < kLookupModes; mode++)
+			printf(" %15.1f", ns[mode]);
+		printf("   %s\n", rowOK ? "ok" : "FAIL");
+
+		ok = ok && rowOK;
+	}
+
+	return ok;
+}
+
+static void
+Usage(void)
+{
+	unsigned int	i;
+
+	fprintf(stderr, "usage: XHCIAsyncRingSim [-v level] [-t] [scenario ...]\n");
+	for (i = 0; i < kNumScenarios; i++)
+		fprintf(stderr, "\t%-20s %s\n", gScenarios[i].name, gScenarios[i].description);
+	fprintf(stderr, "\t%-20s %s\n", gLookupConfig.name, gLookupConfig.description);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	int				i;
+	unsigned int	j;
+	bool			named = false;
+	bool			ok = true;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-v") && ((i + 1) < argc))
+			gSimLogLevel = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t"))
+			gPrintTelemetry = true;
+		else if (argv[i][0] == '-')
+			Usage();
+	}
+
+	printf("%-18s %6s %8s %3s %7s %8s %8s %8s %7s %6s %6s %6s %7s\n",
+		   "scenario", "cmds", "size", "qd", "MB/s", "cmds/s", "p50 us", "p99 us", "frag", "dbells", "events", "noIOC", "host ns");
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-v"))
+		{
+			i++;
+			continue;
+		}
+		if (argv[i][0] == '-')
+			continue;
+
+		named = true;
+		if (!strcmp(argv[i], gLookupConfig.name))
+		{
+			ok = RunLookupBench() && ok;
+			continue;
+		}
+		for (j = 0; j < kNumScenarios; j++)
+		{
+			if (!strcmp(argv[i], gScenarios[j].name))
+				break;
+		}
+		if (j == kNumScenarios)
+			Usage();
+		ok = RunScenario(&gScenarios[j]) && ok;
+	}
+
+	if (!named)
+	{
+		for (j = 0; j < kNumScenarios; j++)
+			ok = RunScenario(&gScenarios[j]) && ok;
+		ok = RunLookupBench() && ok;
+	}
+
+	return ok ? 0 : 1;
+}
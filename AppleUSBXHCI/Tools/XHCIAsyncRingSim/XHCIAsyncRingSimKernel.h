@@ -0,0 +1,388 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  XHCIAsyncRingSimKernel.h
+//
+//  Just enough of libkern and the IOUSBFamily KPI for AppleUSBXHCI_AsyncQueues.cpp to build and run as a user
+//  space program. Only what that file uses is here, and only as far as it uses it:
+//
+//  - OSObject is reference counted and zero filled on allocation like the real one, but has no metaclass;
+//    OSDynamicCast is a dynamic_cast.
+//  - OSDictionary/OSNumber/OSSerialize are enough for the serialize() methods of the pool, wheel and telemetry,
+//    which the simulator prints as "name = value" lines.
+//  - mach_absolute_time() is the simulator's clock, in nanoseconds, so that the adaptive fragment policy and the
+//    telemetry see simulated time rather than how long the host took.
+//  - USBLog/USBError print when their level is at or below gSimLogLevel; USBTrace is compiled out.
+//
+
+#ifndef _XHCIASYNCRINGSIMKERNEL_H
+#define _XHCIASYNCRINGSIMKERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t				UInt8;
+typedef int8_t				SInt8;
+typedef uint16_t			UInt16;
+typedef int16_t				SInt16;
+typedef uint32_t			UInt32;
+typedef int32_t				SInt32;
+typedef uint64_t			UInt64;
+typedef int64_t				SInt64;
+typedef UInt64				IOByteCount;
+typedef UInt64				USBPhysicalAddress64;
+typedef int					IOReturn;
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE			4096
+#endif
+
+#ifndef TRUE
+#define TRUE				1
+#define FALSE				0
+#endif
+
+#define kIOReturnSuccess			0
+#define kIOReturnNoMemory			((IOReturn)0xe00002bd)
+#define kIOReturnNoResources		((IOReturn)0xe00002be)
+#define kIOReturnBadArgument		((IOReturn)0xe00002c2)
+#define kIOReturnNotPermitted		((IOReturn)0xe00002e2)
+#define kIOReturnAborted			((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding		((IOReturn)0xe00002ed)
+#define kIOReturnUnderrun			((IOReturn)0xe00002e7)
+#define kIOUSBPipeStalled			((IOReturn)0xe000404f)
+#define kIOUSBTransactionTimeout	((IOReturn)0xe0004051)
+
+#define OSCompileAssert(x)			static_assert((x), #x)
+
+#define USBToHostLong(x)			(x)
+#define HostToUSBLong(x)			(x)
+
+#define kUSBControllerImmediateDataKey		"USBControllerImmediateData"
+#define kUSBMaxImmediateDataSize			8
+#define kUSBCommandScratchBuffers			10
+
+enum
+{
+	kUSBEnableErrorLogMask		= (1 << 2)
+};
+
+static UInt32	gUSBStackDebugFlags = 0;
+static int		gSimLogLevel = 0;
+static UInt64	gSimNowNS = 0;						// the simulator's clock
+
+// The allocator, with a hook to fail one allocation size so the fallback paths can be driven
+static UInt32	gSimIOMallocCalls = 0;
+static UInt32	gSimIOMallocFailSize = 0;			// fail IOMalloc of exactly this many bytes, 0 for never
+static UInt32	gSimIOMallocFailures = 0;
+
+static inline void *
+IOMalloc(size_t size)
+{
+	gSimIOMallocCalls++;
+	if (gSimIOMallocFailSize && (size == gSimIOMallocFailSize))
+	{
+		gSimIOMallocFailures++;
+		return NULL;
+	}
+	return ::malloc(size);
+}
+
+static inline void
+IOFree(void *address, size_t size)
+{
+	(void)size;
+	::free(address);
+}
+
+static inline UInt64
+mach_absolute_time(void)
+{
+	return gSimNowNS;
+}
+
+static inline void
+absolutetime_to_nanoseconds(UInt64 abstime, UInt64 *result)
+{
+	*result = abstime;
+}
+
+static inline void
+nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 *result)
+{
+	*result = nanoseconds;
+}
+
+static void
+SimLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+SimLog(const char *format, ...)
+{
+	va_list		args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+#define USBLog(LEVEL, FORMAT, ARGS...)		do { if ((LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+#define USBError(LEVEL, FORMAT, ARGS...)	do { if ((LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+#define USBTrace(ARGS...)					do { } while (0)
+#define USBTrace_Start(ARGS...)				do { } while (0)
+#define USBTrace_End(ARGS...)				do { } while (0)
+
+
+#pragma mark libkern
+
+class OSSerialize
+{
+public:
+	FILE *							out;
+	const char *					prefix;
+};
+
+class OSObject
+{
+public:
+	OSObject() : _retainCount(1) {}
+	virtual ~OSObject() {}
+
+	// kalloc'ed objects start out zeroed, and the drivers rely on it
+	static void *					operator new(size_t size)			{ return ::calloc(1, size); }
+	static void						operator delete(void *mem)			{ ::free(mem); }
+
+	virtual bool					init()								{ return true; }
+	virtual void					free()								{ delete this; }
+	virtual bool					serialize(OSSerialize *s) const		{ (void)s; return false; }
+
+	void							retain() const						{ ((OSObject*)this)->_retainCount++; }
+	void							release() const						{ if (--((OSObject*)this)->_retainCount == 0) ((OSObject*)this)->free(); }
+
+	int								_retainCount;
+};
+
+#define OSDeclareDefaultStructors(className)
+#define OSDefineMetaClassAndStructors(className, superclassName)
+#define OSTypeAlloc(type)					(new type)
+#define OSDynamicCast(type, inst)			dynamic_cast<type *>((OSObject *)(inst))
+
+class OSNumber : public OSObject
+{
+public:
+	static OSNumber *				withNumber(unsigned long long value, unsigned int numberOfBits)
+	{
+		OSNumber *me = new OSNumber;
+
+		me->_value = value;
+		me->_bits  = numberOfBits;
+		return me;
+	}
+
+	UInt32							unsigned32BitValue() const			{ return (UInt32)_value; }
+	UInt64							unsigned64BitValue() const			{ return _value; }
+
+	UInt64							_value;
+	unsigned int					_bits;
+};
+
+class OSBoolean : public OSObject
+{
+public:
+	virtual void					free()								{ }			// the constants are never freed
+
+	bool							_value;
+};
+
+static OSBoolean	gSimBooleanTrue;
+#define kOSBooleanTrue		(&gSimBooleanTrue)
+
+class OSDictionary : public OSObject
+{
+public:
+	enum { kSimMaxEntries = 64 };
+
+	static OSDictionary *			withCapacity(unsigned int capacity)	{ (void)capacity; return new OSDictionary; }
+
+	virtual void					free()
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			::free(_keys[i]);
+			_objects[i]->release();
+		}
+		OSObject::free();
+	}
+
+	bool							setObject(const char *key, const OSObject *object)
+	{
+		UInt32	i;
+
+		if (object == NULL)
+			return false;
+
+		object->retain();
+		for (i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+			{
+				_objects[i]->release();
+				_objects[i] = (OSObject*)object;
+				return true;
+			}
+		}
+		if (_count == kSimMaxEntries)
+		{
+			object->release();
+			return false;
+		}
+		_keys[_count]		= strdup(key);
+		_objects[_count]	= (OSObject*)object;
+		_count++;
+		return true;
+	}
+
+	OSObject *						getObject(const char *key) const
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+				return _objects[i];
+		}
+		return NULL;
+	}
+
+	void							removeObject(const char *key)
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+			{
+				::free(_keys[i]);
+				_objects[i]->release();
+				_count--;
+				_keys[i]	= _keys[_count];
+				_objects[i]	= _objects[_count];
+				return;
+			}
+		}
+	}
+
+	virtual bool					serialize(OSSerialize *s) const
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			OSNumber *number = OSDynamicCast(OSNumber, _objects[i]);
+
+			if (number)
+				fprintf(s->out, "%s%-44s = %llu\n", s->prefix, _keys[i], (unsigned long long)number->unsigned64BitValue());
+		}
+		return true;
+	}
+
+	char *							_keys[kSimMaxEntries];
+	OSObject *						_objects[kSimMaxEntries];
+	UInt32							_count;
+};
+
+
+#pragma mark IOKit
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+	IOByteCount						readBytes(IOByteCount offset, void *bytes, IOByteCount length)
+	{
+		if ((offset + length) > _length)
+			return 0;
+		memcpy(bytes, _bytes + offset, length);
+		return length;
+	}
+
+	UInt8 *							_bytes;
+	IOByteCount						_length;
+};
+
+class IODMACommand : public OSObject
+{
+public:
+	const IOMemoryDescriptor *		getMemoryDescriptor() const			{ return _memory; }
+
+	IOMemoryDescriptor *			_memory;
+};
+
+typedef void (*IOUSBCompletionAction)(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+typedef struct IOUSBCompletion
+{
+	void *							target;
+	IOUSBCompletionAction			action;
+	void *							parameter;
+} IOUSBCompletion;
+
+typedef enum
+{
+	DEVICE_REQUEST,
+	READ,
+	WRITE,
+	CREATE_EP,
+	DELETE_EP,
+	DEVICE_REQUEST_DESC,
+	DEVICE_REQUEST_BUFFERCMD
+} usbCommand;
+
+class IOUSBCommand : public OSObject
+{
+public:
+	usbCommand						GetSelector(void)						{ return _selector; }
+	IOMemoryDescriptor *			GetBuffer(void)							{ return _buffer; }
+	IOUSBCompletion					GetUSLCompletion(void)					{ return _uslCompletion; }
+	UInt32							GetNoDataTimeout(void)					{ return _noDataTimeout; }
+	UInt32							GetCompletionTimeout(void)				{ return _completionTimeout; }
+	void							SetNoDataTimeout(UInt32 to)				{ _noDataTimeout = to; }
+	UInt32							GetUIMScratch(UInt32 index)				{ return (index < kUSBCommandScratchBuffers) ? _UIMScratch[index] : 0; }
+	void							SetUIMScratch(UInt32 index, UInt32 v)	{ if (index < kUSBCommandScratchBuffers) _UIMScratch[index] = v; }
+	IOByteCount						GetReqCount(void)						{ return _reqCount; }
+	IODMACommand *					GetDMACommand(void)						{ return _dmaCommand; }
+	bool							GetImmediateData(void)					{ return _immediateData; }
+
+	usbCommand						_selector;
+	IOMemoryDescriptor *			_buffer;
+	IOUSBCompletion					_uslCompletion;
+	UInt32							_noDataTimeout;
+	UInt32							_completionTimeout;
+	UInt32							_UIMScratch[kUSBCommandScratchBuffers];
+	IOByteCount						_reqCount;
+	IODMACommand *					_dmaCommand;
+	bool							_immediateData;
+};
+
+typedef IOUSBCommand *		IOUSBCommandPtr;
+
+#endif
@@ -0,0 +1,5 @@
+//
+//  XHCIBandwidthLedgerCheck stand-in for <libkern/c++/OSMetaClass.h>, see XHCIBandwidthLedgerCheckKernel.h
+//
+
+#include "XHCIBandwidthLedgerCheckKernel.h"
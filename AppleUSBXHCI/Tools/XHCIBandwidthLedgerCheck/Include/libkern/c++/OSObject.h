@@ -0,0 +1,5 @@
+//
+//  XHCIBandwidthLedgerCheck stand-in for <libkern/c++/OSObject.h>, see XHCIBandwidthLedgerCheckKernel.h
+//
+
+#include "XHCIBandwidthLedgerCheckKernel.h"
@@ -0,0 +1,865 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  XHCIBandwidthLedgerCheck
+//
+//  Builds the real AppleUSBXHCI_Bandwidth.cpp and runs randomized admits, releases and hub unplugs through
+//  AppleXHCIBandwidthLedger, checking the ledger after each one against the bandwidth tables rebuilt from scratch
+//  out of the endpoints which are still admitted.
+//
+//  Build:	c++ -O2 -std=c++11 -fno-extended-identifiers -I. -IInclude -I../../Headers -I../../Classes -o XHCIBandwidthLedgerCheck XHCIBandwidthLedgerCheck.cpp
+//		(-fno-extended-identifiers lets gcc through the bullets in the driver's #pragma mark lines; clang doesn't need it)
+//
+//  Usage:	XHCIBandwidthLedgerCheck [-n operations] [-s seed] [-v level] [-p]
+//
+//		-v		USBLog level to print (default 0, nothing)
+//		-p		print the ledger through its serialize() at the end
+//
+//  TTBandwidthTable and RootHubPortTable are only declared in this tree, so the rebuild here is written from their
+//  declarations: for each root hub port and each TT, every interval's endpoint count, total cost and worst case
+//  endpoint, summed into the busiest (micro)frame. It shares the per endpoint cost (BandwidthModelPortBlocks and
+//  BandwidthModelTTBlocks) with the ledger, but none of the bookkeeping. After every operation:
+//
+//  - every interval of every budget the operation touched has the same endpoints, blocks and largest endpoint as
+//    the rebuild, and keeps the same costs in order, and the budget's busiest (micro)frame is the rebuild's
+//  - every admit gets the same answer from the ledger as from the rebuild
+//  - the ledger only runs out of TT entries when that many TTs have endpoints on them
+//
+//  Before the random operations, a ledger of its own is filled with one small endpoint on each of as many TTs as it
+//  has entries for, to see that the next TT is turned down, and that once they are all released as many other TTs
+//  fit again, twice over. Every 1024 operations each budget's busiest (micro)frame is also checked against brute force: the endpoints of
+//  each interval dealt out in turn over the (micro)frames of their period, and every (micro)frame of the longest
+//  period added up. The exit status is 1 if any of the checks failed.
+//
+
+#include <time.h>
+#include <unistd.h>
+
+#include "XHCIBandwidthLedgerCheckKernel.h"
+
+//
+// The stand-in controller: the ledger only keeps itself in the controller's properties
+//
+class AppleUSBXHCI
+{
+public:
+	OSObject *					getProperty(const char *key)					{ return _properties ? _properties->getObject(key) : NULL; }
+	bool						setProperty(const char *key, OSObject *object)
+	{
+		if (!_properties)
+			_properties = OSDictionary::withCapacity(4);
+		return _properties->setObject(key, object);
+	}
+
+	OSDictionary *				_properties;
+};
+
+#include "AppleUSBXHCI_Bandwidth.cpp"
+
+enum
+{
+	kCheckDefaultOperations		= 200000,
+	kCheckPorts					= 8,
+	kCheckMaxLive				= 4096,
+	kCheckHubsPerPort			= 30,					// hub slots are port + (kCheckPorts * n), which stays below 256
+	kCheckMaxHubWindow			= 12,					// most of a port's hubs plugged in at once, enough to run out of TT entries
+	kCheckHubWindowOperations	= 2000,					// how often the window moves on to the next hub
+	kCheckBruteForceOperations	= 1024,
+	kCheckMaxFrames				= 1 << (kMaxIntervalTableSize - 1)
+};
+
+// the ledger's protected state, for checking it
+class CheckLedger : public AppleXHCIBandwidthLedger
+{
+public:
+	AppleXHCIBandwidthPort *		Port(UInt8 rhPort)							{ return _ports[rhPort]; }
+	AppleXHCIBandwidthTT *			TTEntry(UInt32 index)						{ return &_tts[index]; }
+	UInt32							Admitted() const							{ return _admitted; }
+	UInt32							Rejected() const							{ return _rejected; }
+};
+
+// one rebuilt table, for one root hub port or one TT
+typedef struct CheckTable
+{
+	UInt32							limit;
+	UInt32							endpoints[kMaxIntervalTableSize];
+	UInt32							blocks[kMaxIntervalTableSize];
+	UInt32							largest[kMaxIntervalTableSize];
+	UInt32							numEntries;						// every endpoint, in the order it was admitted, for the brute force
+	UInt8							entryInterval[kCheckMaxLive];
+	UInt32							entryBlocks[kCheckMaxLive];
+} CheckTable;
+
+typedef struct CheckStats
+{
+	long							operations;
+	long							admits;
+	long							admitsRejected;
+	long							releases;
+	long							unplugs;
+	long							noResources;
+	long							bruteForces;
+	double							spreadSum;						// what the old ledger charged (every interval in one frame) over the busiest frame
+	long							spreadSamples;
+	double							ledgerNS;
+	double							rebuildNS;
+	long							failures;
+} CheckStats;
+
+static AppleXHCIBandwidthRequest	gLive[kCheckMaxLive];			// what has been admitted, oldest first
+static UInt32						gNumLive = 0;
+static UInt8						gPortSpeed[kCheckPorts + 1];
+static UInt32						gHubWindow = 0;
+static UInt32						gHubWindowWidth = 1;
+static CheckTable					gTable;
+static CheckTable					gTTTable;
+static UInt16						gSorted[kCheckMaxLive];
+static UInt32						gPhaseBlocks[kMaxIntervalTableSize][kCheckMaxFrames];
+static int							gFailuresPrinted = 0;
+
+
+
+static void
+Fail(CheckStats *stats, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+Fail(CheckStats *stats, const char *format, ...)
+{
+	va_list		args;
+
+	stats->failures++;
+	if (gFailuresPrinted++ >= 20)
+		return;
+
+	printf("operation %ld: ", stats->operations);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+
+
+static double
+NowNS(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+
+
+#pragma mark Rebuilding the tables
+
+static UInt8
+TTPort(const AppleXHCIBandwidthRequest *request)
+{
+	return request->mtt ? request->hubPort : 0;
+}
+
+
+
+static bool
+OnTT(const AppleXHCIBandwidthRequest *request, UInt8 hubSlot, UInt8 ttPort)
+{
+	return BandwidthModelNeedsTT(request) && (request->hubSlot == hubSlot) && (TTPort(request) == ttPort);
+}
+
+
+
+// The table interval, in the (micro)frames of the table: the endpoint context Interval counts 125us, and LS/FS
+// tables count 1ms frames
+static UInt8
+TableInterval(UInt8 epInterval, bool frames)
+{
+	int		interval = epInterval;
+
+	if (frames)
+		interval = (interval > 3) ? (interval - 3) : 0;
+
+	return (interval < kMaxIntervalTableSize) ? (UInt8)interval : (UInt8)(kMaxIntervalTableSize - 1);
+}
+
+
+
+static void
+AddToTable(CheckTable *table, UInt8 interval, UInt32 blocks)
+{
+	table->endpoints[interval]++;
+	table->blocks[interval] += blocks;
+	if (blocks > table->largest[interval])
+		table->largest[interval] = blocks;
+	table->entryInterval[table->numEntries] = interval;
+	table->entryBlocks[table->numEntries++] = blocks;
+}
+
+
+
+// the port's table, with extra added at the end if it isn't NULL
+static void
+BuildPortTable(CheckTable *table, UInt8 rhPort, const AppleXHCIBandwidthRequest *extra)
+{
+	bool		frames = (gPortSpeed[rhPort] == kBandwidthModelSpeedLow) || (gPortSpeed[rhPort] == kBandwidthModelSpeedFull);
+	UInt32		i;
+
+	memset(table, 0, offsetof(CheckTable, entryInterval));
+	table->limit = BandwidthModelLimitInBlocks(gPortSpeed[rhPort]);
+
+	for (i = 0; i < gNumLive; i++)
+		if (gLive[i].rhPort == rhPort)
+			AddToTable(table, TableInterval(gLive[i].epInterval, frames), BandwidthModelPortBlocks(&gLive[i]));
+
+	if (extra)
+		AddToTable(table, TableInterval(extra->epInterval, frames), BandwidthModelPortBlocks(extra));
+}
+
+
+
+static void
+BuildTTTable(CheckTable *table, UInt8 hubSlot, UInt8 ttPort, const AppleXHCIBandwidthRequest *extra)
+{
+	UInt32		i;
+
+	memset(table, 0, offsetof(CheckTable, entryInterval));
+	table->limit = kLSFSBandwidthLimitInBlocks;
+
+	for (i = 0; i < gNumLive; i++)
+		if (OnTT(&gLive[i], hubSlot, ttPort))
+			AddToTable(table, TableInterval(gLive[i].epInterval, true), BandwidthModelTTBlocks(&gLive[i]));
+
+	if (extra)
+		AddToTable(table, TableInterval(extra->epInterval, true), BandwidthModelTTBlocks(extra));
+}
+
+
+
+// Each interval's endpoints, spread as evenly as they can be over the (micro)frames of their period, put at most
+// endpoints / period of them (rounded up) in any one (micro)frame, and no more than all of them
+static UInt32
+TableBusiest(const CheckTable *table)
+{
+	UInt32		busiest = 0;
+	UInt32		period;
+	UInt32		worst;
+	int			i;
+
+	for (i = 0; i < kMaxIntervalTableSize; i++)
+	{
+		period = 1U << i;
+		worst = ((table->endpoints[i] + period - 1) / period) * table->largest[i];
+		busiest += (worst < table->blocks[i]) ? worst : table->blocks[i];
+	}
+	return busiest;
+}
+
+
+
+static UInt32
+TableAllInOneFrame(const CheckTable *table)
+{
+	UInt32		total = 0;
+	int			i;
+
+	for (i = 0; i < kMaxIntervalTableSize; i++)
+		total += table->blocks[i];
+	return total;
+}
+
+
+
+// Deals the endpoints of each interval out over the (micro)frames of its period in the order they were admitted,
+// and returns the busiest (micro)frame of the longest period
+static UInt32
+BruteForceBusiest(const CheckTable *table)
+{
+	UInt32		dealt[kMaxIntervalTableSize];
+	UInt32		longest = 0;
+	UInt32		busiest = 0;
+	UInt32		frame;
+	UInt32		load;
+	UInt32		i;
+	int			interval;
+
+	memset(dealt, 0, sizeof(dealt));
+	for (interval = 0; interval < kMaxIntervalTableSize; interval++)
+		memset(gPhaseBlocks[interval], 0, sizeof(UInt32) << interval);
+
+	for (i = 0; i < table->numEntries; i++)
+	{
+		interval = table->entryInterval[i];
+		gPhaseBlocks[interval][dealt[interval]++ & ((1U << interval) - 1)] += table->entryBlocks[i];
+		if ((UInt32)interval > longest)
+			longest = interval;
+	}
+
+	for (frame = 0; frame < (1U << longest); frame++)
+	{
+		load = 0;
+		for (interval = 0; interval <= (int)longest; interval++)
+			load += gPhaseBlocks[interval][frame & ((1U << interval) - 1)];
+		if (load > busiest)
+			busiest = load;
+	}
+	return busiest;
+}
+
+
+
+static UInt32
+LiveTTs(const AppleXHCIBandwidthRequest *live, UInt32 numLive)
+{
+	UInt32		count = 0;
+	UInt32		i, j;
+
+	for (i = 0; i < numLive; i++)
+	{
+		if (!BandwidthModelNeedsTT(&live[i]))
+			continue;
+		for (j = 0; j < i; j++)
+			if (OnTT(&live[j], live[i].hubSlot, TTPort(&live[i])))
+				break;
+		if (j == i)
+			count++;
+	}
+	return count;
+}
+
+
+
+// would the rebuilt tables take the endpoint - noResources is set when it only fails for want of a TT entry
+static bool
+RebuildFits(const AppleXHCIBandwidthRequest *request, bool *noResources)
+{
+	UInt32		i;
+
+	*noResources = false;
+
+	BuildPortTable(&gTable, request->rhPort, request);
+	if (TableBusiest(&gTable) > gTable.limit)
+		return false;
+
+	if (!BandwidthModelNeedsTT(request))
+		return true;
+
+	for (i = 0; i < gNumLive; i++)
+		if (OnTT(&gLive[i], request->hubSlot, TTPort(request)))
+			break;
+
+	if ((i == gNumLive) && (LiveTTs(gLive, gNumLive) >= kBandwidthLedgerTTHashSize))
+	{
+		*noResources = true;
+		return false;
+	}
+
+	BuildTTTable(&gTTTable, request->hubSlot, TTPort(request), request);
+	return TableBusiest(&gTTTable) <= gTTTable.limit;
+}
+
+
+#pragma mark Checking the ledger
+
+static AppleXHCIBandwidthTT *
+FindLedgerTT(CheckLedger *ledger, UInt8 hubSlot, UInt8 ttPort)
+{
+	AppleXHCIBandwidthTT *	tt;
+	UInt32					i;
+
+	for (i = 0; i < kBandwidthLedgerTTHashSize; i++)
+	{
+		tt = ledger->TTEntry(i);
+		if (tt->inUse && (tt->hubSlot == hubSlot) && (tt->hubPort == ttPort) && tt->budget.endpoints)
+			return tt;
+	}
+	return NULL;
+}
+
+
+
+static int
+CompareCosts(const void *a, const void *b)
+{
+	return (int)*(const UInt16 *)a - (int)*(const UInt16 *)b;
+}
+
+
+
+// Compares one budget and its costs with its rebuilt table
+static void
+CheckBudget(CheckStats *stats, const char *name, const AppleXHCIBandwidthBudget *budget, const AppleXHCIBandwidthCosts *costs, const CheckTable *table, bool bruteForce)
+{
+	AppleXHCIBandwidthBudget	empty;
+	UInt32						endpoints = 0;
+	UInt32						brute;
+	UInt32						count;
+	UInt32						i;
+	int							interval;
+
+	if (!budget)
+	{
+		memset(&empty, 0, sizeof(empty));
+		empty.limitBlocks = table->limit;
+		budget = &empty;
+	}
+
+	for (interval = 0; interval < kMaxIntervalTableSize; interval++)
+	{
+		const AppleXHCIBandwidthInterval *	ledgerInterval = &budget->interval[interval];
+
+		endpoints += table->endpoints[interval];
+		if ((ledgerInterval->endpoints != table->endpoints[interval]) || (ledgerInterval->blocks != table->blocks[interval]) ||
+			(ledgerInterval->largestBlocks != table->largest[interval]))
+		{
+			Fail(stats, "%s interval %d has %u endpoints, %u blocks and a largest of %u, the tables have %u, %u and %u", name, interval,
+				 ledgerInterval->endpoints, ledgerInterval->blocks, ledgerInterval->largestBlocks, table->endpoints[interval],
+				 table->blocks[interval], table->largest[interval]);
+			continue;
+		}
+
+		if (!costs || (table->endpoints[interval] == 0))
+			continue;
+
+		count = 0;
+		for (i = 0; i < table->numEntries; i++)
+			if (table->entryInterval[i] == interval)
+				gSorted[count++] = (UInt16)table->entryBlocks[i];
+		qsort(gSorted, count, sizeof(gSorted[0]), CompareCosts);
+
+		if ((costs->capacity[interval] < count) || memcmp(costs->blocks[interval], gSorted, count * sizeof(gSorted[0])))
+			Fail(stats, "%s interval %d does not keep the costs of its %u endpoints in order", name, interval, count);
+	}
+
+	if (budget->endpoints != endpoints)
+		Fail(stats, "%s has %u endpoints, the tables have %u", name, budget->endpoints, endpoints);
+
+	if (endpoints && (budget->limitBlocks != table->limit))
+		Fail(stats, "%s has a limit of %u blocks, the tables have %u", name, budget->limitBlocks, table->limit);
+
+	if (budget->totalBlocks != BandwidthModelUsedBlocks(budget))
+		Fail(stats, "%s has %u blocks in its busiest frame but its intervals add up to %u", name, budget->totalBlocks, BandwidthModelUsedBlocks(budget));
+
+	if (budget->totalBlocks != TableBusiest(table))
+		Fail(stats, "%s has %u blocks in its busiest frame, the tables have %u", name, budget->totalBlocks, TableBusiest(table));
+
+	if (endpoints && (budget->totalBlocks > 0))
+	{
+		stats->spreadSum += (double)TableAllInOneFrame(table) / budget->totalBlocks;
+		stats->spreadSamples++;
+	}
+
+	if (bruteForce && endpoints)
+	{
+		brute = BruteForceBusiest(table);
+		stats->bruteForces++;
+		if (brute > TableBusiest(table))
+			Fail(stats, "%s has a frame with %u blocks when its endpoints are dealt out, more than the %u it is charged", name, brute, TableBusiest(table));
+	}
+}
+
+
+
+static void
+CheckPort(CheckLedger *ledger, CheckStats *stats, UInt8 rhPort, bool bruteForce)
+{
+	AppleXHCIBandwidthPort *	port = ledger->Port(rhPort);
+	char						name[32];
+
+	snprintf(name, sizeof(name), "port %d", (int)rhPort);
+	BuildPortTable(&gTable, rhPort, NULL);
+	CheckBudget(stats, name, port ? &port->budget : NULL, port ? &port->costs : NULL, &gTable, bruteForce);
+}
+
+
+
+static void
+CheckTT(CheckLedger *ledger, CheckStats *stats, UInt8 hubSlot, UInt8 ttPort, bool bruteForce)
+{
+	AppleXHCIBandwidthTT *	tt = FindLedgerTT(ledger, hubSlot, ttPort);
+	char					name[32];
+
+	snprintf(name, sizeof(name), "TT %d.%d", (int)hubSlot, (int)ttPort);
+	BuildTTTable(&gTTTable, hubSlot, ttPort, NULL);
+	CheckBudget(stats, name, tt ? &tt->budget : NULL, tt ? &tt->costs : NULL, &gTTTable, bruteForce);
+}
+
+
+
+// the port and TT of the request, or of every port and TT when request is NULL
+static void
+CheckLedgerAgainstTables(CheckLedger *ledger, CheckStats *stats, const AppleXHCIBandwidthRequest *request, bool bruteForce)
+{
+	UInt32		withEndpoints = 0;
+	UInt32		i;
+	UInt8		port;
+
+	if (request)
+	{
+		CheckPort(ledger, stats, request->rhPort, bruteForce);
+		if (BandwidthModelNeedsTT(request))
+			CheckTT(ledger, stats, request->hubSlot, TTPort(request), bruteForce);
+		return;
+	}
+
+	for (port = 1; port <= kCheckPorts; port++)
+		CheckPort(ledger, stats, port, bruteForce);
+
+	for (i = 0; i < kBandwidthLedgerTTHashSize; i++)
+	{
+		AppleXHCIBandwidthTT *	tt = ledger->TTEntry(i);
+
+		if (!tt->inUse || !tt->budget.endpoints)
+			continue;
+		withEndpoints++;
+		CheckTT(ledger, stats, tt->hubSlot, tt->hubPort, bruteForce);
+	}
+
+	if (withEndpoints != LiveTTs(gLive, gNumLive))
+		Fail(stats, "%u TT entries have endpoints, the tables have %u TTs", withEndpoints, LiveTTs(gLive, gNumLive));
+
+	if (ledger->Admitted() != gNumLive)
+		Fail(stats, "the ledger has admitted %u endpoints, the tables have %u", ledger->Admitted(), gNumLive);
+}
+
+
+#pragma mark The workload
+
+static void
+RandomRequest(AppleXHCIBandwidthRequest *request)
+{
+	UInt8		rhPort = 1 + (rand() % kCheckPorts);
+	UInt32		hub;
+
+	memset(request, 0, sizeof(*request));
+	request->rhPort = rhPort;
+	request->rhPortSpeed = gPortSpeed[rhPort];
+
+	switch (request->rhPortSpeed)
+	{
+		case kBandwidthModelSpeedSuper:
+			request->epSpeed = kBandwidthModelSpeedSuper;
+			request->epInterval = rand() % 16;
+			request->mps = 64 << (rand() % 5);
+			request->maxBurst = rand() % 4;
+			request->mult = ((rand() % 4) == 0) ? (rand() % 3) : 0;
+			break;
+
+		case kBandwidthModelSpeedHigh:
+			if ((rand() % 3) == 0)
+			{
+				hub = (gHubWindow + (rand() % gHubWindowWidth)) % kCheckHubsPerPort;
+				request->hubSlot = rhPort + (kCheckPorts * hub);
+				request->hubPort = 1 + (rand() % 7);
+				request->mtt = (hub & 1);
+				request->epSpeed = (rand() % 4) ? kBandwidthModelSpeedFull : kBandwidthModelSpeedLow;
+				request->epInterval = 3 + (rand() % 11);
+				request->mps = (request->epSpeed == kBandwidthModelSpeedLow) ? (1 + (rand() % 8)) : (1 + (rand() % ((rand() % 4) ? 64 : 1023)));
+			}
+			else
+			{
+				request->epSpeed = kBandwidthModelSpeedHigh;
+				request->epInterval = rand() % 16;
+				request->mps = 1 + (rand() % 1024);
+				request->maxBurst = rand() % 3;
+			}
+			break;
+
+		default:
+			request->epSpeed = request->rhPortSpeed;
+			request->epInterval = 3 + (rand() % 11);
+			request->mps = (request->epSpeed == kBandwidthModelSpeedLow) ? (1 + (rand() % 8)) : (1 + (rand() % ((rand() % 4) ? 64 : 1023)));
+			break;
+	}
+}
+
+
+
+static void
+RemoveLive(UInt32 index)
+{
+	memmove(&gLive[index], &gLive[index + 1], (gNumLive - index - 1) * sizeof(gLive[0]));
+	gNumLive--;
+}
+
+
+
+static void
+DoAdmit(CheckLedger *ledger, CheckStats *stats)
+{
+	AppleXHCIBandwidthRequest	request;
+	IOReturn					err;
+	bool						fits;
+	bool						noResources;
+	double						start;
+	UInt32						i;
+
+	if (gNumLive == kCheckMaxLive)
+		return;
+
+	RandomRequest(&request);
+
+	// a port with nothing on it may come back at another speed
+	for (i = 0; i < gNumLive; i++)
+		if (gLive[i].rhPort == request.rhPort)
+			break;
+	if ((i == gNumLive) && ((rand() % 4) == 0))
+	{
+		gPortSpeed[request.rhPort] = rand() % 4;
+		RandomRequest(&request);
+	}
+
+	CheckLedgerAgainstTables(ledger, stats, &request, false);
+
+	start = NowNS();
+	fits = RebuildFits(&request, &noResources);
+	stats->rebuildNS += NowNS() - start;
+
+	start = NowNS();
+	err = ledger->Admit(&request);
+	stats->ledgerNS += NowNS() - start;
+
+	stats->admits++;
+	if (err == kIOReturnSuccess)
+	{
+		if (!fits)
+			Fail(stats, "the ledger admitted port %d interval %d mps %d which the tables turn down", (int)request.rhPort, (int)request.epInterval, (int)request.mps);
+		gLive[gNumLive++] = request;
+	}
+	else
+	{
+		stats->admitsRejected++;
+		if (err == kIOReturnNoResources)
+			stats->noResources++;
+		if (fits)
+			Fail(stats, "the ledger turned down port %d interval %d mps %d which the tables take", (int)request.rhPort, (int)request.epInterval, (int)request.mps);
+		else if ((err == kIOReturnNoResources) != noResources)
+			Fail(stats, "the ledger %s out of TT entries with %u TTs in use", noResources ? "did not run" : "ran", LiveTTs(gLive, gNumLive));
+	}
+
+	CheckLedgerAgainstTables(ledger, stats, &request, false);
+}
+
+
+
+static void
+DoRelease(CheckLedger *ledger, CheckStats *stats, UInt32 index)
+{
+	AppleXHCIBandwidthRequest	request = gLive[index];
+
+	ledger->Release(&request);
+	RemoveLive(index);
+	stats->releases++;
+	CheckLedgerAgainstTables(ledger, stats, &request, false);
+}
+
+
+
+static void
+DoUnplug(CheckLedger *ledger, CheckStats *stats)
+{
+	UInt32		i;
+	UInt8		hubSlot;
+
+	for (i = 0; i < gNumLive; i++)
+		if (BandwidthModelNeedsTT(&gLive[i]))
+			break;
+	if (i == gNumLive)
+		return;
+
+	hubSlot = gLive[i].hubSlot;
+	stats->unplugs++;
+
+	for (i = gNumLive; i > 0; i--)
+		if (BandwidthModelNeedsTT(&gLive[i - 1]) && (gLive[i - 1].hubSlot == hubSlot))
+			DoRelease(ledger, stats, i - 1);
+}
+
+
+
+// Returns how many TTs, each a different hub and port, the ledger admits a LS endpoint on before running out of
+// TT entries, starting at hub slot firstHub
+static UInt32
+FillTTs(AppleXHCIBandwidthLedger *ledger, UInt32 firstHub, AppleXHCIBandwidthRequest *admitted)
+{
+	AppleXHCIBandwidthRequest	request;
+	UInt32						numTTs = 0;
+	IOReturn					err = kIOReturnSuccess;
+
+	while (err == kIOReturnSuccess)
+	{
+		memset(&request, 0, sizeof(request));
+		request.rhPort = 1;
+		request.rhPortSpeed = kBandwidthModelSpeedHigh;
+		request.epSpeed = kBandwidthModelSpeedLow;
+		request.epInterval = 13;
+		request.mps = 8;
+		request.hubSlot = firstHub + (numTTs / 7);
+		request.hubPort = 1 + (numTTs % 7);
+		request.mtt = true;
+
+		err = ledger->Admit(&request);
+		if (err == kIOReturnSuccess)
+			admitted[numTTs++] = request;
+		else if (err != kIOReturnNoResources)
+			return 0;
+	}
+	return numTTs;
+}
+
+
+
+static void
+CheckTTEntries(CheckStats *stats)
+{
+	AppleXHCIBandwidthLedger *	ledger = OSTypeAlloc(AppleXHCIBandwidthLedger);
+	AppleXHCIBandwidthRequest	admitted[kBandwidthLedgerTTHashSize];
+	UInt32						numTTs;
+	UInt32						round;
+	UInt32						i;
+
+	if (!ledger || !ledger->init())
+		return;
+
+	for (round = 0; round < 3; round++)
+	{
+		numTTs = FillTTs(ledger, 1 + (round * 64), admitted);
+		if (numTTs != kBandwidthLedgerTTHashSize)
+			Fail(stats, "%u TTs fit in the ledger on round %u, rather than %u", numTTs, round, kBandwidthLedgerTTHashSize);
+
+		for (i = 0; i < numTTs; i++)
+			ledger->Release(&admitted[i]);
+	}
+
+	ledger->release();
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+	CheckStats					stats;
+	AppleUSBXHCI				controller;
+	AppleXHCIBandwidthLedger *	fromController;
+	CheckLedger *				ledger;
+	OSSerialize					s;
+	long						numOperations = kCheckDefaultOperations;
+	unsigned int				seed = (unsigned int)time(NULL);
+	bool						print = false;
+	int							ch;
+	int							dice;
+	UInt8						port;
+
+	while ((ch = getopt(argc, argv, "n:s:v:p")) != -1)
+	{
+		switch (ch)
+		{
+			case 'n':
+				numOperations = strtol(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				gSimLogLevel = (int)strtol(optarg, NULL, 0);
+				break;
+			case 'p':
+				print = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n operations] [-s seed] [-v level] [-p]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (numOperations <= 0)
+	{
+		fprintf(stderr, "%s: the number of operations must be positive\n", argv[0]);
+		return 2;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	srand(seed);
+	for (port = 1; port <= kCheckPorts; port++)
+		gPortSpeed[port] = rand() % 4;
+
+	// the controller's ledger is found again, rather than made twice
+	memset(&controller, 0, sizeof(controller));
+	fromController = AppleXHCIBandwidthLedger::ForController(&controller);
+	if (!fromController || (AppleXHCIBandwidthLedger::ForController(&controller) != fromController) || (fromController->getRetainCount() != 3))
+		Fail(&stats, "ForController did not find the ledger it had made");
+
+	CheckTTEntries(&stats);
+
+	ledger = OSTypeAlloc(CheckLedger);
+	if (!ledger || !ledger->init())
+		return 2;
+
+	for (stats.operations = 1; stats.operations <= numOperations; stats.operations++)
+	{
+		if ((stats.operations % kCheckHubWindowOperations) == 0)
+		{
+			gHubWindow = (gHubWindow + 1) % kCheckHubsPerPort;
+			gHubWindowWidth = 1 + (rand() % kCheckMaxHubWindow);
+		}
+
+		dice = rand() % 100;
+		if (dice < 59)
+			DoAdmit(ledger, &stats);
+		else if (dice < 96)
+		{
+			if (gNumLive)
+				DoRelease(ledger, &stats, rand() % gNumLive);
+		}
+		else
+			DoUnplug(ledger, &stats);
+
+		if ((stats.operations % kCheckBruteForceOperations) == 0)
+			CheckLedgerAgainstTables(ledger, &stats, NULL, true);
+	}
+	stats.operations--;
+	CheckLedgerAgainstTables(ledger, &stats, NULL, true);
+
+	if (print)
+	{
+		s.out = stdout;
+		s.prefix = "  ";
+		printf("ledger:\n");
+		ledger->serialize(&s);
+	}
+
+	printf("seed %u: %ld operations, %ld admits (%ld turned down, %ld for want of a TT entry), %ld releases, %ld hub unplugs, %u still admitted\n",
+		   seed, stats.operations, stats.admits, stats.admitsRejected, stats.noResources, stats.releases, stats.unplugs, gNumLive);
+	printf("%ld brute force checks; charging every interval in one frame would cost %.2fx the busiest frame\n",
+		   stats.bruteForces, stats.spreadSamples ? stats.spreadSum / stats.spreadSamples : 0.0);
+	printf("ledger %.1f ns/admit, rebuilding the tables %.1f ns/admit; %ld failures\n", stats.admits ? stats.ledgerNS / stats.admits : 0.0,
+		   stats.admits ? stats.rebuildNS / stats.admits : 0.0, stats.failures);
+
+	ledger->release();
+	fromController->release();
+	fromController->release();
+	if (controller._properties)
+		controller._properties->release();
+
+	return stats.failures ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  XHCIBandwidthLedgerCheckKernel.h
+//
+//  Just enough of libkern and the IOUSBFamily KPI for AppleUSBXHCI_Bandwidth.cpp to build and run as a user space
+//  program. Only what that file uses is here, and only as far as it uses it:
+//
+//  - OSObject is reference counted and zero filled on allocation like the real one, but has no metaclass;
+//    OSDynamicCast is a dynamic_cast. OSArray is only declared, as the bandwidth tables are.
+//  - OSDictionary/OSNumber/OSSerialize are enough for the ledger's serialize(), which is printed as "name = value"
+//    lines, with the dictionary of each port and TT indented under its name.
+//  - USBLog/USBError print when their level is at or below gSimLogLevel.
+//
+
+#ifndef _XHCIBANDWIDTHLEDGERCHECKKERNEL_H
+#define _XHCIBANDWIDTHLEDGERCHECKKERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+
+typedef uint8_t				UInt8;
+typedef int8_t				SInt8;
+typedef uint16_t			UInt16;
+typedef int16_t				SInt16;
+typedef uint32_t			UInt32;
+typedef int32_t				SInt32;
+typedef uint64_t			UInt64;
+typedef int64_t				SInt64;
+typedef int					IOReturn;
+
+#define kIOReturnSuccess			0
+#define kIOReturnNoMemory			((IOReturn)0xe00002bd)
+#define kIOReturnNoResources		((IOReturn)0xe00002be)
+#define kIOReturnNoBandwidth		((IOReturn)0xe00002ec)
+
+static int		gSimLogLevel = 0;
+static UInt32	gSimIOMallocCalls = 0;
+
+static inline void *
+IOMalloc(size_t size)
+{
+	gSimIOMallocCalls++;
+	return ::malloc(size);
+}
+
+static inline void
+IOFree(void *address, size_t size)
+{
+	(void)size;
+	::free(address);
+}
+
+static void
+SimLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+SimLog(const char *format, ...)
+{
+	va_list		args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+#define USBLog(LEVEL, FORMAT, ARGS...)		do { if ((LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+#define USBError(LEVEL, FORMAT, ARGS...)	do { if ((LEVEL) <= gSimLogLevel) SimLog(FORMAT, ## ARGS); } while (0)
+
+
+#pragma mark libkern
+
+class OSSerialize
+{
+public:
+	FILE *							out;
+	const char *					prefix;
+};
+
+class OSObject
+{
+public:
+	OSObject() : _retainCount(1) {}
+	virtual ~OSObject() {}
+
+	// kalloc'ed objects start out zeroed, and the drivers rely on it
+	static void *					operator new(size_t size)			{ return ::calloc(1, size); }
+	static void						operator delete(void *mem)			{ ::free(mem); }
+
+	virtual bool					init()								{ return true; }
+	virtual void					free()								{ delete this; }
+	virtual bool					serialize(OSSerialize *s) const		{ (void)s; return false; }
+
+	void							retain() const						{ ((OSObject*)this)->_retainCount++; }
+	void							release() const						{ if (--((OSObject*)this)->_retainCount == 0) ((OSObject*)this)->free(); }
+	int								getRetainCount() const				{ return _retainCount; }
+
+	int								_retainCount;
+};
+
+class OSArray;
+
+#define OSDeclareDefaultStructors(className)
+#define OSDefineMetaClassAndStructors(className, superclassName)
+#define OSTypeAlloc(type)					(new type)
+#define OSDynamicCast(type, inst)			dynamic_cast<type *>((OSObject *)(inst))
+
+class OSNumber : public OSObject
+{
+public:
+	static OSNumber *				withNumber(unsigned long long value, unsigned int numberOfBits)
+	{
+		OSNumber *me = new OSNumber;
+
+		me->_value = value;
+		me->_bits  = numberOfBits;
+		return me;
+	}
+
+	UInt32							unsigned32BitValue() const			{ return (UInt32)_value; }
+	UInt64							unsigned64BitValue() const			{ return _value; }
+
+	UInt64							_value;
+	unsigned int					_bits;
+};
+
+class OSDictionary : public OSObject
+{
+public:
+	enum { kSimMaxEntries = 512 };
+
+	static OSDictionary *			withCapacity(unsigned int capacity)	{ (void)capacity; return new OSDictionary; }
+
+	virtual void					free()
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			::free(_keys[i]);
+			_objects[i]->release();
+		}
+		OSObject::free();
+	}
+
+	bool							setObject(const char *key, const OSObject *object)
+	{
+		UInt32	i;
+
+		if (object == NULL)
+			return false;
+
+		object->retain();
+		for (i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+			{
+				_objects[i]->release();
+				_objects[i] = (OSObject*)object;
+				return true;
+			}
+		}
+		if (_count == kSimMaxEntries)
+		{
+			object->release();
+			return false;
+		}
+		_keys[_count]		= strdup(key);
+		_objects[_count]	= (OSObject*)object;
+		_count++;
+		return true;
+	}
+
+	OSObject *						getObject(const char *key) const
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			if (strcmp(_keys[i], key) == 0)
+				return _objects[i];
+		}
+		return NULL;
+	}
+
+	virtual bool					serialize(OSSerialize *s) const
+	{
+		for (UInt32 i = 0; i < _count; i++)
+		{
+			OSNumber *		number = OSDynamicCast(OSNumber, _objects[i]);
+			OSDictionary *	dictionary = OSDynamicCast(OSDictionary, _objects[i]);
+
+			if (number)
+				fprintf(s->out, "%s%-24s = %llu\n", s->prefix, _keys[i], (unsigned long long)number->unsigned64BitValue());
+			else if (dictionary)
+			{
+				OSSerialize		inner;
+				char			prefix[64];
+
+				snprintf(prefix, sizeof(prefix), "%s    ", s->prefix);
+				inner.out = s->out;
+				inner.prefix = prefix;
+				fprintf(s->out, "%s%s\n", s->prefix, _keys[i]);
+				dictionary->serialize(&inner);
+			}
+		}
+		return true;
+	}
+
+	char *							_keys[kSimMaxEntries];
+	OSObject *						_objects[kSimMaxEntries];
+	UInt32							_count;
+};
+
+#endif
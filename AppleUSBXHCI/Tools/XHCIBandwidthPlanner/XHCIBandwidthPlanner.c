@@ -0,0 +1,465 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+//  XHCIBandwidthPlanner
+//
+//  Runs a list of periodic endpoints through the same admission math as AppleXHCIBandwidthLedger and reports the
+//  utilization of each root hub port, each TT and each interval, and the first endpoint the controller would reject.
+//  Intervals are reported as the budget counts them: in uFrames on HS/SS ports, and in frames on LS/FS ports and TTs.
+//
+//  Build:	cc -O2 -I../../Headers -o XHCIBandwidthPlanner XHCIBandwidthPlanner.c
+//
+//  Usage:	XHCIBandwidthPlanner [-q] [file ...]			(reads stdin when there are no files)
+//
+//  Input is one directive per line, and anything after a '#' is ignored:
+//
+//		config <name>
+//			starts a new configuration, so that one file can hold a sweep of many of them
+//
+//		ep <rhPort> <rhSpeed> <epSpeed> <interval> <mps> [<maxBurst> <mult> [<hubSlot> <hubPort> <mtt>]] [<label>]
+//			a periodic endpoint. Speeds are low, full, high or super (or 0 to 3). interval, maxBurst and mult
+//			are the values which go in the endpoint context. hubSlot is the HS hub whose TT a LS/FS device is behind.
+//
+//  With -q only one line is printed per configuration, which is what you want when sweeping thousands of them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "AppleUSBXHCI_BandwidthModel.h"
+
+enum
+{
+	kPlannerMaxRootPorts		= 256,
+	kPlannerMaxTTs				= 128,
+	kPlannerMaxLine				= 512,
+	kPlannerMaxName				= 64
+};
+
+typedef struct PlannerTT
+{
+	uint8_t						rhPort;
+	uint8_t						hubSlot;
+	uint8_t						hubPort;				// 0 for a single TT hub
+	AppleXHCIBandwidthBudget	budget;
+} PlannerTT;
+
+typedef struct PlannerConfig
+{
+	char						name[kPlannerMaxName];
+	AppleXHCIBandwidthBudget	ports[kPlannerMaxRootPorts];
+	uint8_t						portSpeed[kPlannerMaxRootPorts];
+	uint8_t						portUsed[kPlannerMaxRootPorts];
+	PlannerTT					tts[kPlannerMaxTTs];
+	uint32_t					numTTs;
+	uint32_t					endpoints;
+	uint32_t					admitted;
+	uint32_t					rejected;
+	uint32_t					firstRejectedLine;
+	char						firstRejectedLabel[kPlannerMaxName];
+	char						firstRejectedReason[128];
+} PlannerConfig;
+
+static const char *			gSpeedNames[] = { "low", "full", "high", "super" };
+static int					gQuiet = 0;
+static unsigned long		gConfigs = 0;
+static unsigned long		gConfigsRejecting = 0;
+
+
+
+static void
+ResetConfig(PlannerConfig *config, const char *name)
+{
+	int			port;
+	
+	// only clear what was touched, since a sweep resets the configuration thousands of times
+	for (port = 0; port < kPlannerMaxRootPorts; port++)
+	{
+		if (config->portUsed[port])
+		{
+			memset(&config->ports[port], 0, sizeof(config->ports[port]));
+			config->portUsed[port] = 0;
+		}
+	}
+	config->numTTs = 0;
+	config->endpoints = 0;
+	config->admitted = 0;
+	config->rejected = 0;
+	config->firstRejectedLine = 0;
+	config->firstRejectedLabel[0] = 0;
+	config->firstRejectedReason[0] = 0;
+	snprintf(config->name, sizeof(config->name), "%s", name);
+}
+
+
+
+static int
+ParseSpeed(const char *token, uint8_t *speed)
+{
+	int			i;
+	
+	for (i = 0; i < 4; i++)
+	{
+		if (!strcasecmp(token, gSpeedNames[i]) || ((token[0] == ('0' + i)) && (token[1] == 0)))
+		{
+			*speed = (uint8_t)i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+static PlannerTT *
+GetTT(PlannerConfig *config, const AppleXHCIBandwidthRequest *request)
+{
+	uint8_t		hubPort = request->mtt ? request->hubPort : 0;
+	uint32_t	i;
+	PlannerTT	*tt;
+	
+	for (i = 0; i < config->numTTs; i++)
+	{
+		tt = &config->tts[i];
+		if ((tt->hubSlot == request->hubSlot) && (tt->hubPort == hubPort))
+			return tt;
+	}
+	
+	if (config->numTTs == kPlannerMaxTTs)
+		return NULL;
+	
+	tt = &config->tts[config->numTTs++];
+	memset(tt, 0, sizeof(*tt));
+	tt->rhPort = request->rhPort;
+	tt->hubSlot = request->hubSlot;
+	tt->hubPort = hubPort;
+	tt->budget.limitBlocks = kLSFSBandwidthLimitInBlocks;
+	return tt;
+}
+
+
+
+static void
+Reject(PlannerConfig *config, unsigned lineNumber, const char *label, const char *reason)
+{
+	config->rejected++;
+	if (config->firstRejectedLine)
+		return;
+	
+	config->firstRejectedLine = lineNumber;
+	snprintf(config->firstRejectedLabel, sizeof(config->firstRejectedLabel), "%s", label);
+	snprintf(config->firstRejectedReason, sizeof(config->firstRejectedReason), "%s", reason);
+}
+
+
+
+// Admit
+// The same order of checks as AppleXHCIBandwidthLedger::Admit - the root hub port first and then the TT. A rejected
+// endpoint does not use any bandwidth, so the endpoints after it are checked against what was actually admitted.
+static void
+Admit(PlannerConfig *config, const AppleXHCIBandwidthRequest *request, unsigned lineNumber, const char *label)
+{
+	AppleXHCIBandwidthBudget	*port = &config->ports[request->rhPort];
+	PlannerTT					*tt = NULL;
+	AppleXHCIBandwidthCost		portCost;
+	AppleXHCIBandwidthCost		ttCost;
+	char						reason[128];
+	
+	config->endpoints++;
+	
+	if (!config->portUsed[request->rhPort] || (port->endpoints == 0))
+	{
+		memset(port, 0, sizeof(*port));
+		port->limitBlocks = BandwidthModelLimitInBlocks(request->rhPortSpeed);
+		config->portSpeed[request->rhPort] = request->rhPortSpeed;
+		config->portUsed[request->rhPort] = 1;
+	}
+	else if (config->portSpeed[request->rhPort] != request->rhPortSpeed)
+	{
+		snprintf(reason, sizeof(reason), "port %d is already running at %s speed", (int)request->rhPort, gSpeedNames[config->portSpeed[request->rhPort]]);
+		Reject(config, lineNumber, label, reason);
+		return;
+	}
+	
+	BandwidthModelPortCost(request, &portCost);
+	if (!BandwidthModelFits(port, &portCost))
+	{
+		snprintf(reason, sizeof(reason), "port %d would need %u of its %u blocks", (int)request->rhPort, BandwidthModelBlocksWith(port, &portCost), port->limitBlocks);
+		Reject(config, lineNumber, label, reason);
+		return;
+	}
+	
+	if (BandwidthModelNeedsTT(request))
+	{
+		tt = GetTT(config, request);
+		if (!tt)
+		{
+			snprintf(reason, sizeof(reason), "no room for the TT on hub slot %d port %d", (int)request->hubSlot, (int)request->hubPort);
+			Reject(config, lineNumber, label, reason);
+			return;
+		}
+		
+		BandwidthModelTTCost(request, &ttCost);
+		if (!BandwidthModelFits(&tt->budget, &ttCost))
+		{
+			snprintf(reason, sizeof(reason), "TT on hub slot %d port %d would need %u of its %u blocks", (int)tt->hubSlot, (int)tt->hubPort, BandwidthModelBlocksWith(&tt->budget, &ttCost), tt->budget.limitBlocks);
+			Reject(config, lineNumber, label, reason);
+			return;
+		}
+		BandwidthModelCharge(&tt->budget, &ttCost);
+	}
+	
+	BandwidthModelCharge(port, &portCost);
+	config->admitted++;
+}
+
+
+
+static void
+PrintBudget(const char *name, const AppleXHCIBandwidthBudget *budget)
+{
+	int			i;
+	
+	printf("  %-20s %5u / %5u blocks  %5.1f%%  %u endpoints\n", name, budget->totalBlocks, budget->limitBlocks,
+		   budget->limitBlocks ? (100.0 * budget->totalBlocks) / budget->limitBlocks : 0.0, budget->endpoints);
+	
+	// the busiest (micro)frame is the sum of each interval's share of it, not of everything in the interval
+	for (i = 0; i < kMaxIntervalTableSize; i++)
+	{
+		const AppleXHCIBandwidthInterval	*interval = &budget->interval[i];
+		uint32_t							share = BandwidthModelIntervalBlocks(interval, (uint8_t)i);
+		
+		if (interval->endpoints)
+			printf("    interval %2d        %5u blocks  %5.1f%%  (%u endpoints, %u blocks in all)\n", i, share, (100.0 * share) / budget->limitBlocks,
+				   interval->endpoints, interval->blocks);
+	}
+}
+
+
+
+static void
+ReportConfig(const PlannerConfig *config)
+{
+	char		name[64];
+	int			port;
+	uint32_t	i;
+	
+	if (config->endpoints == 0)
+		return;
+	
+	gConfigs++;
+	if (config->rejected)
+		gConfigsRejecting++;
+	
+	if (gQuiet)
+	{
+		if (config->firstRejectedLine)
+			printf("%s: %u/%u admitted, first rejected at line %u (%s): %s\n", config->name, config->admitted, config->endpoints,
+				   config->firstRejectedLine, config->firstRejectedLabel, config->firstRejectedReason);
+		else
+			printf("%s: %u/%u admitted\n", config->name, config->admitted, config->endpoints);
+		return;
+	}
+	
+	printf("%s: %u of %u endpoints admitted\n", config->name, config->admitted, config->endpoints);
+	
+	for (port = 0; port < kPlannerMaxRootPorts; port++)
+	{
+		if (!config->portUsed[port] || !config->ports[port].endpoints)
+			continue;
+		snprintf(name, sizeof(name), "port %d (%s)", port, gSpeedNames[config->portSpeed[port]]);
+		PrintBudget(name, &config->ports[port]);
+	}
+	
+	for (i = 0; i < config->numTTs; i++)
+	{
+		if (!config->tts[i].budget.endpoints)
+			continue;
+		snprintf(name, sizeof(name), "TT %d.%d (port %d)", (int)config->tts[i].hubSlot, (int)config->tts[i].hubPort, (int)config->tts[i].rhPort);
+		PrintBudget(name, &config->tts[i].budget);
+	}
+	
+	if (config->firstRejectedLine)
+		printf("  first rejected: line %u (%s): %s - %u rejected in all\n", config->firstRejectedLine, config->firstRejectedLabel,
+			   config->firstRejectedReason, config->rejected);
+	printf("\n");
+}
+
+
+
+// ParseEndpoint
+// Returns 0 if the line is malformed, in which case the endpoint is not counted
+static int
+ParseEndpoint(char **tokens, int numTokens, AppleXHCIBandwidthRequest *request, const char **label)
+{
+	unsigned long	values[8];
+	int				numValues = 0;
+	int				i;
+	char			*end;
+	
+	memset(request, 0, sizeof(*request));
+	*label = "";
+	
+	if (numTokens < 6)
+		return 0;
+	
+	if (!ParseSpeed(tokens[2], &request->rhPortSpeed) || !ParseSpeed(tokens[3], &request->epSpeed))
+		return 0;
+	
+	values[numValues++] = strtoul(tokens[1], &end, 0);
+	if (*end)
+		return 0;
+	
+	for (i = 4; (i < numTokens) && (numValues < 8); i++)
+	{
+		values[numValues] = strtoul(tokens[i], &end, 0);
+		if (*end)
+			break;
+		numValues++;
+	}
+	
+	if (i < numTokens)
+		*label = tokens[i];
+	
+	// rhPort interval mps, then optionally maxBurst mult, then optionally hubSlot hubPort mtt
+	if ((numValues != 3) && (numValues != 5) && (numValues != 8))
+		return 0;
+	
+	if ((values[0] == 0) || (values[0] >= kPlannerMaxRootPorts) || (values[1] >= kMaxIntervalTableSize) || (values[2] > 0xFFFF))
+		return 0;
+	
+	request->rhPort = (uint8_t)values[0];
+	request->epInterval = (uint8_t)values[1];
+	request->mps = (uint16_t)values[2];
+	if (numValues >= 5)
+	{
+		request->maxBurst = (uint8_t)values[3];
+		request->mult = (uint8_t)values[4];
+	}
+	if (numValues == 8)
+	{
+		request->hubSlot = (uint8_t)values[5];
+		request->hubPort = (uint8_t)values[6];
+		request->mtt = (values[7] != 0);
+	}
+	
+	return 1;
+}
+
+
+
+static int
+ProcessFile(FILE *file, const char *fileName, PlannerConfig *config)
+{
+	char						line[kPlannerMaxLine];
+	char						*tokens[16];
+	int							numTokens;
+	unsigned					lineNumber = 0;
+	int							errors = 0;
+	char						*p;
+	AppleXHCIBandwidthRequest	request;
+	const char					*label;
+	
+	ResetConfig(config, fileName);
+	
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+		
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		
+		numTokens = 0;
+		for (p = strtok(line, " \t\r\n"); p && (numTokens < 16); p = strtok(NULL, " \t\r\n"))
+			tokens[numTokens++] = p;
+		
+		if (numTokens == 0)
+			continue;
+		
+		if (!strcmp(tokens[0], "config"))
+		{
+			ReportConfig(config);
+			ResetConfig(config, (numTokens > 1) ? tokens[1] : "");
+		}
+		else if (!strcmp(tokens[0], "ep") && ParseEndpoint(tokens, numTokens, &request, &label))
+		{
+			Admit(config, &request, lineNumber, label);
+		}
+		else
+		{
+			fprintf(stderr, "%s:%u: can't parse \"%s\"\n", fileName, lineNumber, tokens[0]);
+			errors++;
+		}
+	}
+	
+	ReportConfig(config);
+	
+	return errors;
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	PlannerConfig	*config = calloc(1, sizeof(PlannerConfig));
+	int				errors = 0;
+	int				i = 1;
+	FILE			*file;
+	
+	if (!config)
+		return 1;
+	
+	if ((argc > 1) && !strcmp(argv[1], "-q"))
+	{
+		gQuiet = 1;
+		i++;
+	}
+	
+	if (i == argc)
+		errors += ProcessFile(stdin, "stdin", config);
+	
+	for (; i < argc; i++)
+	{
+		file = fopen(argv[i], "r");
+		if (!file)
+		{
+			perror(argv[i]);
+			errors++;
+			continue;
+		}
+		errors += ProcessFile(file, argv[i], config);
+		fclose(file);
+	}
+	
+	if (gConfigs > 1)
+		printf("%lu configurations, %lu with at least one endpoint rejected\n", gConfigs, gConfigsRejecting);
+	
+	free(config);
+	
+	// 2 for malformed input, 1 if anything would be rejected, so a sweep script can just check the status
+	return errors ? 2 : (gConfigsRejecting ? 1 : 0);
+}
@@ -206,3 +206,87 @@ void AppleUSBDiagnostics::UpdateNumberEntry( OSDictionary * dictionary, UInt32 v
 	dictionary->setObject( name, number );
 	number->release();
 }
+
+
+
+#pragma mark •••••••• AppleUSBIsochDiagnostics ••••••••
+
+OSDefineMetaClassAndStructors(AppleUSBIsochDiagnostics, OSObject)
+
+AppleUSBIsochDiagnostics * AppleUSBIsochDiagnostics::create(void)
+{
+	AppleUSBIsochDiagnostics *	diagnostics = OSTypeAlloc(AppleUSBIsochDiagnostics);
+	
+	if( diagnostics && !diagnostics->init() )
+	{
+		diagnostics->release();
+		diagnostics = NULL;
+	}
+	
+	// OSObject allocations are zero filled, so all of the histograms start out empty
+	return diagnostics;
+}
+
+void AppleUSBIsochDiagnostics::serializeHistogram( OSDictionary * dictionary, const Histogram * histogram, const char * name ) const
+{
+	OSDictionary *	histogramDictionary;
+	OSArray *		bucketArray;
+	
+	histogramDictionary = OSDictionary::withCapacity(5);
+	if( !histogramDictionary )
+		return;
+	
+	UpdateNumberEntry( histogramDictionary, histogram->samples, "Samples");
+	UpdateNumberEntry( histogramDictionary, histogram->max, "Max");
+	UpdateNumberEntry( histogramDictionary, histogram->samples ? (UInt32)(histogram->total / histogram->samples) : 0, "Mean");
+	
+	bucketArray = OSArray::withCapacity(kHistogramBuckets);
+	if( bucketArray )
+	{
+		for(int i=0; i<kHistogramBuckets; i++)
+		{
+			OSNumber * number = OSNumber::withNumber( histogram->bucket[i], 32 );
+			if( number )
+			{
+				bucketArray->setObject( number );
+				number->release();
+			}
+		}
+		histogramDictionary->setObject( "Buckets (log2)", bucketArray );
+		bucketArray->release();
+	}
+	
+	dictionary->setObject( name, histogramDictionary );
+	histogramDictionary->release();
+}
+
+bool AppleUSBIsochDiagnostics::serialize( OSSerialize * s ) const
+{
+	OSDictionary *	dictionary;
+	bool			ok;
+	
+	dictionary = OSDictionary::withCapacity( 3 );
+	if( !dictionary )
+		return false;
+	
+	serializeHistogram( dictionary, &scheduleLead, "Schedule Lead (frames)");
+	serializeHistogram( dictionary, &missedFrames, "Missed Frames (frames late)");
+	serializeHistogram( dictionary, &completionLatency, "Completion Latency (us)");
+	
+	ok = dictionary->serialize(s);
+	dictionary->release();
+	
+	return ok;
+}
+
+void AppleUSBIsochDiagnostics::UpdateNumberEntry( OSDictionary * dictionary, UInt32 value, const char * name ) const
+{
+	OSNumber *	number;
+	
+	number = OSNumber::withNumber( value, 32 );
+	if( !number )
+		return;
+		
+	dictionary->setObject( name, number );
+	number->release();
+}
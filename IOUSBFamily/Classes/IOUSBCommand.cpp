@@ -619,6 +619,7 @@ IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
 		for ( int i=0; i < kUSBCommandScratchBuffers; i++)
 			usbCommand->SetUIMScratch(i, POISONVALUE);
 		usbCommand->SetStreamID(POISONVALUE);
+		usbCommand->SetImmediateData(false);
 		
 		if ( usbCommand->GetBufferUSBCommand() != NULL )
 		{
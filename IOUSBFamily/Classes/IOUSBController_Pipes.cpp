@@ -518,6 +518,7 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
     IOUSBCompletion			nullCompletion;
     int						i;
 	bool					isSyncTransfer = false;
+	bool					immediateData = false;
 	
     USBLog(7, "%s[%p]::Write - reqCount = %qd", getName(), this, (uint64_t)reqCount);
     
@@ -570,8 +571,18 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
         }
     }
 
+	// A tiny bulk or interrupt OUT payload goes in the TD itself on controllers which support it, so mapping it
+	// for DMA (and checking it for disjoint segments) would cost far more than the transfer
+	if ((reqCount != 0) && (reqCount <= kUSBMaxImmediateDataSize) && 
+		((endpoint->transferType == kUSBBulk) || (endpoint->transferType == kUSBInterrupt)) &&
+		(getProperty(kUSBControllerImmediateDataKey) == kOSBooleanTrue))
+	{
+		USBLog(7, "%s[%p]::Write - %d bytes as immediate data", getName(), this, (int)reqCount);
+		immediateData = true;
+	}
+	
 	// 7455477: from this point forward, we have the command object, and we need to be careful to put it back if there is an error..
-	if (reqCount)
+	if (reqCount && !immediateData)
 	{
 		IOMemoryDescriptor	*memDesc;
 		
@@ -616,6 +627,7 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
 		command->SetType(endpoint->transferType);
 		command->SetBuffer(buffer);
 		command->SetReqCount(reqCount);
+		command->SetImmediateData(immediateData);
 		command->SetClientCompletion(*completion);
 		command->SetNoDataTimeout(noDataTimeout); 
 		command->SetCompletionTimeout(completionTimeout);
@@ -629,7 +641,10 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
 		nullCompletion.parameter = (void *) NULL;
 		command->SetDisjointCompletion(nullCompletion);
 
-		err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
+		if (!immediateData)
+		{
+			err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
+		}
 		if (!err)
 		{			
 			err = _commandGate->runAction(DoIOTransfer, command);
@@ -103,4 +103,57 @@ protected:
 	
 };
 
+
+
+// AppleUSBIsochDiagnostics
+// Histograms for a single isochronous endpoint. A UIM creates one for its own isoch endpoint subclass when
+// kUSBEnableErrorLogMask is set in gUSBStackDebugFlags, keeps and releases the reference itself, and publishes it in
+// the registry as a property of the controller. The histograms are only ever written on the workloop, so Record()
+// takes no lock, and serialize() may see a sample which is half way in, which is fine for diagnostics.
+//
+// The reference can't be kept in IOUSBControllerIsochEndpoint, whose layout and vtable are KPI, so only the UIMs
+// which add it to their own subclass have histograms. So far that is just xHCI (AppleXHCIIsochEndpoint). The EHCI,
+// OHCI and UHCI isoch endpoints don't collect them.
+class AppleUSBIsochDiagnostics : public OSObject
+{
+	OSDeclareDefaultStructors(AppleUSBIsochDiagnostics);
+
+public:
+    enum{
+        kHistogramBuckets = 16					// bucket 0 holds zeros, bucket n holds [2^(n-1), 2^n), the last bucket holds the rest
+    };
+    typedef struct
+    {
+        UInt32			bucket[kHistogramBuckets];
+        UInt64			total;
+        UInt32			samples;
+        UInt32			max;
+    } Histogram;
+
+    Histogram			scheduleLead;			// frames between the current frame and the frame a TD was put on the schedule for
+    Histogram			missedFrames;			// frames a TD was short of the first schedulable frame when it was sent back as "old before it began"
+    Histogram			completionLatency;		// microseconds between the completion interrupt and the TD being picked up on the workloop
+	
+	static AppleUSBIsochDiagnostics *	create(void);
+	virtual bool		serialize( OSSerialize * s ) const;
+	
+	static inline void	Record(Histogram *histogram, UInt32 value)
+	{
+		UInt32		bucket = value ? (32 - __builtin_clz(value)) : 0;
+		
+		if (bucket >= kHistogramBuckets)
+			bucket = kHistogramBuckets - 1;
+		histogram->bucket[bucket]++;
+		histogram->total += value;
+		histogram->samples++;
+		if (value > histogram->max)
+			histogram->max = value;
+	}
+	
+protected:
+	
+	virtual void		serializeHistogram( OSDictionary * dictionary, const Histogram * histogram, const char * name ) const;
+	virtual void		UpdateNumberEntry( OSDictionary * dictionary, UInt32 value, const char * name ) const;
+};
+
 #endif
\ No newline at end of file
@@ -54,6 +54,11 @@ typedef enum {
 
 #define 	kUSBCommandScratchBuffers	10
 
+// Controllers which can carry a small OUT payload in the transfer descriptor itself (e.g. xHCI Immediate Data)
+// set this property to kOSBooleanTrue, and IOUSBController::Write will then not map such payloads for DMA
+#define		kUSBControllerImmediateDataKey		"USBControllerImmediateData"
+#define		kUSBMaxImmediateDataSize			8
+
 /*
  IOUSBCommand
  Subclass of IOCommand that is used to add USB specific data.
@@ -98,6 +103,7 @@ protected:
 		IOUSBCommand		*_masterUSBCommand;						// points from the bufferUSBCommand back to the parent command
 		UInt32				_streamID;
 		void *				_backTrace[kUSBCommandScratchBuffers];
+		bool				_immediateData;							// OUT payload of kUSBMaxImmediateDataSize or less, not mapped in _dmaCommand
     };
     ExpansionData * 		_expansionData;
     
@@ -140,6 +146,7 @@ public:
 	void					SetIsSyncTransfer(bool);
 	inline void				SetDMACommand(IODMACommand *dmaCommand)					{ _expansionData->_dmaCommand = dmaCommand; }
 	inline void				SetStreamID(UInt32 streamID)					{ _expansionData->_streamID = streamID; }
+	inline void				SetImmediateData(bool immediateData)			{ _expansionData->_immediateData = immediateData; }
 	void					SetBufferUSBCommand(IOUSBCommand *bufferUSBCommand);
 	void					SetBT(UInt32 index, void * value);
 	
@@ -173,6 +180,7 @@ public:
 	bool						GetIsSyncTransfer(void);
 	inline IODMACommand *		GetDMACommand(void)							{return _expansionData->_dmaCommand; }
 	inline UInt32				GetStreamID(void)							{return _expansionData->_streamID; }
+	inline bool					GetImmediateData(void)						{return _expansionData->_immediateData; }
 	inline IOUSBCommand *		GetBufferUSBCommand(void)					{return _expansionData->_bufferUSBCommand; }
 };
 
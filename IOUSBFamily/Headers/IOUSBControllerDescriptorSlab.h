@@ -0,0 +1,373 @@
+/*
+ * Copyright © 2013 Apple Inc.  All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOUSBCONTROLLERDESCRIPTORSLAB_H
+#define _IOUSBCONTROLLERDESCRIPTORSLAB_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IODMACommand.h>
+
+#include <IOKit/usb/IOUSBLog.h>
+
+
+enum
+{
+    kIOUSBControllerDescriptorSlabPageSize		= 4096
+};
+
+// Used as the PrivateType of a slab whose descriptors have no non shared data (UHCI keeps its
+// non shared data in IOUSBControllerListElement subclasses instead)
+struct IOUSBControllerDescriptorSlabNoPrivate
+{
+};
+
+// Written at the start of every page of a slab.  The chunk pointer has to come first and the tag has
+// to follow it directly, since a done queue walked at primary interrupt time reads both through IOMappedRead
+struct IOUSBControllerDescriptorSlabPageHeader
+{
+    uintptr_t					chunk;			// the IOUSBControllerDescriptorSlab::Chunk which owns this page
+    UInt32						tag;			// kTag of the owning slab
+    UInt32						pageIndex;		// index of this page within its chunk
+};
+
+
+/*
+ template IOUSBControllerDescriptorSlab
+ Allocator for the descriptors a host controller shares with its hardware (EDs, TDs, QHs, ITDs, SITDs).
+ Memory is allocated kChunkPages at a time, physically contiguous and within kPhysicalMask, and carved into
+ kAlignment aligned slots of SharedType.  Each slot has a matching PrivateType for the non shared data. Every
+ page starts with a IOUSBControllerDescriptorSlabPageHeader, which lets both the shared logical address and
+ the physical address of a descriptor be translated to the rest of the descriptor in constant time.
+ Freed slots are kept on a free list whose links live in a side array in each chunk, never in the slot itself,
+ since the controller may still be reading a descriptor after it has been freed (a done queue, for one).
+ A zero filled slab is empty and ready to use, so it can be embedded directly in the controller object.
+ This object is not thread safe. It has to be used from the controller's workloop.
+ Only UHCI allocates from slabs so far. OHCI and EHCI keep their MemoryBlock classes until the allocation
+ routines in their controller sources are converted.
+*/
+template <typename SharedType, typename PrivateType, UInt64 kPhysicalMask, UInt32 kAlignment, UInt32 kChunkPages, UInt32 kTag>
+class IOUSBControllerDescriptorSlab
+{
+public:
+    enum
+    {
+        kSlotSize			= (sizeof(SharedType) + kAlignment - 1) & ~(kAlignment - 1),
+        kHeaderSlots		= (sizeof(IOUSBControllerDescriptorSlabPageHeader) + kSlotSize - 1) / kSlotSize,
+        kSlotsPerPage		= (kIOUSBControllerDescriptorSlabPageSize / kSlotSize) - kHeaderSlots,
+        kSlotsPerChunk		= kSlotsPerPage * kChunkPages,
+        kChunkBytes			= kIOUSBControllerDescriptorSlabPageSize * kChunkPages
+    };
+
+private:
+    typedef char	alignmentIsAPowerOfTwo[((kAlignment != 0) && ((kAlignment & (kAlignment - 1)) == 0)) ? 1 : -1];
+    typedef char	pageHoldsADescriptor[(kSlotsPerPage > 0) ? 1 : -1];
+    typedef char	chunkIsNotEmpty[(kChunkPages > 0) ? 1 : -1];
+
+    struct Chunk
+    {
+        Chunk						*next;
+        IOBufferMemoryDescriptor	*buffer;
+        UInt8						*logical;
+        IOPhysicalAddress			physical;
+        PrivateType					privates[kSlotsPerChunk];
+        SharedType					*freeNext[kSlotsPerChunk];	// free list link of each free slot
+    };
+
+    Chunk							*_chunks;			// every chunk this slab has allocated
+    SharedType						*_freeList;			// free slots, lowest address first within a chunk
+    UInt32							_numChunks;
+    UInt32							_numFree;
+    UInt32							_numAllocated;
+
+    static IOPhysicalAddress		PageStart(IOPhysicalAddress addr)	{ return addr & ~(IOPhysicalAddress)(kIOUSBControllerDescriptorSlabPageSize - 1); }
+    static UInt32					PageOffset(uintptr_t addr)			{ return (UInt32)(addr & (kIOUSBControllerDescriptorSlabPageSize - 1)); }
+
+    static UInt32 SlotIndex(UInt32 pageIndex, UInt32 pageOffset)
+    {
+        return (pageIndex * kSlotsPerPage) + (pageOffset / kSlotSize) - kHeaderSlots;
+    }
+
+    static Chunk * ChunkForShared(SharedType *shared, UInt32 *slotIndex)
+    {
+        IOUSBControllerDescriptorSlabPageHeader	*header = (IOUSBControllerDescriptorSlabPageHeader*)((uintptr_t)shared & ~(uintptr_t)(kIOUSBControllerDescriptorSlabPageSize - 1));
+
+        if (slotIndex)
+            *slotIndex = SlotIndex(header->pageIndex, PageOffset((uintptr_t)shared));
+        return (Chunk*)header->chunk;
+    }
+
+    // NOTE:  Don't use any USBLogs here, as this is called at primary interrupt time
+    static Chunk * ChunkForPhysical(IOPhysicalAddress addr, UInt32 *slotIndex)
+    {
+        IOPhysicalAddress	pageStart;
+        UInt32				pageOffset;
+        Chunk				*chunk;
+
+        if (!addr)
+            return NULL;
+
+        pageStart = PageStart(addr);
+        pageOffset = PageOffset(addr);
+        if ((pageOffset < (kHeaderSlots * kSlotSize)) || (pageOffset >= ((kHeaderSlots + kSlotsPerPage) * kSlotSize)))
+            return NULL;
+
+        if (GetTagFromPhysical(addr) != kTag)
+            return NULL;
+
+#if defined (__x86_64__)
+        chunk = (Chunk*)IOMappedRead64(pageStart);
+#else
+        chunk = (Chunk*)IOMappedRead32(pageStart);
+#endif
+        if (slotIndex)
+            *slotIndex = SlotIndex(IOMappedRead32(pageStart + sizeof(uintptr_t) + sizeof(UInt32)), pageOffset);
+        return chunk;
+    }
+
+public:
+
+    // Returns the tag of the slab owning the page of addr, which lets a controller with several slabs (such as
+    // GTD and ITD slabs sharing one done queue) decide which one to ask.
+    // NOTE:  Don't use any USBLogs here, as this is called at primary interrupt time
+    static UInt32 GetTagFromPhysical(IOPhysicalAddress addr)
+    {
+        if (!addr)
+            return 0;
+        return IOMappedRead32(PageStart(addr) + sizeof(uintptr_t));
+    }
+
+    static SharedType * GetSharedFromPhysical(IOPhysicalAddress addr)
+    {
+        Chunk	*chunk = ChunkForPhysical(addr, NULL);
+
+        if (!chunk)
+            return NULL;
+        return (SharedType*)(chunk->logical + (addr - chunk->physical));
+    }
+
+    static PrivateType * GetPrivateFromPhysical(IOPhysicalAddress addr)
+    {
+        UInt32	index;
+        Chunk	*chunk = ChunkForPhysical(addr, &index);
+
+        if (!chunk)
+            return NULL;
+        return &chunk->privates[index];
+    }
+
+    static IOPhysicalAddress GetPhysical(SharedType *shared)
+    {
+        Chunk	*chunk = ChunkForShared(shared, NULL);
+
+        return chunk->physical + (IOPhysicalAddress)((UInt8*)shared - chunk->logical);
+    }
+
+    static PrivateType * GetPrivate(SharedType *shared)
+    {
+        UInt32	index;
+        Chunk	*chunk = ChunkForShared(shared, &index);
+
+        return &chunk->privates[index];
+    }
+
+    // Used to validate an address read back from the controller before it is dereferenced through IOMappedRead
+    bool ContainsPhysical(IOPhysicalAddress addr)
+    {
+        Chunk	*chunk;
+
+        for (chunk = _chunks; chunk; chunk = chunk->next)
+        {
+            if ((addr >= chunk->physical) && (addr < (chunk->physical + kChunkBytes)))
+                return true;
+        }
+        return false;
+    }
+
+    UInt32 NumChunks(void)		{ return _numChunks; }
+    UInt32 NumFree(void)		{ return _numFree; }
+    UInt32 NumAllocated(void)	{ return _numAllocated; }
+
+    // Returns a zeroed descriptor, growing the slab by one chunk if there are no free slots
+    SharedType * Allocate(IOPhysicalAddress *physical, PrivateType **privateData)
+    {
+        SharedType	*slot;
+        UInt32		index;
+        Chunk		*chunk;
+
+        if (!_freeList && (Grow() != kIOReturnSuccess))
+            return NULL;
+
+        slot = _freeList;
+        chunk = ChunkForShared(slot, &index);
+        _freeList = chunk->freeNext[index];
+        chunk->freeNext[index] = NULL;
+        _numFree--;
+        _numAllocated++;
+
+        bzero(slot, kSlotSize);
+        if (physical)
+            *physical = chunk->physical + (IOPhysicalAddress)((UInt8*)slot - chunk->logical);
+        if (privateData)
+        {
+            *privateData = &chunk->privates[index];
+            bzero(*privateData, sizeof(PrivateType));
+        }
+        return slot;
+    }
+
+    // Leaves the descriptor itself untouched, the controller may not be done reading it yet
+    void Free(SharedType *shared)
+    {
+        UInt32		index;
+        Chunk		*chunk;
+
+        if (!shared)
+            return;
+
+        chunk = ChunkForShared(shared, &index);
+        chunk->freeNext[index] = _freeList;
+        _freeList = shared;
+        _numFree++;
+        _numAllocated--;
+    }
+
+    IOReturn Grow(void)
+    {
+        Chunk						*chunk;
+        IOBufferMemoryDescriptor	*buffer;
+        IODMACommand				*dmaCommand;
+        IODMACommand::Segment32		segments;
+        UInt64						offset = 0;
+        UInt32						numSegments = 1;
+        IOReturn					status;
+        UInt32						page, slot;
+
+        chunk = (Chunk*)IOMalloc(sizeof(Chunk));
+        if (!chunk)
+        {
+            USBError(1, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - could not allocate chunk", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag);
+            return kIOReturnNoMemory;
+        }
+        bzero(chunk, sizeof(Chunk));
+
+        // Use IODMACommand to get the physical address
+        dmaCommand = IODMACommand::withSpecification(kIODMACommandOutputHost32, 32, kChunkBytes, (IODMACommand::MappingOptions)(IODMACommand::kMapped | IODMACommand::kIterateOnly));
+        if (!dmaCommand)
+        {
+            USBError(1, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - could not create IODMACommand", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag);
+            IOFree(chunk, sizeof(Chunk));
+            return kIOReturnNoMemory;
+        }
+
+        // allocate the whole chunk on a page boundary within the physical mask, contiguous so that it is a single segment
+        buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIOMemoryUnshared | kIODirectionInOut | ((kChunkPages > 1) ? kIOMemoryPhysicallyContiguous : 0), kChunkBytes, kPhysicalMask);
+        if (!buffer)
+        {
+            USBError(1, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - could not allocate buffer", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag);
+            dmaCommand->release();
+            IOFree(chunk, sizeof(Chunk));
+            return kIOReturnNoMemory;
+        }
+
+        status = buffer->prepare();
+        if (status)
+        {
+            USBError(1, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - could not prepare buffer", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag);
+            buffer->release();
+            dmaCommand->release();
+            IOFree(chunk, sizeof(Chunk));
+            return status;
+        }
+        chunk->logical = (UInt8*)buffer->getBytesNoCopy();
+        bzero(chunk->logical, kChunkBytes);
+
+        status = dmaCommand->setMemoryDescriptor(buffer);
+        if (!status)
+        {
+            status = dmaCommand->gen32IOVMSegments(&offset, &segments, &numSegments);
+            dmaCommand->clearMemoryDescriptor();
+        }
+        dmaCommand->release();
+        if (status || (numSegments != 1) || (segments.fLength != kChunkBytes))
+        {
+            USBError(1, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - could not get physical segment (status 0x%x, %d segments)", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag, (uint32_t)status, (int)numSegments);
+            buffer->complete();
+            buffer->release();
+            IOFree(chunk, sizeof(Chunk));
+            return status ? status : kIOReturnNoResources;
+        }
+        chunk->buffer = buffer;
+        chunk->physical = segments.fIOVMAddr;
+
+        for (page = 0; page < kChunkPages; page++)
+        {
+            IOUSBControllerDescriptorSlabPageHeader	*header = (IOUSBControllerDescriptorSlabPageHeader*)(chunk->logical + (page * kIOUSBControllerDescriptorSlabPageSize));
+
+            header->chunk = (uintptr_t)chunk;
+            header->tag = kTag;
+            header->pageIndex = page;
+        }
+
+        // push the slots in reverse so that they come back off the free list in address order
+        for (page = kChunkPages; page-- > 0; )
+        {
+            UInt8	*pageStart = chunk->logical + (page * kIOUSBControllerDescriptorSlabPageSize);
+
+            for (slot = kHeaderSlots + kSlotsPerPage; slot-- > kHeaderSlots; )
+            {
+                chunk->freeNext[SlotIndex(page, slot * kSlotSize)] = _freeList;
+                _freeList = (SharedType*)(pageStart + (slot * kSlotSize));
+            }
+        }
+
+        chunk->next = _chunks;
+        _chunks = chunk;
+        _numChunks++;
+        _numFree += kSlotsPerChunk;
+
+        USBLog(6, "IOUSBControllerDescriptorSlab<%c%c%c%c>::Grow - chunk %d at phys 0x%x, %d descriptors of %d bytes", (char)(kTag >> 24), (char)(kTag >> 16), (char)(kTag >> 8), (char)kTag, (int)_numChunks, (uint32_t)chunk->physical, (int)kSlotsPerChunk, (int)kSlotSize);
+        return kIOReturnSuccess;
+    }
+
+    // Only valid once the controller no longer references any of the descriptors
+    void ReleaseAll(void)
+    {
+        Chunk	*chunk;
+
+        while ((chunk = _chunks))
+        {
+            _chunks = chunk->next;
+            chunk->buffer->complete();
+            chunk->buffer->release();
+            IOFree(chunk, sizeof(Chunk));
+        }
+        _freeList = NULL;
+        _numChunks = 0;
+        _numFree = 0;
+        _numAllocated = 0;
+    }
+};
+
+#endif